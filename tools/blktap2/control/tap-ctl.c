@@ -536,6 +536,52 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_resize_usage(FILE *stream)
+{
+	fprintf(stream, "usage: resize <-p pid> <-m minor> <-s size (MB)>\n");
+}
+
+static int
+tap_cli_resize(int argc, char **argv)
+{
+	int c, pid, minor;
+	uint64_t size;
+
+	pid   = -1;
+	minor = -1;
+	size  = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:s:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_resize_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !size)
+		goto usage;
+
+	return tap_ctl_resize(pid, minor, size << 11);
+
+usage:
+	tap_cli_resize_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_unpause_usage(FILE *stream)
 {
@@ -715,6 +761,7 @@ struct command commands[] = {
 	{ .name = "close",        .func = tap_cli_close         },
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
+	{ .name = "resize",       .func = tap_cli_resize        },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
 };
@@ -95,6 +95,7 @@ int tap_ctl_close(const int id, const int minor, const int force);
 
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
+int tap_ctl_resize(const int id, const int minor, const uint64_t sectors);
 
 int tap_ctl_blk_major(void);
 
@@ -55,6 +55,7 @@
 #include <sys/mman.h>
 
 #include "libvhd.h"
+#include "libvhd-hash.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
@@ -111,6 +112,11 @@ unsigned int SPB;
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
 
+/* preallocation: blocks zeroed at a time, and bat updates per write */
+#define VHD_ALLOC_RESERVE            16
+#define VHD_BAT_BATCH                (VHD_CACHE_SIZE / 2)
+#define VHD_BAT_WINDOW               8   /* max bat sectors per write */
+
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
@@ -143,6 +149,7 @@ unsigned int SPB;
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOC_PENDING    16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -191,6 +198,14 @@ struct vhd_bat_state {
 	struct vhd_request        req;         /* for writing bat table */
 	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+
+	/* preallocation only */
+	uint64_t                  zero_next;   /* next pre-zeroed block */
+	uint32_t                  zero_left;   /* pre-zeroed blocks left */
+	int                       alloc_writing; /* allocations in bat write */
+	int                       alloc_count;
+	struct vhd_bitmap        *alloc[VHD_BAT_BATCH]; /* blocks awaiting
+						* their bat entries */
 };
 
 struct vhd_bitmap {
@@ -213,6 +228,10 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+
+	u64                       offset;      /* block offset while its bat
+						* entry is being written */
+	struct vhd_request        bat_req;     /* bat update in tx */
 };
 
 struct vhd_state {
@@ -226,6 +245,7 @@ struct vhd_state {
 						* (unallocated) datablock */
 
 	struct vhd_bat_state      bat;
+	vhd_hash_t                hash;        /* optional block digest index */
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
@@ -270,8 +290,6 @@ vhd_initialize(struct vhd_state *s)
 		return 0;
 
 	_vhd_zsize = 2 * getpagesize();
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-		_vhd_zsize += VHD_BLOCK_SIZE;
 
 	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
 			  MAP_SHARED | MAP_ANON, -1, 0);
@@ -436,8 +454,8 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign((void **)&s->bat.bat_buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_WINDOW << VHD_SECTOR_SHIFT);
 	if (err) {
 		s->bat.bat_buf = NULL;
 		goto fail;
@@ -654,6 +672,15 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
             ", inf:%u)\n",
 	    driver->info.size, driver->info.sector_size, driver->info.info);
 
+	/*
+	 * keep an existing digest index current by invalidating blocks
+	 * as they are written.  this must happen before the footer is
+	 * killed below, which would leave the index looking stale.
+	 */
+	if (!test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY) &&
+	    vhd_type_dynamic(&s->vhd))
+		vhd_hash_open(&s->hash, &s->vhd, VHD_HASH_OPEN_RDWR);
+
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
 	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
 		err = vhd_kill_footer(s);
@@ -667,6 +694,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
         return 0;
 
  fail:
+	if (s->hash.file)
+		vhd_hash_close(&s->hash);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
@@ -721,6 +750,29 @@ vhd_log_close(struct vhd_state *s)
 		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
 }
 
+/*
+ * preallocated blocks that were never handed out sit between the end of
+ * data and the end of the file, where the footer belongs.  expects
+ * s->vhd.bat to be current.
+ */
+static void
+vhd_release_reserved_blocks(struct vhd_state *s)
+{
+	int err;
+	off_t eod;
+
+	if (!s->bat.zero_next || s->vhd.is_block)
+		return;
+
+	err = vhd_end_of_data(&s->vhd, &eod);
+	if (!err && ftruncate(s->vhd.fd, eod) == -1)
+		err = -errno;
+
+	if (err)
+		EPRINTF("%s: releasing preallocated blocks: %d\n",
+			s->vhd.file, err);
+}
+
 static int
 _vhd_close(td_driver_t *driver)
 {
@@ -742,21 +794,31 @@ _vhd_close(td_driver_t *driver)
 	 */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
+		vhd_release_reserved_blocks(s);
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
 		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
 
 		if (err)
 			EPRINTF("writing %s footer: %d\n", s->vhd.file, err);
 
-		if (!vhd_has_batmap(&s->vhd))
-			goto free;
+		if (vhd_has_batmap(&s->vhd)) {
+			err = vhd_write_batmap(&s->vhd, &s->bat.batmap);
+			if (err)
+				EPRINTF("writing %s batmap: %d\n",
+					s->vhd.file, err);
+		}
 
-		err = vhd_write_batmap(&s->vhd, &s->bat.batmap);
-		if (err)
-			EPRINTF("writing %s batmap: %d\n", s->vhd.file, err);
+		if (s->hash.file) {
+			err = vhd_hash_write(&s->hash, &s->vhd);
+			if (err)
+				EPRINTF("writing %s hash index: %d\n",
+					s->vhd.file, err);
+		}
 	}
 
  free:
+	if (s->hash.file)
+		vhd_hash_close(&s->hash);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
@@ -966,6 +1028,8 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->bat_req);
+	bm->offset = 0;
 }
 
 static inline struct vhd_bitmap *
@@ -1135,6 +1199,47 @@ free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
+static inline struct vhd_bitmap *
+get_pending_alloc(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap *bm = get_bitmap(s, blk);
+
+	if (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING))
+		return bm;
+
+	return NULL;
+}
+
+/*
+ * can a first write to unallocated block @blk proceed now?  without
+ * preallocation, one block is allocated at a time.  with it, new blocks
+ * join the next bat write while that stays within VHD_BAT_WINDOW sectors.
+ */
+static int
+bat_can_allocate(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+	uint32_t sec, lo, hi;
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		return (!bat_locked(s) || s->bat.pbw_blk == blk);
+
+	if (get_pending_alloc(s, blk))
+		return 1;
+
+	if (s->bat.alloc_count == VHD_BAT_BATCH)
+		return 0;
+
+	lo = hi = blk / 128;
+	for (i = s->bat.alloc_writing; i < s->bat.alloc_count; i++) {
+		sec = s->bat.alloc[i]->blk / 128;
+		lo  = MIN(lo, sec);
+		hi  = MAX(hi, sec);
+	}
+
+	return (hi - lo < VHD_BAT_WINDOW);
+}
+
 static int
 read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 {
@@ -1155,8 +1260,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		if (op == VHD_OP_DATA_WRITE && !bat_can_allocate(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1377,54 +1481,149 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/* sectors between the starts of consecutive preallocated blocks */
+static inline uint64_t
+prealloc_stride(struct vhd_state *s)
+{
+	uint64_t stride = s->spb + s->bm_secs;
+
+	/* data region of segment should begin on page boundary */
+	if (stride % s->spp)
+		stride += s->spp - (stride % s->spp);
+
+	return stride;
+}
+
+/*
+ * zero the next VHD_ALLOC_RESERVE blocks, bitmaps included, past the
+ * end of data in one step.  handing one out then only needs a bat update.
+ */
 static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+reserve_zeroed_blocks(struct vhd_state *s)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t start, end;
+
+	start = s->next_db;
+
+	/* data region of segment should begin on page boundary */
+	if ((start + s->bm_secs) % s->spp)
+		start += s->spp - ((start + s->bm_secs) % s->spp);
+
+	end = start + prealloc_stride(s) * VHD_ALLOC_RESERVE;
+
+	err = vhd_zero_range(&s->vhd, vhd_sectors_to_bytes(s->next_db),
+			     vhd_sectors_to_bytes(end - s->next_db));
+	if (err) {
+		ERR(err, "zeroing 0x%"PRIx64" secs at 0x%08"PRIx64" failed\n",
+		    end - s->next_db, s->next_db);
+		return err;
+	}
+
+	DBG(TLOG_DBG, "reserved 0x%x blocks at 0x%08"PRIx64"\n",
+	    VHD_ALLOC_RESERVE, start);
+
+	s->bat.zero_next = start;
+	s->bat.zero_left = VHD_ALLOC_RESERVE;
+	s->next_db       = end;
+
+	return 0;
+}
+
+/*
+ * write the bat entries of all queued allocations at once.  the batch
+ * was admitted by bat_can_allocate, so it spans at most VHD_BAT_WINDOW
+ * sectors of the table.
+ */
+static void
+schedule_bat_batch_write(struct vhd_state *s)
+{
+	int i;
+	char *buf;
+	u64 offset;
+	u32 first, last, secs, sec;
 	struct vhd_bitmap *bm;
+	struct vhd_request *req;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+	ASSERT(bat_locked(s) && s->bat.alloc_count);
+	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
+	req   = &s->bat.req;
+	buf   = s->bat.bat_buf;
+	first = last = s->bat.alloc[0]->blk / 128;
+
+	for (i = 1; i < s->bat.alloc_count; i++) {
+		sec   = s->bat.alloc[i]->blk / 128;
+		first = MIN(first, sec);
+		last  = MAX(last, sec);
 	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	secs = last - first + 1;
+	ASSERT(secs <= VHD_BAT_WINDOW);
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
+	memcpy(buf, &bat_entry(s, first * 128), vhd_sectors_to_bytes(secs));
+
+	for (i = 0; i < s->bat.alloc_count; i++) {
+		bm = s->bat.alloc[i];
+		((u32 *)buf)[bm->blk - first * 128] = bm->offset;
 	}
 
-	s->bat.pbw_offset = s->next_db;
+	for (i = 0; i < secs * 128; i++)
+		BE32_OUT(&((u32 *)buf)[i]);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	init_vhd_request(s, req);
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
+	offset         = s->vhd.header.table_offset +
+		vhd_sectors_to_bytes(first);
+	req->treq.sec  = s->bat.alloc[0]->blk * s->spb;
+	req->treq.secs = secs;
+	req->treq.buf  = buf;
+	req->op        = VHD_OP_BAT_WRITE;
+	req->next      = NULL;
+
+	aio_write(s, req, offset);
+	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	s->bat.alloc_writing = s->bat.alloc_count;
+
+	DBG(TLOG_DBG, "blks: %d, bat secs: 0x%x-0x%x, "
+	    "table_offset: 0x%08"PRIx64"\n",
+	    s->bat.alloc_count, first, last, offset);
+}
+
+/*
+ * hand out a pre-zeroed block.  its bat entry joins the next bat write,
+ * and its transaction stays open until that write completes; data can be
+ * written to the block in the meantime.
+ */
+static int
+allocate_block(struct vhd_state *s, uint32_t blk, uint64_t *offset)
+{
+	int err;
+	struct vhd_bitmap *bm;
+	struct vhd_request *req;
+
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+
+	bm = get_bitmap(s, blk);
+	if (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING)) {
+		*offset = bm->offset;
+		return 0;
 	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
-	if (err != size) {
-		err = (err == -1 ? -errno : -EIO);
-		ERR(err, "write failed");
-		return err;
+	/* an earlier, failed allocation of this block is still draining */
+	if (bm && bitmap_in_use(bm))
+		return -EBUSY;
+
+	ASSERT(s->bat.alloc_count < VHD_BAT_BATCH);
+
+	if (!s->bat.zero_left) {
+		err = reserve_zeroed_blocks(s);
+		if (err)
+			return err;
 	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1434,11 +1633,27 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
+	bm->offset        = s->bat.zero_next;
+	s->bat.zero_next += prealloc_stride(s);
+	s->bat.zero_left--;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64"\n", blk, bm->offset);
+
+	req = &bm->bat_req;
+	init_vhd_request(s, req);
+	req->op       = VHD_OP_BAT_WRITE;
+	req->treq.sec = blk * s->spb;
+
 	lock_bat(s);
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING);
+	add_to_transaction(&bm->tx, req);
 
+	s->bat.alloc[s->bat.alloc_count++] = bm;
+	if (!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		schedule_bat_batch_write(s);
+
+	*offset = bm->offset;
 	return 0;
 }
 
@@ -1506,14 +1721,14 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
 		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-			err = allocate_block(s, blk);
-		else
-			err = update_bat(s, blk);
+			err = allocate_block(s, blk, &offset);
+		else {
+			err    = update_bat(s, blk);
+			offset = s->bat.pbw_offset;
+		}
 
 		if (err)
 			return err;
-
-		offset = s->bat.pbw_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1751,6 +1966,14 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	if (s->hash.entries && treq.secs) {
+		uint32_t blk, end;
+
+		end = (treq.sec + treq.secs - 1) / s->spb;
+		for (blk = treq.sec / s->spb; blk <= end; blk++)
+			vhd_hash_invalidate(&s->hash, blk);
+	}
+
 	while (treq.secs) {
 		int err;
 		uint8_t flags;
@@ -1904,6 +2127,10 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
 
+	/* the batch allocator releases the bat itself */
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		return;
+
 	if (!bat_locked(s))
 		return;
 
@@ -1983,6 +2210,61 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return finish_bitmap_transaction(s, bm, 0);
 }
 
+static void
+finish_bat_batch_write(struct vhd_state *s, struct vhd_request *req)
+{
+	int i, n;
+	struct vhd_bitmap *bm;
+	struct vhd_transaction *tx;
+	struct vhd_bitmap *done[VHD_BAT_BATCH];
+
+	ASSERT(bat_locked(s) &&
+	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+
+	/*
+	 * retire the written batch before completing anything: completions
+	 * can queue new writes, and with them new allocations.  the next bat
+	 * write is built from the in-memory bat, so it must already map the
+	 * blocks just written.
+	 */
+	n = s->bat.alloc_writing;
+	memcpy(done, s->bat.alloc, n * sizeof(struct vhd_bitmap *));
+	memmove(s->bat.alloc, s->bat.alloc + n,
+		(s->bat.alloc_count - n) * sizeof(struct vhd_bitmap *));
+	s->bat.alloc_count  -= n;
+	s->bat.alloc_writing = 0;
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+
+	/* on error the blocks' space is simply not reused */
+	if (!req->error)
+		for (i = 0; i < n; i++)
+			bat_entry(s, done[i]->blk) = done[i]->offset;
+
+	if (s->bat.alloc_count)
+		schedule_bat_batch_write(s);
+	else
+		unlock_bat(s);
+
+	for (i = 0; i < n; i++) {
+		bm = done[i];
+		tx = &bm->tx;
+
+		DBG(TLOG_DBG, "blk 0x%04x, offset: 0x%08"PRIx64", err %d\n",
+		    bm->blk, bm->offset, req->error);
+		ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING));
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+
+		if (req->error)
+			tx->error = req->error;
+
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING);
+		tx->finished++;
+		remove_from_req_list(&tx->requests, &bm->bat_req);
+		if (transaction_completed(tx))
+			finish_data_transaction(s, bm);
+	}
+}
+
 static void
 finish_bat_write(struct vhd_request *req)
 {
@@ -1993,6 +2275,9 @@ finish_bat_write(struct vhd_request *req)
 	s->returned++;
 	TRACE(s);
 
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		return finish_bat_batch_write(s, req);
+
 	bm = get_bitmap(s, s->bat.pbw_blk);
 
 	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
@@ -2010,16 +2295,9 @@ finish_bat_write(struct vhd_request *req)
 	} else
 		tx->error = req->error;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
-	}
+	clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+	if (s->bat.req.tx)
+		finish_bitmap_transaction(s, bm, req->error);
 
 	finish_bat_transaction(s, bm);
 }
@@ -2236,6 +2514,79 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 	}
 }
 
+/*
+ * grow the virtual size of an attached dynamic disk.  only bat entries
+ * reserved at creation can be handed out, so no data or metadata moves;
+ * growing beyond them requires an offline vhd-util resize.
+ */
+static int
+vhd_resize(td_driver_t *driver, td_sector_t secs)
+{
+	int err;
+	uint64_t size;
+	vhd_footer_t footer;
+	struct vhd_state *s;
+
+	s    = (struct vhd_state *)driver->data;
+	size = vhd_sectors_to_bytes(secs);
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		return -EROFS;
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return -EOPNOTSUPP;
+
+	if (size < s->vhd.footer.curr_size)
+		return -EINVAL;
+
+	if (size > (uint64_t)s->bat.bat.entries * s->vhd.header.block_size)
+		return -ENOSPC;
+
+	/* let any in-flight block allocation finish updating the bat */
+	if (bat_locked(s))
+		return -EAGAIN;
+
+	footer = s->vhd.footer;
+	s->vhd.footer.curr_size = size;
+	s->vhd.footer.geometry  = vhd_chs(size);
+	s->vhd.footer.checksum  = vhd_checksum_footer(&s->vhd.footer);
+
+	/*
+	 * in strict mode the primary footer was killed on open and is
+	 * rewritten on close; only the backup copy is current until then
+	 */
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT))
+		err = vhd_write_footer_at(&s->vhd, &s->vhd.footer, 0);
+	else if (s->bat.zero_next && !s->vhd.is_block) {
+		/*
+		 * the end of data falls at the start of the preallocated run,
+		 * where the footer would land in a zeroed bitmap: put it past
+		 * the run, where the next one starts
+		 */
+		err = vhd_write_footer_at(&s->vhd, &s->vhd.footer,
+					  vhd_sectors_to_bytes(s->next_db));
+		if (!err)
+			err = vhd_write_footer_at(&s->vhd, &s->vhd.footer, 0);
+	} else {
+		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
+		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
+		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
+	}
+
+	if (err) {
+		EPRINTF("%s: resizing to %"PRIu64" bytes: %d\n",
+			s->vhd.file, size, err);
+		s->vhd.footer = footer;
+		return err;
+	}
+
+	DPRINTF("%s: resized from %"PRIu64" to %"PRIu64" sectors\n",
+		s->vhd.file, driver->info.size, secs);
+
+	driver->info.size = secs;
+	return 0;
+}
+
 void 
 vhd_debug(td_driver_t *driver)
 {
@@ -2301,6 +2652,9 @@ vhd_debug(td_driver_t *driver)
 	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
 	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
 	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "ALLOC: pending: %d, writing: %d, reserved: %u at "
+	    "0x%08"PRIx64"\n", s->bat.alloc_count, s->bat.alloc_writing,
+	    s->bat.zero_left, s->bat.zero_next);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2319,4 +2673,5 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_resize          = vhd_resize,
 };
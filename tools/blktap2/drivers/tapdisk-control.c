@@ -627,6 +627,40 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_resize_vbd(struct tapdisk_control_connection *connection,
+			   tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_RESIZE_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	do {
+		err = tapdisk_vbd_resize(vbd, request->u.image.sectors);
+
+		if (!err || err != -EAGAIN)
+			break;
+
+		tapdisk_server_iterate();
+	} while (1);
+
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -664,6 +698,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_RESIZE:
+		return tapdisk_control_resize_vbd(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <libgen.h>	/* for basename(3) */
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "scheduler.h"
@@ -47,6 +48,10 @@
 
 #define SPB_SHIFT (VHD_BLOCK_SHIFT - SECTOR_SHIFT)
 
+#define BLOCK_UNRESOLVED                 0
+#define BLOCK_PRIVATE                    1
+#define BLOCK_SHARED                     2
+
 struct tapdisk_stream_poll {
 	int                              pipe[2];
 	int                              set;
@@ -88,9 +93,20 @@ static unsigned int tapdisk_stream_count;
 
 static void tapdisk_stream_close_image(struct tapdisk_stream *);
 
+struct tapdisk_diff_mismatch {
+	uint64_t                         start;
+	uint64_t                         secs;
+
+	uint64_t                         extents;
+	uint64_t                         sectors;
+};
+
 static char *program;
 static struct tapdisk_stream stream1, stream2;
 static vhd_context_t vhd1;
+static uint8_t *shared;
+static uint64_t skipped;
+static struct tapdisk_diff_mismatch mismatch;
 
 static void
 usage(FILE *stream)
@@ -99,6 +115,139 @@ usage(FILE *stream)
 			program);
 }
 
+/*
+ * walk the chain of the second image and mark every block that it
+ * resolves to the first image itself.  those reads would return the
+ * very same sectors on both sides, so they need not be compared.
+ */
+static int
+find_shared_blocks(const char *path1, const char *path2)
+{
+	int err;
+	uint32_t i, entries, left;
+	struct stat st1, st2;
+	char *path, *parent;
+	vhd_context_t vhd;
+
+	if (stat(path1, &st1))
+		return -errno;
+
+	entries = vhd1.bat.entries;
+	shared  = calloc(entries, sizeof(uint8_t));
+	if (!shared)
+		return -ENOMEM;
+
+	path = strdup(path2);
+	if (!path)
+		return -ENOMEM;
+
+	err  = 0;
+	left = entries;
+
+	while (left) {
+		if (stat(path, &st2)) {
+			err = -errno;
+			break;
+		}
+
+		if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+			for (i = 0; i < entries; i++)
+				if (shared[i] == BLOCK_UNRESOLVED)
+					shared[i] = BLOCK_SHARED;
+			break;
+		}
+
+		err = vhd_open(&vhd, path, VHD_OPEN_RDONLY);
+		if (err)
+			break;
+
+		if (vhd.header.block_size != vhd1.header.block_size) {
+			vhd_close(&vhd);
+			break;
+		}
+
+		err = vhd_get_bat(&vhd);
+		if (err) {
+			vhd_close(&vhd);
+			break;
+		}
+
+		for (i = 0; i < entries && i < vhd.bat.entries; i++)
+			if (shared[i] == BLOCK_UNRESOLVED &&
+			    vhd.bat.bat[i] != DD_BLK_UNUSED) {
+				shared[i] = BLOCK_PRIVATE;
+				left--;
+			}
+
+		if (vhd.footer.type != HD_TYPE_DIFF || vhd_parent_raw(&vhd)) {
+			vhd_close(&vhd);
+			break;
+		}
+
+		err = vhd_parent_locator_get(&vhd, &parent);
+		vhd_close(&vhd);
+		if (err)
+			break;
+
+		free(path);
+		path = parent;
+	}
+
+	free(path);
+
+	if (err) {
+		free(shared);
+		shared = NULL;
+	}
+
+	return err;
+}
+
+static inline int
+tapdisk_diff_skip_block(int blk)
+{
+	if (vhd1.bat.bat[blk] == DD_BLK_UNUSED)
+		return 1;
+
+	if (shared && shared[blk] == BLOCK_SHARED) {
+		skipped++;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_diff_flush_mismatch(void)
+{
+	struct tapdisk_diff_mismatch *m = &mismatch;
+
+	if (!m->secs)
+		return;
+
+	fprintf(stderr, "mismatch at sector 0x%"PRIx64", %"PRIu64" sectors\n",
+		m->start, m->secs);
+
+	m->extents++;
+	m->sectors += m->secs;
+	m->secs     = 0;
+}
+
+static void
+tapdisk_diff_add_mismatch(uint64_t sec)
+{
+	struct tapdisk_diff_mismatch *m = &mismatch;
+
+	if (m->secs && m->start + m->secs == sec) {
+		m->secs++;
+		return;
+	}
+
+	tapdisk_diff_flush_mismatch();
+	m->start = sec;
+	m->secs  = 1;
+}
+
 static int
 open_vhd(const char *path, vhd_context_t *vhd)
 {
@@ -246,7 +395,7 @@ tapdisk_result_compare(struct tapdisk_stream_request *sreq1,
 {
 	unsigned long idx1, idx2;
 	char *buf1, *buf2;
-	int result;
+	int i, result;
 
 	assert(sreq1->seqno == sreq2->seqno);
 	assert(sreq1->secs == sreq2->secs);
@@ -257,7 +406,19 @@ tapdisk_result_compare(struct tapdisk_stream_request *sreq1,
 	buf1 = (char *)MMAP_VADDR(stream1.vbd->ring.vstart, idx1, 0);
 	buf2 = (char *)MMAP_VADDR(stream2.vbd->ring.vstart, idx2, 0);
 
-	result = memcmp(buf1, buf2, sreq1->secs << SECTOR_SHIFT);
+	/* common case: one wide compare over the whole request */
+	if (!memcmp(buf1, buf2, sreq1->secs << SECTOR_SHIFT))
+		return 0;
+
+	result = 0;
+	for (i = 0; i < sreq1->secs; i++) {
+		off_t off = (off_t)i << SECTOR_SHIFT;
+		if (memcmp(buf1 + off, buf2 + off, 1 << SECTOR_SHIFT)) {
+			tapdisk_diff_add_mismatch(sreq1->sec + i);
+			result++;
+		}
+	}
+
 	return result;
 }
 
@@ -276,8 +437,7 @@ tapdisk_stream_process_data(void)
 			struct tapdisk_stream_request, next);
 	tmp2 = list_entry(sreq2->next.next,
 			struct tapdisk_stream_request, next);
-	while (result == 0 &&
-			&sreq1->next != &stream1.completed_list &&
+	while (&sreq1->next != &stream1.completed_list &&
 			&sreq2->next != &stream2.completed_list) {
 		//printf("checking: %llu|%llu\n", sreq1->seqno, sreq2->seqno);
 		advance_both = 1;
@@ -288,7 +448,7 @@ tapdisk_stream_process_data(void)
 		if (sreq1->seqno > sreq2->seqno)
 			goto advance2;
 
-		result = tapdisk_result_compare(sreq1, sreq2);
+		result += tapdisk_result_compare(sreq1, sreq2);
 
 		stream1.completed++;
 		stream2.completed++;
@@ -329,12 +489,7 @@ tapdisk_stream_dequeue(void *arg, blkif_response_t *rsp)
 		fprintf(stderr, "error reading sector 0x%"PRIx64"\n", sreq->sec);
 	}
 
-	if (tapdisk_stream_process_data()) {
-		fprintf(stderr, "mismatch at sector 0x%"PRIx64"\n",
-				sreq->sec);
-		stream1.err = EINVAL;
-		stream2.err = EINVAL;
-	}
+	tapdisk_stream_process_data();
 
 	tapdisk_stream_poll_set(&stream1.poll);
 	tapdisk_stream_poll_set(&stream2.poll);
@@ -405,7 +560,7 @@ tapdisk_stream_enqueue1(void)
 
 		/* skip any blocks that are not present in this image */
 		blk = s->cur >> SPB_SHIFT;
-		while (s->cur < s->end && vhd1.bat.bat[blk] == DD_BLK_UNUSED) {
+		while (s->cur < s->end && tapdisk_diff_skip_block(blk)) {
 			//printf("skipping block %d\n", blk);
 			blk++;
 			s->cur = blk << SPB_SHIFT;
@@ -503,6 +658,8 @@ tapdisk_diff_done(void)
 static void
 tapdisk_diff_stop(void)
 {
+	tapdisk_diff_flush_mismatch();
+
 	tapdisk_stream_close_image(&stream1);
 	tapdisk_stream_close_image(&stream2);
 }
@@ -716,10 +873,10 @@ tapdisk_stream_run(struct tapdisk_stream *s)
 int
 main(int argc, char *argv[])
 {
-	int c, err, type1;
+	int c, err, type1, type2;
 	const char *arg1 = NULL, *arg2 = NULL;
 	const disk_info_t *info;
-	const char *path1;
+	const char *path1, *path2;
 
 	err    = 0;
 
@@ -757,6 +914,15 @@ main(int argc, char *argv[])
 	if (err)
 		return err;
 
+	type2 = tapdisk_disktype_parse_params(arg2, &path2);
+	if (type2 == DISK_TYPE_VHD) {
+		err = find_shared_blocks(path1, path2);
+		if (err)
+			fprintf(stderr, "comparing all blocks of %s: %d\n",
+				path2, err);
+		err = 0;
+	}
+
 	tapdisk_start_logging("tapdisk-diff");
 
 	err = tapdisk_server_initialize();
@@ -785,12 +951,23 @@ main(int argc, char *argv[])
 	}
 
 	tapdisk_server_run();
-	
+
+	if (skipped)
+		fprintf(stderr, "skipped %"PRIu64" blocks shared by both "
+			"images\n", skipped);
+
+	if (mismatch.extents) {
+		fprintf(stderr, "%"PRIu64" sectors differ in %"PRIu64
+			" extents\n", mismatch.sectors, mismatch.extents);
+		err = EINVAL;
+	}
+
 out2:
 	tapdisk_stream_release(&stream2);
 out1:
 	tapdisk_stream_release(&stream1);
 out:
+	free(shared);
 	vhd_close(&vhd1);
 	tapdisk_stop_logging();
 
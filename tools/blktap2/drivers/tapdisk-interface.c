@@ -157,6 +157,30 @@ td_validate_parent(td_image_t *image, td_image_t *parent)
 	return driver->ops->td_validate_parent(driver, pdriver, 0);
 }
 
+int
+td_resize(td_image_t *image, td_sector_t secs)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_resize)
+		return -EOPNOTSUPP;
+
+	err = driver->ops->td_resize(driver, secs);
+	if (err)
+		return err;
+
+	image->info.size = driver->info.size;
+	return 0;
+}
+
 void
 td_queue_write(td_image_t *image, td_request_t treq)
 {
@@ -32,6 +32,10 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "scheduler.h"
@@ -39,11 +43,29 @@
 #include "tapdisk-server.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-utils.h"
+#include "libvhd.h"
 
 #define POLL_READ                        0
 #define POLL_WRITE                       1
 
-#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+#define TAPDISK_STREAM_COOKIE            "tdstream"
+
+/*
+ * extent stream format (-E): a tapdisk_stream_header, then any number
+ * of tapdisk_stream_extent records each followed by secs sectors of
+ * data, terminated by an extent with secs == 0.  sectors are relative
+ * to the start of the stream; fields are little-endian.  sectors not
+ * covered by an extent read as zero.
+ */
+struct tapdisk_stream_header {
+	char                             cookie[8];
+	uint64_t                         secs;
+};
+
+struct tapdisk_stream_extent {
+	uint64_t                         sec;
+	uint64_t                         secs;
+};
 
 struct tapdisk_stream_poll {
 	int                              pipe[2];
@@ -67,6 +89,16 @@ struct tapdisk_stream {
 
 	int                              err;
 
+	int                              sparse;
+	int                              extents;
+	int                              seekable;
+	int                              punch;
+	uint64_t                         out_sec;
+
+	uint8_t                         *map;
+	uint32_t                         spb;
+	uint32_t                         entries;
+
 	uint64_t                         cur;
 	uint64_t                         start;
 	uint64_t                         end;
@@ -92,7 +124,8 @@ static void
 usage(const char *app, int err)
 {
 	printf("usage: %s <-n type:/path/to/image> "
-	       "[-c sector count] [-s skip sectors]\n", app);
+	       "[-c sector count] [-s skip sectors] [-S sparse] "
+	       "[-E extent stream]\n", app);
 	exit(err);
 }
 
@@ -198,30 +231,326 @@ tapdisk_stream_get_request(struct tapdisk_stream *s)
 	return req;
 }
 
-static void
-tapdisk_stream_print_request(struct tapdisk_stream *s,
-			     struct tapdisk_stream_request *sreq)
+static int
+tapdisk_stream_writev(int fd, struct iovec *iov, int cnt)
 {
-	unsigned long idx = (unsigned long)tapdisk_stream_request_idx(s, sreq);
-	char *buf = (char *)MMAP_VADDR(s->vbd->ring.vstart, idx, 0);
-	write_exact(s->out_fd, buf, sreq->secs << SECTOR_SHIFT);
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(fd, iov, MIN(cnt, IOV_MAX));
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		while (cnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+
+		if (cnt) {
+			iov->iov_base  = (char *)iov->iov_base + ret;
+			iov->iov_len  -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_stream_write_zeros(struct tapdisk_stream *s, uint64_t secs)
+{
+	int err;
+	char *buf;
+	size_t size;
+	struct iovec iov;
+
+	size = MIN(secs, 2048) << SECTOR_SHIFT;
+	buf  = calloc(1, size);
+	if (!buf)
+		return -ENOMEM;
+
+	err = 0;
+	while (secs && !err) {
+		iov.iov_base = buf;
+		iov.iov_len  = MIN(secs << SECTOR_SHIFT, size);
+		secs        -= iov.iov_len >> SECTOR_SHIFT;
+		err          = tapdisk_stream_writev(s->out_fd, &iov, 1);
+	}
+
+	free(buf);
+	return err;
+}
+
+/*
+ * clear @gap sectors at the output position by punching a hole in them,
+ * and move past it.  returns -EOPNOTSUPP if the output can't do that.
+ */
+static int
+tapdisk_stream_punch(struct tapdisk_stream *s, uint64_t gap)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	off_t pos;
+
+	pos = lseek(s->out_fd, 0, SEEK_CUR);
+	if (pos == (off_t)-1)
+		return -errno;
+
+	if (fallocate(s->out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      pos, gap << SECTOR_SHIFT))
+		return -EOPNOTSUPP;
+
+	if (lseek(s->out_fd, gap << SECTOR_SHIFT, SEEK_CUR) == -1)
+		return -errno;
+
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/*
+ * move the output up to @sec, past sectors that were never read
+ * because no image in the chain has them allocated.  outputs which
+ * already hold data there (devices, existing files) must read back
+ * zeros, so the sectors are only seeked over in fresh regular files.
+ */
+static int
+tapdisk_stream_skip_to(struct tapdisk_stream *s, uint64_t sec)
+{
+	int err;
+	uint64_t gap;
+
+	gap = sec - s->out_sec;
+	if (!gap || s->extents)
+		goto out;
+
+	if (s->punch) {
+		err = tapdisk_stream_punch(s, gap);
+		if (!err)
+			goto out;
+		if (err != -EOPNOTSUPP)
+			return err;
+		s->punch = 0;
+	}
+
+	if (s->seekable) {
+		if (lseek(s->out_fd, gap << SECTOR_SHIFT, SEEK_CUR) == -1)
+			return -errno;
+	} else {
+		err = tapdisk_stream_write_zeros(s, gap);
+		if (err)
+			return err;
+	}
+
+out:
+	s->out_sec = sec;
+	return 0;
+}
+
+static int
+tapdisk_stream_write_extent(struct tapdisk_stream *s, struct iovec *iov,
+			    int cnt, uint64_t sec, uint64_t secs)
+{
+	int err;
+	struct tapdisk_stream_extent ext;
+
+	if (!cnt)
+		return 0;
+
+	err = tapdisk_stream_skip_to(s, sec);
+	if (err)
+		return err;
+
+	if (s->extents) {
+		ext.sec  = htole64(sec - s->start);
+		ext.secs = htole64(secs);
+		if (write_exact(s->out_fd, &ext, sizeof(ext)))
+			return -errno;
+	}
+
+	err = tapdisk_stream_writev(s->out_fd, iov, cnt);
+	if (err)
+		return err;
+
+	s->out_sec = sec + secs;
+	return 0;
 }
 
 static void
 tapdisk_stream_write_data(struct tapdisk_stream *s)
 {
+	int err, cnt;
+	uint64_t sec, secs;
+	struct iovec iov[MAX_REQUESTS];
 	struct tapdisk_stream_request *sreq, *tmp;
 
+	cnt  = 0;
+	sec  = 0;
+	secs = 0;
+	err  = 0;
+
+	/* gather contiguous completed requests into a single write */
 	list_for_each_entry_safe(sreq, tmp, &s->completed_list, next) {
+		unsigned long idx;
+
 		if (sreq->seqno != s->completed)
 			break;
 
+		if (cnt && sreq->sec != sec + secs) {
+			err = tapdisk_stream_write_extent(s, iov, cnt,
+							  sec, secs);
+			if (err)
+				break;
+			cnt  = 0;
+			secs = 0;
+		}
+
+		if (!cnt)
+			sec = sreq->sec;
+
+		idx = (unsigned long)tapdisk_stream_request_idx(s, sreq);
+		iov[cnt].iov_base = (char *)MMAP_VADDR(s->vbd->ring.vstart,
+						       idx, 0);
+		iov[cnt].iov_len  = sreq->secs << SECTOR_SHIFT;
+		secs += sreq->secs;
+		cnt++;
+
 		s->completed++;
-		tapdisk_stream_print_request(s, sreq);
 
 		list_del_init(&sreq->next);
 		list_add_tail(&sreq->next, &s->free_list);
 	}
+
+	if (!err)
+		err = tapdisk_stream_write_extent(s, iov, cnt, sec, secs);
+
+	if (err) {
+		fprintf(stderr, "error writing output: %d\n", err);
+		s->err = -err;
+	}
+}
+
+/* finish off the output once every request has been written */
+static int
+tapdisk_stream_write_tail(struct tapdisk_stream *s)
+{
+	int err;
+	off_t pos;
+	struct stat st;
+	struct tapdisk_stream_extent ext;
+
+	if (s->extents) {
+		memset(&ext, 0, sizeof(ext));
+		return (write_exact(s->out_fd, &ext, sizeof(ext)) ? -errno : 0);
+	}
+
+	err = tapdisk_stream_skip_to(s, s->end);
+	if (err)
+		return err;
+
+	/* a trailing hole in a regular file needs an explicit size */
+	if (fstat(s->out_fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	pos = lseek(s->out_fd, 0, SEEK_CUR);
+	if (pos == (off_t)-1 || pos <= st.st_size)
+		return 0;
+
+	return (ftruncate(s->out_fd, pos) ? -errno : 0);
+}
+
+/*
+ * build a per-block map of sectors allocated anywhere in the vhd chain;
+ * everything else reads as zero and need not go through tapdisk at all
+ */
+static int
+tapdisk_stream_map_chain(struct tapdisk_stream *s, const char *name)
+{
+	int err;
+	uint32_t i;
+	char *path, *parent;
+	vhd_context_t vhd;
+
+	path = strdup(name);
+	if (!path)
+		return -ENOMEM;
+
+	for (;;) {
+		err = vhd_open(&vhd, path, VHD_OPEN_RDONLY);
+		if (err)
+			break;
+
+		err = -EINVAL;
+		if (!vhd_type_dynamic(&vhd))
+			goto close;
+
+		if (!s->map) {
+			s->spb     = vhd.header.block_size >> SECTOR_SHIFT;
+			s->entries = vhd.header.max_bat_size;
+			s->map     = calloc(s->entries, sizeof(uint8_t));
+			if (!s->map) {
+				err = -ENOMEM;
+				goto close;
+			}
+		} else if (vhd.header.block_size >> SECTOR_SHIFT != s->spb)
+			goto close;
+
+		err = vhd_get_bat(&vhd);
+		if (err)
+			goto close;
+
+		for (i = 0; i < s->entries && i < vhd.bat.entries; i++)
+			if (vhd.bat.bat[i] != DD_BLK_UNUSED)
+				s->map[i] = 1;
+
+		if (vhd.footer.type != HD_TYPE_DIFF) {
+			err = 0;
+			goto close;
+		}
+
+		/* anything may be allocated in a raw parent */
+		err = -EINVAL;
+		if (vhd_parent_raw(&vhd))
+			goto close;
+
+		err = vhd_parent_locator_get(&vhd, &parent);
+		if (err)
+			goto close;
+
+		vhd_close(&vhd);
+		free(path);
+		path = parent;
+	}
+
+	free(path);
+	goto out;
+
+close:
+	vhd_close(&vhd);
+	free(path);
+out:
+	if (err) {
+		free(s->map);
+		s->map     = NULL;
+		s->entries = 0;
+	}
+
+	return err;
+}
+
+static inline int
+tapdisk_stream_allocated(struct tapdisk_stream *s, uint64_t sec)
+{
+	uint64_t blk;
+
+	if (!s->map)
+		return 1;
+
+	blk = sec / s->spb;
+	return (blk >= s->entries || s->map[blk]);
 }
 
 static inline void
@@ -270,6 +599,14 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 	tapdisk_stream_poll_clear(&s->poll);
 
 	if (tapdisk_stream_stop(s)) {
+		if (s->vbd && !s->err) {
+			int err = tapdisk_stream_write_tail(s);
+			if (err) {
+				fprintf(stderr, "error writing output: %d\n",
+					err);
+				s->err = -err;
+			}
+		}
 		tapdisk_stream_close_image(s);
 		return;
 	}
@@ -277,10 +614,20 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 	psize = getpagesize();
 
 	while (s->cur < s->end && !s->err) {
+		uint64_t bend;
 		blkif_request_t *breq;
 		td_vbd_request_t *vreq;
 		struct tapdisk_stream_request *sreq;
 
+		/* skip whole blocks that no image in the chain allocates */
+		while (s->cur < s->end && !tapdisk_stream_allocated(s, s->cur))
+			s->cur = MIN((s->cur / s->spb + 1) * s->spb, s->end);
+
+		if (s->cur >= s->end)
+			break;
+
+		bend = (s->map ? (s->cur / s->spb + 1) * s->spb : s->end);
+
 		sreq = tapdisk_stream_get_request(s);
 		if (!sreq)
 			break;
@@ -298,7 +645,8 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 		breq->operation     = BLKIF_OP_READ;
 
 		for (i = 0; i < BLKIF_MAX_SEGMENTS_PER_REQUEST; i++) {
-			uint32_t secs = MIN(s->end - s->cur, psize >> SECTOR_SHIFT);
+			uint32_t secs = MIN(MIN(s->end, bend) - s->cur,
+					    psize >> SECTOR_SHIFT);
 			struct blkif_request_segment *seg = breq->seg + i;
 
 			if (!secs)
@@ -325,6 +673,10 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 		list_add_tail(&sreq->next, &s->pending_list);
 	}
 
+	/* nothing left to read: no completion will wake us up again */
+	if (tapdisk_stream_stop(s))
+		tapdisk_stream_poll_set(&s->poll);
+
 	tapdisk_vbd_issue_requests(vbd);
 }
 
@@ -404,9 +756,10 @@ tapdisk_stream_set_position(struct tapdisk_stream *s,
 		return -EINVAL;
 	}
 
-	s->start = skip;
-	s->cur   = s->start;
-	s->end   = s->start + count;
+	s->start   = skip;
+	s->cur     = s->start;
+	s->end     = s->start + count;
+	s->out_sec = s->start;
 
 	return 0;
 }
@@ -496,14 +849,58 @@ tapdisk_stream_open_fds(struct tapdisk_stream *s)
 	return 0;
 }
 
+static int
+tapdisk_stream_open_sparse(struct tapdisk_stream *s, const char *path,
+			   int type)
+{
+	int err;
+	off_t pos;
+	struct stat st;
+	struct tapdisk_stream_header hdr;
+
+	if (type == DISK_TYPE_VHD) {
+		err = tapdisk_stream_map_chain(s, path);
+		if (err)
+			fprintf(stderr, "reading allocation of %s failed (%d), "
+				"streaming every sector\n", path, err);
+	}
+
+	if (s->extents) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.cookie, TAPDISK_STREAM_COOKIE, sizeof(hdr.cookie));
+		hdr.secs = htole64(s->end - s->start);
+
+		if (write_exact(s->out_fd, &hdr, sizeof(hdr))) {
+			fprintf(stderr, "failed to write header: %d\n", errno);
+			return errno;
+		}
+	} else {
+		pos = lseek(s->out_fd, 0, SEEK_CUR);
+		if (pos != (off_t)-1) {
+			/* holes can only be seeked over if nothing is there */
+			if (!fstat(s->out_fd, &st) && S_ISREG(st.st_mode) &&
+			    st.st_size <= pos)
+				s->seekable = 1;
+			else
+				s->punch = 1;
+		}
+	}
+
+	return 0;
+}
+
 static int
 tapdisk_stream_open(struct tapdisk_stream *s, const char *path,
-		    int type, uint64_t count, uint64_t skip)
+		    int type, uint64_t count, uint64_t skip,
+		    int sparse, int extents)
 {
 	int err;
 
 	tapdisk_stream_initialize(s);
 
+	s->sparse  = sparse || extents;
+	s->extents = extents;
+
 	err = tapdisk_stream_open_fds(s);
 	if (err)
 		return err;
@@ -516,6 +913,12 @@ tapdisk_stream_open(struct tapdisk_stream *s, const char *path,
 	if (err)
 		return err;
 
+	if (s->sparse) {
+		err = tapdisk_stream_open_sparse(s, path, type);
+		if (err)
+			return err;
+	}
+
 	err = tapdisk_stream_initialize_requests(s);
 	if (err)
 		return err;
@@ -531,6 +934,7 @@ static void
 tapdisk_stream_release(struct tapdisk_stream *s)
 {
 	close(s->out_fd);
+	free(s->map);
 	tapdisk_stream_close_image(s);
 	tapdisk_stream_unregister_enqueue_event(s);
 }
@@ -546,7 +950,7 @@ tapdisk_stream_run(struct tapdisk_stream *s)
 int
 main(int argc, char *argv[])
 {
-	int c, err, type;
+	int c, err, type, sparse, extents;
 	const char *params;
 	const disk_info_t *info;
 	const char *path;
@@ -555,10 +959,12 @@ main(int argc, char *argv[])
 
 	err    = 0;
 	skip   = 0;
-	count  = (uint64_t)-1;
-	params = NULL;
+	count   = (uint64_t)-1;
+	params  = NULL;
+	sparse  = 0;
+	extents = 0;
 
-	while ((c = getopt(argc, argv, "n:c:s:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:c:s:SEh")) != -1) {
 		switch (c) {
 		case 'n':
 			params = optarg;
@@ -569,6 +975,12 @@ main(int argc, char *argv[])
 		case 's':
 			skip = strtoull(optarg, NULL, 10);
 			break;
+		case 'S':
+			sparse = 1;
+			break;
+		case 'E':
+			extents = 1;
+			break;
 		default:
 			err = EINVAL;
 		case 'h':
@@ -588,7 +1000,8 @@ main(int argc, char *argv[])
 
 	tapdisk_start_logging("tapdisk-stream");
 
-	err = tapdisk_stream_open(&stream, path, type, count, skip);
+	err = tapdisk_stream_open(&stream, path, type, count, skip,
+				  sparse, extents);
 	if (err)
 		goto out;
 
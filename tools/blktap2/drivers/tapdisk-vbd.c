@@ -554,6 +554,28 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *path,
 	if (err)
 		return err;
 
+	/* callers that skip tapdisk_vbd_parse_stack open a single image */
+	if (list_empty(&vbd->driver_stack)) {
+		td_vbd_driver_info_t *driver;
+
+		driver = calloc(1, sizeof(td_vbd_driver_info_t));
+		if (!driver) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		INIT_LIST_HEAD(&driver->next);
+		driver->type   = drivertype;
+		driver->params = strdup(path);
+		if (!driver->params) {
+			free(driver);
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		list_add(&driver->next, &vbd->driver_stack);
+	}
+
 	vbd->flags   = flags;
 	vbd->storage = storage;
 
@@ -857,6 +879,53 @@ tapdisk_vbd_get_image_info(td_vbd_t *vbd, image_t *img)
 	return 0;
 }
 
+/*
+ * grow the leaf image of a running vbd and tell blktap about the new
+ * capacity.  the driver returns -EAGAIN while it cannot safely change
+ * size; callers are expected to run the server loop and retry.  blktap
+ * may refuse the new capacity while the device exists, in which case
+ * the image has grown but the guest only sees it after a pause and
+ * unpause; that is reported as an error.
+ */
+int
+tapdisk_vbd_resize(td_vbd_t *vbd, td_sector_t secs)
+{
+	int err;
+	image_t image;
+	struct blktap2_params params;
+
+	if (list_empty(&vbd->images))
+		return -EINVAL;
+
+	if (td_flag_test(vbd->state, TD_VBD_PAUSED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
+		return -EBUSY;
+
+	err = td_resize(tapdisk_vbd_first_image(vbd), secs);
+	if (err)
+		return err;
+
+	if (vbd->ring.fd == -1)
+		return 0;
+
+	memset(&params, 0, sizeof(params));
+	tapdisk_vbd_get_image_info(vbd, &image);
+
+	params.sector_size = image.secsize;
+	params.capacity    = image.size;
+	snprintf(params.name, sizeof(params.name) - 1, "%s", vbd->name);
+
+	if (ioctl(vbd->ring.fd, BLKTAP2_IOCTL_SET_PARAMS, &params)) {
+		err = -errno;
+		EPRINTF("%s: image resized to %llu sectors, but the device "
+			"capacity was not updated: %d; pause and unpause the "
+			"vbd to apply it\n", vbd->name, image.size, err);
+		return err;
+	}
+
+	return 0;
+}
+
 int
 tapdisk_vbd_queue_ready(td_vbd_t *vbd)
 {
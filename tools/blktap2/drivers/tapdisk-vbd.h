@@ -189,6 +189,7 @@ void tapdisk_vbd_detach(td_vbd_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_image_info(td_vbd_t *, image_t *);
+int tapdisk_vbd_resize(td_vbd_t *, td_sector_t);
 int tapdisk_vbd_queue_ready(td_vbd_t *);
 int tapdisk_vbd_retry_needed(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
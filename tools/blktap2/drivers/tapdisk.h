@@ -164,6 +164,7 @@ struct tap_disk {
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
+	int (*td_resize)             (td_driver_t *, td_sector_t);
 };
 
 #endif
@@ -0,0 +1,88 @@
+/* Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _VHD_HASH_H_
+#define _VHD_HASH_H_
+
+#include <inttypes.h>
+
+#include "libvhd.h"
+
+/*
+ * optional sidecar index (<vhd>.hash) holding a sha-256 digest of every
+ * allocated block.  the index is stamped with the vhd's inode, size and
+ * mtime when written; any writer that does not maintain it leaves it
+ * stale, and a stale index is treated as empty.
+ */
+
+#define VHD_HASH_COOKIE            "vhdhash"
+#define VHD_HASH_SUFFIX            ".hash"
+#define VHD_HASH_VERSION           1
+#define VHD_HASH_DIGEST_SIZE       32
+
+#define VHD_HASH_VALID             0x01
+/* digest covers the whole logical block, not just part of a diff */
+#define VHD_HASH_FULL              0x02
+
+#define VHD_HASH_OPEN_RDONLY       0x01
+#define VHD_HASH_OPEN_RDWR         0x02
+#define VHD_HASH_OPEN_CREAT        0x04
+
+typedef struct vhd_hash_header {
+	char                       cookie[8];
+	uint32_t                   version;
+	uint32_t                   block_size;
+	uint32_t                   entries;
+	vhd_uuid_t                 uuid;
+	uint64_t                   stamp_ino;
+	uint64_t                   stamp_size;
+	uint64_t                   stamp_sec;
+	uint64_t                   stamp_nsec;
+	char                       pad[440];
+} vhd_hash_header_t;
+
+typedef struct vhd_hash_entry {
+	uint32_t                   flags;
+	uint32_t                   pad;
+	uint8_t                    digest[VHD_HASH_DIGEST_SIZE];
+} vhd_hash_entry_t;
+
+typedef struct vhd_hash {
+	char                      *file;
+	int                        fd;
+	int                        flags;
+	vhd_hash_header_t          header;
+	vhd_hash_entry_t          *entries;
+} vhd_hash_t;
+
+int vhd_hash_open(vhd_hash_t *, vhd_context_t *, int flags);
+int vhd_hash_close(vhd_hash_t *);
+int vhd_hash_write(vhd_hash_t *, vhd_context_t *);
+int vhd_hash_block(vhd_hash_t *, vhd_context_t *, uint32_t block, char *buf);
+void vhd_hash_invalidate(vhd_hash_t *, uint32_t block);
+int vhd_hash_equal(vhd_hash_t *, uint32_t, vhd_hash_t *, uint32_t);
+
+#endif
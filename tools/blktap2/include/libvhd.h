@@ -253,6 +253,12 @@ int vhd_create(const char *name, uint64_t bytes, int type, vhd_flag_creat_t);
  * is to have the same size as the (first non-empty) parent */
 int vhd_snapshot(const char *snapshot, uint64_t bytes, const char *parent,
 		vhd_flag_creat_t);
+/* the _reserved variants size the bat for max_bytes so that the disk can
+ * later be grown up to that size without moving any data */
+int vhd_create_reserved(const char *name, uint64_t bytes, uint64_t max_bytes,
+		int type, vhd_flag_creat_t);
+int vhd_snapshot_reserved(const char *snapshot, uint64_t bytes,
+		uint64_t max_bytes, const char *parent, vhd_flag_creat_t);
 
 int vhd_hidden(vhd_context_t *, int *);
 int vhd_chain_depth(vhd_context_t *, int *);
@@ -261,6 +267,7 @@ off_t vhd_position(vhd_context_t *);
 int vhd_seek(vhd_context_t *, off_t, int);
 int vhd_read(vhd_context_t *, void *, size_t);
 int vhd_write(vhd_context_t *, void *, size_t);
+int vhd_copy_range(vhd_context_t *, off_t src, int fd, off_t dst, size_t);
 
 int vhd_offset(vhd_context_t *, uint32_t, uint32_t *);
 
@@ -285,6 +292,8 @@ void vhd_batmap_clear(vhd_context_t *, vhd_batmap_t *, uint32_t);
 
 int vhd_get_phys_size(vhd_context_t *, off_t *);
 int vhd_set_phys_size(vhd_context_t *, off_t);
+uint64_t vhd_max_capacity(vhd_context_t *);
+int vhd_set_virt_size(vhd_context_t *, uint64_t);
 
 int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
@@ -310,6 +319,7 @@ int vhd_read_bat(vhd_context_t *, vhd_bat_t *);
 int vhd_read_batmap(vhd_context_t *, vhd_batmap_t *);
 int vhd_read_bitmap(vhd_context_t *, uint32_t block, char **bufp);
 int vhd_read_block(vhd_context_t *, uint32_t block, char **bufp);
+int vhd_read_block_and_bitmap(vhd_context_t *, uint32_t block, char *buf);
 
 int vhd_write_footer(vhd_context_t *, vhd_footer_t *);
 int vhd_write_footer_at(vhd_context_t *, vhd_footer_t *, off_t);
@@ -319,6 +329,7 @@ int vhd_write_bat(vhd_context_t *, vhd_bat_t *);
 int vhd_write_batmap(vhd_context_t *, vhd_batmap_t *);
 int vhd_write_bitmap(vhd_context_t *, uint32_t block, char *bitmap);
 int vhd_write_block(vhd_context_t *, uint32_t block, char *data);
+int vhd_zero_range(vhd_context_t *, off_t off, off_t len);
 
 int vhd_io_read(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_write(vhd_context_t *, char *, uint64_t, uint32_t);
@@ -0,0 +1,507 @@
+/* Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "atomicio.h"
+#include "libvhd-hash.h"
+
+/* sha-256 (fips 180-4) */
+
+struct sha256 {
+	uint32_t                   h[8];
+	uint8_t                    buf[64];
+	uint64_t                   len;
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)                (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_init(struct sha256 *s)
+{
+	s->h[0] = 0x6a09e667;
+	s->h[1] = 0xbb67ae85;
+	s->h[2] = 0x3c6ef372;
+	s->h[3] = 0xa54ff53a;
+	s->h[4] = 0x510e527f;
+	s->h[5] = 0x9b05688c;
+	s->h[6] = 0x1f83d9ab;
+	s->h[7] = 0x5be0cd19;
+	s->len  = 0;
+}
+
+static void
+sha256_block(struct sha256 *s, const uint8_t *p)
+{
+	int i;
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)p[4 * i] << 24) |
+			((uint32_t)p[4 * i + 1] << 16) |
+			((uint32_t)p[4 * i + 2] << 8) |
+			(uint32_t)p[4 * i + 3];
+
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+			 (w[i - 15] >> 3)) +
+			(ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+			 (w[i - 2] >> 10));
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void
+sha256_update(struct sha256 *s, const void *data, size_t size)
+{
+	size_t used, n;
+	const uint8_t *p = data;
+
+	used    = s->len & 63;
+	s->len += size;
+
+	if (used) {
+		n = MIN(64 - used, size);
+		memcpy(s->buf + used, p, n);
+		p    += n;
+		size -= n;
+		if (used + n < 64)
+			return;
+		sha256_block(s, s->buf);
+	}
+
+	for (; size >= 64; p += 64, size -= 64)
+		sha256_block(s, p);
+
+	memcpy(s->buf, p, size);
+}
+
+static void
+sha256_final(struct sha256 *s, uint8_t *digest)
+{
+	int i;
+	size_t used;
+	uint64_t bits;
+
+	bits = s->len << 3;
+	used = s->len & 63;
+
+	s->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(s->buf + used, 0, 64 - used);
+		sha256_block(s, s->buf);
+		used = 0;
+	}
+
+	memset(s->buf + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		s->buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(s, s->buf);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = s->h[i >> 2] >> (24 - 8 * (i & 3));
+}
+
+static inline void
+vhd_hash_header_in(vhd_hash_header_t *header)
+{
+	BE32_IN(&header->version);
+	BE32_IN(&header->block_size);
+	BE32_IN(&header->entries);
+	BE64_IN(&header->stamp_ino);
+	BE64_IN(&header->stamp_size);
+	BE64_IN(&header->stamp_sec);
+	BE64_IN(&header->stamp_nsec);
+}
+
+static inline void
+vhd_hash_header_out(vhd_hash_header_t *header)
+{
+	BE32_OUT(&header->version);
+	BE32_OUT(&header->block_size);
+	BE32_OUT(&header->entries);
+	BE64_OUT(&header->stamp_ino);
+	BE64_OUT(&header->stamp_size);
+	BE64_OUT(&header->stamp_sec);
+	BE64_OUT(&header->stamp_nsec);
+}
+
+static void
+vhd_hash_initialize(vhd_hash_t *h, vhd_context_t *ctx)
+{
+	vhd_hash_header_t *header = &h->header;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->cookie, VHD_HASH_COOKIE, sizeof(header->cookie));
+	header->version    = VHD_HASH_VERSION;
+	header->block_size = ctx->header.block_size;
+	header->entries    = ctx->header.max_bat_size;
+	header->uuid       = ctx->footer.uuid;
+
+	memset(h->entries, 0, header->entries * sizeof(vhd_hash_entry_t));
+}
+
+static int
+vhd_hash_stamp(vhd_context_t *ctx, vhd_hash_header_t *header)
+{
+	struct stat st;
+
+	if (fstat(ctx->fd, &st))
+		return -errno;
+
+	header->stamp_ino  = st.st_ino;
+	header->stamp_size = st.st_size;
+	header->stamp_sec  = st.st_mtim.tv_sec;
+	header->stamp_nsec = st.st_mtim.tv_nsec;
+
+	return 0;
+}
+
+static int
+vhd_hash_validate(vhd_hash_t *h, vhd_context_t *ctx)
+{
+	int err;
+	vhd_hash_header_t stamp, *header = &h->header;
+
+	if (memcmp(header->cookie, VHD_HASH_COOKIE, sizeof(header->cookie)) ||
+	    header->version != VHD_HASH_VERSION)
+		return -EINVAL;
+
+	if (header->block_size != ctx->header.block_size ||
+	    header->entries != ctx->header.max_bat_size ||
+	    vhd_uuid_compare(&header->uuid, &ctx->footer.uuid))
+		return -ESTALE;
+
+	memset(&stamp, 0, sizeof(stamp));
+	err = vhd_hash_stamp(ctx, &stamp);
+	if (err)
+		return err;
+
+	if (header->stamp_ino != stamp.stamp_ino ||
+	    header->stamp_size != stamp.stamp_size ||
+	    header->stamp_sec != stamp.stamp_sec ||
+	    header->stamp_nsec != stamp.stamp_nsec)
+		return -ESTALE;
+
+	return 0;
+}
+
+static int
+vhd_hash_read(vhd_hash_t *h, vhd_context_t *ctx)
+{
+	int err;
+	size_t size;
+	ssize_t ret;
+	uint32_t i;
+
+	errno = 0;
+	ret   = atomicio(read, h->fd, &h->header, sizeof(h->header));
+	if (ret != sizeof(h->header))
+		return (errno ? -errno : -ENODATA);
+
+	vhd_hash_header_in(&h->header);
+
+	err = vhd_hash_validate(h, ctx);
+	if (err)
+		return err;
+
+	size = h->header.entries * sizeof(vhd_hash_entry_t);
+	ret  = atomicio(read, h->fd, h->entries, size);
+	if (ret != size)
+		return (errno ? -errno : -EIO);
+
+	for (i = 0; i < h->header.entries; i++)
+		BE32_IN(&h->entries[i].flags);
+
+	return 0;
+}
+
+int
+vhd_hash_open(vhd_hash_t *h, vhd_context_t *ctx, int flags)
+{
+	int err, oflags;
+
+	memset(h, 0, sizeof(*h));
+	h->fd    = -1;
+	h->flags = flags;
+
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	/* the staleness stamp relies on file metadata */
+	if (ctx->is_block)
+		return -EOPNOTSUPP;
+
+	err = vhd_get_header(ctx);
+	if (err)
+		return err;
+
+	h->file = malloc(strlen(ctx->file) + strlen(VHD_HASH_SUFFIX) + 1);
+	if (!h->file)
+		return -ENOMEM;
+
+	sprintf(h->file, "%s%s", ctx->file, VHD_HASH_SUFFIX);
+
+	oflags = ((flags & VHD_HASH_OPEN_RDWR) ? O_RDWR : O_RDONLY);
+	if (flags & VHD_HASH_OPEN_CREAT)
+		oflags |= O_RDWR | O_CREAT;
+
+	h->fd = open(h->file, oflags | O_LARGEFILE, 0644);
+	if (h->fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	h->entries = calloc(ctx->header.max_bat_size,
+			    sizeof(vhd_hash_entry_t));
+	if (!h->entries) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = vhd_hash_read(h, ctx);
+	if (err) {
+		/* writers start over with an empty index */
+		if (!(flags & (VHD_HASH_OPEN_RDWR | VHD_HASH_OPEN_CREAT)))
+			goto fail;
+		vhd_hash_initialize(h, ctx);
+	}
+
+	return 0;
+
+fail:
+	vhd_hash_close(h);
+	return err;
+}
+
+int
+vhd_hash_close(vhd_hash_t *h)
+{
+	if (h->fd != -1)
+		close(h->fd);
+	free(h->file);
+	free(h->entries);
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+	return 0;
+}
+
+/*
+ * flush @ctx and record its current state in the index.  the index is
+ * written to a temporary file and renamed over the old one so that a
+ * reader never sees new entries under an old, still matching stamp.
+ */
+int
+vhd_hash_write(vhd_hash_t *h, vhd_context_t *ctx)
+{
+	int err, fd;
+	char *tmp;
+	size_t size;
+	uint32_t i;
+	vhd_hash_header_t header;
+	vhd_hash_entry_t *entries;
+
+	if (!(h->flags & (VHD_HASH_OPEN_RDWR | VHD_HASH_OPEN_CREAT)))
+		return -EBADF;
+
+	fd      = -1;
+	tmp     = NULL;
+	size    = h->header.entries * sizeof(vhd_hash_entry_t);
+	entries = malloc(size);
+	if (!entries)
+		return -ENOMEM;
+
+	if (fsync(ctx->fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = vhd_hash_stamp(ctx, &h->header);
+	if (err)
+		goto out;
+
+	header = h->header;
+	vhd_hash_header_out(&header);
+
+	memcpy(entries, h->entries, size);
+	for (i = 0; i < h->header.entries; i++)
+		BE32_OUT(&entries[i].flags);
+
+	err = -ENOMEM;
+	tmp = malloc(strlen(h->file) + 5);
+	if (!tmp)
+		goto out;
+	sprintf(tmp, "%s.tmp", h->file);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	errno = 0;
+	if (atomicio(vwrite, fd, &header, sizeof(header)) != sizeof(header) ||
+	    atomicio(vwrite, fd, entries, size) != size) {
+		err = (errno ? -errno : -EIO);
+		goto out;
+	}
+
+	if (fdatasync(fd) || rename(tmp, h->file)) {
+		err = -errno;
+		goto out;
+	}
+
+	close(h->fd);
+	h->fd = fd;
+	fd    = -1;
+	err   = 0;
+
+out:
+	if (fd != -1) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(entries);
+	return err;
+}
+
+/*
+ * (re)compute the digest of @block.  @buf must hold the block's bitmap
+ * and data.  sectors that a differencing disk leaves to its parent are
+ * hashed as zeros, and the entry is then not marked VHD_HASH_FULL.
+ */
+int
+vhd_hash_block(vhd_hash_t *h, vhd_context_t *ctx, uint32_t block, char *buf)
+{
+	int err, full;
+	uint32_t i;
+	char *map, *data;
+	struct sha256 sha;
+	vhd_hash_entry_t *e;
+
+	if (block >= h->header.entries)
+		return -ERANGE;
+
+	e = h->entries + block;
+	memset(e, 0, sizeof(*e));
+
+	err = vhd_get_bat(ctx);
+	if (err)
+		return err;
+
+	if (block >= ctx->bat.entries || ctx->bat.bat[block] == DD_BLK_UNUSED)
+		return 0;
+
+	err = vhd_read_block_and_bitmap(ctx, block, buf);
+	if (err)
+		return err;
+
+	full = 1;
+	map  = buf;
+	data = buf + vhd_sectors_to_bytes(ctx->bm_secs);
+
+	for (i = 0; i < ctx->spb; i++)
+		if (!vhd_bitmap_test(ctx, map, i)) {
+			memset(data + vhd_sectors_to_bytes(i), 0,
+			       VHD_SECTOR_SIZE);
+			full = 0;
+		}
+
+	sha256_init(&sha);
+	sha256_update(&sha, data, vhd_sectors_to_bytes(ctx->spb));
+	sha256_final(&sha, e->digest);
+
+	e->flags = VHD_HASH_VALID;
+	if (full || ctx->footer.type != HD_TYPE_DIFF)
+		e->flags |= VHD_HASH_FULL;
+
+	return 0;
+}
+
+void
+vhd_hash_invalidate(vhd_hash_t *h, uint32_t block)
+{
+	if (h->entries && block < h->header.entries)
+		h->entries[block].flags = 0;
+}
+
+/* true if both blocks are known to hold identical logical contents */
+int
+vhd_hash_equal(vhd_hash_t *a, uint32_t ablock, vhd_hash_t *b, uint32_t bblock)
+{
+	vhd_hash_entry_t *ea, *eb;
+	const uint32_t mask = VHD_HASH_VALID | VHD_HASH_FULL;
+
+	if (!a->entries || !b->entries ||
+	    ablock >= a->header.entries || bblock >= b->header.entries)
+		return 0;
+
+	ea = a->entries + ablock;
+	eb = b->entries + bblock;
+
+	return ((ea->flags & mask) == mask && (eb->flags & mask) == mask &&
+		!memcmp(ea->digest, eb->digest, VHD_HASH_DIGEST_SIZE));
+}
@@ -352,13 +352,18 @@ vhd_journal_validate_entry_data(vhd_journal_entry_t *entry, char *buf)
 	return err;
 }
 
+/*
+ * write an entry and its data at the end of the journal and account for it
+ * in the in-memory header only.  the entry becomes visible to revert once
+ * the header is written out, so callers batching several entries can defer
+ * that (and the sync) until vhd_journal_flush.
+ */
 static int
-vhd_journal_update(vhd_journal_t *j, off_t offset,
+vhd_journal_append(vhd_journal_t *j, off_t offset,
 		   char *buf, size_t size, uint32_t type)
 {
 	int err;
-	off_t eof;
-	uint64_t *off, off_bak;
+	off_t data;
 	uint32_t *entries;
 	vhd_journal_entry_t entry;
 
@@ -376,31 +381,35 @@ vhd_journal_update(vhd_journal_t *j, off_t offset,
 	if (err)
 		goto fail;
 
-	err = vhd_journal_write(j, buf, size);
+	/*
+	 * data entries are copies of what is currently on disk at @offset,
+	 * so let the kernel copy (or reflink) them if it can
+	 */
+	data = j->header.journal_eof + sizeof(vhd_journal_entry_t);
+	err  = -EOPNOTSUPP;
+	if (type == VHD_JOURNAL_ENTRY_TYPE_DATA && !j->is_block)
+		err = vhd_copy_range(&j->vhd, offset, j->jfd, data, size);
+	if (err == -EOPNOTSUPP) {
+		err = vhd_journal_seek(j, data, SEEK_SET);
+		if (err)
+			goto fail;
+
+		err = vhd_journal_write(j, buf, size);
+	}
 	if (err)
 		goto fail;
 
 	if (type == VHD_JOURNAL_ENTRY_TYPE_DATA) {
-		off     = &j->header.journal_data_offset;
 		entries = &j->header.journal_data_entries;
+		if (!(*entries)++)
+			j->header.journal_data_offset = j->header.journal_eof;
 	} else {
-		off     = &j->header.journal_metadata_offset;
 		entries = &j->header.journal_metadata_entries;
+		if (!(*entries)++)
+			j->header.journal_metadata_offset = j->header.journal_eof;
 	}
 
-	off_bak = *off;
-	if (!(*entries)++)
-		*off = j->header.journal_eof;
 	j->header.journal_eof += (size + sizeof(vhd_journal_entry_t));
-
-	err = vhd_journal_write_header(j, &j->header);
-	if (err) {
-		if (!--(*entries))
-			*off = off_bak;
-		j->header.journal_eof -= (size + sizeof(vhd_journal_entry_t));
-		goto fail;
-	}
-
 	return 0;
 
 fail:
@@ -409,6 +418,30 @@ fail:
 	return err;
 }
 
+static int
+vhd_journal_update(vhd_journal_t *j, off_t offset,
+		   char *buf, size_t size, uint32_t type)
+{
+	int err;
+	vhd_journal_header_t bak;
+
+	bak = j->header;
+
+	err = vhd_journal_append(j, offset, buf, size, type);
+	if (err)
+		return err;
+
+	err = vhd_journal_write_header(j, &j->header);
+	if (err) {
+		j->header = bak;
+		if (!j->is_block)
+			vhd_journal_truncate(j, j->header.journal_eof);
+		return err;
+	}
+
+	return 0;
+}
+
 static int
 vhd_journal_add_footer(vhd_journal_t *j)
 {
@@ -1369,6 +1402,25 @@ vhd_journal_add_block(vhd_journal_t *j, uint32_t block, char mode)
 
 	off = vhd_sectors_to_bytes(blk);
 
+	if ((mode & VHD_JOURNAL_METADATA) && (mode & VHD_JOURNAL_DATA)) {
+		size = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
+
+		err  = posix_memalign((void **)&buf, VHD_SECTOR_SIZE, size);
+		if (err)
+			return -err;
+
+		err  = vhd_read_block_and_bitmap(vhd, block, buf);
+		if (!err)
+			err = vhd_journal_add_data(j, off, buf, size);
+
+		free(buf);
+
+		if (err)
+			return err;
+
+		return vhd_journal_flush(j);
+	}
+
 	if (mode & VHD_JOURNAL_METADATA) {
 		size = vhd_sectors_to_bytes(vhd->bm_secs);
 
@@ -1404,6 +1456,33 @@ vhd_journal_add_block(vhd_journal_t *j, uint32_t block, char mode)
 	return vhd_journal_sync(j);
 }
 
+/*
+ * journal @size bytes of the vhd at @offset, which the caller has already
+ * read into @buf.  the entry is not durable until vhd_journal_flush, so
+ * callers must not overwrite @offset before flushing.
+ */
+int
+vhd_journal_add_data(vhd_journal_t *j, off_t offset, char *buf, size_t size)
+{
+	return vhd_journal_append(j, offset, buf, size,
+				  VHD_JOURNAL_ENTRY_TYPE_DATA);
+}
+
+/*
+ * make all entries added so far durable with one header write and sync
+ */
+int
+vhd_journal_flush(vhd_journal_t *j)
+{
+	int err;
+
+	err = vhd_journal_write_header(j, &j->header);
+	if (err)
+		return err;
+
+	return vhd_journal_sync(j);
+}
+
 /*
  * commit indicates the transaction completed 
  * successfully and we can remove the undo log
@@ -37,10 +37,35 @@
 #include <iconv.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
 
 #include "libvhd.h"
 #include "relative-path.h"
 
+#if defined(__linux__)
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE       0x10
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD                 _IO(0x12, 119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES           _IO(0x12, 124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT                 _IO(0x12, 127)
+#endif
+#endif
+
+/* number of VHD_BLOCK_SIZE zero buffers per write when zeroing by hand */
+#define VHD_ZERO_IOVS              32
+
 /* VHD uses an epoch of 12:00AM, Jan 1, 2000. This is the Unix timestamp for
  * the start of the VHD epoch. */
 #define VHD_EPOCH_START 946684800
@@ -1884,6 +1909,51 @@ fail:
 	return err;
 }
 
+/*
+ * read the bitmap and data of @block with a single i/o.
+ * @buf must be sector aligned and hold (bm_secs + spb) sectors.
+ */
+int
+vhd_read_block_and_bitmap(vhd_context_t *ctx, uint32_t block, char *buf)
+{
+	int err;
+	size_t size;
+	uint64_t blk;
+	off_t end, off;
+
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	err = vhd_get_bat(ctx);
+	if (err)
+		return err;
+
+	if (block >= ctx->bat.entries)
+		return -ERANGE;
+
+	blk  = ctx->bat.bat[block];
+	if (blk == DD_BLK_UNUSED)
+		return -EINVAL;
+
+	off  = vhd_sectors_to_bytes(blk);
+	size = vhd_sectors_to_bytes(ctx->bm_secs + ctx->spb);
+
+	err  = vhd_footer_offset_at_eof(ctx, &end);
+	if (err)
+		return err;
+
+	if (end < off + size) {
+		memset(buf + (end - off), 0, off + size - end);
+		size = end - off;
+	}
+
+	err  = vhd_seek(ctx, off, SEEK_SET);
+	if (err)
+		return err;
+
+	return vhd_read(ctx, buf, size);
+}
+
 int
 vhd_write_footer_at(vhd_context_t *ctx, vhd_footer_t *footer, off_t off)
 {
@@ -2270,6 +2340,63 @@ vhd_write(vhd_context_t *ctx, void *buf, size_t size)
 	return (errno ? -errno : -EIO);
 }
 
+/*
+ * copy @size bytes at @src in @ctx to @dst in @fd inside the kernel,
+ * letting filesystems that support it share extents instead of copying.
+ * returns -EOPNOTSUPP if the range can't be offloaded; the caller should
+ * then fall back to writing the data itself.  ranges running into the
+ * footer are never offloaded: callers' buffers hold zeros there (see
+ * vhd_read_block_and_bitmap), not the footer.
+ */
+int
+vhd_copy_range(vhd_context_t *ctx, off_t src, int fd, off_t dst, size_t size)
+{
+#if defined(__linux__) && defined(__NR_copy_file_range)
+	int err;
+	off_t end;
+	ssize_t ret;
+	loff_t in, out;
+
+	err = vhd_footer_offset_at_eof(ctx, &end);
+	if (err || src + (off_t)size > end)
+		return -EOPNOTSUPP;
+
+	in  = src;
+	out = dst;
+
+	while (size) {
+		ret = syscall(__NR_copy_file_range,
+			      ctx->fd, &in, fd, &out, size, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			switch (errno) {
+			case ENOSYS:
+			case EXDEV:
+			case EINVAL:
+			case EBADF:
+			case EOPNOTSUPP:
+				return -EOPNOTSUPP;
+			}
+
+			VHDLOG("%s: copy of %zu from 0x%08"PRIx64" failed: %d\n",
+			       ctx->file, size, (uint64_t)in, -errno);
+			return -errno;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		size -= ret;
+	}
+
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
 int
 vhd_offset(vhd_context_t *ctx, uint32_t sector, uint32_t *offset)
 {
@@ -2759,36 +2886,100 @@ vhd_create_bat(vhd_context_t *ctx)
 }
 
 static int
-vhd_initialize_fixed_disk(vhd_context_t *ctx)
+vhd_zero_write(vhd_context_t *ctx, off_t off, off_t len)
 {
 	char *buf;
-	int i, err;
-
-	if (ctx->footer.type != HD_TYPE_FIXED)
-		return -EINVAL;
-
-	err = vhd_seek(ctx, 0, SEEK_SET);
-	if (err)
-		return err;
+	int cnt, err;
+	size_t size;
+	ssize_t ret;
+	struct iovec iov[VHD_ZERO_IOVS];
 
 	buf = mmap(0, VHD_BLOCK_SIZE, PROT_READ,
 		   MAP_SHARED | MAP_ANON, -1, 0);
 	if (buf == MAP_FAILED)
 		return -errno;
 
-	for (i = 0; i < ctx->footer.curr_size >> VHD_BLOCK_SHIFT; i++) {
-		err = vhd_write(ctx, buf, VHD_BLOCK_SIZE);
-		if (err)
-			goto out;
-	}
-
 	err = 0;
 
-out:
+	while (len) {
+		size = 0;
+		for (cnt = 0; cnt < VHD_ZERO_IOVS && size < len; cnt++) {
+			iov[cnt].iov_base = buf;
+			iov[cnt].iov_len  = MIN(len - size, VHD_BLOCK_SIZE);
+			size += iov[cnt].iov_len;
+		}
+
+		ret = pwritev(ctx->fd, iov, cnt, off);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			err = (ret ? -errno : -EIO);
+			VHDLOG("%s: zeroing 0x%"PRIx64" bytes at 0x%08"PRIx64
+			       " failed: %d\n", ctx->file, (uint64_t)len,
+			       (uint64_t)off, err);
+			break;
+		}
+
+		off += ret;
+		len -= ret;
+	}
+
 	munmap(buf, VHD_BLOCK_SIZE);
 	return err;
 }
 
+/*
+ * zero [@off, @off + @len) of @ctx, preferably without moving any data:
+ * fallocate on files and discard/zeroout on block devices.  falls back
+ * to large writes from a shared zero mapping.
+ */
+int
+vhd_zero_range(vhd_context_t *ctx, off_t off, off_t len)
+{
+#if defined(__linux__)
+	struct stat st;
+	uint64_t range[2];
+	int zeroes;
+
+	if (ctx->is_block) {
+		range[0] = off;
+		range[1] = len;
+		zeroes   = 0;
+
+		if (!ioctl(ctx->fd, BLKDISCARDZEROES, &zeroes) && zeroes &&
+		    !ioctl(ctx->fd, BLKDISCARD, range))
+			return 0;
+
+		if (!ioctl(ctx->fd, BLKZEROOUT, range))
+			return 0;
+	} else {
+		if (!fallocate(ctx->fd, FALLOC_FL_ZERO_RANGE, off, len))
+			return 0;
+		if (errno == ENOSPC)
+			return -errno;
+
+		/* anything past eof reads back as zeros once allocated */
+		if (!fstat(ctx->fd, &st) && off >= st.st_size) {
+			if (!fallocate(ctx->fd, 0, off, len))
+				return 0;
+			if (errno == ENOSPC)
+				return -errno;
+		}
+	}
+#endif
+
+	return vhd_zero_write(ctx, off, len);
+}
+
+static int
+vhd_initialize_fixed_disk(vhd_context_t *ctx)
+{
+	if (ctx->footer.type != HD_TYPE_FIXED)
+		return -EINVAL;
+
+	return vhd_zero_range(ctx, 0, ctx->footer.curr_size);
+}
+
 int 
 vhd_get_phys_size(vhd_context_t *ctx, off_t *size)
 {
@@ -2819,9 +3010,42 @@ vhd_set_phys_size(vhd_context_t *ctx, off_t size)
 			size - sizeof(vhd_footer_t));
 }
 
+/*
+ * largest virtual size @ctx can be grown to without relocating any
+ * metadata or data: the capacity covered by its (possibly reserved) bat
+ */
+uint64_t
+vhd_max_capacity(vhd_context_t *ctx)
+{
+	if (!vhd_type_dynamic(ctx))
+		return ctx->footer.curr_size;
+
+	return (uint64_t)ctx->header.max_bat_size * ctx->header.block_size;
+}
+
+/*
+ * grow the virtual size of a dynamic vhd in place.  only the footers
+ * change; the new size must fit in the bat entries reserved at creation.
+ */
+int
+vhd_set_virt_size(vhd_context_t *ctx, uint64_t size)
+{
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	if (size < ctx->footer.curr_size || size > vhd_max_capacity(ctx))
+		return -EINVAL;
+
+	ctx->footer.curr_size = size;
+	ctx->footer.geometry  = vhd_chs(size);
+	ctx->footer.checksum  = vhd_checksum_footer(&ctx->footer);
+
+	return vhd_write_footer(ctx, &ctx->footer);
+}
+
 static int
-__vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
-		vhd_flag_creat_t flags)
+__vhd_create(const char *name, const char *parent, uint64_t bytes,
+	     uint64_t max_bytes, int type, vhd_flag_creat_t flags)
 {
 	int err;
 	off_t off;
@@ -2877,6 +3101,11 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 		if (err)
 			goto out;
 
+		/* reserve bat entries so the disk can later grow in place */
+		if (max_bytes > ctx.footer.curr_size)
+			header->max_bat_size = (max_bytes + VHD_BLOCK_SIZE - 1)
+				>> VHD_BLOCK_SHIFT;
+
 		err = vhd_write_footer_at(&ctx, &ctx.footer, 0);
 		if (err)
 			goto out;
@@ -2934,14 +3163,29 @@ out:
 int
 vhd_create(const char *name, uint64_t bytes, int type, vhd_flag_creat_t flags)
 {
-	return __vhd_create(name, NULL, bytes, type, flags);
+	return __vhd_create(name, NULL, bytes, 0, type, flags);
+}
+
+int
+vhd_create_reserved(const char *name, uint64_t bytes, uint64_t max_bytes,
+		    int type, vhd_flag_creat_t flags)
+{
+	return __vhd_create(name, NULL, bytes, max_bytes, type, flags);
 }
 
 int
 vhd_snapshot(const char *name, uint64_t bytes, const char *parent,
 		vhd_flag_creat_t flags)
 {
-	return __vhd_create(name, parent, bytes, HD_TYPE_DIFF, flags);
+	return __vhd_create(name, parent, bytes, 0, HD_TYPE_DIFF, flags);
+}
+
+int
+vhd_snapshot_reserved(const char *name, uint64_t bytes, uint64_t max_bytes,
+		      const char *parent, vhd_flag_creat_t flags)
+{
+	return __vhd_create(name, parent, bytes, max_bytes,
+			    HD_TYPE_DIFF, flags);
 }
 
 static int
@@ -3185,7 +3429,6 @@ __vhd_io_fixed_write(vhd_context_t *ctx,
 static int
 __vhd_io_allocate_block(vhd_context_t *ctx, uint32_t block)
 {
-	char *buf;
 	size_t size;
 	off_t off, max;
 	int i, err, gap, spp;
@@ -3206,29 +3449,13 @@ __vhd_io_allocate_block(vhd_context_t *ctx, uint32_t block)
 		max += gap;
 	}
 
-	err = vhd_seek(ctx, off, SEEK_SET);
-	if (err)
-		return err;
-
 	size = vhd_sectors_to_bytes(ctx->spb + ctx->bm_secs + gap);
-	buf  = mmap(0, size, PROT_READ, MAP_SHARED | MAP_ANON, -1, 0);
-	if (buf == MAP_FAILED)
-		return -errno;
-
-	err = vhd_write(ctx, buf, size);
+	err  = vhd_zero_range(ctx, off, size);
 	if (err)
-		goto out;
+		return err;
 
 	ctx->bat.bat[block] = max;
-	err = vhd_write_bat(ctx, &ctx->bat);
-	if (err)
-		goto out;
-
-	err = 0;
-
-out:
-	munmap(buf, size);
-	return err;
+	return vhd_write_bat(ctx, &ctx->bat);
 }
 
 static int
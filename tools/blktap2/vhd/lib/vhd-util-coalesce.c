@@ -28,9 +28,11 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "libvhd.h"
+#include "libvhd-hash.h"
 
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
@@ -56,11 +58,13 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 }
 
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw.
+ * 'hash' and 'phash' are the (possibly empty) digest indexes of the two.
  */
 static int
 vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+		int parent_fd, vhd_hash_t *hash, vhd_hash_t *phash,
+		uint64_t block)
 {
 	int i, err;
 	char *buf, *map;
@@ -73,6 +77,23 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
 		return 0;
 
+	/* parent already holds exactly this data */
+	if (vhd_hash_equal(hash, block, phash, block))
+		return 0;
+
+	/*
+	 * a fully populated child block replaces the parent's contents,
+	 * so its digest carries over; anything else leaves the parent
+	 * block's digest unknown.
+	 */
+	if (phash->entries && block < phash->header.entries) {
+		if (hash->entries && block < hash->header.entries &&
+		    (hash->entries[block].flags & VHD_HASH_FULL))
+			phash->entries[block] = hash->entries[block];
+		else
+			vhd_hash_invalidate(phash, block);
+	}
+
 	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
 	if (err)
 		return -err;
@@ -130,11 +151,15 @@ vhd_util_coalesce(int argc, char **argv)
 	uint64_t i;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
+	vhd_hash_t hash, phash;
 	int parent_fd = -1;
 
 	name  = NULL;
 	pname = NULL;
 	parent.file = NULL;
+	memset(&hash, 0, sizeof(hash));
+	memset(&phash, 0, sizeof(phash));
+	hash.fd = phash.fd = -1;
 
 	if (!argc || !argv)
 		goto usage;
@@ -195,16 +220,31 @@ vhd_util_coalesce(int argc, char **argv)
 			goto done;
 	}
 
+	/* digest indexes are optional; without them every block is copied */
+	if (parent.file) {
+		vhd_hash_open(&hash, &vhd, VHD_HASH_OPEN_RDONLY);
+		vhd_hash_open(&phash, &parent, VHD_HASH_OPEN_RDWR);
+	}
+
 	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
+		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd,
+					      &hash, &phash, i);
 		if (err)
 			goto done;
 	}
 
+	if (phash.entries) {
+		err = vhd_hash_write(&phash, &parent);
+		if (err)
+			printf("error writing %s hash index: %d\n", pname, err);
+	}
+
 	err = 0;
 
  done:
 	free(pname);
+	vhd_hash_close(&hash);
+	vhd_hash_close(&phash);
 	vhd_close(&vhd);
 	if (parent.file)
 		vhd_close(&parent);
@@ -35,12 +35,13 @@ int
 vhd_util_create(int argc, char **argv)
 {
 	char *name;
-	uint64_t size;
+	uint64_t size, max;
 	int c, sparse, err;
 	vhd_flag_creat_t flags;
 
 	err       = -EINVAL;
 	size      = 0;
+	max       = 0;
 	sparse    = 1;
 	name      = NULL;
 	flags     = 0;
@@ -49,7 +50,7 @@ vhd_util_create(int argc, char **argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:s:rh")) != -1) {
+	while ((c = getopt(argc, argv, "n:s:S:rh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -58,6 +59,9 @@ vhd_util_create(int argc, char **argv)
 			err  = 0;
 			size = strtoull(optarg, NULL, 10);
 			break;
+		case 'S':
+			max  = strtoull(optarg, NULL, 10);
+			break;
 		case 'r':
 			sparse = 0;
 			break;
@@ -70,11 +74,15 @@ vhd_util_create(int argc, char **argv)
 	if (err || !name || optind != argc)
 		goto usage;
 
-	return vhd_create(name, size << 20,
-				  (sparse ? HD_TYPE_DYNAMIC : HD_TYPE_FIXED),
-				  flags);
+	if (max && (!sparse || max < size))
+		goto usage;
+
+	return vhd_create_reserved(name, size << 20, max << 20,
+				   (sparse ? HD_TYPE_DYNAMIC : HD_TYPE_FIXED),
+				   flags);
 
 usage:
-	printf("options: <-n name> <-s size (MB)> [-r reserve] [-h help]\n");
+	printf("options: <-n name> <-s size (MB)> [-r reserve] "
+	       "[-S max size for online growth (MB)] [-h help]\n");
 	return -EINVAL;
 }
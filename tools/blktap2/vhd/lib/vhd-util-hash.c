@@ -0,0 +1,156 @@
+/* Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libvhd.h"
+#include "libvhd-hash.h"
+
+static void
+vhd_util_hash_print(vhd_hash_t *hash, uint32_t block)
+{
+	int i;
+	vhd_hash_entry_t *e = hash->entries + block;
+
+	if (!(e->flags & VHD_HASH_VALID))
+		return;
+
+	printf("%u ", block);
+	for (i = 0; i < VHD_HASH_DIGEST_SIZE; i++)
+		printf("%02x", e->digest[i]);
+	printf("%s\n", (e->flags & VHD_HASH_FULL) ? "" : " partial");
+}
+
+int
+vhd_util_hash(int argc, char **argv)
+{
+	char *name, *buf;
+	vhd_context_t vhd;
+	vhd_hash_t hash;
+	uint32_t i, hashed;
+	int err, c, force, print;
+
+	buf    = NULL;
+	name   = NULL;
+	force  = 0;
+	print  = 0;
+	hashed = 0;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:fph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'p':
+			print = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc)
+		goto usage;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto close;
+
+	err = vhd_hash_open(&hash, &vhd, VHD_HASH_OPEN_RDWR | VHD_HASH_OPEN_CREAT);
+	if (err) {
+		printf("error opening hash index of %s: %d\n", name, err);
+		goto close;
+	}
+
+	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE,
+			     vhd_sectors_to_bytes(vhd.bm_secs + vhd.spb));
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto done;
+	}
+
+	for (i = 0; i < vhd.bat.entries; i++) {
+		if (vhd.bat.bat[i] == DD_BLK_UNUSED) {
+			vhd_hash_invalidate(&hash, i);
+			continue;
+		}
+
+		if (!force && (hash.entries[i].flags & VHD_HASH_VALID))
+			continue;
+
+		err = vhd_hash_block(&hash, &vhd, i, buf);
+		if (err) {
+			printf("error hashing block %u of %s: %d\n",
+			       i, name, err);
+			goto done;
+		}
+
+		hashed++;
+	}
+
+	err = vhd_hash_write(&hash, &vhd);
+	if (err) {
+		printf("error writing hash index of %s: %d\n", name, err);
+		goto done;
+	}
+
+	if (print)
+		for (i = 0; i < vhd.bat.entries; i++)
+			vhd_util_hash_print(&hash, i);
+	else
+		printf("%u blocks hashed\n", hashed);
+
+done:
+	free(buf);
+	vhd_hash_close(&hash);
+close:
+	vhd_close(&vhd);
+	return err;
+
+usage:
+	printf("options: <-n name> [-f force rehash] [-p print digests] "
+	       "[-h help]\n");
+	return -EINVAL;
+}
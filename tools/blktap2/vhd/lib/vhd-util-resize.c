@@ -53,6 +53,18 @@ typedef struct vhd_block {
 	uint32_t offset;
 } vhd_block_t;
 
+/* blocks moved between journal syncs */
+#define VHD_MOVE_BATCH_SIZE 32
+
+typedef struct vhd_move_batch {
+	char    *buf;
+	int      cnt;
+	struct {
+		off_t off;
+		off_t size;
+	} src[VHD_MOVE_BATCH_SIZE];
+} vhd_move_batch_t;
+
 TEST_FAIL_EXTERN_VARS;
 
 static inline uint32_t
@@ -234,70 +246,129 @@ quicksort(vhd_block_t *list, int left, int right)
 }
 
 static int
-vhd_move_block(vhd_journal_t *journal, uint32_t src, off_t offset)
+vhd_move_batch_init(vhd_journal_t *journal, vhd_move_batch_t *batch)
 {
 	int err;
-	char *buf;
 	size_t size;
 	vhd_context_t *vhd;
-	off_t off, src_off;
 
-	buf     = NULL;
-	vhd     = &journal->vhd;
-	off     = offset;
-	size    = vhd_sectors_to_bytes(vhd->bm_secs);
-	src_off = vhd->bat.bat[src];
+	vhd  = &journal->vhd;
+	size = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
 
-	if (src_off == DD_BLK_UNUSED)
-		return -EINVAL;
-	src_off = vhd_sectors_to_bytes(src_off);
+	memset(batch, 0, sizeof(*batch));
 
-	err  = vhd_journal_add_block(journal, src,
-				     VHD_JOURNAL_DATA | VHD_JOURNAL_METADATA);
-	if (err)
-		goto out;
+	err  = posix_memalign((void **)&batch->buf, VHD_SECTOR_SIZE, size);
+	if (err) {
+		batch->buf = NULL;
+		return -err;
+	}
 
-	err  = vhd_read_bitmap(vhd, src, &buf);
-	if (err)
-		goto out;
+	return 0;
+}
 
-	err  = vhd_seek(vhd, off, SEEK_SET);
-	if (err)
-		goto out;
+static void
+vhd_move_batch_free(vhd_move_batch_t *batch)
+{
+	free(batch->buf);
+	batch->buf = NULL;
+}
 
-	err  = vhd_write(vhd, buf, size);
+/*
+ * make the undo records of all blocks moved in this batch durable,
+ * then release their old locations.  adjacent sources are zeroed together.
+ */
+static int
+vhd_move_batch_flush(vhd_journal_t *journal, vhd_move_batch_t *batch)
+{
+	int i, err;
+	off_t off, size;
+
+	if (!batch->cnt)
+		return 0;
+
+	err = vhd_journal_flush(journal);
 	if (err)
-		goto out;
+		return err;
+
+	off  = batch->src[0].off;
+	size = batch->src[0].size;
+
+	for (i = 1; i <= batch->cnt; i++) {
+		if (i < batch->cnt && batch->src[i].off == off + size) {
+			size += batch->src[i].size;
+			continue;
+		}
+
+		err = vhd_write_zeros(journal, off, size);
+		if (err)
+			return err;
+
+		if (i < batch->cnt) {
+			off  = batch->src[i].off;
+			size = batch->src[i].size;
+		}
+	}
+
+	batch->cnt = 0;
+	return 0;
+}
+
+/*
+ * move the bitmap and data of block @src to @offset.  the block is read
+ * once; the same buffer feeds both the undo journal and the new location.
+ * the old location is only zeroed once the batch is flushed.
+ */
+static int
+vhd_move_block(vhd_journal_t *journal, vhd_move_batch_t *batch,
+	       uint32_t src, off_t offset)
+{
+	int err;
+	size_t size;
+	vhd_context_t *vhd;
+	off_t src_off;
 
-	free(buf);
-	buf   = NULL;
-	off  += size;
-	size  = vhd_sectors_to_bytes(vhd->spb);
+	vhd     = &journal->vhd;
+	size    = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
+	src_off = vhd->bat.bat[src];
 
-	err  = vhd_read_block(vhd, src, &buf);
+	if (src_off == DD_BLK_UNUSED)
+		return -EINVAL;
+	src_off = vhd_sectors_to_bytes(src_off);
+
+	err  = vhd_read_block_and_bitmap(vhd, src, batch->buf);
 	if (err)
-		goto out;
+		return err;
 
-	err  = vhd_seek(vhd, off, SEEK_SET);
+	err  = vhd_journal_add_data(journal, src_off, batch->buf, size);
 	if (err)
-		goto out;
+		return err;
+
+	err  = -EOPNOTSUPP;
+	if (!vhd->is_block)
+		err = vhd_copy_range(vhd, src_off, vhd->fd, offset, size);
+	if (err == -EOPNOTSUPP) {
+		err = vhd_seek(vhd, offset, SEEK_SET);
+		if (err)
+			return err;
 
-	err  = vhd_write(vhd, buf, size);
+		err = vhd_write(vhd, batch->buf, size);
+	}
 	if (err)
-		goto out;
+		return err;
 
 	vhd->bat.bat[src] = offset >> VHD_SECTOR_SHIFT;
 
-	err = vhd_write_zeros(journal, src_off,
-			      vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb));
+	batch->src[batch->cnt].off  = src_off;
+	batch->src[batch->cnt].size = size;
+	if (++batch->cnt == VHD_MOVE_BATCH_SIZE)
+		return vhd_move_batch_flush(journal, batch);
 
-out:
-	free(buf);
-	return err;
+	return 0;
 }
 
 static int
-vhd_clobber_block(vhd_journal_t *journal, uint32_t src, uint32_t dest)
+vhd_clobber_block(vhd_journal_t *journal, vhd_move_batch_t *batch,
+		  uint32_t src, uint32_t dest)
 {
 	int err;
 	off_t off;
@@ -311,7 +382,7 @@ vhd_clobber_block(vhd_journal_t *journal, uint32_t src, uint32_t dest)
 	if (err)
 		return err;
 
-	err = vhd_move_block(journal, src, off);
+	err = vhd_move_block(journal, batch, src, off);
 	if (err)
 		return err;
 
@@ -333,6 +404,7 @@ vhd_defrag_shrink(vhd_journal_t *journal,
 {
 	vhd_context_t *vhd;
 	int i, j, free_idx, err;
+	vhd_move_batch_t batch;
 	vhd_block_t *blocks, *free_list;
 
 	err       = 0;
@@ -340,6 +412,10 @@ vhd_defrag_shrink(vhd_journal_t *journal,
 	free_list = NULL;
 	vhd       = &journal->vhd;
 
+	err = vhd_move_batch_init(journal, &batch);
+	if (err)
+		return err;
+
 	blocks = malloc(vhd->bat.entries * sizeof(vhd_block_t));
 	if (!blocks) {
 		err = -ENOMEM;
@@ -382,17 +458,22 @@ vhd_defrag_shrink(vhd_journal_t *journal,
 				continue;
 			}
 
-		err = vhd_clobber_block(journal, b->block,
+		err = vhd_clobber_block(journal, &batch, b->block,
 					free_list[free_idx++].block);
 		if (err)
 			goto out;
 	}
 
+	err = vhd_move_batch_flush(journal, &batch);
+	if (err)
+		goto out;
+
 	/* clear any bat entries for blocks we did not shuffle */
 	for (i = free_idx; i < free_cnt; i++)
 		vhd->bat.bat[free_list[i].block] = DD_BLK_UNUSED;
 
 out:
+	vhd_move_batch_free(&batch);
 	free(blocks);
 	free(free_list);
 
@@ -880,6 +961,7 @@ vhd_dynamic_grow(vhd_journal_t *journal, uint64_t secs)
 	int i, err;
 	off_t eob, eom;
 	vhd_context_t *vhd;
+	vhd_move_batch_t batch;
 	vhd_block_t first_block;
 	uint64_t blocks, size_needed;
 	uint64_t bat_needed, bat_size, bat_avail, bat_bytes, bat_secs;
@@ -948,6 +1030,10 @@ vhd_dynamic_grow(vhd_journal_t *journal, uint64_t secs)
 	if (!first_block.offset)
 		goto shift_metadata;
 
+	err = vhd_move_batch_init(journal, &batch);
+	if (err)
+		return err;
+
 	/* 
 	 * not enough space -- 
 	 * move vhd data blocks to the end of the file to make room 
@@ -964,19 +1050,27 @@ vhd_dynamic_grow(vhd_journal_t *journal, uint64_t secs)
 
 			err = vhd_write_zeros(journal, new_off, gap_size);
 			if (err)
-				return err;
+				goto out;
 
 			new_off += gap_size;
 		}
 
-		err = vhd_move_block(journal, first_block.block, new_off);
+		err = vhd_move_block(journal, &batch,
+				     first_block.block, new_off);
 		if (err)
-			return err;
+			goto out;
 
 		vhd_first_data_block(vhd, &first_block);
 
 	} while (eom + size_needed >= vhd_sectors_to_bytes(first_block.offset));
 
+	err = vhd_move_batch_flush(journal, &batch);
+
+out:
+	vhd_move_batch_free(&batch);
+	if (err)
+		return err;
+
 	TEST_FAIL_AT(FAIL_RESIZE_DATA_MOVED);
 
 shift_metadata:
@@ -1021,8 +1115,12 @@ vhd_dynamic_resize(vhd_journal_t *journal, uint64_t size)
 
 	if (cur_secs > new_secs)
 		err = vhd_dynamic_shrink(journal, cur_secs - new_secs);
+	else if (new_secs <= vhd_max_capacity(vhd) >> VHD_SECTOR_SHIFT)
+		/* bat entries were reserved at creation; only footers change */
+		err = vhd_set_virt_size(vhd, new_secs << VHD_SECTOR_SHIFT);
 	else
-		err = vhd_dynamic_grow(journal, new_secs - cur_secs);
+		err = vhd_dynamic_grow(journal, new_secs -
+				       (vhd_max_capacity(vhd) >> VHD_SECTOR_SHIFT));
 
 	return err;
 }
@@ -107,7 +107,7 @@ vhd_util_snapshot(int argc, char **argv)
 	vhd_flag_creat_t flags;
 	int c, err, prt_raw, limit;
 	char *name, *pname, *ppath, *backing;
-	uint64_t size;
+	uint64_t size, max;
 	vhd_context_t vhd;
 
 	name    = NULL;
@@ -115,6 +115,7 @@ vhd_util_snapshot(int argc, char **argv)
 	ppath   = NULL;
 	backing = NULL;
 	size    = 0;
+	max     = 0;
 	flags   = 0;
 	limit   = 0;
 
@@ -124,7 +125,7 @@ vhd_util_snapshot(int argc, char **argv)
 	}
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:p:l:mh")) != -1) {
+	while ((c = getopt(argc, argv, "n:p:l:S:mh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -135,6 +136,9 @@ vhd_util_snapshot(int argc, char **argv)
 		case 'l':
 			limit = strtol(optarg, NULL, 10);
 			break;
+		case 'S':
+			max = strtoull(optarg, NULL, 10) << 20;
+			break;
 		case 'm':
 			vhd_flag_set(flags, VHD_FLAG_CREAT_PARENT_RAW);
 			break;
@@ -201,7 +205,7 @@ vhd_util_snapshot(int argc, char **argv)
 			goto out;
 	}
 
-	err = vhd_snapshot(name, size, backing, flags);
+	err = vhd_snapshot_reserved(name, size, max, backing, flags);
 
 out:
 	free(ppath);
@@ -211,6 +215,7 @@ out:
 
 usage:
 	printf("options: <-n name> <-p parent name> [-l snapshot depth limit]"
-	       " [-m parent_is_raw] [-h help]\n");
+	       " [-m parent_is_raw] [-S max size for online growth (MB)]"
+	       " [-h help]\n");
 	return err;
 }
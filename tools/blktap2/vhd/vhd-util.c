@@ -59,6 +59,7 @@ struct command commands[] = {
 	{ .name = "scan",        .func = vhd_util_scan          },
 	{ .name = "check",       .func = vhd_util_check         },
 	{ .name = "revert",      .func = vhd_util_revert        },
+	{ .name = "hash",        .func = vhd_util_hash          },
 };
 
 #define print_commands()					\
@@ -39,16 +39,16 @@ static pthread_mutex_t fsi_lock = PTHREAD_MUTEX_INITIALIZER;
 fsi_t *fsi_open_fsimage(const char *path, uint64_t off, const char *options)
 {
 	fsi_t *fsi = NULL;
-	int fd;
+	fsi_disk_t *disk;
 	int err;
 
-	if ((fd = open(path, O_RDONLY)) == -1)
+	if ((disk = fsi_open_disk(path)) == NULL)
 		goto fail;
 
 	if ((fsi = malloc(sizeof(*fsi))) == NULL)
 		goto fail;
 
-	fsi->f_fd = fd;
+	fsi->f_disk = disk;
 	fsi->f_off = off;
 	fsi->f_data = NULL;
 	fsi->f_bootstring = NULL;
@@ -63,8 +63,8 @@ fsi_t *fsi_open_fsimage(const char *path, uint64_t off, const char *options)
 
 fail:
 	err = errno;
-	if (fd != -1)
-		(void) close(fd);
+	if (disk != NULL)
+		fsi_close_disk(disk);
 	free(fsi);
 	errno = err;
 	return (NULL);
@@ -74,7 +74,7 @@ void fsi_close_fsimage(fsi_t *fsi)
 {
 	pthread_mutex_lock(&fsi_lock);
         fsi->f_plugin->fp_ops->fpo_umount(fsi);
-        (void) close(fsi->f_fd);
+        fsi_close_disk(fsi->f_disk);
 	free(fsi);
 	pthread_mutex_unlock(&fsi_lock);
 }
@@ -34,6 +34,7 @@ extern C {
 
 typedef struct fsi fsi_t;
 typedef struct fsi_file fsi_file_t;
+typedef struct fsi_disk fsi_disk_t;
 
 fsi_t *fsi_open_fsimage(const char *, uint64_t, const char *);
 void fsi_close_fsimage(fsi_t *);
@@ -45,6 +46,14 @@ int fsi_close_file(fsi_file_t *);
 ssize_t fsi_read_file(fsi_file_t *, void *, size_t);
 ssize_t fsi_pread_file(fsi_file_t *, void *, size_t, uint64_t);
 
+/*
+ * The disk under the filesystems, as the guest sees it: partition tables
+ * are read through here, so that they come out of VHD chains too.
+ */
+fsi_disk_t *fsi_open_disk(const char *);
+void fsi_close_disk(fsi_disk_t *);
+ssize_t fsi_pread_disk(fsi_disk_t *, void *, size_t, uint64_t);
+
 char *fsi_bootstring_alloc(fsi_t *, size_t);
 void fsi_bootstring_free(fsi_t *);
 char *fsi_fs_bootstring(fsi_t *);
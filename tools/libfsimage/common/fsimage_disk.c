@@ -0,0 +1,370 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The disk image under the filesystems, and a block cache in front of it.
+ *
+ * The filesystem readers ask for a sector or a filesystem block at a
+ * time. Here those are served out of 64KB blocks, kept in LRU order, and
+ * reads which miss the cache one after the other fetch more and more
+ * blocks ahead in a single backend read, up to 1MB.
+ */
+
+#ifndef __sun__
+#define	_XOPEN_SOURCE 600
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fsimage_priv.h"
+
+#define	SECTOR_SIZE		512
+
+#define	FSI_CBLK_SHIFT		16
+#define	FSI_CBLK_SIZE		(1 << FSI_CBLK_SHIFT)
+#define	FSI_CACHE_NBLKS		128
+#define	FSI_CACHE_HASH		64
+#define	FSI_RA_MAX		16
+
+struct fsi_cblk {
+	uint64_t cb_blkno;
+	size_t cb_len;
+	char *cb_data;
+	fsi_cblk_t *cb_hnext;
+	fsi_cblk_t *cb_prev;
+	fsi_cblk_t *cb_next;
+};
+
+static fsi_disk_ops_t *fsi_disk_backends[] = {
+#ifdef FSIMAGE_VHD
+	&fsi_vhd_ops,
+#endif
+	&fsi_raw_ops,
+	NULL
+};
+
+static int
+raw_probe(fsi_disk_t *d, const char *sector)
+{
+	return (1);
+}
+
+static int
+raw_open(fsi_disk_t *d, const char *path)
+{
+	struct stat st;
+	off_t end;
+
+	if (fstat(d->d_fd, &st) == -1)
+		return (-1);
+
+	if (S_ISREG(st.st_mode))
+		d->d_size = st.st_size;
+	else if ((end = lseek(d->d_fd, 0, SEEK_END)) > 0)
+		d->d_size = end;
+	else
+		d->d_size = UINT64_MAX;
+
+	return (0);
+}
+
+static ssize_t
+raw_pread(fsi_disk_t *d, void *buf, size_t nbytes, uint64_t off)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < nbytes) {
+		ret = pread(d->d_fd, (char *)buf + done, nbytes - done,
+		    off + done);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return (done);
+}
+
+static void
+raw_close(fsi_disk_t *d)
+{
+}
+
+fsi_disk_ops_t fsi_raw_ops = {
+	.fdo_name = "raw",
+	.fdo_probe = raw_probe,
+	.fdo_open = raw_open,
+	.fdo_pread = raw_pread,
+	.fdo_close = raw_close
+};
+
+static fsi_cblk_t *
+cache_lookup(fsi_disk_t *d, uint64_t blkno)
+{
+	fsi_cblk_t *cb;
+
+	for (cb = d->d_hash[blkno % FSI_CACHE_HASH]; cb != NULL;
+	    cb = cb->cb_hnext) {
+		if (cb->cb_blkno == blkno)
+			return (cb);
+	}
+
+	return (NULL);
+}
+
+static void
+cache_unhash(fsi_disk_t *d, fsi_cblk_t *cb)
+{
+	fsi_cblk_t **cbp = &d->d_hash[cb->cb_blkno % FSI_CACHE_HASH];
+
+	while (*cbp != cb)
+		cbp = &(*cbp)->cb_hnext;
+	*cbp = cb->cb_hnext;
+}
+
+/* Make cb the most recently used block. */
+static void
+cache_touch(fsi_disk_t *d, fsi_cblk_t *cb)
+{
+	if (d->d_lru == cb)
+		return;
+
+	if (cb->cb_next != NULL) {
+		cb->cb_prev->cb_next = cb->cb_next;
+		cb->cb_next->cb_prev = cb->cb_prev;
+	}
+
+	if (d->d_lru == NULL) {
+		cb->cb_next = cb->cb_prev = cb;
+	} else {
+		cb->cb_next = d->d_lru;
+		cb->cb_prev = d->d_lru->cb_prev;
+		cb->cb_prev->cb_next = cb;
+		d->d_lru->cb_prev = cb;
+	}
+	d->d_lru = cb;
+}
+
+/* A block to fill, a new one or else the least recently used. */
+static fsi_cblk_t *
+cache_alloc(fsi_disk_t *d)
+{
+	fsi_cblk_t *cb;
+
+	if (d->d_nblks < FSI_CACHE_NBLKS &&
+	    (cb = calloc(1, sizeof (*cb))) != NULL) {
+		if (posix_memalign((void **)&cb->cb_data, getpagesize(),
+		    FSI_CBLK_SIZE) == 0) {
+			d->d_nblks++;
+			cache_touch(d, cb);
+			return (cb);
+		}
+		free(cb);
+	}
+
+	if (d->d_lru == NULL)
+		return (NULL);
+
+	cb = d->d_lru->cb_prev;
+	cache_unhash(d, cb);
+	cache_touch(d, cb);
+	return (cb);
+}
+
+/*
+ * Read blkno in from the backend, with as many of the blocks after it as
+ * the read ahead window allows. The window doubles each time a miss comes
+ * straight after the blocks last read in, and closes again on any other.
+ */
+static fsi_cblk_t *
+cache_fill(fsi_disk_t *d, uint64_t blkno)
+{
+	fsi_cblk_t *cb, *first = NULL;
+	uint64_t off = blkno << FSI_CBLK_SHIFT;
+	unsigned int n, i;
+	size_t len;
+	ssize_t ret;
+
+	if (blkno == d->d_ranext && d->d_rasize < FSI_RA_MAX)
+		d->d_rasize *= 2;
+	else if (blkno != d->d_ranext)
+		d->d_rasize = 1;
+
+	for (n = 1; n < d->d_rasize; n++) {
+		if (((blkno + n) << FSI_CBLK_SHIFT) >= d->d_size ||
+		    cache_lookup(d, blkno + n) != NULL)
+			break;
+	}
+
+	len = (size_t)n << FSI_CBLK_SHIFT;
+	if (off < d->d_size && d->d_size - off < len)
+		len = (d->d_size - off + SECTOR_SIZE - 1) &
+		    ~(uint64_t)(SECTOR_SIZE - 1);
+
+	if (off >= d->d_size)
+		ret = 0;
+	else if ((ret = d->d_ops->fdo_pread(d, d->d_rabuf, len, off)) == -1)
+		return (NULL);
+
+	i = 0;
+	do {
+		if ((cb = cache_alloc(d)) == NULL) {
+			errno = ENOMEM;
+			return (NULL);
+		}
+		cb->cb_blkno = blkno + i;
+		cb->cb_len = 0;
+		if (ret > (ssize_t)i << FSI_CBLK_SHIFT)
+			cb->cb_len = ret - ((size_t)i << FSI_CBLK_SHIFT);
+		if (cb->cb_len > FSI_CBLK_SIZE)
+			cb->cb_len = FSI_CBLK_SIZE;
+		memcpy(cb->cb_data, d->d_rabuf + ((size_t)i << FSI_CBLK_SHIFT),
+		    cb->cb_len);
+		cb->cb_hnext = d->d_hash[cb->cb_blkno % FSI_CACHE_HASH];
+		d->d_hash[cb->cb_blkno % FSI_CACHE_HASH] = cb;
+		if (first == NULL)
+			first = cb;
+	} while (++i < n && cb->cb_len == FSI_CBLK_SIZE);
+
+	d->d_ranext = blkno + n;
+	cache_touch(d, first);
+	return (first);
+}
+
+fsi_disk_t *
+fsi_open_disk(const char *path)
+{
+	fsi_disk_t *d;
+	fsi_disk_ops_t **ops;
+	char sector[SECTOR_SIZE];
+	int err;
+
+	if ((d = calloc(1, sizeof (*d))) == NULL)
+		return (NULL);
+
+	if ((d->d_fd = open(path, O_RDONLY)) == -1)
+		goto fail;
+
+	d->d_hash = calloc(FSI_CACHE_HASH, sizeof (*d->d_hash));
+	if (d->d_hash == NULL)
+		goto fail;
+	if ((err = posix_memalign((void **)&d->d_rabuf, getpagesize(),
+	    FSI_RA_MAX * FSI_CBLK_SIZE)) != 0) {
+		d->d_rabuf = NULL;
+		errno = err;
+		goto fail;
+	}
+
+	bzero(sector, sizeof (sector));
+	if (pread(d->d_fd, sector, sizeof (sector), 0) == -1)
+		goto fail;
+
+	for (ops = fsi_disk_backends; *ops != NULL; ops++) {
+		if ((*ops)->fdo_probe(d, sector))
+			break;
+	}
+
+	if ((*ops)->fdo_open(d, path) != 0)
+		goto fail;
+	d->d_ops = *ops;
+
+	d->d_rasize = 1;
+	pthread_mutex_init(&d->d_lock, NULL);
+	return (d);
+
+fail:
+	err = errno;
+	if (d->d_fd != -1)
+		(void) close(d->d_fd);
+	free(d->d_rabuf);
+	free(d->d_hash);
+	free(d);
+	errno = err;
+	return (NULL);
+}
+
+void
+fsi_close_disk(fsi_disk_t *d)
+{
+	fsi_cblk_t *cb, *next;
+	unsigned int i;
+
+	d->d_ops->fdo_close(d);
+
+	for (cb = d->d_lru, i = 0; i < d->d_nblks; cb = next, i++) {
+		next = cb->cb_next;
+		free(cb->cb_data);
+		free(cb);
+	}
+
+	pthread_mutex_destroy(&d->d_lock);
+	(void) close(d->d_fd);
+	free(d->d_rabuf);
+	free(d->d_hash);
+	free(d);
+}
+
+ssize_t
+fsi_pread_disk(fsi_disk_t *d, void *buf, size_t nbytes, uint64_t off)
+{
+	fsi_cblk_t *cb;
+	size_t done = 0, boff, n;
+	int err = 0;
+
+	pthread_mutex_lock(&d->d_lock);
+	while (done < nbytes) {
+		cb = cache_lookup(d, off >> FSI_CBLK_SHIFT);
+		if (cb != NULL)
+			cache_touch(d, cb);
+		else if ((cb = cache_fill(d, off >> FSI_CBLK_SHIFT)) == NULL) {
+			err = errno;
+			break;
+		}
+
+		boff = off & (FSI_CBLK_SIZE - 1);
+		if (cb->cb_len <= boff)
+			break;
+		n = cb->cb_len - boff;
+		if (n > nbytes - done)
+			n = nbytes - done;
+
+		memcpy((char *)buf + done, cb->cb_data + boff, n);
+		done += n;
+		off += n;
+	}
+	pthread_mutex_unlock(&d->d_lock);
+
+	if (done == 0 && err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return (done);
+}
@@ -158,50 +158,15 @@ int
 fsig_devread(fsi_file_t *ffi, unsigned int sector, unsigned int offset,
     unsigned int bufsize, char *buf)
 {
-	off_t off;
-	ssize_t ret;
-	int n, r;
-	char tmp[SECTOR_SIZE];
+	uint64_t off;
 
-	off = ffi->ff_fsi->f_off + ((off_t)sector * SECTOR_SIZE) + offset;
+	off = ffi->ff_fsi->f_off + ((uint64_t)sector * SECTOR_SIZE) + offset;
 
 	/*
-	 * Make reads from a raw disk sector-aligned. This is a requirement
-	 * for NetBSD. Split the read up into to three parts to meet this
-	 * requirement.
+	 * The disk is read in whole, aligned blocks through the cache, which
+	 * also keeps reads from a raw disk sector-aligned, as NetBSD needs.
 	 */
-
-	n = (off & (SECTOR_SIZE - 1));
-	if (n > 0) {
-		r = SECTOR_SIZE - n;
-		if (r > bufsize)
-			r = bufsize;
-		ret = pread(ffi->ff_fsi->f_fd, tmp, SECTOR_SIZE, off - n);
-		if (ret < n + r)
-			return (0);
-		memcpy(buf, tmp + n, r);
-		buf += r;
-		bufsize -= r;
-		off += r;
-	}
-
-	n = (bufsize & ~(SECTOR_SIZE - 1));
-	if (n > 0) {
-		ret = pread(ffi->ff_fsi->f_fd, buf, n, off);
-		if (ret < n)
-			return (0);
-		buf += n;
-		bufsize -= n;
-		off += n;
-	}
-	if (bufsize > 0) {
-		ret = pread(ffi->ff_fsi->f_fd, tmp, SECTOR_SIZE, off);
-		if (ret < bufsize)
-			return (0);
-		memcpy(buf, tmp, bufsize);
-	}
-
-	return (1);
+	return (fsip_fs_pread(ffi->ff_fsi, buf, bufsize, off) == bufsize);
 }
 
 int
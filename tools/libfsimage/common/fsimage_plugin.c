@@ -72,6 +72,13 @@ fsip_fs_offset(fsi_t *fsi)
 	return (fsi->f_off);
 }
 
+/* Read from the disk under the filesystem, through its block cache. */
+ssize_t
+fsip_fs_pread(fsi_t *fsi, void *buf, size_t nbytes, uint64_t off)
+{
+	return (fsi_pread_disk(fsi->f_disk, buf, nbytes, off));
+}
+
 void *
 fsip_fs_data(fsi_t *fsi)
 {
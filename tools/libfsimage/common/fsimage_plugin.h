@@ -54,6 +54,7 @@ fsi_file_t *fsip_file_alloc(fsi_t *, void *);
 void fsip_file_free(fsi_file_t *);
 fsi_t *fsip_fs(fsi_file_t *);
 uint64_t fsip_fs_offset(fsi_t *);
+ssize_t fsip_fs_pread(fsi_t *, void *, size_t, uint64_t);
 void *fsip_fs_data(fsi_t *);
 void *fsip_file_data(fsi_file_t *);
 
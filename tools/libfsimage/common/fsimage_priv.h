@@ -29,6 +29,7 @@ extern C {
 #endif
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include "fsimage.h"
 #include "fsimage_plugin.h"
@@ -42,7 +43,7 @@ struct fsi_plugin {
 };
 
 struct fsi {
-	int f_fd;
+	fsi_disk_t *f_disk;
 	uint64_t f_off;
 	void *f_data;
 	fsi_plugin_t *f_plugin;
@@ -56,6 +57,44 @@ struct fsi_file {
 
 int find_plugin(fsi_t *, const char *, const char *);
 
+/*
+ * A block backend reads the guest disk out of an image: a raw file or
+ * device, or a VHD chain. fdo_probe() is given the first sector of the
+ * image and says whether the backend knows the format; fdo_open() sets
+ * d_size and d_data. Reads are always whole sectors, into buffers
+ * aligned to at least a sector.
+ */
+typedef struct fsi_disk_ops {
+	const char *fdo_name;
+	int (*fdo_probe)(fsi_disk_t *, const char *);
+	int (*fdo_open)(fsi_disk_t *, const char *);
+	ssize_t (*fdo_pread)(fsi_disk_t *, void *, size_t, uint64_t);
+	void (*fdo_close)(fsi_disk_t *);
+} fsi_disk_ops_t;
+
+typedef struct fsi_cblk fsi_cblk_t;
+
+struct fsi_disk {
+	int d_fd;
+	uint64_t d_size;
+	fsi_disk_ops_t *d_ops;
+	void *d_data;
+
+	/* Block cache in front of the backend. */
+	pthread_mutex_t d_lock;
+	fsi_cblk_t **d_hash;
+	fsi_cblk_t *d_lru;
+	unsigned int d_nblks;
+	char *d_rabuf;
+	uint64_t d_ranext;
+	unsigned int d_rasize;
+};
+
+extern fsi_disk_ops_t fsi_raw_ops;
+#ifdef FSIMAGE_VHD
+extern fsi_disk_ops_t fsi_vhd_ops;
+#endif
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,268 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Dynamic and differencing VHD images, read with libvhd, so that pygrub
+ * can boot a guest straight off a VHD chain without attaching a tapdisk.
+ *
+ * The whole chain is opened once, with each BAT. A sector comes from the
+ * first image in the chain, child first, whose block is allocated and has
+ * the sector's bit set in the block bitmap; the last bitmap read is kept
+ * for each image. Sectors which are nowhere in the chain read as zero,
+ * unless the chain ends in a raw image. (libvhd's vhd_io_read() does the
+ * same, but opens and reads the headers of every parent on each call.)
+ *
+ * Fixed VHD images are left to the raw backend: their data starts at 0.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <libvhd.h>
+
+#include "fsimage_priv.h"
+
+#define	FSI_VHD_MAX_CHAIN	64
+#define	FSI_VHD_NO_BLOCK	(~0U)
+
+typedef struct fsi_vhd_link {
+	vhd_context_t vl_vhd;
+	uint32_t vl_bmblk;
+	char *vl_bitmap;
+} fsi_vhd_link_t;
+
+typedef struct fsi_vhd {
+	fsi_vhd_link_t *fv_links;
+	int fv_nlinks;
+	int fv_rawfd;
+} fsi_vhd_t;
+
+static void
+vhd_disk_free(fsi_vhd_t *fv)
+{
+	int i;
+
+	for (i = 0; i < fv->fv_nlinks; i++) {
+		free(fv->fv_links[i].vl_bitmap);
+		vhd_close(&fv->fv_links[i].vl_vhd);
+	}
+	if (fv->fv_rawfd != -1)
+		(void) close(fv->fv_rawfd);
+	free(fv->fv_links);
+	free(fv);
+}
+
+static int
+vhd_disk_probe(fsi_disk_t *d, const char *sector)
+{
+	return (memcmp(sector, HD_COOKIE, sizeof (HD_COOKIE) - 1) == 0);
+}
+
+static int
+vhd_disk_open(fsi_disk_t *d, const char *path)
+{
+	fsi_vhd_t *fv;
+	fsi_vhd_link_t *links;
+	vhd_context_t *vhd;
+	char *parent = NULL;
+	const char *name = path;
+	int err;
+
+	if ((fv = calloc(1, sizeof (*fv))) == NULL)
+		return (-1);
+	fv->fv_rawfd = -1;
+
+	for (;;) {
+		if (fv->fv_nlinks == FSI_VHD_MAX_CHAIN) {
+			err = -ELOOP;
+			goto fail;
+		}
+
+		links = realloc(fv->fv_links,
+		    (fv->fv_nlinks + 1) * sizeof (*links));
+		if (links == NULL) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		fv->fv_links = links;
+
+		vhd = &links[fv->fv_nlinks].vl_vhd;
+		if ((err = vhd_open(vhd, name, VHD_OPEN_RDONLY)) != 0)
+			goto fail;
+		links[fv->fv_nlinks].vl_bmblk = FSI_VHD_NO_BLOCK;
+		links[fv->fv_nlinks].vl_bitmap = NULL;
+		fv->fv_nlinks++;
+
+		free(parent);
+		parent = NULL;
+
+		if (!vhd_type_dynamic(vhd))
+			break;
+		if ((err = vhd_get_bat(vhd)) != 0)
+			goto fail;
+		if (vhd->footer.type != HD_TYPE_DIFF)
+			break;
+
+		if ((err = vhd_parent_locator_get(vhd, &parent)) != 0)
+			goto fail;
+		if (vhd_parent_raw(vhd)) {
+			if ((fv->fv_rawfd = open(parent, O_RDONLY)) == -1) {
+				err = -errno;
+				goto fail;
+			}
+			break;
+		}
+		name = parent;
+	}
+
+	free(parent);
+	d->d_size = fv->fv_links[0].vl_vhd.footer.curr_size;
+	d->d_data = fv;
+	return (0);
+
+fail:
+	free(parent);
+	vhd_disk_free(fv);
+	errno = -err;
+	return (-1);
+}
+
+/*
+ * Where sector sec of the disk is: the index of the image holding it and
+ * its offset in that image, fv_nlinks for the raw parent, or -1 if it is
+ * nowhere in the chain. Returns -2 on error.
+ */
+static int
+vhd_disk_locate(fsi_vhd_t *fv, uint64_t sec, uint64_t *off)
+{
+	fsi_vhd_link_t *link;
+	vhd_context_t *vhd;
+	uint32_t blk, bsec;
+	char *bitmap;
+	int i, err;
+
+	for (i = 0; i < fv->fv_nlinks; i++) {
+		link = &fv->fv_links[i];
+		vhd = &link->vl_vhd;
+
+		if (!vhd_type_dynamic(vhd)) {
+			*off = vhd_sectors_to_bytes(sec);
+			return (i);
+		}
+
+		blk = sec / vhd->spb;
+		bsec = sec % vhd->spb;
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (link->vl_bmblk != blk) {
+			if ((err = vhd_read_bitmap(vhd, blk, &bitmap)) != 0) {
+				errno = -err;
+				return (-2);
+			}
+			free(link->vl_bitmap);
+			link->vl_bitmap = bitmap;
+			link->vl_bmblk = blk;
+		}
+
+		if (vhd_bitmap_test(vhd, link->vl_bitmap, bsec)) {
+			*off = vhd_sectors_to_bytes((uint64_t)vhd->bat.bat[blk] +
+			    vhd->bm_secs + bsec);
+			return (i);
+		}
+	}
+
+	if (fv->fv_rawfd != -1) {
+		*off = vhd_sectors_to_bytes(sec);
+		return (fv->fv_nlinks);
+	}
+
+	return (-1);
+}
+
+/* Read the runs of sectors which are in one place at a time. */
+static ssize_t
+vhd_disk_pread(fsi_disk_t *d, void *buf, size_t nbytes, uint64_t off)
+{
+	fsi_vhd_t *fv = d->d_data;
+	uint64_t sec, secs, n, where, next;
+	char *dst = buf;
+	ssize_t ret;
+	int src, fd;
+
+	if (off >= d->d_size)
+		return (0);
+	if (nbytes > d->d_size - off)
+		nbytes = d->d_size - off;
+
+	sec = off >> VHD_SECTOR_SHIFT;
+	secs = nbytes >> VHD_SECTOR_SHIFT;
+
+	while (secs > 0) {
+		if ((src = vhd_disk_locate(fv, sec, &where)) == -2)
+			return (-1);
+
+		for (n = 1; n < secs; n++) {
+			if (vhd_disk_locate(fv, sec + n, &next) != src)
+				break;
+			if (src != -1 &&
+			    next != where + vhd_sectors_to_bytes(n))
+				break;
+		}
+
+		if (src == -1) {
+			memset(dst, 0, vhd_sectors_to_bytes(n));
+		} else {
+			fd = src == fv->fv_nlinks ? fv->fv_rawfd :
+			    fv->fv_links[src].vl_vhd.fd;
+			ret = pread(fd, dst, vhd_sectors_to_bytes(n), where);
+			if (ret == -1)
+				return (-1);
+			if (ret != vhd_sectors_to_bytes(n)) {
+				errno = EIO;
+				return (-1);
+			}
+		}
+
+		dst += vhd_sectors_to_bytes(n);
+		sec += n;
+		secs -= n;
+	}
+
+	return (dst - (char *)buf);
+}
+
+static void
+vhd_disk_close(fsi_disk_t *d)
+{
+	vhd_disk_free(d->d_data);
+}
+
+fsi_disk_ops_t fsi_vhd_ops = {
+	.fdo_name = "vhd",
+	.fdo_probe = vhd_disk_probe,
+	.fdo_open = vhd_disk_open,
+	.fdo_pread = vhd_disk_pread,
+	.fdo_close = vhd_disk_close
+};
@@ -28,23 +28,116 @@
 #include INCLUDE_EXTFS_H
 #include <errno.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * libext2fs reads the disk through libfsimage, rather than with its own
+ * unix I/O manager, so that it goes through the block cache and can come
+ * out of a VHD chain. Mounts are done under the libfsimage lock, which
+ * covers ext2lib_io_fsi.
+ */
+static fsi_t *ext2lib_io_fsi;
+static struct struct_io_manager ext2lib_io_manager;
+
+static errcode_t
+ext2lib_io_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel io;
+
+	if ((io = calloc(1, sizeof (*io))) == NULL)
+		return (ENOMEM);
+	if ((io->name = strdup(name)) == NULL) {
+		free(io);
+		return (ENOMEM);
+	}
+
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = &ext2lib_io_manager;
+	io->block_size = 1024;
+	io->refcount = 1;
+	io->private_data = ext2lib_io_fsi;
+
+	*channel = io;
+	return (0);
+}
+
+static errcode_t
+ext2lib_io_close(io_channel io)
+{
+	if (--io->refcount > 0)
+		return (0);
+
+	free(io->name);
+	free(io);
+	return (0);
+}
+
+static errcode_t
+ext2lib_io_set_blksize(io_channel io, int blksize)
+{
+	io->block_size = blksize;
+	return (0);
+}
+
+static errcode_t
+ext2lib_io_read_blk(io_channel io, unsigned long block, int count, void *data)
+{
+	fsi_t *fsi = io->private_data;
+	size_t size;
+	ssize_t ret;
+
+	/* A negative count is a size in bytes. */
+	size = count < 0 ? -count : (size_t)count * io->block_size;
+
+	ret = fsip_fs_pread(fsi, data, size,
+	    fsip_fs_offset(fsi) + (uint64_t)block * io->block_size);
+	if (ret == -1)
+		return (errno);
+	if ((size_t)ret < size) {
+		memset((char *)data + ret, 0, size - ret);
+		return (EXT2_ET_SHORT_READ);
+	}
+
+	return (0);
+}
+
+static errcode_t
+ext2lib_io_write_blk(io_channel io, unsigned long block, int count,
+    const void *data)
+{
+	return (EXT2_ET_UNIMPLEMENTED);
+}
+
+static errcode_t
+ext2lib_io_flush(io_channel io)
+{
+	return (0);
+}
+
+static struct struct_io_manager ext2lib_io_manager = {
+	.magic = EXT2_ET_MAGIC_IO_MANAGER,
+	.name = "libfsimage I/O Manager",
+	.open = ext2lib_io_open,
+	.close = ext2lib_io_close,
+	.set_blksize = ext2lib_io_set_blksize,
+	.read_blk = ext2lib_io_read_blk,
+	.write_blk = ext2lib_io_write_blk,
+	.flush = ext2lib_io_flush
+};
 
 static int
 ext2lib_mount(fsi_t *fsi, const char *name, const char *options)
 {
 	int err;
-	char opts[30] = "";
 	ext2_filsys *fs;
-	uint64_t offset = fsip_fs_offset(fsi);
-
-	if (offset)
-		snprintf(opts, 29, "offset=%" PRId64, offset);
 
 	fs = malloc(sizeof (*fs));
 	if (fs == NULL)
 		return (-1);
 
-	err = ext2fs_open2(name, opts, 0, 0, 0, unix_io_manager, fs);
+	ext2lib_io_fsi = fsi;
+	err = ext2fs_open2(name, NULL, 0, 0, 0, &ext2lib_io_manager, fs);
 
 	if (err != 0) {
 		free(fs);
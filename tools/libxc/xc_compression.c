@@ -33,12 +33,19 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include <errno.h>
+#ifndef __MINIOS__
+#include <pthread.h>
+#endif
 #include "xc_private.h"
 #include "xenctrl.h"
 #include "xg_save_restore.h"
 #include "xg_private.h"
 #include "xc_dom.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 /* Page Cache for Delta Compression*/
 #define DELTA_CACHE_SIZE (XC_PAGE_SIZE * 8192)
 
@@ -47,6 +54,23 @@
  */
 #define PAGE_BUFFER_SIZE (XC_PAGE_SIZE * 8192)
 
+/* Most threads xc_compression_set_threads will start */
+#define MAX_COMPRESSION_THREADS 32
+
+/*
+ * In parallel mode, pages are compressed a window at a time: each thread
+ * compresses its share into a segment of its own, then the segments are
+ * gathered in page order.
+ */
+#define WINDOW_PAGES 1024
+
+#define MAX_DELTAS (XC_PAGE_SIZE/sizeof(uint32_t))
+#define DELTA_WORDS (MAX_DELTAS/64)
+
+/* Sets bit i of changed if 32-bit lane i of the pages differs. */
+typedef void diff_lanes_fn(const uint32_t *new, const uint32_t *old,
+                           uint64_t *changed);
+
 struct cache_page
 {
     char *page;
@@ -55,6 +79,28 @@ struct cache_page
     struct cache_page *prev;
 };
 
+/*
+ * The cache is split by pfn into shards, each with an LRU list of its
+ * own, so that threads never share one.
+ */
+struct cache_shard
+{
+    struct cache_page *page_list_head;
+    struct cache_page *page_list_tail;
+};
+
+#ifndef __MINIOS__
+struct compression_worker
+{
+    comp_ctx *ctx;
+    unsigned int id;
+    pthread_t thread;
+    int started;
+    /* Compressed pages of this window */
+    char *segment;
+};
+#endif
+
 struct compression_ctx
 {
     /* compression buffer - holds compressed data */
@@ -69,13 +115,34 @@ struct compression_ctx
     unsigned int pfns_len;
     unsigned int pfns_index;
 
-    /* Compression Cache (LRU) */
+    /* Compression Cache (LRU), one shard per thread */
     char *cache_base;
     struct cache_page **pfn2cache;
     struct cache_page *cache;
-    struct cache_page *page_list_head;
-    struct cache_page *page_list_tail;
+    struct cache_shard *shards;
+    unsigned int nr_shards;
     unsigned long dom_pfnlist_size;
+
+    /* Fastest way this cpu has to compare pages */
+    diff_lanes_fn *diff_lanes;
+
+#ifndef __MINIOS__
+    /* Parallel mode: worker i has shard i, worker 0 is the caller */
+    struct compression_worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t window_start;
+    pthread_cond_t window_done;
+    unsigned int window_nr;
+    unsigned int busy;
+    int stop;
+
+    /* The pages of this window */
+    unsigned int window_first;
+    unsigned int window_end;
+    /* Where each page ended up in its worker's segment */
+    unsigned long seg_off[WINDOW_PAGES];
+    unsigned int seg_len[WINDOW_PAGES];
+#endif
 };
 
 #define RUNFLAG 0
@@ -107,7 +174,6 @@ struct compression_ctx
 #define EMPTY_PAGE 0
 #define FULL_PAGE SKIPFLAG
 #define FULL_PAGE_SIZE (XC_PAGE_SIZE + 1)
-#define MAX_DELTAS (XC_PAGE_SIZE/sizeof(uint32_t))
 
 /*
  * Add a pagetable page or a new page (uncached)
@@ -116,99 +182,189 @@ struct compression_ctx
  *  cache_page points to a free page slot in the cache where
  *  this new page can be copied to.
  */
-static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+static int add_full_page(char *srcpage, char *cache_page, char *dest)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-
-    if ( (ctx->compbuf_pos + FULL_PAGE_SIZE) > ctx->compbuf_size)
-        return -1;
-
     if (cache_page)
         memcpy(cache_page, srcpage, XC_PAGE_SIZE);
     dest[0] = FULL_PAGE;
     memcpy(&dest[1], srcpage, XC_PAGE_SIZE);
-    ctx->compbuf_pos += FULL_PAGE_SIZE;
 
     return FULL_PAGE_SIZE;
 }
 
-static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+#ifndef __SSE2__
+static void diff_lanes_scalar(const uint32_t *new, const uint32_t *old,
+                              uint64_t *changed)
+{
+    unsigned int i, j;
+    uint64_t bits;
+
+    for (i = 0; i < DELTA_WORDS; i++, new += 64, old += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j++)
+            bits |= (uint64_t)(new[j] != old[j]) << j;
+        changed[i] = bits;
+    }
+}
+#else
+/* 4 lanes per compare */
+static void diff_lanes_sse2(const uint32_t *new, const uint32_t *old,
+                            uint64_t *changed)
+{
+    unsigned int i, j, same;
+    uint64_t bits;
+    __m128i a, b;
+
+    for (i = 0; i < DELTA_WORDS; i++, new += 64, old += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j += 4)
+        {
+            a = _mm_loadu_si128((const __m128i *)(new + j));
+            b = _mm_loadu_si128((const __m128i *)(old + j));
+            same = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+            bits |= (uint64_t)(~same & 0xf) << j;
+        }
+        changed[i] = bits;
+    }
+}
+#endif
+
+/*
+ * The AVX2 version is built whatever the compiler targets by default,
+ * and only used if the cpu has AVX2.
+ */
+#if defined(__x86_64__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_DIFF_LANES_AVX2
+
+/* 8 lanes per compare */
+__attribute__((target("avx2")))
+static void diff_lanes_avx2(const uint32_t *new, const uint32_t *old,
+                            uint64_t *changed)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-    uint32_t *new, *old;
+    unsigned int i, j, same;
+    uint64_t bits;
+    __m256i a, b;
 
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
-    int complen = 0, pageoff = 0, runbytes = 0;
+    for (i = 0; i < DELTA_WORDS; i++, new += 64, old += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j += 8)
+        {
+            a = _mm256_loadu_si256((const __m256i *)(new + j));
+            b = _mm256_loadu_si256((const __m256i *)(old + j));
+            same = _mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+            bits |= (uint64_t)(~same & 0xff) << j;
+        }
+        changed[i] = bits;
+    }
+}
+#endif
 
-    char runlen = 0;
+static diff_lanes_fn *select_diff_lanes(void)
+{
+#ifdef HAVE_DIFF_LANES_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return diff_lanes_avx2;
+#endif
+#ifdef __SSE2__
+    return diff_lanes_sse2;
+#else
+    return diff_lanes_scalar;
+#endif
+}
 
-    if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
-        return -1;
+/*
+ * First lane from lane onwards which isn't changed (if copying) or
+ * changed (if not), or MAX_DELTAS.
+ */
+static unsigned int run_end(const uint64_t *changed, unsigned int lane,
+                            int copying)
+{
+    unsigned int i = lane / 64;
+    uint64_t bits;
+
+    bits = (copying ? ~changed[i] : changed[i]) & (~0ULL << (lane % 64));
+    while (!bits)
+    {
+        if (++i == DELTA_WORDS)
+            return MAX_DELTAS;
+        bits = copying ? ~changed[i] : changed[i];
+    }
+
+    return i * 64 + __builtin_ctzll(bits);
+}
+
+/* dest must have room for WORST_COMP_PAGE_SIZE bytes. */
+static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page,
+                         char *dest)
+{
+    uint64_t changed[DELTA_WORDS], any = 0;
+    unsigned int i, off, end, runlen, pageoff;
+    int copying, complen = 0;
 
     /*
      * There are no alignment issues here since srcpage is
      * domU's page passed from xc_domain_save and cache_page is
      * a ptr to cache page (cache is page aligned).
      */
-    new = (uint32_t*)srcpage;
-    old = (uint32_t*)cache_page;
+    ctx->diff_lanes((uint32_t *)srcpage, (uint32_t *)cache_page, changed);
 
-    for (off = 0; off <= MAX_DELTAS; off++)
+    for (i = 0; i < DELTA_WORDS; i++)
+        any |= changed[i];
+    if (!any)
     {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
+        dest[0] = EMPTY_PAGE;
+        return 1;
+    }
+
+    /*
+     * Alternate between runs of changed and unchanged lanes, splitting
+     * them at LENMASK lanes.
+     */
+    for (off = 0; off < MAX_DELTAS; off = end)
+    {
+        copying = (changed[off / 64] >> (off % 64)) & 1;
+        end = run_end(changed, off, copying);
 
-        if (runlen)
+        if (copying)
         {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
+            pageoff = off * sizeof(uint32_t);
+            memcpy(cache_page + pageoff, srcpage + pageoff,
+                   (end - off) * sizeof(uint32_t));
+        }
 
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
+        for (i = off; i < end; i += runlen)
+        {
+            runlen = (end - i < LENMASK) ? end - i : LENMASK;
+            dest[complen++] = runlen | (copying ? RUNFLAG : SKIPFLAG);
 
-                runlen = 0;
-                runptr = off;
+            if (copying) /* RUNFLAG */
+            {
+                memcpy(dest + complen, srcpage + i * sizeof(uint32_t),
+                       runlen * sizeof(uint32_t));
+                complen += runlen * sizeof(uint32_t);
             }
         }
-        runlen++;
-        wascopying = copying;
     }
 
-    /*
-     * Check for empty page.
-     */
-    if (bytes_skipped == XC_PAGE_SIZE)
-    {
-        complen = 1;
-        dest[0] = EMPTY_PAGE;
-    }
-    ctx->compbuf_pos += complen;
-
     return complen;
 }
 
+static struct cache_shard *get_shard(comp_ctx *ctx, xen_pfn_t pfn)
+{
+    return &ctx->shards[pfn % ctx->nr_shards];
+}
+
 static
 char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
                      int *israw)
 {
+    struct cache_shard *shard = get_shard(ctx, pfn);
     struct cache_page *item = NULL;
 
     item = ctx->pfn2cache[pfn];
@@ -218,7 +374,7 @@ char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
         *israw = 1;
 
         /* If the list is full, evict a page from the tail end. */
-        item = ctx->page_list_tail;
+        item = shard->page_list_tail;
         if (item->pfn != INVALID_P2M_ENTRY)
             ctx->pfn2cache[item->pfn] = NULL;
 
@@ -227,13 +383,13 @@ char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
     }
         
     /* 	if requested item is in cache move to head of list */
-    if (item != ctx->page_list_head)
+    if (item != shard->page_list_head)
     {
-        if (item == ctx->page_list_tail)
+        if (item == shard->page_list_tail)
         {
             /* item at tail of list. */
-            ctx->page_list_tail = item->prev;
-            (ctx->page_list_tail)->next = NULL;
+            shard->page_list_tail = item->prev;
+            (shard->page_list_tail)->next = NULL;
         }
         else
         {
@@ -243,30 +399,31 @@ char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
         }
 
         item->prev = NULL;
-        item->next = ctx->page_list_head;
-        (ctx->page_list_head)->prev = item;
-        ctx->page_list_head = item;
+        item->next = shard->page_list_head;
+        (shard->page_list_head)->prev = item;
+        shard->page_list_head = item;
     }
 
-    return (ctx->page_list_head)->page;
+    return (shard->page_list_head)->page;
 }
 
 /* Remove pagetable pages from cache and move to tail, as free pages */
 static
 void invalidate_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
 {
+    struct cache_shard *shard = get_shard(ctx, pfn);
     struct cache_page *item = NULL;
 
     item = ctx->pfn2cache[pfn];
     if (item)
     {
-        if (item != ctx->page_list_tail)
+        if (item != shard->page_list_tail)
         {
             /* item at head of list */
-            if (item == ctx->page_list_head)
+            if (item == shard->page_list_head)
             {
-                ctx->page_list_head = (ctx->page_list_head)->next;
-                (ctx->page_list_head)->prev = NULL;
+                shard->page_list_head = (shard->page_list_head)->next;
+                (shard->page_list_head)->prev = NULL;
             }
             else /* item in middle of list */
             {            
@@ -275,12 +432,12 @@ void invalidate_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
             }
 
             item->next = NULL;
-            item->prev = ctx->page_list_tail;
-            (ctx->page_list_tail)->next = item;
-            ctx->page_list_tail = item;
+            item->prev = shard->page_list_tail;
+            (shard->page_list_tail)->next = item;
+            shard->page_list_tail = item;
         }
         ctx->pfn2cache[pfn] = NULL;
-        (ctx->page_list_tail)->pfn = INVALID_P2M_ENTRY;
+        (shard->page_list_tail)->pfn = INVALID_P2M_ENTRY;
     }
 }
 
@@ -309,12 +466,159 @@ int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
     return 0;
 }
 
+/*
+ * Compress page i of the page buffer into dest, which has room for
+ * WORST_COMP_PAGE_SIZE bytes.
+ */
+static int compress_one(comp_ctx *ctx, unsigned int i, char *dest)
+{
+    char *current_page = ctx->inputbuf + i * XC_PAGE_SIZE;
+    char *cache_copy = NULL;
+    int israw = 0;
+
+    if (ctx->sendbuf_pfns[i] == INVALID_P2M_ENTRY)
+        israw = 1;
+    else
+        cache_copy = get_cache_page(ctx, ctx->sendbuf_pfns[i], &israw);
+
+    if (israw)
+        return add_full_page(current_page, cache_copy, dest);
+    return compress_page(ctx, current_page, cache_copy, dest);
+}
+
+#ifndef __MINIOS__
+/* The shard, and so the worker, which page i of the buffer belongs to */
+static unsigned int page_shard(comp_ctx *ctx, unsigned int i)
+{
+    xen_pfn_t pfn = ctx->sendbuf_pfns[i];
+
+    /* Pagetable pages aren't cached: share them out by position */
+    return (pfn == INVALID_P2M_ENTRY ? i : pfn) % ctx->nr_shards;
+}
+
+/* Compress a worker's share of the window into its segment */
+static void compress_share(comp_ctx *ctx, unsigned int id)
+{
+    struct compression_worker *worker = &ctx->workers[id];
+    unsigned long pos = 0;
+    unsigned int i, n;
+
+    for (i = ctx->window_first, n = 0; i < ctx->window_end; i++, n++)
+    {
+        if (page_shard(ctx, i) != id)
+            continue;
+        ctx->seg_off[n] = pos;
+        ctx->seg_len[n] = compress_one(ctx, i, worker->segment + pos);
+        pos += ctx->seg_len[n];
+    }
+}
+
+static void *compression_thread(void *arg)
+{
+    struct compression_worker *worker = arg;
+    comp_ctx *ctx = worker->ctx;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;)
+    {
+        while (ctx->window_nr == seen && !ctx->stop)
+            pthread_cond_wait(&ctx->window_start, &ctx->lock);
+        if (ctx->stop)
+            break;
+        seen = ctx->window_nr;
+        pthread_mutex_unlock(&ctx->lock);
+
+        compress_share(ctx, worker->id);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (--ctx->busy == 0)
+            pthread_cond_signal(&ctx->window_done);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+/* Compress n pages, which fit in compbuf, on all the workers */
+static void compress_window(comp_ctx *ctx, unsigned int n)
+{
+    struct compression_worker *worker;
+    unsigned int i, j;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->window_first = ctx->pfns_index;
+    ctx->window_end = ctx->pfns_index + n;
+    ctx->busy = ctx->nr_shards - 1;
+    ctx->window_nr++;
+    pthread_cond_broadcast(&ctx->window_start);
+    pthread_mutex_unlock(&ctx->lock);
+
+    compress_share(ctx, 0);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->busy)
+        pthread_cond_wait(&ctx->window_done, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* The stream has the pages in the order they were added */
+    for (i = ctx->window_first, j = 0; i < ctx->window_end; i++, j++)
+    {
+        worker = &ctx->workers[page_shard(ctx, i)];
+        memcpy(ctx->compbuf + ctx->compbuf_pos,
+               worker->segment + ctx->seg_off[j], ctx->seg_len[j]);
+        ctx->compbuf_pos += ctx->seg_len[j];
+    }
+    ctx->pfns_index += n;
+}
+
+static int compress_parallel(comp_ctx *ctx)
+{
+    unsigned long n;
+
+    while (ctx->pfns_index < ctx->pfns_len)
+    {
+        n = (ctx->compbuf_size - ctx->compbuf_pos) / WORST_COMP_PAGE_SIZE;
+        if (!n)
+            return -1;
+        if (n > WINDOW_PAGES)
+            n = WINDOW_PAGES;
+        if (n > ctx->pfns_len - ctx->pfns_index)
+            n = ctx->pfns_len - ctx->pfns_index;
+
+        compress_window(ctx, n);
+    }
+
+    return 1;
+}
+#endif
+
+static int compress_serial(comp_ctx *ctx)
+{
+    for (; ctx->pfns_index < ctx->pfns_len; ctx->pfns_index++)
+    {
+        /*
+         * Check for space before looking the page up: a page new to the
+         * cache must be sent in full, or the cache has stale data for it.
+         */
+        if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
+        {
+            /* Out of space in outbuf! flush and come back */
+            return -1;
+        }
+
+        ctx->compbuf_pos += compress_one(ctx, ctx->pfns_index,
+                                         ctx->compbuf + ctx->compbuf_pos);
+    }
+
+    return 1;
+}
+
 int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
                                   char *compbuf, unsigned long compbuf_size,
                                   unsigned long *compbuf_len)
 {
-    char *cache_copy = NULL, *current_page = NULL;
-    int israw, rc = 1;
+    int rc;
 
     if (!ctx->pfns_len || (ctx->pfns_index == ctx->pfns_len)) {
         ctx->pfns_len = ctx->pfns_index = 0;
@@ -325,31 +629,15 @@ int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
     ctx->compbuf = compbuf;
     ctx->compbuf_size = compbuf_size;
 
-    for (; ctx->pfns_index < ctx->pfns_len; ctx->pfns_index++)
-    {
-        israw = 0;
-        cache_copy = NULL;
-        current_page = ctx->inputbuf + ctx->pfns_index * XC_PAGE_SIZE;
-
-        if (ctx->sendbuf_pfns[ctx->pfns_index] == INVALID_P2M_ENTRY)
-            israw = 1;
-        else
-            cache_copy = get_cache_page(ctx,
-                                        ctx->sendbuf_pfns[ctx->pfns_index],
-                                        &israw);
+#ifndef __MINIOS__
+    if (ctx->nr_shards > 1)
+        rc = compress_parallel(ctx);
+    else
+        rc = compress_serial(ctx);
+#else
+    rc = compress_serial(ctx);
+#endif
 
-        if (israw)
-            rc = (add_full_page(ctx, current_page, cache_copy) >= 0);
-        else
-            rc = (compress_page(ctx, current_page, cache_copy) >= 0);
-
-        if ( !rc )
-        {
-            /* Out of space in outbuf! flush and come back */
-            rc = -1;
-            break;
-        }
-    }
     if (compbuf_len)
         *compbuf_len = ctx->compbuf_pos;
 
@@ -453,10 +741,151 @@ int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
     return 0;
 }
 
+/* Empty the cache and split it into nr_shards LRU lists */
+static void init_cache(comp_ctx *ctx, unsigned int nr_shards)
+{
+    unsigned long num_cache_pages = DELTA_CACHE_SIZE/XC_PAGE_SIZE;
+    unsigned long i, first, per_shard = num_cache_pages / nr_shards;
+    unsigned int s;
+
+    memset(ctx->pfn2cache, 0,
+           ctx->dom_pfnlist_size * sizeof(struct cache_page *));
+
+    for (s = 0; s < nr_shards; s++)
+    {
+        first = s * per_shard;
+        for (i = first; i < first + per_shard; i++)
+        {
+            ctx->cache[i].pfn = INVALID_P2M_ENTRY;
+            ctx->cache[i].page = ctx->cache_base + i * XC_PAGE_SIZE;
+            ctx->cache[i].prev = (i == first) ? NULL : &(ctx->cache[i - 1]);
+            ctx->cache[i].next = ((i+1) == first + per_shard)? NULL :
+                &(ctx->cache[i + 1]);
+        }
+        ctx->shards[s].page_list_head = &(ctx->cache[first]);
+        ctx->shards[s].page_list_tail = &(ctx->cache[first + per_shard - 1]);
+    }
+    ctx->nr_shards = nr_shards;
+}
+
+#ifndef __MINIOS__
+/* Stop the threads: back to one shard, compressed by the caller */
+static void stop_workers(comp_ctx *ctx)
+{
+    unsigned int i;
+
+    if (!ctx->workers)
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = 1;
+    pthread_cond_broadcast(&ctx->window_start);
+    pthread_mutex_unlock(&ctx->lock);
+
+    for (i = 0; i < ctx->nr_shards; i++)
+    {
+        if (ctx->workers[i].started)
+            pthread_join(ctx->workers[i].thread, NULL);
+        free(ctx->workers[i].segment);
+    }
+    free(ctx->workers);
+    ctx->workers = NULL;
+    ctx->stop = 0;
+
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->window_start);
+    pthread_cond_destroy(&ctx->window_done);
+
+    init_cache(ctx, 1);
+}
+
+int xc_compression_set_threads(xc_interface *xch, comp_ctx *ctx,
+                               unsigned int nr_threads)
+{
+    struct cache_shard *shards;
+    unsigned int i;
+
+    if (!nr_threads || nr_threads > MAX_COMPRESSION_THREADS)
+    {
+        ERROR("Invalid number of compression threads %u\n", nr_threads);
+        errno = EINVAL;
+        return -1;
+    }
+
+    stop_workers(ctx);
+    if (nr_threads == 1)
+        return 0;
+
+    shards = realloc(ctx->shards, nr_threads * sizeof(*shards));
+    if (!shards)
+    {
+        ERROR("Could not alloc compression cache shards\n");
+        return -1;
+    }
+    ctx->shards = shards;
+
+    ctx->workers = calloc(nr_threads, sizeof(*ctx->workers));
+    if (!ctx->workers)
+    {
+        ERROR("Could not alloc compression threads\n");
+        return -1;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->window_start, NULL);
+    pthread_cond_init(&ctx->window_done, NULL);
+    ctx->window_nr = 0;
+    init_cache(ctx, nr_threads);
+
+    for (i = 0; i < nr_threads; i++)
+    {
+        ctx->workers[i].ctx = ctx;
+        ctx->workers[i].id = i;
+        /* A whole window may belong to one worker */
+        ctx->workers[i].segment = malloc(WINDOW_PAGES * WORST_COMP_PAGE_SIZE);
+        if (!ctx->workers[i].segment)
+        {
+            ERROR("Could not alloc compression segment\n");
+            goto error;
+        }
+        /* Worker 0 is whoever calls xc_compression_compress_pages */
+        if (!i)
+            continue;
+        if (pthread_create(&ctx->workers[i].thread, NULL,
+                           compression_thread, &ctx->workers[i]))
+        {
+            PERROR("Could not start compression thread");
+            goto error;
+        }
+        ctx->workers[i].started = 1;
+    }
+
+    return 0;
+
+error:
+    stop_workers(ctx);
+    return -1;
+}
+#else
+int xc_compression_set_threads(xc_interface *xch, comp_ctx *ctx,
+                               unsigned int nr_threads)
+{
+    if (nr_threads != 1)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 {
     if (!ctx) return;
 
+#ifndef __MINIOS__
+    stop_workers(ctx);
+#endif
+    free(ctx->shards);
     free(ctx->inputbuf);
     free(ctx->sendbuf_pfns);
     free(ctx->cache_base);
@@ -468,7 +897,6 @@ void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 comp_ctx *xc_compression_create_context(xc_interface *xch,
                                         unsigned long p2m_size)
 {
-    unsigned long i;
     comp_ctx *ctx = NULL;
     unsigned long num_cache_pages = DELTA_CACHE_SIZE/XC_PAGE_SIZE;
 
@@ -518,17 +946,16 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
-    for (i = 0; i < num_cache_pages; i++)
+    ctx->shards = malloc(sizeof(struct cache_shard));
+    if (!ctx->shards)
     {
-        ctx->cache[i].pfn = INVALID_P2M_ENTRY;
-        ctx->cache[i].page = ctx->cache_base + i * XC_PAGE_SIZE;
-        ctx->cache[i].prev = (i == 0) ? NULL : &(ctx->cache[i - 1]);
-        ctx->cache[i].next = ((i+1) == num_cache_pages)? NULL :
-            &(ctx->cache[i + 1]);
-    }
-    ctx->page_list_head = &(ctx->cache[0]);
-    ctx->page_list_tail = &(ctx->cache[num_cache_pages -1]);
+        ERROR("Could not alloc compression cache shards\n");
+        goto error;
+    }
+
     ctx->dom_pfnlist_size = p2m_size;
+    init_cache(ctx, 1);
+    ctx->diff_lanes = select_diff_lanes();
 
     return ctx;
 error:
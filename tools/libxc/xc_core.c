@@ -66,10 +66,17 @@
 #include "xc_dom.h"
 #include <stdlib.h>
 #include <unistd.h>
+#ifndef __MINIOS__
+#include <pthread.h>
+#include <zlib.h>
+#endif
 
 /* number of pages to write at a time */
 #define DUMP_INCREMENT (4 * 1024)
 
+/* number of pages to map at a time */
+#define DUMP_MAP_BATCH 1024
+
 /* string table */
 struct xc_core_strtab {
     char       *strings;
@@ -417,6 +424,80 @@ elfnote_dump_format_version(xc_interface *xch,
     return dump_rtn(xch, args, (char*)&format_version, sizeof(format_version));
 }
 
+/* Guest pages to be mapped and copied into the dump */
+struct dump_batch {
+    unsigned int nr;
+    uint64_t pfn[DUMP_MAP_BATCH];
+    xen_pfn_t gmfn[DUMP_MAP_BATCH];
+    int err[DUMP_MAP_BATCH];
+};
+
+/*
+ * Copy the pages of the batch into dump_mem, handing it to dump_rtn each
+ * time it is full, and fill in their entries of the p2m or pfn table.
+ * Pages which cannot be mapped are left out, as they always were.
+ */
+static int
+dump_batch_pages(xc_interface *xch, uint32_t domid, void *args,
+                 dumpcore_rtn_t dump_rtn, struct dump_batch *batch,
+                 struct xen_dumpcore_p2m *p2m_array, uint64_t *pfn_array,
+                 unsigned long *j, char *dump_mem_start, char **dump_mem)
+{
+    char *vaddr, *page;
+    unsigned int k;
+    int sts = 0;
+
+    if ( batch->nr == 0 )
+        return 0;
+
+    vaddr = xc_map_foreign_bulk(xch, domid, PROT_READ, batch->gmfn,
+                                batch->err, batch->nr);
+    for ( k = 0; k < batch->nr; k++ )
+    {
+        if ( vaddr == NULL )
+        {
+            /* Not all at once: perhaps one at a time. */
+            page = xc_map_foreign_range(xch, domid, PAGE_SIZE, PROT_READ,
+                                        batch->gmfn[k]);
+            if ( page == NULL )
+                continue;
+            memcpy(*dump_mem, page, PAGE_SIZE);
+            munmap(page, PAGE_SIZE);
+        }
+        else
+        {
+            if ( batch->err[k] )
+                continue;
+            memcpy(*dump_mem, vaddr + k * PAGE_SIZE, PAGE_SIZE);
+        }
+
+        if ( p2m_array != NULL )
+        {
+            p2m_array[*j].pfn = batch->pfn[k];
+            p2m_array[*j].gmfn = batch->gmfn[k];
+        }
+        else
+            pfn_array[*j] = batch->pfn[k];
+        (*j)++;
+
+        *dump_mem += PAGE_SIZE;
+        if ( *dump_mem - dump_mem_start == DUMP_INCREMENT * PAGE_SIZE )
+        {
+            sts = dump_rtn(xch, args, dump_mem_start,
+                           *dump_mem - dump_mem_start);
+            if ( sts != 0 )
+                break;
+            *dump_mem = dump_mem_start;
+        }
+    }
+
+    if ( vaddr != NULL )
+        munmap(vaddr, batch->nr * PAGE_SIZE);
+    batch->nr = 0;
+
+    return sts;
+}
+
 int
 xc_domain_dumpcore_via_callback(xc_interface *xch,
                                 uint32_t domid,
@@ -449,6 +530,7 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     struct xen_dumpcore_p2m *p2m_array = NULL;
 
     uint64_t *pfn_array = NULL;
+    struct dump_batch *batch = NULL;
 
     Elf64_Ehdr ehdr;
     uint64_t filesz;
@@ -472,6 +554,12 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         PERROR("Could not allocate dump_mem");
         goto out;
     }
+    if ( (batch = malloc(sizeof(*batch))) == NULL )
+    {
+        PERROR("Could not allocate page batch");
+        goto out;
+    }
+    batch->nr = 0;
 
     if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 )
     {
@@ -789,8 +877,16 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         for ( i = pfn_start; i < pfn_end; i++ )
         {
             uint64_t gmfn;
-            void *vaddr;
-            
+
+            if ( j + batch->nr >= nr_pages )
+            {
+                /* Some of the batch may not map: see how many do. */
+                sts = dump_batch_pages(xch, domid, args, dump_rtn, batch,
+                                       p2m_array, pfn_array, &j,
+                                       dump_mem_start, &dump_mem);
+                if ( sts != 0 )
+                    goto out;
+            }
             if ( j >= nr_pages )
             {
                 /*
@@ -818,9 +914,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     if ( gmfn == (uint32_t)INVALID_P2M_ENTRY )
                        continue;
                 }
-
-                p2m_array[j].pfn = i;
-                p2m_array[j].gmfn = gmfn;
             }
             else
             {
@@ -828,28 +921,25 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     continue;
 
                 gmfn = i;
-                pfn_array[j] = i;
             }
 
-            vaddr = xc_map_foreign_range(
-                xch, domid, PAGE_SIZE, PROT_READ, gmfn);
-            if ( vaddr == NULL )
-                continue;
-            memcpy(dump_mem, vaddr, PAGE_SIZE);
-            munmap(vaddr, PAGE_SIZE);
-            dump_mem += PAGE_SIZE;
-            if ( (j + 1) % DUMP_INCREMENT == 0 )
+            batch->pfn[batch->nr] = i;
+            batch->gmfn[batch->nr] = gmfn;
+            if ( ++batch->nr == DUMP_MAP_BATCH )
             {
-                sts = dump_rtn(
-                    xch, args, dump_mem_start, dump_mem - dump_mem_start);
+                sts = dump_batch_pages(xch, domid, args, dump_rtn, batch,
+                                       p2m_array, pfn_array, &j,
+                                       dump_mem_start, &dump_mem);
                 if ( sts != 0 )
                     goto out;
-                dump_mem = dump_mem_start;
             }
-
-            j++;
         }
     }
+    sts = dump_batch_pages(xch, domid, args, dump_rtn, batch,
+                           p2m_array, pfn_array, &j,
+                           dump_mem_start, &dump_mem);
+    if ( sts != 0 )
+        goto out;
 
 copy_done:
     sts = dump_rtn(xch, args, dump_mem_start, dump_mem - dump_mem_start);
@@ -910,6 +1000,7 @@ out:
         free(ctxt);
     if ( dump_mem_start != NULL )
         free(dump_mem_start);
+    free(batch);
     if ( live_shinfo != NULL )
         munmap(live_shinfo, PAGE_SIZE);
     xc_core_arch_context_free(&arch_ctxt);
@@ -917,22 +1008,346 @@ out:
     return sts;
 }
 
+/* Pages of dump compressed at a time, each as a gzip member of its own. */
+#define GZIP_CHUNK_PAGES 256
+#define GZIP_CHUNK_SIZE (GZIP_CHUNK_PAGES * PAGE_SIZE)
+
+#ifndef __MINIOS__
+struct dump_chunk {
+    char *in, *out;
+    unsigned long in_len, out_len;
+    int done;                   /* 1 when compressed, -1 if that failed */
+};
+
+/*
+ * The dump is cut into chunks, which are compressed on nr_threads
+ * threads while more of it is copied, and written out in order.
+ * Chunks [written, filled) are compressed or being compressed, the one
+ * at filled is being filled, and started is the next one to compress.
+ */
+struct dump_gzip {
+    int fd;
+    unsigned int nr_chunks;
+    struct dump_chunk *chunks;
+    unsigned long filled, started, written;
+
+    unsigned int nr_threads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int stop;
+};
+#endif
+
 /* Callback args for writing to a local dump file. */
 struct dump_args {
     int     fd;
+    unsigned int flags;
+    uint64_t offset;            /* bytes of the file so far, holes too */
+#ifndef __MINIOS__
+    struct dump_gzip *gz;       /* when XC_DUMPCORE_COMPRESS */
+#endif
 };
 
+#ifndef __MINIOS__
+static int gzip_chunk(struct dump_chunk *chunk)
+{
+    z_stream z;
+    int rc;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 more window bits for a gzip header and trailer */
+    if ( deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) != Z_OK )
+        return -1;
+
+    z.next_in = (Bytef *)chunk->in;
+    z.avail_in = chunk->in_len;
+    z.next_out = (Bytef *)chunk->out;
+    z.avail_out = deflateBound(&z, GZIP_CHUNK_SIZE);
+    rc = deflate(&z, Z_FINISH);
+    chunk->out_len = z.total_out;
+    deflateEnd(&z);
+
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+static void *gzip_thread(void *arg)
+{
+    struct dump_gzip *gz = arg;
+    struct dump_chunk *chunk;
+    int rc;
+
+    pthread_mutex_lock(&gz->lock);
+    for ( ; ; )
+    {
+        while ( gz->started == gz->filled && !gz->stop )
+            pthread_cond_wait(&gz->work, &gz->lock);
+        if ( gz->started == gz->filled )
+            break;
+        chunk = &gz->chunks[gz->started++ % gz->nr_chunks];
+        pthread_mutex_unlock(&gz->lock);
+
+        rc = gzip_chunk(chunk);
+
+        pthread_mutex_lock(&gz->lock);
+        chunk->done = rc ? -1 : 1;
+        pthread_cond_broadcast(&gz->done);
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    return NULL;
+}
+
+static void gzip_free(struct dump_gzip *gz)
+{
+    unsigned int i;
+
+    if ( gz == NULL )
+        return;
+
+    if ( gz->threads != NULL )
+    {
+        pthread_mutex_lock(&gz->lock);
+        gz->stop = 1;
+        pthread_cond_broadcast(&gz->work);
+        pthread_mutex_unlock(&gz->lock);
+        for ( i = 0; i < gz->nr_threads; i++ )
+            pthread_join(gz->threads[i], NULL);
+        pthread_cond_destroy(&gz->done);
+        pthread_cond_destroy(&gz->work);
+        pthread_mutex_destroy(&gz->lock);
+        free(gz->threads);
+    }
+
+    if ( gz->chunks != NULL )
+    {
+        for ( i = 0; i < gz->nr_chunks; i++ )
+        {
+            free(gz->chunks[i].in);
+            free(gz->chunks[i].out);
+        }
+        free(gz->chunks);
+    }
+    free(gz);
+}
+
+static struct dump_gzip *gzip_init(xc_interface *xch, int fd,
+                                   unsigned int nr_threads)
+{
+    struct dump_gzip *gz;
+    unsigned long out_size;
+    unsigned int i;
+    z_stream z;
+
+    gz = calloc(1, sizeof(*gz));
+    if ( gz == NULL )
+        goto err;
+    gz->fd = fd;
+
+    memset(&z, 0, sizeof(z));
+    if ( deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) != Z_OK )
+        goto err;
+    out_size = deflateBound(&z, GZIP_CHUNK_SIZE);
+    deflateEnd(&z);
+
+    /* Enough chunks for every thread to have one, and some to fill. */
+    gz->nr_chunks = nr_threads > 1 ? 2 * nr_threads : 1;
+    gz->chunks = calloc(gz->nr_chunks, sizeof(*gz->chunks));
+    if ( gz->chunks == NULL )
+        goto err;
+    for ( i = 0; i < gz->nr_chunks; i++ )
+    {
+        gz->chunks[i].in = malloc(GZIP_CHUNK_SIZE);
+        gz->chunks[i].out = malloc(out_size);
+        if ( gz->chunks[i].in == NULL || gz->chunks[i].out == NULL )
+            goto err;
+    }
+
+    if ( nr_threads <= 1 )
+        return gz;
+
+    gz->threads = calloc(nr_threads, sizeof(*gz->threads));
+    if ( gz->threads == NULL )
+        goto err;
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->work, NULL);
+    pthread_cond_init(&gz->done, NULL);
+    for ( gz->nr_threads = 0; gz->nr_threads < nr_threads; gz->nr_threads++ )
+    {
+        if ( pthread_create(&gz->threads[gz->nr_threads], NULL,
+                            gzip_thread, gz) )
+        {
+            PERROR("Could not start compression thread");
+            goto err;
+        }
+    }
+
+    return gz;
+
+ err:
+    ERROR("Could not set up dump compression");
+    gzip_free(gz);
+    return NULL;
+}
+
+/* Write out the chunks before upto, in order, once they are compressed. */
+static int gzip_write(xc_interface *xch, struct dump_gzip *gz,
+                      unsigned long upto)
+{
+    struct dump_chunk *chunk;
+
+    for ( ; gz->written < upto; gz->written++ )
+    {
+        chunk = &gz->chunks[gz->written % gz->nr_chunks];
+        if ( gz->threads != NULL )
+        {
+            pthread_mutex_lock(&gz->lock);
+            while ( !chunk->done )
+                pthread_cond_wait(&gz->done, &gz->lock);
+            pthread_mutex_unlock(&gz->lock);
+        }
+        else
+            chunk->done = gzip_chunk(chunk) ? -1 : 1;
+
+        if ( chunk->done < 0 )
+        {
+            ERROR("Failed to compress dump");
+            errno = EIO;
+            return -1;
+        }
+        if ( write_exact(gz->fd, chunk->out, chunk->out_len) == -1 )
+        {
+            PERROR("Failed to write buffer");
+            return -1;
+        }
+        discard_file_cache(xch, gz->fd, 0 /* no flush */);
+
+        chunk->done = 0;
+        chunk->in_len = 0;
+    }
+
+    return 0;
+}
+
+/* Hand the chunk being filled over to be compressed. */
+static int gzip_submit(xc_interface *xch, struct dump_gzip *gz)
+{
+    if ( gz->threads != NULL )
+    {
+        pthread_mutex_lock(&gz->lock);
+        gz->filled++;
+        pthread_cond_signal(&gz->work);
+        pthread_mutex_unlock(&gz->lock);
+    }
+    else
+        gz->filled++;
+
+    /* The next one to fill has to be written out first. */
+    if ( gz->filled - gz->written >= gz->nr_chunks )
+        return gzip_write(xch, gz, gz->filled - gz->nr_chunks + 1);
+    return 0;
+}
+
+static int gzip_dump(xc_interface *xch, struct dump_gzip *gz,
+                     char *buffer, unsigned int length)
+{
+    struct dump_chunk *chunk;
+    unsigned int len;
+
+    while ( length )
+    {
+        chunk = &gz->chunks[gz->filled % gz->nr_chunks];
+        len = GZIP_CHUNK_SIZE - chunk->in_len;
+        if ( len > length )
+            len = length;
+        memcpy(chunk->in + chunk->in_len, buffer, len);
+        chunk->in_len += len;
+        buffer += len;
+        length -= len;
+
+        if ( chunk->in_len == GZIP_CHUNK_SIZE && gzip_submit(xch, gz) )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Compress what is left, and wait for all of it to be written. */
+static int gzip_flush(xc_interface *xch, struct dump_gzip *gz)
+{
+    if ( gz->chunks[gz->filled % gz->nr_chunks].in_len &&
+         gzip_submit(xch, gz) )
+        return -1;
+    return gzip_write(xch, gz, gz->filled);
+}
+#endif
+
+static int page_is_zero(const char *page)
+{
+    const uint64_t *p = (const uint64_t *)page;
+    uint64_t any = 0;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        any |= p[i];
+
+    return !any;
+}
+
+/* Write the buffer, seeking over whole pages of zeroes. */
+static int sparse_write(int fd, uint64_t offset, char *buffer,
+                        unsigned int length)
+{
+    unsigned int off, run;
+    int zero;
+
+    if ( (offset | length) & (PAGE_SIZE - 1) )
+        return write_exact(fd, buffer, length);
+
+    for ( off = 0; off < length; off += run )
+    {
+        zero = page_is_zero(buffer + off);
+        for ( run = PAGE_SIZE;
+              off + run < length && page_is_zero(buffer + off + run) == zero;
+              run += PAGE_SIZE )
+            ;
+
+        if ( zero )
+        {
+            if ( lseek(fd, run, SEEK_CUR) == (off_t)-1 )
+                return -1;
+        }
+        else if ( write_exact(fd, buffer + off, run) == -1 )
+            return -1;
+    }
+
+    return 0;
+}
+
 /* Callback routine for writing to a local dump file. */
 static int local_file_dump(xc_interface *xch,
                            void *args, char *buffer, unsigned int length)
 {
     struct dump_args *da = args;
+    int sts;
+
+#ifndef __MINIOS__
+    if ( da->gz != NULL )
+        return gzip_dump(xch, da->gz, buffer, length) ? -errno : 0;
+#endif
 
-    if ( write_exact(da->fd, buffer, length) == -1 )
+    if ( da->flags & XC_DUMPCORE_SPARSE )
+        sts = sparse_write(da->fd, da->offset, buffer, length);
+    else
+        sts = write_exact(da->fd, buffer, length);
+    if ( sts == -1 )
     {
         PERROR("Failed to write buffer");
         return -errno;
     }
+    da->offset += length;
 
     if ( length >= (DUMP_INCREMENT * PAGE_SIZE) )
     {
@@ -945,22 +1360,62 @@ static int local_file_dump(xc_interface *xch,
 }
 
 int
-xc_domain_dumpcore(xc_interface *xch,
-                   uint32_t domid,
-                   const char *corename)
+xc_domain_dumpcore_flags(xc_interface *xch,
+                         uint32_t domid,
+                         const char *corename,
+                         unsigned int flags,
+                         unsigned int nr_threads)
 {
-    struct dump_args da;
+    struct dump_args da = { .flags = flags };
     int sts;
 
+#ifdef __MINIOS__
+    if ( flags & XC_DUMPCORE_COMPRESS )
+    {
+        ERROR("Compressed dumps are not supported");
+        errno = ENOSYS;
+        return -errno;
+    }
+#endif
+
     if ( (da.fd = open(corename, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 )
     {
         PERROR("Could not open corefile %s", corename);
         return -errno;
     }
 
+#ifndef __MINIOS__
+    if ( flags & XC_DUMPCORE_COMPRESS )
+    {
+        da.gz = gzip_init(xch, da.fd, nr_threads);
+        if ( da.gz == NULL )
+        {
+            close(da.fd);
+            return -ENOMEM;
+        }
+    }
+#endif
+
     sts = xc_domain_dumpcore_via_callback(
         xch, domid, &da, &local_file_dump);
 
+#ifndef __MINIOS__
+    if ( da.gz != NULL )
+    {
+        if ( sts == 0 && gzip_flush(xch, da.gz) )
+            sts = -errno;
+        gzip_free(da.gz);
+    }
+#endif
+
+    /* A hole at the end is only there once the file is that long. */
+    if ( sts == 0 && (flags & XC_DUMPCORE_SPARSE) &&
+         !(flags & XC_DUMPCORE_COMPRESS) && ftruncate(da.fd, da.offset) )
+    {
+        PERROR("Could not set the size of corefile %s", corename);
+        sts = -errno;
+    }
+
     /* flush and discard any remaining portion of the file from cache */
     discard_file_cache(xch, da.fd, 1/* flush first*/);
 
@@ -969,6 +1424,14 @@ xc_domain_dumpcore(xc_interface *xch,
     return sts;
 }
 
+int
+xc_domain_dumpcore(xc_interface *xch,
+                   uint32_t domid,
+                   const char *corename)
+{
+    return xc_domain_dumpcore_flags(xch, domid, corename, 0, 0);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -41,80 +41,12 @@
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
+#include "xg_restore_stream.h"
 #include "xc_dom.h"
 
 #include <xen/hvm/ioreq.h>
 #include <xen/hvm/params.h>
 
-struct restore_ctx {
-    unsigned long max_mfn; /* max mfn of the current host machine */
-    unsigned long hvirt_start; /* virtual starting address of the hypervisor */
-    unsigned int pt_levels; /* #levels of page tables used by the current guest */
-    unsigned long nr_pfns; /* number of 'in use' pfns in the guest (i.e. #P2M entries with a valid mfn) */
-    xen_pfn_t *live_p2m; /* Live mapping of the table mapping each PFN to its current MFN. */
-    xen_pfn_t *p2m; /* A table mapping each PFN to its new MFN. */
-    xen_pfn_t *p2m_batch; /* A table of P2M mappings in the current region.  */
-    xen_pfn_t *p2m_saved_batch; /* Copy of p2m_batch array for pv superpage alloc */
-    int superpages; /* Superpage allocation has been requested */
-    int hvm;    /* This is an hvm domain */
-    int completed; /* Set when a consistent image is available */
-    int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
-    int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
-    struct domain_info_context dinfo;
-};
-
-#define HEARTBEAT_MS 1000
-
-#ifndef __MINIOS__
-static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
-                       int fd, void* buf, size_t size)
-{
-    size_t offset = 0;
-    ssize_t len;
-    struct timeval tv;
-    fd_set rfds;
-
-    while ( offset < size )
-    {
-        if ( ctx->completed ) {
-            /* expect a heartbeat every HEARBEAT_MS ms maximum */
-            tv.tv_sec = HEARTBEAT_MS / 1000;
-            tv.tv_usec = (HEARTBEAT_MS % 1000) * 1000;
-
-            FD_ZERO(&rfds);
-            FD_SET(fd, &rfds);
-            len = select(fd + 1, &rfds, NULL, NULL, &tv);
-            if ( len == -1 && errno == EINTR )
-                continue;
-            if ( !FD_ISSET(fd, &rfds) ) {
-                ERROR("%s failed (select returned %zd)", __func__, len);
-                errno = ETIMEDOUT;
-                return -1;
-            }
-        }
-
-        len = read(fd, buf + offset, size - offset);
-        if ( (len == -1) && ((errno == EINTR) || (errno == EAGAIN)) )
-            continue;
-        if ( len == 0 ) {
-            ERROR("0-length read");
-            errno = 0;
-        }
-        if ( len <= 0 ) {
-            ERROR("%s failed (read rc: %d, errno: %d)", __func__, len, errno);
-            return -1;
-        }
-        offset += len;
-    }
-
-    return 0;
-}
-
-#define RDEXACT(fd,buf,size) rdexact(xch, ctx, fd, buf, size)
-#else
-#define RDEXACT read_exact
-#endif
-
 #define SUPERPAGE_PFN_SHIFT  9
 #define SUPERPAGE_NR_PFNS    (1UL << SUPERPAGE_PFN_SHIFT)
 #define SUPERPAGE(_pfn) ((_pfn) & (~(SUPERPAGE_NR_PFNS-1)))
@@ -715,374 +647,77 @@ static void tailbuf_free(tailbuf_t *buf)
         tailbuf_free_pv(&buf->u.pv);
 }
 
-struct toolstack_data_t {
-    uint8_t *data;
-    uint32_t len;
-};
-
-typedef struct {
-    void* pages;
-    /* pages is of length nr_physpages, pfn_types is of length nr_pages */
-    unsigned int nr_physpages, nr_pages;
-
-    /* checkpoint compression state */
-    int compressing;
-    unsigned long compbuf_pos, compbuf_size;
-
-    /* Types of the pfns in the current region */
-    unsigned long* pfn_types;
-
-    int verify;
-
-    int new_ctxt_format;
-    int max_vcpu_id;
-    uint64_t vcpumap[XC_SR_MAX_VCPUS/64];
-    uint64_t identpt;
-    uint64_t paging_ring_pfn;
-    uint64_t access_ring_pfn;
-    uint64_t sharing_ring_pfn;
-    uint64_t vm86_tss;
-    uint64_t console_pfn;
-    uint64_t acpi_ioport_location;
-    uint64_t viridian;
-    uint64_t vm_generationid_addr;
-
-    struct toolstack_data_t tdata;
-} pagebuf_t;
-
-static int pagebuf_init(pagebuf_t* buf)
+/* The first page reference at or after entry idx of the buffer. */
+static struct xc_page_ref *pagebuf_find_ref(pagebuf_t* buf, unsigned int idx)
 {
-    memset(buf, 0, sizeof(*buf));
-    return 0;
-}
+    unsigned int lo = 0, hi = buf->nr_refs, mid;
 
-static void pagebuf_free(pagebuf_t* buf)
-{
-    if (buf->tdata.data != NULL) {
-        free(buf->tdata.data);
-        buf->tdata.data = NULL;
-    }
-    if (buf->pages) {
-        free(buf->pages);
-        buf->pages = NULL;
-    }
-    if(buf->pfn_types) {
-        free(buf->pfn_types);
-        buf->pfn_types = NULL;
+    while ( lo < hi )
+    {
+        mid = (lo + hi) / 2;
+        if ( buf->refs[mid].index < idx )
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return buf->refs + lo;
 }
 
-static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
-                           pagebuf_t* buf, int fd, uint32_t dom)
+/*
+ * Map, in order, the pages which the references [ref, end) copy and which
+ * are not in the batch starting at entry curbatch: they are already in
+ * guest memory.
+ */
+static int map_ref_sources(xc_interface *xch, uint32_t dom,
+                           struct restore_ctx *ctx, pagebuf_t* buf,
+                           struct xc_page_ref *ref, struct xc_page_ref *end,
+                           int curbatch, char **base, int **err)
 {
-    int count, countpages, oldcount, i;
-    void* ptmp;
-    unsigned long compbuf_size;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    xen_pfn_t *mfns;
+    unsigned long pfn;
+    unsigned int nr = 0;
+    int rc = -1;
 
-    if ( RDEXACT(fd, &count, sizeof(count)) )
+    mfns = malloc((end - ref) * sizeof(*mfns));
+    *err = calloc(end - ref, sizeof(**err));
+    if ( !mfns || !*err )
     {
-        PERROR("Error when reading batch size");
-        return -1;
+        ERROR("Could not allocate page reference sources");
+        goto out;
     }
 
-    // DPRINTF("reading batch of %d pages\n", count);
-
-    switch ( count )
-    {
-    case 0:
-        // DPRINTF("Last batch read\n");
-        return 0;
-
-    case XC_SAVE_ID_ENABLE_VERIFY_MODE:
-        DPRINTF("Entering page verify mode\n");
-        buf->verify = 1;
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_VCPU_INFO:
-        buf->new_ctxt_format = 1;
-        if ( RDEXACT(fd, &buf->max_vcpu_id, sizeof(buf->max_vcpu_id)) ||
-             buf->max_vcpu_id >= XC_SR_MAX_VCPUS ||
-             RDEXACT(fd, buf->vcpumap, vcpumap_sz(buf->max_vcpu_id)) ) {
-            PERROR("Error when reading max_vcpu_id");
-            return -1;
-        }
-        // DPRINTF("Max VCPU ID: %d, vcpumap: %llx\n", buf->max_vcpu_id, buf->vcpumap[0]);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_IDENT_PT:
-        /* Skip padding 4 bytes then read the EPT identity PT location. */
-        if ( RDEXACT(fd, &buf->identpt, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->identpt, sizeof(uint64_t)) )
-        {
-            PERROR("error read the address of the EPT identity map");
-            return -1;
-        }
-        // DPRINTF("EPT identity map address: %llx\n", buf->identpt);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_PAGING_RING_PFN:
-        /* Skip padding 4 bytes then read the paging ring location. */
-        if ( RDEXACT(fd, &buf->paging_ring_pfn, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->paging_ring_pfn, sizeof(uint64_t)) )
-        {
-            PERROR("error read the paging ring pfn");
-            return -1;
-        }
-        // DPRINTF("paging ring pfn address: %llx\n", buf->paging_ring_pfn);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_ACCESS_RING_PFN:
-        /* Skip padding 4 bytes then read the mem access ring location. */
-        if ( RDEXACT(fd, &buf->access_ring_pfn, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->access_ring_pfn, sizeof(uint64_t)) )
-        {
-            PERROR("error read the access ring pfn");
-            return -1;
-        }
-        // DPRINTF("access ring pfn address: %llx\n", buf->access_ring_pfn);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_SHARING_RING_PFN:
-        /* Skip padding 4 bytes then read the sharing ring location. */
-        if ( RDEXACT(fd, &buf->sharing_ring_pfn, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->sharing_ring_pfn, sizeof(uint64_t)) )
-        {
-            PERROR("error read the sharing ring pfn");
-            return -1;
-        }
-        // DPRINTF("sharing ring pfn address: %llx\n", buf->sharing_ring_pfn);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_VM86_TSS:
-        /* Skip padding 4 bytes then read the vm86 TSS location. */
-        if ( RDEXACT(fd, &buf->vm86_tss, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->vm86_tss, sizeof(uint64_t)) )
-        {
-            PERROR("error read the address of the vm86 TSS");
-            return -1;
-        }
-        // DPRINTF("VM86 TSS location: %llx\n", buf->vm86_tss);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_TMEM:
-        DPRINTF("xc_domain_restore start tmem\n");
-        if ( xc_tmem_restore(xch, dom, fd) ) {
-            PERROR("error reading/restoring tmem");
-            return -1;
-        }
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_TMEM_EXTRA:
-        if ( xc_tmem_restore_extra(xch, dom, fd) ) {
-            PERROR("error reading/restoring tmem extra");
-            return -1;
-        }
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_TSC_INFO:
+    for ( ; ref < end; ref++ )
     {
-        uint32_t tsc_mode, khz, incarn;
-        uint64_t nsec;
-        if ( RDEXACT(fd, &tsc_mode, sizeof(uint32_t)) ||
-             RDEXACT(fd, &nsec, sizeof(uint64_t)) ||
-             RDEXACT(fd, &khz, sizeof(uint32_t)) ||
-             RDEXACT(fd, &incarn, sizeof(uint32_t)) ||
-             xc_domain_set_tsc_info(xch, dom, tsc_mode, nsec, khz, incarn) ) {
-            PERROR("error reading/restoring tsc info");
-            return -1;
-        }
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-    }
-
-    case XC_SAVE_ID_HVM_CONSOLE_PFN :
-        /* Skip padding 4 bytes then read the console pfn location. */
-        if ( RDEXACT(fd, &buf->console_pfn, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->console_pfn, sizeof(uint64_t)) )
-        {
-            PERROR("error read the address of the console pfn");
-            return -1;
-        }
-        // DPRINTF("console pfn location: %llx\n", buf->console_pfn);
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_LAST_CHECKPOINT:
-        ctx->last_checkpoint = 1;
-        // DPRINTF("last checkpoint indication received");
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_ACPI_IOPORTS_LOCATION:
-        /* Skip padding 4 bytes then read the acpi ioport location. */
-        if ( RDEXACT(fd, &buf->acpi_ioport_location, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->acpi_ioport_location, sizeof(uint64_t)) )
-        {
-            PERROR("error read the acpi ioport location");
-            return -1;
-        }
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_HVM_VIRIDIAN:
-        /* Skip padding 4 bytes then read the acpi ioport location. */
-        if ( RDEXACT(fd, &buf->viridian, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->viridian, sizeof(uint64_t)) )
-        {
-            PERROR("error read the viridian flag");
-            return -1;
-        }
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_TOOLSTACK:
-        {
-            if ( RDEXACT(fd, &buf->tdata.len, sizeof(buf->tdata.len)) )
-            {
-                PERROR("error read toolstack id size");
-                return -1;
-            }
-            buf->tdata.data = (uint8_t*) realloc(buf->tdata.data, buf->tdata.len);
-            if ( buf->tdata.data == NULL )
-            {
-                PERROR("error memory allocation");
-                return -1;
-            }
-            if ( RDEXACT(fd, buf->tdata.data, buf->tdata.len) )
-            {
-                PERROR("error read toolstack id");
-                return -1;
-            }
-            return pagebuf_get_one(xch, ctx, buf, fd, dom);
-        }
-
-    case XC_SAVE_ID_ENABLE_COMPRESSION:
-        /* We cannot set compression flag directly in pagebuf structure,
-         * since this pagebuf still has uncompressed pages that are yet to
-         * be applied. We enable the compression field in pagebuf structure
-         * after receiving the first tailbuf.
-         */
-        ctx->compressing = 1;
-        // DPRINTF("compression flag received");
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    case XC_SAVE_ID_COMPRESSED_DATA:
-
-        /* read the length of compressed chunk coming in */
-        if ( RDEXACT(fd, &compbuf_size, sizeof(unsigned long)) )
-        {
-            PERROR("Error when reading compbuf_size");
-            return -1;
-        }
-        if (!compbuf_size) return 1;
-
-        buf->compbuf_size += compbuf_size;
-        if (!(ptmp = realloc(buf->pages, buf->compbuf_size))) {
-            ERROR("Could not (re)allocate compression buffer");
-            return -1;
-        }
-        buf->pages = ptmp;
-
-        if ( RDEXACT(fd, buf->pages + (buf->compbuf_size - compbuf_size),
-                     compbuf_size) ) {
-            PERROR("Error when reading compression buffer");
-            return -1;
-        }
-        return compbuf_size;
+        if ( ref->type == XC_PAGE_REF_ZERO ||
+             (ref->type == XC_PAGE_REF_BATCH && ref->source >= curbatch) )
+            continue;
 
-    case XC_SAVE_ID_HVM_GENERATION_ID_ADDR:
-        /* Skip padding 4 bytes then read the generation id buffer location. */
-        if ( RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint32_t)) ||
-             RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint64_t)) )
+        if ( ref->type == XC_PAGE_REF_PFN )
+            pfn = ref->source;
+        else
+            pfn = buf->pfn_types[ref->source] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( pfn >= dinfo->p2m_size || ctx->p2m[pfn] == INVALID_P2M_ENTRY )
         {
-            PERROR("error read the generation id buffer location");
-            return -1;
-        }
-        DPRINTF("read generation id buffer address");
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    default:
-        if ( (count > MAX_BATCH_SIZE) || (count < 0) ) {
-            ERROR("Max batch size exceeded (%d). Giving up.", count);
-            errno = EMSGSIZE;
-            return -1;
-        }
-        break;
-    }
-
-    oldcount = buf->nr_pages;
-    buf->nr_pages += count;
-    if (!buf->pfn_types) {
-        if (!(buf->pfn_types = malloc(buf->nr_pages * sizeof(*(buf->pfn_types))))) {
-            ERROR("Could not allocate PFN type buffer");
-            return -1;
-        }
-    } else {
-        if (!(ptmp = realloc(buf->pfn_types, buf->nr_pages * sizeof(*(buf->pfn_types))))) {
-            ERROR("Could not reallocate PFN type buffer");
-            return -1;
+            ERROR("Page reference to pfn %lx, which was not sent", pfn);
+            goto out;
         }
-        buf->pfn_types = ptmp;
-    }
-    if ( RDEXACT(fd, buf->pfn_types + oldcount, count * sizeof(*(buf->pfn_types)))) {
-        PERROR("Error when reading region pfn types");
-        return -1;
+        mfns[nr++] = ctx->hvm ? pfn : ctx->p2m[pfn];
     }
 
-    countpages = count;
-    for (i = oldcount; i < buf->nr_pages; ++i)
+    if ( nr )
     {
-        unsigned long pagetype;
-
-        pagetype = buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
-        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
-             pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
-             pagetype == XEN_DOMCTL_PFINFO_XALLOC )
-            --countpages;
-    }
-
-    if (!countpages)
-        return count;
-
-    /* If Remus Checkpoint Compression is turned on, we will only be
-     * receiving the pfn lists now. The compressed pages will come in later,
-     * following a <XC_SAVE_ID_COMPRESSED_DATA, compressedChunkSize> tuple.
-     */
-    if (buf->compressing)
-        return pagebuf_get_one(xch, ctx, buf, fd, dom);
-
-    oldcount = buf->nr_physpages;
-    buf->nr_physpages += countpages;
-    if (!buf->pages) {
-        if (!(buf->pages = malloc(buf->nr_physpages * PAGE_SIZE))) {
-            ERROR("Could not allocate page buffer");
-            return -1;
-        }
-    } else {
-        if (!(ptmp = realloc(buf->pages, buf->nr_physpages * PAGE_SIZE))) {
-            ERROR("Could not reallocate page buffer");
-            return -1;
+        *base = xc_map_foreign_bulk(xch, dom, PROT_READ, mfns, *err, nr);
+        if ( *base == NULL )
+        {
+            PERROR("map page reference sources failed");
+            goto out;
         }
-        buf->pages = ptmp;
     }
-    if ( RDEXACT(fd, buf->pages + oldcount * PAGE_SIZE, countpages * PAGE_SIZE) ) {
-        PERROR("Error when reading pages");
-        return -1;
-    }
-
-    return count;
-}
-
-static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
-                       pagebuf_t* buf, int fd, uint32_t dom)
-{
-    int rc;
-
-    buf->nr_physpages = buf->nr_pages = 0;
-    buf->compbuf_pos = buf->compbuf_size = 0;
-
-    do {
-        rc = pagebuf_get_one(xch, ctx, buf, fd, dom);
-    } while (rc > 0);
-
-    if (rc < 0)
-        pagebuf_free(buf);
+    rc = nr;
 
+ out:
+    free(mfns);
     return rc;
 }
 
@@ -1091,7 +726,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        struct xc_mmu* mmu,
                        pagebuf_t* pagebuf, int curbatch)
 {
-    int i, j, curpage, nr_mfns;
+    int i, j, nr_mfns;
     int k, scount;
     unsigned long superpage_start=INVALID_P2M_ENTRY;
     /* used by debug verify code */
@@ -1104,6 +739,12 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     struct domain_info_context *dinfo = &ctx->dinfo;
     int* pfn_err = NULL;
     int rc = -1;
+    /* Pages of this batch sent as references, and the pages they copy
+     * from outside it */
+    struct xc_page_ref *ref, *ref_end;
+    char *src_base = NULL;
+    int *src_err = NULL;
+    int nr_srcs = 0, src = 0;
 
     unsigned long mfn, pfn, pagetype;
 
@@ -1271,7 +912,20 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         return -1;
     }
 
-    for ( i = 0, curpage = -1; i < j; i++ )
+    ref = pagebuf_find_ref(pagebuf, curbatch);
+    ref_end = pagebuf_find_ref(pagebuf, curbatch + j);
+    if ( ref < ref_end )
+    {
+        nr_srcs = map_ref_sources(xch, dom, ctx, pagebuf, ref, ref_end,
+                                  curbatch, &src_base, &src_err);
+        if ( nr_srcs < 0 )
+        {
+            nr_srcs = 0;
+            goto err_mapped;
+        }
+    }
+
+    for ( i = 0; i < j; i++ )
     {
         pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
         pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
@@ -1299,8 +953,6 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             goto err_mapped;
         }
 
-        ++curpage;
-
         if ( pfn > dinfo->p2m_size )
         {
             ERROR("pfn out of range");
@@ -1314,8 +966,27 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         /* In verify mode, we use a copy; otherwise we work in place */
         page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
+        if ( ref < ref_end && ref->index == i + curbatch )
+        {
+            /* Sent as a reference: clear or copy it. */
+            if ( ref->type == XC_PAGE_REF_ZERO )
+                memset(page, 0, PAGE_SIZE);
+            else if ( ref->type == XC_PAGE_REF_BATCH &&
+                      ref->source >= curbatch )
+                memcpy(page, region_base + (ref->source - curbatch) * PAGE_SIZE,
+                       PAGE_SIZE);
+            else if ( src_err[src] )
+            {
+                ERROR("unexpected mapping failure for the copy of pfn %lx",
+                      pfn);
+                goto err_mapped;
+            }
+            else
+                memcpy(page, src_base + src++ * PAGE_SIZE, PAGE_SIZE);
+            ref++;
+        }
         /* Remus - page decompression */
-        if (pagebuf->compressing)
+        else if (pagebuf->compressing)
         {
             if (xc_compression_uncompress_page(xch, pagebuf->pages,
                                                pagebuf->compbuf_size,
@@ -1327,7 +998,8 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             }
         }
         else
-            memcpy(page, pagebuf->pages + (curpage + curbatch) * PAGE_SIZE,
+            memcpy(page,
+                   pagebuf->pages + pagebuf->next_physpage++ * PAGE_SIZE,
                    PAGE_SIZE);
 
         pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
@@ -1405,6 +1077,9 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
   err_mapped:
     munmap(region_base, j*PAGE_SIZE);
     free(pfn_err);
+    if ( src_base )
+        munmap(src_base, nr_srcs*PAGE_SIZE);
+    free(src_err);
 
     return rc;
 }
@@ -1464,6 +1139,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     int new_ctxt_format = 0;
 
     pagebuf_t pagebuf;
+    struct restore_pipe *pipe = NULL;
     tailbuf_t tailbuf, tmptail;
     struct toolstack_data_t tdata, tdatatmp;
     void* vcpup;
@@ -1600,25 +1276,31 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     /*
      * Now simply read each saved frame into its new machine frame.
      * We uncanonicalise page tables as we go.
+     *
+     * The first time round, the stream is read by another thread, a few
+     * batches ahead of those being applied here. Checkpoints after that
+     * are buffered whole before any of them is applied.
      */
+    pipe = restore_pipe_start(xch, ctx, &pagebuf, io_fd, dom, 1);
+    if ( pipe == NULL )
+        goto out;
 
     n = m = 0;
  loadpages:
     for ( ; ; )
     {
+        pagebuf_t *batch = &pagebuf;
         int j, curbatch;
 
         xc_report_progress_step(xch, n, dinfo->p2m_size);
 
         if ( !ctx->completed ) {
-            pagebuf.nr_physpages = pagebuf.nr_pages = 0;
-            pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
-            if ( pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom) < 0 ) {
+            if ( restore_pipe_next(pipe, &batch) < 0 ) {
                 PERROR("Error when reading batch");
                 goto out;
             }
         }
-        j = pagebuf.nr_pages;
+        j = batch->nr_pages;
 
         DBGPRINTF("batch %d\n",j);
 
@@ -1689,7 +1371,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             int brc;
 
             brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
-                              pae_extended_cr3, mmu, &pagebuf, curbatch);
+                              pae_extended_cr3, mmu, batch, curbatch);
             if ( brc < 0 )
                 goto out;
 
@@ -1698,8 +1380,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             curbatch += MAX_BATCH_SIZE;
         }
 
-        pagebuf.nr_physpages = pagebuf.nr_pages = 0;
-        pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
+        if ( batch == &pagebuf )
+            pagebuf_reset(&pagebuf);
+        else
+            restore_pipe_done(pipe, batch);
 
         n += j; /* crude stats */
 
@@ -1729,6 +1413,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     if ( !ctx->completed ) {
 
+        /* The reader is done with the body: the tail is ours to read. */
+        restore_pipe_stop(pipe);
+        pipe = NULL;
+
         if ( buffer_tail(xch, ctx, &tailbuf, io_fd, max_vcpu_id, vcpumap,
                          ext_vcpucontext, vcpuextstate, vcpuextstate_size) < 0 ) {
             ERROR ("error buffering image tail");
@@ -2346,6 +2034,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     free(pfn_type);
     free(region_mfn);
     free(ctx->p2m_batch);
+    restore_pipe_stop(pipe);
     pagebuf_free(&pagebuf);
     tailbuf_free(&tailbuf);
 
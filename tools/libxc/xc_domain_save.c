@@ -64,6 +64,9 @@ struct outbuf {
 
 #define OUTBUF_SIZE (16384 * 1024)
 
+/* most threads to compress checkpoints on */
+#define COMPRESS_MAX_THREADS 8
+
 /* grep fodder: machine_to_phys */
 
 #define mfn_to_pfn(_mfn)  (ctx->live_m2p[(_mfn)])
@@ -798,6 +801,50 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
     return 0;
 }
 
+/* Where xc_page_refs_encode() finds the pages sent in earlier batches. */
+struct page_refs_map {
+    xc_interface *xch;
+    uint32_t dom;
+    int hvm;
+    struct save_ctx *ctx;
+    void *base;
+    unsigned int nr;
+    xen_pfn_t gmfn[MAX_BATCH_SIZE];
+    int err[MAX_BATCH_SIZE];
+};
+
+static int page_refs_map(void *data, const xen_pfn_t *pfns, unsigned int nr,
+                         const void **pages)
+{
+    struct page_refs_map *m = data;
+    struct save_ctx *ctx = m->ctx;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+        m->gmfn[i] = m->hvm ? pfns[i] : pfn_to_mfn(pfns[i]);
+
+    m->base = xc_map_foreign_bulk(m->xch, m->dom, PROT_READ,
+                                  m->gmfn, m->err, nr);
+    if ( !m->base )
+        return -1;
+    m->nr = nr;
+
+    for ( i = 0; i < nr; i++ )
+        if ( !m->err[i] )
+            pages[i] = (char *)m->base + i * PAGE_SIZE;
+
+    return 0;
+}
+
+static void page_refs_unmap(void *data)
+{
+    struct page_refs_map *m = data;
+
+    munmap(m->base, m->nr * PAGE_SIZE);
+    m->base = NULL;
+}
+
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
@@ -890,6 +937,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      * first time.
      */
     int compressing = 0;
+    long ncpus;
+
+    /* Zero and duplicate pages sent as references (XCFLAGS_PAGE_REFS) */
+    xc_page_refs_t *page_refs_ctx = NULL;
+    struct xc_page_ref *page_refs = NULL;
+    struct page_refs_map *page_refs_src = NULL;
+    struct xc_page_refs_sources page_refs_sources;
+    unsigned int nr_page_refs = 0;
+    unsigned long total_zero = 0, total_dup = 0;
 
     int completed = 0;
 
@@ -997,9 +1053,34 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             ERROR("Failed to create compression context");
             goto out;
         }
+        /* Compression bounds how often we can checkpoint: use our cpus. */
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if ( ncpus > 1 &&
+             xc_compression_set_threads(xch, compress_ctx,
+                                        MIN(ncpus, COMPRESS_MAX_THREADS)) )
+            DPRINTF("Compressing checkpoints on one thread");
         outbuf_init(xch, &ob_tailbuf, OUTBUF_SIZE/4);
     }
 
+    if ( flags & XCFLAGS_PAGE_REFS )
+    {
+        page_refs_ctx = xc_page_refs_create(xch, dinfo->p2m_size);
+        page_refs = malloc(MAX_BATCH_SIZE * sizeof(*page_refs));
+        page_refs_src = calloc(1, sizeof(*page_refs_src));
+        if ( !page_refs_ctx || !page_refs || !page_refs_src )
+        {
+            ERROR("Failed to allocate page reference state");
+            goto out;
+        }
+        page_refs_src->xch = xch;
+        page_refs_src->dom = dom;
+        page_refs_src->hvm = hvm;
+        page_refs_src->ctx = ctx;
+        page_refs_sources.map = page_refs_map;
+        page_refs_sources.unmap = page_refs_unmap;
+        page_refs_sources.data = page_refs_src;
+    }
+
     last_iter = !live;
 
     /* pretend we sent all the pages last iteration */
@@ -1116,7 +1197,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
-        unsigned int N, batch, run;
+        unsigned int N, batch, run, r;
         char reportbuf[80];
 
         snprintf(reportbuf, sizeof(reportbuf),
@@ -1130,6 +1211,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         skip_this_iter = 0;
         N = 0;
 
+        /*
+         * A page can only be sent as a copy of another while the guest
+         * cannot change what was sent: once it is suspended.
+         */
+        if ( page_refs_ctx )
+            xc_page_refs_reset(xch, page_refs_ctx, last_iter);
+
         while ( N < dinfo->p2m_size )
         {
             xc_report_progress_step(xch, N, dinfo->p2m_size);
@@ -1330,6 +1418,35 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
+            nr_page_refs = 0;
+            if ( page_refs_ctx && !compressing )
+            {
+                nr_page_refs = xc_page_refs_encode(xch, page_refs_ctx, pfn_type,
+                                                   batch, (char *)region_base,
+                                                   page_refs,
+                                                   &page_refs_sources);
+                if ( nr_page_refs )
+                {
+                    int id = XC_SAVE_ID_PAGE_REFS;
+
+                    if ( wrexact(io_fd, &id, sizeof(id)) ||
+                         wrexact(io_fd, &nr_page_refs, sizeof(nr_page_refs)) ||
+                         wrexact(io_fd, page_refs,
+                                 nr_page_refs * sizeof(*page_refs)) )
+                    {
+                        PERROR("Error when writing to state file (page refs)");
+                        goto out;
+                    }
+                }
+                for ( r = 0; r < nr_page_refs; r++ )
+                {
+                    if ( page_refs[r].type == XC_PAGE_REF_ZERO )
+                        total_zero++;
+                    else
+                        total_dup++;
+                }
+            }
+
             if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
             {
                 PERROR("Error when writing to state file (2)");
@@ -1349,16 +1466,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     pfn_type[j] = ((unsigned long *)pfn_type)[j];
 
             /* entering this loop, pfn_type is now in pfns (Not mfns) */
-            run = 0;
+            run = r = 0;
             for ( j = 0; j < batch; j++ )
             {
                 unsigned long pfn, pagetype;
                 void *spage = (char *)region_base + (PAGE_SIZE*j);
+                int is_ref = 0;
 
                 pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
                 pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
 
-                if ( pagetype != 0 )
+                if ( r < nr_page_refs && page_refs[r].index == j )
+                {
+                    is_ref = 1;
+                    r++;
+                }
+
+                if ( pagetype != 0 || is_ref )
                 {
                     /* If the page is not a normal data page, write out any
                        run of pages we may have previously acumulated */
@@ -1378,11 +1502,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
                 /*
                  * skip pages that aren't present,
-                 * or are broken, or are alloc-only
+                 * or are broken, or are alloc-only,
+                 * or were sent as a reference
                  */
                 if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
                     || pagetype == XEN_DOMCTL_PFINFO_BROKEN
-                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC
+                    || is_ref )
                     continue;
 
                 pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
@@ -1508,6 +1634,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Total pages sent= %ld (%.2fx)\n",
                     total_sent, ((float)total_sent)/dinfo->p2m_size );
             DPRINTF("(of which %ld were fixups)\n", needed_to_fix  );
+            if ( page_refs_ctx )
+                DPRINTF("(%lu sent as zero pages, %lu as duplicates)\n",
+                        total_zero, total_dup);
         }
 
         if ( last_iter && debug )
@@ -2111,6 +2240,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
 
+    xc_page_refs_free(xch, page_refs_ctx);
+    free(page_refs);
+    free(page_refs_src);
+
     if ( live_shinfo )
         munmap(live_shinfo, PAGE_SIZE);
 
@@ -0,0 +1,354 @@
+/******************************************************************************
+ * xc_page_refs.c
+ *
+ * Zero and duplicate page detection for the save stream.
+ * - Pages which are all zeroes are not sent at all: the receiver clears them.
+ * - While guest memory cannot change under us (the last iteration, or a
+ * save which isn't live), the pages sent are indexed by a hash of their
+ * contents. A page with the same contents as one sent before is then sent
+ * as a reference to that pfn, and the receiver copies it.
+ * - The index is a fixed size table with one entry per bucket, so it is
+ * lossy: a duplicate is only found while the earlier page is still there.
+ * - A hash match is never trusted: the two pages are always compared.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "xc_private.h"
+#include "xenguest.h"
+
+/* At most this many pages are indexed: 6MB of table. */
+#define MAX_ENTRIES (1UL << 18)
+
+#define HASH_PRIME 0x100000001b3ULL
+
+/* A candidate reference which turned out not to be a duplicate. */
+#define REF_DROPPED (~0U)
+
+struct page_entry {
+    uint64_t hash;
+    xen_pfn_t pfn;
+    uint32_t batch;   /* serial of the batch the page was sent in */
+    uint32_t index;   /* and its entry in that batch */
+};
+
+struct xc_page_refs {
+    struct page_entry *entries;
+    unsigned long mask;
+
+    /* Serial of the batch being encoded, and of the first one indexed. */
+    uint32_t batch, first_batch;
+    int dups;
+
+    /* Pages which may be duplicates of ones sent in earlier batches. */
+    unsigned int nr_cands, max_cands;
+    unsigned int *cand_ref;
+    xen_pfn_t *cand_pfn;
+    const void **cand_page;
+};
+
+static inline uint64_t rotl64(uint64_t x, unsigned int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/*
+ * Hash the page on four independent lanes, noting on the way whether it is
+ * all zeroes. Returns 0 for a zero page, and never otherwise.
+ */
+static uint64_t page_hash(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4, any = 0, h;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 4 )
+    {
+        any |= p[i] | p[i + 1] | p[i + 2] | p[i + 3];
+        h0 = rotl64((h0 ^ p[i]) * HASH_PRIME, 31);
+        h1 = rotl64((h1 ^ p[i + 1]) * HASH_PRIME, 31);
+        h2 = rotl64((h2 ^ p[i + 2]) * HASH_PRIME, 31);
+        h3 = rotl64((h3 ^ p[i + 3]) * HASH_PRIME, 31);
+    }
+    if ( !any )
+        return 0;
+
+    /* Fold the lanes, and finish as murmur3 does. */
+    h = h0 ^ rotl64(h1, 16) ^ rotl64(h2, 32) ^ rotl64(h3, 48);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h ? h : 1;
+}
+
+xc_page_refs_t *xc_page_refs_create(xc_interface *xch, unsigned long nr_pfns)
+{
+    xc_page_refs_t *pr;
+    unsigned long nr = 1;
+
+    while ( nr < nr_pfns && nr < MAX_ENTRIES )
+        nr <<= 1;
+
+    pr = calloc(1, sizeof(*pr));
+    if ( !pr )
+        goto error;
+    pr->entries = calloc(nr, sizeof(*pr->entries));
+    if ( !pr->entries )
+        goto error;
+    pr->mask = nr - 1;
+    pr->batch = pr->first_batch = 1;
+
+    return pr;
+
+ error:
+    ERROR("Failed to allocate the page index");
+    xc_page_refs_free(xch, pr);
+    return NULL;
+}
+
+void xc_page_refs_free(xc_interface *xch, xc_page_refs_t *pr)
+{
+    if ( !pr )
+        return;
+
+    free(pr->entries);
+    free(pr->cand_ref);
+    free(pr->cand_pfn);
+    free(pr->cand_page);
+    free(pr);
+}
+
+static void next_batch(xc_page_refs_t *pr)
+{
+    if ( ++pr->batch == 0 )
+    {
+        memset(pr->entries, 0, (pr->mask + 1) * sizeof(*pr->entries));
+        pr->batch = pr->first_batch = 1;
+    }
+}
+
+void xc_page_refs_reset(xc_interface *xch, xc_page_refs_t *pr, int dups)
+{
+    /* Every entry from an earlier batch is stale from now on. */
+    next_batch(pr);
+    pr->first_batch = pr->batch;
+    pr->dups = dups;
+}
+
+static int add_cand(xc_interface *xch, xc_page_refs_t *pr,
+                    unsigned int ref, xen_pfn_t pfn)
+{
+    unsigned int max;
+    void *p;
+
+    if ( pr->nr_cands == pr->max_cands )
+    {
+        max = pr->max_cands ? pr->max_cands * 2 : 64;
+        if ( !(p = realloc(pr->cand_ref, max * sizeof(*pr->cand_ref))) )
+            return -1;
+        pr->cand_ref = p;
+        if ( !(p = realloc(pr->cand_pfn, max * sizeof(*pr->cand_pfn))) )
+            return -1;
+        pr->cand_pfn = p;
+        if ( !(p = realloc(pr->cand_page, max * sizeof(*pr->cand_page))) )
+            return -1;
+        pr->cand_page = p;
+        pr->max_cands = max;
+    }
+
+    pr->cand_ref[pr->nr_cands] = ref;
+    pr->cand_pfn[pr->nr_cands] = pfn;
+    pr->nr_cands++;
+    return 0;
+}
+
+/*
+ * Compare the candidates with the pages they may duplicate, and drop the
+ * references for those which differ. Returns the new number of refs.
+ */
+static unsigned int confirm_cands(xc_page_refs_t *pr, const char *pages,
+                                  struct xc_page_ref *refs,
+                                  unsigned int nr_refs,
+                                  const struct xc_page_refs_sources *src)
+{
+    unsigned int i, j;
+    int mapped;
+
+    memset(pr->cand_page, 0, pr->nr_cands * sizeof(*pr->cand_page));
+    mapped = !src->map(src->data, pr->cand_pfn, pr->nr_cands, pr->cand_page);
+
+    for ( i = 0; i < pr->nr_cands; i++ )
+    {
+        struct xc_page_ref *ref = &refs[pr->cand_ref[i]];
+
+        if ( !mapped || !pr->cand_page[i] ||
+             memcmp(pr->cand_page[i], pages + ref->index * PAGE_SIZE,
+                    PAGE_SIZE) )
+            ref->type = REF_DROPPED;
+    }
+
+    if ( mapped && src->unmap )
+        src->unmap(src->data);
+
+    for ( i = j = 0; i < nr_refs; i++ )
+    {
+        if ( refs[i].type == REF_DROPPED )
+            continue;
+        refs[j++] = refs[i];
+    }
+    pr->nr_cands = 0;
+
+    return j;
+}
+
+int xc_page_refs_encode(xc_interface *xch, xc_page_refs_t *pr,
+                        const xen_pfn_t *pfn_type, unsigned int nr,
+                        const char *pages, struct xc_page_ref *refs,
+                        const struct xc_page_refs_sources *src)
+{
+    unsigned int i, nr_refs = 0;
+    struct page_entry *e;
+    const char *page;
+    xen_pfn_t pfn;
+    uint64_t hash;
+
+    next_batch(pr);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( (pfn_type[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+             XEN_DOMCTL_PFINFO_NOTAB )
+            continue;
+
+        pfn = pfn_type[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        page = pages + i * PAGE_SIZE;
+        hash = page_hash(page);
+        if ( !hash )
+        {
+            refs[nr_refs].index = i;
+            refs[nr_refs].type = XC_PAGE_REF_ZERO;
+            refs[nr_refs].source = 0;
+            nr_refs++;
+            continue;
+        }
+
+        if ( !pr->dups )
+            continue;
+
+        e = &pr->entries[hash & pr->mask];
+        if ( e->hash == hash && e->batch >= pr->first_batch )
+        {
+            if ( e->batch == pr->batch )
+            {
+                /* Earlier in this batch: we can check it here and now. */
+                if ( !memcmp(page, pages + e->index * PAGE_SIZE, PAGE_SIZE) )
+                {
+                    refs[nr_refs].index = i;
+                    refs[nr_refs].type = XC_PAGE_REF_BATCH;
+                    refs[nr_refs].source = e->index;
+                    nr_refs++;
+                    continue;
+                }
+            }
+            else if ( src && e->pfn != pfn &&
+                      !add_cand(xch, pr, nr_refs, e->pfn) )
+            {
+                refs[nr_refs].index = i;
+                refs[nr_refs].type = XC_PAGE_REF_PFN;
+                refs[nr_refs].source = e->pfn;
+                nr_refs++;
+                continue;
+            }
+        }
+
+        e->hash = hash;
+        e->pfn = pfn;
+        e->batch = pr->batch;
+        e->index = i;
+    }
+
+    if ( pr->nr_cands )
+        nr_refs = confirm_cands(pr, pages, refs, nr_refs, src);
+
+    return nr_refs;
+}
+
+int xc_page_refs_check(xc_interface *xch, const struct xc_page_ref *refs,
+                       unsigned int nr_refs, const unsigned long *pfn_type,
+                       unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_refs; i++ )
+    {
+        if ( refs[i].index >= nr || (i && refs[i].index <= refs[i - 1].index) )
+        {
+            ERROR("Page reference %u to entry %u out of order", i,
+                  refs[i].index);
+            goto inval;
+        }
+        if ( (pfn_type[refs[i].index] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+             XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            ERROR("Page reference to entry %u, which is not a data page",
+                  refs[i].index);
+            goto inval;
+        }
+
+        switch ( refs[i].type )
+        {
+        case XC_PAGE_REF_ZERO:
+        case XC_PAGE_REF_PFN:
+            break;
+        case XC_PAGE_REF_BATCH:
+            if ( refs[i].source >= refs[i].index ||
+                 (pfn_type[refs[i].source] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+                 XEN_DOMCTL_PFINFO_NOTAB )
+            {
+                ERROR("Page reference from entry %u to bad entry %"PRIu64,
+                      refs[i].index, refs[i].source);
+                goto inval;
+            }
+            break;
+        default:
+            ERROR("Unknown page reference type %u", refs[i].type);
+            goto inval;
+        }
+    }
+
+    return 0;
+
+ inval:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -206,8 +206,11 @@ static int xc_interface_close_common(xc_interface *xch)
     xtl_logger_destroy(xch->dombuild_logger_tofree);
     xtl_logger_destroy(xch->error_handler_tofree);
 
-    rc = xch->ops->close(xch, xch->ops_handle);
-    if (rc) PERROR("Could not close hypervisor interface");
+    /* A dummy handle has no hypervisor interface to close */
+    if (xch->ops) {
+        rc = xch->ops->close(xch, xch->ops_handle);
+        if (rc) PERROR("Could not close hypervisor interface");
+    }
 
     free(xch);
     return rc;
@@ -464,6 +464,21 @@ int xc_domain_dumpcore(xc_interface *xch,
                        uint32_t domid,
                        const char *corename);
 
+/*
+ * xc_domain_dumpcore_flags - as xc_domain_dumpcore, with these flags:
+ *  XC_DUMPCORE_SPARSE   - pages of zeroes are left as holes in the file
+ *  XC_DUMPCORE_COMPRESS - the file is gzip compressed, on nr_threads
+ *                         threads; gunzip gives back the plain dump
+ */
+#define XC_DUMPCORE_SPARSE   (1 << 0)
+#define XC_DUMPCORE_COMPRESS (1 << 1)
+
+int xc_domain_dumpcore_flags(xc_interface *xch,
+                             uint32_t domid,
+                             const char *corename,
+                             unsigned int flags,
+                             unsigned int nr_threads);
+
 /* Define the callback function type for xc_domain_dumpcore_via_callback.
  *
  * This function is called by the coredump code for every "write",
@@ -2321,6 +2336,17 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
 					unsigned long p2m_size);
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx);
 
+/**
+ * Compress pages on nr_threads threads from now on: the caller's and
+ * nr_threads - 1 more. The cache is split between them, and emptied, so
+ * every page is sent in full once more. nr_threads of 1 turns this off.
+ *
+ * returns 0 on success, -1 on failure (compression is then back to the
+ *  caller's thread alone).
+ */
+int xc_compression_set_threads(xc_interface *xch, comp_ctx *ctx,
+			       unsigned int nr_threads);
+
 /**
  * Add a page to compression page buffer, to be compressed later.
  *
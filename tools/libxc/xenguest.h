@@ -28,6 +28,9 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/* Send zero and duplicate pages as references: older receivers cannot
+ * restore such a stream */
+#define XCFLAGS_PAGE_REFS (1 << 5)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -137,6 +140,71 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
  */
 #define XC_DEVICE_MODEL_RESTORE_FILE "/var/lib/xen/qemu-resume"
 
+/**
+ * Zero and duplicate pages in the save stream (XCFLAGS_PAGE_REFS).
+ *
+ * A batch of pages may be preceded by a list of references, one for each
+ * page of the batch which is sent without its data. The list is sorted by
+ * index.
+ */
+#define XC_PAGE_REF_ZERO  0 /* all zeroes */
+#define XC_PAGE_REF_BATCH 1 /* same as entry 'source' of this batch */
+#define XC_PAGE_REF_PFN   2 /* same as pfn 'source', sent in an earlier batch */
+
+struct xc_page_ref {
+    uint32_t index;   /* entry in the batch */
+    uint32_t type;    /* XC_PAGE_REF_* */
+    uint64_t source;
+};
+
+/* Access to the pages an encoder may refer to, in earlier batches. */
+struct xc_page_refs_sources {
+    /*
+     * Map the pages of nr pfns, setting pages[i] to the contents of pfns[i]
+     * as sent, or leaving it NULL. Returns 0 on success, -1 if nothing
+     * was mapped.
+     */
+    int (*map)(void *data, const xen_pfn_t *pfns, unsigned int nr,
+               const void **pages);
+    /* Release what map() mapped. May be NULL. */
+    void (*unmap)(void *data);
+    void *data;
+};
+
+typedef struct xc_page_refs xc_page_refs_t;
+
+xc_page_refs_t *xc_page_refs_create(xc_interface *xch, unsigned long nr_pfns);
+void xc_page_refs_free(xc_interface *xch, xc_page_refs_t *pr);
+
+/**
+ * Forget the pages sent so far: called at the start of every iteration.
+ * Duplicates are only looked for if dups is non-zero, which is only safe
+ * while the guest cannot change the pages already sent.
+ */
+void xc_page_refs_reset(xc_interface *xch, xc_page_refs_t *pr, int dups);
+
+/**
+ * Find the pages of a batch which need not be sent. pfn_type[] holds the
+ * nr entries of the batch and pages their contents, PAGE_SIZE apart; only
+ * data pages (XEN_DOMCTL_PFINFO_NOTAB) are considered. src may be NULL, in
+ * which case pages are only found to duplicate ones in the same batch.
+ *
+ * returns the number of references stored in refs (up to nr).
+ */
+int xc_page_refs_encode(xc_interface *xch, xc_page_refs_t *pr,
+                        const xen_pfn_t *pfn_type, unsigned int nr,
+                        const char *pages, struct xc_page_ref *refs,
+                        const struct xc_page_refs_sources *src);
+
+/**
+ * Check a list of references received for a batch of nr entries.
+ *
+ * returns 0 if it is well formed, -1 (with errno EINVAL) if not.
+ */
+int xc_page_refs_check(xc_interface *xch, const struct xc_page_ref *refs,
+                       unsigned int nr_refs, const unsigned long *pfn_type,
+                       unsigned int nr);
+
 /**
  * This function will create a domain for a paravirtualized Linux
  * using file names pointing to kernel and ramdisk
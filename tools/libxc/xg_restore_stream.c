@@ -0,0 +1,745 @@
+/******************************************************************************
+ * xg_restore_stream.c
+ *
+ * Reading the body of a save image, ahead of the restore if need be.
+ *
+ * Copyright (c) 2003, K A Fraser.
+ * Copyright (c) 2006, Intel Corporation
+ * Copyright (c) 2007, XenSource Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#ifndef __MINIOS__
+#include <pthread.h>
+#endif
+
+#include "xg_private.h"
+#include "xg_save_restore.h"
+#include "xg_restore_stream.h"
+
+#define HEARTBEAT_MS 1000
+
+#ifndef __MINIOS__
+ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
+                int fd, void* buf, size_t size)
+{
+    size_t offset = 0;
+    ssize_t len;
+    struct timeval tv;
+    fd_set rfds;
+    int cancel;
+
+    while ( offset < size )
+    {
+        if ( ctx->completed ) {
+            /* expect a heartbeat every HEARBEAT_MS ms maximum */
+            tv.tv_sec = HEARTBEAT_MS / 1000;
+            tv.tv_usec = (HEARTBEAT_MS % 1000) * 1000;
+
+            FD_ZERO(&rfds);
+            FD_SET(fd, &rfds);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cancel);
+            len = select(fd + 1, &rfds, NULL, NULL, &tv);
+            pthread_setcancelstate(cancel, NULL);
+            if ( len == -1 && errno == EINTR )
+                continue;
+            if ( !FD_ISSET(fd, &rfds) ) {
+                ERROR("%s failed (select returned %zd)", __func__, len);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        /* The read ahead thread may only be cancelled while it waits. */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cancel);
+        len = read(fd, buf + offset, size - offset);
+        pthread_setcancelstate(cancel, NULL);
+        if ( (len == -1) && ((errno == EINTR) || (errno == EAGAIN)) )
+            continue;
+        if ( len == 0 ) {
+            ERROR("0-length read");
+            errno = 0;
+        }
+        if ( len <= 0 ) {
+            ERROR("%s failed (read rc: %d, errno: %d)", __func__, len, errno);
+            return -1;
+        }
+        offset += len;
+    }
+
+    return 0;
+}
+#endif
+
+int pagebuf_init(pagebuf_t* buf)
+{
+    memset(buf, 0, sizeof(*buf));
+    return 0;
+}
+
+void pagebuf_free(pagebuf_t* buf)
+{
+    if (buf->tdata.data != NULL) {
+        free(buf->tdata.data);
+        buf->tdata.data = NULL;
+    }
+    if (buf->pages) {
+        free(buf->pages);
+        buf->pages = NULL;
+    }
+    if(buf->pfn_types) {
+        free(buf->pfn_types);
+        buf->pfn_types = NULL;
+    }
+    if (buf->refs) {
+        free(buf->refs);
+        buf->refs = NULL;
+    }
+    buf->max_refs = 0;
+}
+
+/* Start filling the buffer from scratch. */
+void pagebuf_reset(pagebuf_t* buf)
+{
+    buf->nr_physpages = buf->nr_pages = 0;
+    buf->compbuf_pos = buf->compbuf_size = 0;
+    buf->nr_refs = buf->pending_refs = 0;
+    buf->next_physpage = 0;
+}
+
+int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
+                    pagebuf_t* buf, int fd, uint32_t dom)
+{
+    int count, countpages, oldcount, i;
+    void* ptmp;
+    unsigned long compbuf_size;
+
+    if ( RDEXACT(fd, &count, sizeof(count)) )
+    {
+        PERROR("Error when reading batch size");
+        return -1;
+    }
+
+    // DPRINTF("reading batch of %d pages\n", count);
+
+    switch ( count )
+    {
+    case 0:
+        // DPRINTF("Last batch read\n");
+        if ( buf->pending_refs )
+        {
+            ERROR("Page references without a batch of pages");
+            return -1;
+        }
+        return 0;
+
+    case XC_SAVE_ID_ENABLE_VERIFY_MODE:
+        DPRINTF("Entering page verify mode\n");
+        buf->verify = 1;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_VCPU_INFO:
+        buf->new_ctxt_format = 1;
+        if ( RDEXACT(fd, &buf->max_vcpu_id, sizeof(buf->max_vcpu_id)) ||
+             buf->max_vcpu_id >= XC_SR_MAX_VCPUS ||
+             RDEXACT(fd, buf->vcpumap, vcpumap_sz(buf->max_vcpu_id)) ) {
+            PERROR("Error when reading max_vcpu_id");
+            return -1;
+        }
+        // DPRINTF("Max VCPU ID: %d, vcpumap: %llx\n", buf->max_vcpu_id, buf->vcpumap[0]);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_IDENT_PT:
+        /* Skip padding 4 bytes then read the EPT identity PT location. */
+        if ( RDEXACT(fd, &buf->identpt, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->identpt, sizeof(uint64_t)) )
+        {
+            PERROR("error read the address of the EPT identity map");
+            return -1;
+        }
+        // DPRINTF("EPT identity map address: %llx\n", buf->identpt);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_PAGING_RING_PFN:
+        /* Skip padding 4 bytes then read the paging ring location. */
+        if ( RDEXACT(fd, &buf->paging_ring_pfn, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->paging_ring_pfn, sizeof(uint64_t)) )
+        {
+            PERROR("error read the paging ring pfn");
+            return -1;
+        }
+        // DPRINTF("paging ring pfn address: %llx\n", buf->paging_ring_pfn);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_ACCESS_RING_PFN:
+        /* Skip padding 4 bytes then read the mem access ring location. */
+        if ( RDEXACT(fd, &buf->access_ring_pfn, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->access_ring_pfn, sizeof(uint64_t)) )
+        {
+            PERROR("error read the access ring pfn");
+            return -1;
+        }
+        // DPRINTF("access ring pfn address: %llx\n", buf->access_ring_pfn);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_SHARING_RING_PFN:
+        /* Skip padding 4 bytes then read the sharing ring location. */
+        if ( RDEXACT(fd, &buf->sharing_ring_pfn, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->sharing_ring_pfn, sizeof(uint64_t)) )
+        {
+            PERROR("error read the sharing ring pfn");
+            return -1;
+        }
+        // DPRINTF("sharing ring pfn address: %llx\n", buf->sharing_ring_pfn);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_VM86_TSS:
+        /* Skip padding 4 bytes then read the vm86 TSS location. */
+        if ( RDEXACT(fd, &buf->vm86_tss, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->vm86_tss, sizeof(uint64_t)) )
+        {
+            PERROR("error read the address of the vm86 TSS");
+            return -1;
+        }
+        // DPRINTF("VM86 TSS location: %llx\n", buf->vm86_tss);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_TMEM:
+        DPRINTF("xc_domain_restore start tmem\n");
+        if ( xc_tmem_restore(xch, dom, fd) ) {
+            PERROR("error reading/restoring tmem");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_TMEM_EXTRA:
+        if ( xc_tmem_restore_extra(xch, dom, fd) ) {
+            PERROR("error reading/restoring tmem extra");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_TSC_INFO:
+    {
+        uint32_t tsc_mode, khz, incarn;
+        uint64_t nsec;
+        if ( RDEXACT(fd, &tsc_mode, sizeof(uint32_t)) ||
+             RDEXACT(fd, &nsec, sizeof(uint64_t)) ||
+             RDEXACT(fd, &khz, sizeof(uint32_t)) ||
+             RDEXACT(fd, &incarn, sizeof(uint32_t)) ||
+             xc_domain_set_tsc_info(xch, dom, tsc_mode, nsec, khz, incarn) ) {
+            PERROR("error reading/restoring tsc info");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
+    case XC_SAVE_ID_HVM_CONSOLE_PFN :
+        /* Skip padding 4 bytes then read the console pfn location. */
+        if ( RDEXACT(fd, &buf->console_pfn, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->console_pfn, sizeof(uint64_t)) )
+        {
+            PERROR("error read the address of the console pfn");
+            return -1;
+        }
+        // DPRINTF("console pfn location: %llx\n", buf->console_pfn);
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_LAST_CHECKPOINT:
+        ctx->last_checkpoint = 1;
+        // DPRINTF("last checkpoint indication received");
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_ACPI_IOPORTS_LOCATION:
+        /* Skip padding 4 bytes then read the acpi ioport location. */
+        if ( RDEXACT(fd, &buf->acpi_ioport_location, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->acpi_ioport_location, sizeof(uint64_t)) )
+        {
+            PERROR("error read the acpi ioport location");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_HVM_VIRIDIAN:
+        /* Skip padding 4 bytes then read the acpi ioport location. */
+        if ( RDEXACT(fd, &buf->viridian, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->viridian, sizeof(uint64_t)) )
+        {
+            PERROR("error read the viridian flag");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_TOOLSTACK:
+        {
+            if ( RDEXACT(fd, &buf->tdata.len, sizeof(buf->tdata.len)) )
+            {
+                PERROR("error read toolstack id size");
+                return -1;
+            }
+            buf->tdata.data = (uint8_t*) realloc(buf->tdata.data, buf->tdata.len);
+            if ( buf->tdata.data == NULL )
+            {
+                PERROR("error memory allocation");
+                return -1;
+            }
+            if ( RDEXACT(fd, buf->tdata.data, buf->tdata.len) )
+            {
+                PERROR("error read toolstack id");
+                return -1;
+            }
+            return pagebuf_get_one(xch, ctx, buf, fd, dom);
+        }
+
+    case XC_SAVE_ID_ENABLE_COMPRESSION:
+        /* We cannot set compression flag directly in pagebuf structure,
+         * since this pagebuf still has uncompressed pages that are yet to
+         * be applied. We enable the compression field in pagebuf structure
+         * after receiving the first tailbuf.
+         */
+        ctx->compressing = 1;
+        // DPRINTF("compression flag received");
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_COMPRESSED_DATA:
+
+        /* read the length of compressed chunk coming in */
+        if ( RDEXACT(fd, &compbuf_size, sizeof(unsigned long)) )
+        {
+            PERROR("Error when reading compbuf_size");
+            return -1;
+        }
+        if (!compbuf_size) return 1;
+
+        buf->compbuf_size += compbuf_size;
+        if (!(ptmp = realloc(buf->pages, buf->compbuf_size))) {
+            ERROR("Could not (re)allocate compression buffer");
+            return -1;
+        }
+        buf->pages = ptmp;
+
+        if ( RDEXACT(fd, buf->pages + (buf->compbuf_size - compbuf_size),
+                     compbuf_size) ) {
+            PERROR("Error when reading compression buffer");
+            return -1;
+        }
+        return compbuf_size;
+
+    case XC_SAVE_ID_PAGE_REFS:
+    {
+        unsigned int nr_refs;
+
+        if ( RDEXACT(fd, &nr_refs, sizeof(nr_refs)) )
+        {
+            PERROR("Error when reading number of page references");
+            return -1;
+        }
+        if ( buf->compressing || buf->pending_refs ||
+             nr_refs > MAX_BATCH_SIZE )
+        {
+            ERROR("Unexpected page references (%u)", nr_refs);
+            errno = EINVAL;
+            return -1;
+        }
+        if ( buf->nr_refs + nr_refs > buf->max_refs )
+        {
+            unsigned int max = buf->nr_refs + MAX_BATCH_SIZE;
+
+            if ( !(ptmp = realloc(buf->refs, max * sizeof(*buf->refs))) )
+            {
+                ERROR("Could not (re)allocate page reference buffer");
+                return -1;
+            }
+            buf->refs = ptmp;
+            buf->max_refs = max;
+        }
+        if ( RDEXACT(fd, buf->refs + buf->nr_refs,
+                     nr_refs * sizeof(*buf->refs)) )
+        {
+            PERROR("Error when reading page references");
+            return -1;
+        }
+        buf->pending_refs = nr_refs;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+    }
+
+    case XC_SAVE_ID_HVM_GENERATION_ID_ADDR:
+        /* Skip padding 4 bytes then read the generation id buffer location. */
+        if ( RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint32_t)) ||
+             RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint64_t)) )
+        {
+            PERROR("error read the generation id buffer location");
+            return -1;
+        }
+        DPRINTF("read generation id buffer address");
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    default:
+        if ( (count > MAX_BATCH_SIZE) || (count < 0) ) {
+            ERROR("Max batch size exceeded (%d). Giving up.", count);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        break;
+    }
+
+    oldcount = buf->nr_pages;
+    buf->nr_pages += count;
+    if (!buf->pfn_types) {
+        if (!(buf->pfn_types = malloc(buf->nr_pages * sizeof(*(buf->pfn_types))))) {
+            ERROR("Could not allocate PFN type buffer");
+            return -1;
+        }
+    } else {
+        if (!(ptmp = realloc(buf->pfn_types, buf->nr_pages * sizeof(*(buf->pfn_types))))) {
+            ERROR("Could not reallocate PFN type buffer");
+            return -1;
+        }
+        buf->pfn_types = ptmp;
+    }
+    if ( RDEXACT(fd, buf->pfn_types + oldcount, count * sizeof(*(buf->pfn_types)))) {
+        PERROR("Error when reading region pfn types");
+        return -1;
+    }
+
+    countpages = count;
+    for (i = oldcount; i < buf->nr_pages; ++i)
+    {
+        unsigned long pagetype;
+
+        pagetype = buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
+             pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
+             pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            --countpages;
+    }
+
+    /* Pages sent as references have no data to follow. */
+    if ( buf->pending_refs )
+    {
+        struct xc_page_ref *ref = buf->refs + buf->nr_refs;
+
+        if ( xc_page_refs_check(xch, ref, buf->pending_refs,
+                                buf->pfn_types + oldcount, count) )
+            return -1;
+        for ( i = 0; i < buf->pending_refs; i++, ref++ )
+        {
+            ref->index += oldcount;
+            if ( ref->type == XC_PAGE_REF_BATCH )
+                ref->source += oldcount;
+        }
+        countpages -= buf->pending_refs;
+        buf->nr_refs += buf->pending_refs;
+        buf->pending_refs = 0;
+    }
+
+    if (!countpages)
+        return count;
+
+    /* If Remus Checkpoint Compression is turned on, we will only be
+     * receiving the pfn lists now. The compressed pages will come in later,
+     * following a <XC_SAVE_ID_COMPRESSED_DATA, compressedChunkSize> tuple.
+     */
+    if (buf->compressing)
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    oldcount = buf->nr_physpages;
+    buf->nr_physpages += countpages;
+    if (!buf->pages) {
+        if (!(buf->pages = malloc(buf->nr_physpages * PAGE_SIZE))) {
+            ERROR("Could not allocate page buffer");
+            return -1;
+        }
+    } else {
+        if (!(ptmp = realloc(buf->pages, buf->nr_physpages * PAGE_SIZE))) {
+            ERROR("Could not reallocate page buffer");
+            return -1;
+        }
+        buf->pages = ptmp;
+    }
+    if ( RDEXACT(fd, buf->pages + oldcount * PAGE_SIZE, countpages * PAGE_SIZE) ) {
+        PERROR("Error when reading pages");
+        return -1;
+    }
+
+    return count;
+}
+
+int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
+                pagebuf_t* buf, int fd, uint32_t dom)
+{
+    int rc;
+
+    pagebuf_reset(buf);
+
+    do {
+        rc = pagebuf_get_one(xch, ctx, buf, fd, dom);
+    } while (rc > 0);
+
+    if (rc < 0)
+        pagebuf_free(buf);
+
+    return rc;
+}
+
+/* Batches read ahead: one being applied, and two more coming in. */
+#define RESTORE_PIPE_SLOTS 3
+
+struct restore_pipe {
+    xc_interface *xch;
+    struct restore_ctx *ctx;
+    pagebuf_t *buf;     /* stream state: the reader's until it finishes */
+    int fd;
+    uint32_t dom;
+
+    /* Batches [head, tail) have been read, the one at head is next. */
+    pagebuf_t slots[RESTORE_PIPE_SLOTS];
+    unsigned int head, tail;
+
+    /* Set when the reader is done, with what pagebuf_get_one() said. */
+    int finished, rc, err;
+
+#ifndef __MINIOS__
+    int threaded, stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled, emptied;
+#endif
+};
+
+/* Hand the batch in buf over to slot, giving buf the slot's buffers. */
+static void pipe_fill(pagebuf_t *slot, pagebuf_t *buf)
+{
+    void *pages = slot->pages;
+    unsigned long *pfn_types = slot->pfn_types;
+    struct xc_page_ref *refs = slot->refs;
+    unsigned int max_refs = slot->max_refs;
+
+    slot->pages = buf->pages;
+    slot->nr_physpages = buf->nr_physpages;
+    slot->nr_pages = buf->nr_pages;
+    slot->pfn_types = buf->pfn_types;
+    slot->refs = buf->refs;
+    slot->nr_refs = buf->nr_refs;
+    slot->max_refs = buf->max_refs;
+    slot->next_physpage = 0;
+    slot->compressing = buf->compressing;
+    slot->compbuf_pos = buf->compbuf_pos;
+    slot->compbuf_size = buf->compbuf_size;
+    slot->verify = buf->verify;
+
+    buf->pages = pages;
+    buf->pfn_types = pfn_types;
+    buf->refs = refs;
+    buf->max_refs = max_refs;
+    pagebuf_reset(buf);
+}
+
+static int pipe_read(struct restore_pipe *pipe, pagebuf_t *slot)
+{
+    int rc;
+
+    pagebuf_reset(pipe->buf);
+    rc = pagebuf_get_one(pipe->xch, pipe->ctx, pipe->buf, pipe->fd,
+                         pipe->dom);
+    if ( rc > 0 )
+        pipe_fill(slot, pipe->buf);
+
+    return rc;
+}
+
+#ifndef __MINIOS__
+static void *pipe_thread(void *arg)
+{
+    struct restore_pipe *pipe = arg;
+    pagebuf_t *slot;
+    int rc;
+
+    /* Only a wait for the stream may be cancelled: see rdexact(). */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&pipe->lock);
+    for ( ; ; )
+    {
+        while ( pipe->tail - pipe->head == RESTORE_PIPE_SLOTS && !pipe->stop )
+            pthread_cond_wait(&pipe->emptied, &pipe->lock);
+        if ( pipe->stop )
+            break;
+        slot = &pipe->slots[pipe->tail % RESTORE_PIPE_SLOTS];
+        pthread_mutex_unlock(&pipe->lock);
+
+        rc = pipe_read(pipe, slot);
+
+        pthread_mutex_lock(&pipe->lock);
+        if ( rc > 0 )
+            pipe->tail++;
+        else
+        {
+            pipe->finished = 1;
+            pipe->rc = rc;
+            pipe->err = errno;
+        }
+        pthread_cond_signal(&pipe->filled);
+        if ( pipe->finished )
+            break;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+#endif
+
+struct restore_pipe *restore_pipe_start(xc_interface *xch,
+                                        struct restore_ctx *ctx,
+                                        pagebuf_t* buf, int fd, uint32_t dom,
+                                        int threaded)
+{
+    struct restore_pipe *pipe;
+    int i;
+
+    pipe = calloc(1, sizeof(*pipe));
+    if ( !pipe )
+    {
+        ERROR("Could not allocate the restore pipe");
+        return NULL;
+    }
+    pipe->xch = xch;
+    pipe->ctx = ctx;
+    pipe->buf = buf;
+    pipe->fd = fd;
+    pipe->dom = dom;
+    for ( i = 0; i < RESTORE_PIPE_SLOTS; i++ )
+        pagebuf_init(&pipe->slots[i]);
+
+#ifndef __MINIOS__
+    if ( !threaded )
+        return pipe;
+
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->filled, NULL);
+    pthread_cond_init(&pipe->emptied, NULL);
+    if ( pthread_create(&pipe->thread, NULL, pipe_thread, pipe) )
+    {
+        DPRINTF("Could not start the read ahead thread, reading in line\n");
+        pthread_cond_destroy(&pipe->emptied);
+        pthread_cond_destroy(&pipe->filled);
+        pthread_mutex_destroy(&pipe->lock);
+        return pipe;
+    }
+    pipe->threaded = 1;
+#endif
+
+    return pipe;
+}
+
+int restore_pipe_next(struct restore_pipe *pipe, pagebuf_t **batch)
+{
+    int rc;
+
+#ifndef __MINIOS__
+    if ( pipe->threaded )
+    {
+        pthread_mutex_lock(&pipe->lock);
+        while ( pipe->head == pipe->tail && !pipe->finished )
+            pthread_cond_wait(&pipe->filled, &pipe->lock);
+        if ( pipe->head != pipe->tail )
+        {
+            *batch = &pipe->slots[pipe->head % RESTORE_PIPE_SLOTS];
+            rc = 1;
+        }
+        else
+        {
+            rc = pipe->rc;
+            errno = pipe->err;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        return rc;
+    }
+#endif
+
+    if ( pipe->finished )
+        return pipe->rc;
+
+    rc = pipe_read(pipe, &pipe->slots[0]);
+    if ( rc <= 0 )
+    {
+        pipe->finished = 1;
+        pipe->rc = rc;
+        return rc;
+    }
+
+    *batch = &pipe->slots[0];
+    return 1;
+}
+
+void restore_pipe_done(struct restore_pipe *pipe, pagebuf_t *batch)
+{
+    pagebuf_reset(batch);
+
+#ifndef __MINIOS__
+    if ( pipe->threaded )
+    {
+        pthread_mutex_lock(&pipe->lock);
+        pipe->head++;
+        pthread_cond_signal(&pipe->emptied);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+#endif
+}
+
+void restore_pipe_stop(struct restore_pipe *pipe)
+{
+    int i;
+
+    if ( !pipe )
+        return;
+
+#ifndef __MINIOS__
+    if ( pipe->threaded )
+    {
+        pthread_mutex_lock(&pipe->lock);
+        pipe->stop = 1;
+        pthread_cond_signal(&pipe->emptied);
+        /* It may be waiting on a stream which has nothing more to give. */
+        if ( !pipe->finished )
+            pthread_cancel(pipe->thread);
+        pthread_mutex_unlock(&pipe->lock);
+
+        pthread_join(pipe->thread, NULL);
+        pthread_cond_destroy(&pipe->emptied);
+        pthread_cond_destroy(&pipe->filled);
+        pthread_mutex_destroy(&pipe->lock);
+    }
+#endif
+
+    for ( i = 0; i < RESTORE_PIPE_SLOTS; i++ )
+        pagebuf_free(&pipe->slots[i]);
+    free(pipe);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,147 @@
+/*
+ * Reading the body of a save image, for xc_domain_restore().
+ *
+ * The stream is parsed into a pagebuf_t, one batch of pages at a time,
+ * by pagebuf_get_one(). None of it needs the hypervisor except the few
+ * chunks which are handed straight to it (tmem, TSC info), so it can be
+ * driven from a saved file on its own.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef XG_RESTORE_STREAM_H
+#define XG_RESTORE_STREAM_H
+
+/* Needs xg_private.h and xg_save_restore.h. */
+
+struct restore_ctx {
+    unsigned long max_mfn; /* max mfn of the current host machine */
+    unsigned long hvirt_start; /* virtual starting address of the hypervisor */
+    unsigned int pt_levels; /* #levels of page tables used by the current guest */
+    unsigned long nr_pfns; /* number of 'in use' pfns in the guest (i.e. #P2M entries with a valid mfn) */
+    xen_pfn_t *live_p2m; /* Live mapping of the table mapping each PFN to its current MFN. */
+    xen_pfn_t *p2m; /* A table mapping each PFN to its new MFN. */
+    xen_pfn_t *p2m_batch; /* A table of P2M mappings in the current region.  */
+    xen_pfn_t *p2m_saved_batch; /* Copy of p2m_batch array for pv superpage alloc */
+    int superpages; /* Superpage allocation has been requested */
+    int hvm;    /* This is an hvm domain */
+    int completed; /* Set when a consistent image is available */
+    int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
+    int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    struct domain_info_context dinfo;
+};
+
+#ifndef __MINIOS__
+ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
+                int fd, void* buf, size_t size);
+#define RDEXACT(fd,buf,size) rdexact(xch, ctx, fd, buf, size)
+#else
+#define RDEXACT read_exact
+#endif
+
+struct toolstack_data_t {
+    uint8_t *data;
+    uint32_t len;
+};
+
+typedef struct {
+    void* pages;
+    /* pages is of length nr_physpages, pfn_types is of length nr_pages */
+    unsigned int nr_physpages, nr_pages;
+
+    /* checkpoint compression state */
+    int compressing;
+    unsigned long compbuf_pos, compbuf_size;
+
+    /* Types of the pfns in the current region */
+    unsigned long* pfn_types;
+
+    /* Pages sent without data (XC_SAVE_ID_PAGE_REFS), by index into
+     * pfn_types; pending_refs more were read for the batch to come. */
+    struct xc_page_ref *refs;
+    unsigned int nr_refs, max_refs, pending_refs;
+
+    /* Index into pages of the data of the next batch to apply */
+    unsigned int next_physpage;
+
+    int verify;
+
+    int new_ctxt_format;
+    int max_vcpu_id;
+    uint64_t vcpumap[XC_SR_MAX_VCPUS/64];
+    uint64_t identpt;
+    uint64_t paging_ring_pfn;
+    uint64_t access_ring_pfn;
+    uint64_t sharing_ring_pfn;
+    uint64_t vm86_tss;
+    uint64_t console_pfn;
+    uint64_t acpi_ioport_location;
+    uint64_t viridian;
+    uint64_t vm_generationid_addr;
+
+    struct toolstack_data_t tdata;
+} pagebuf_t;
+
+int pagebuf_init(pagebuf_t* buf);
+void pagebuf_free(pagebuf_t* buf);
+void pagebuf_reset(pagebuf_t* buf);
+
+/*
+ * Read chunks up to and including the next batch of pages. Returns the
+ * number of entries in the batch (or the size of a compressed chunk), 0
+ * at the end of the body and -1 on error.
+ */
+int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
+                    pagebuf_t* buf, int fd, uint32_t dom);
+
+/* Read the whole of a checkpoint body. */
+int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
+                pagebuf_t* buf, int fd, uint32_t dom);
+
+/*
+ * Read ahead of the restore: a thread runs pagebuf_get_one() on buf, and
+ * hands the pages of each batch over in one of a few buffers, so that the
+ * next batches come in off the stream while one is being applied.
+ *
+ * restore_pipe_next() returns the next batch in order (1), or 0 at the end
+ * of the body, or -1 if the stream failed. Once it has returned 0, buf
+ * has the rest of the state read from the body. A batch is given back
+ * with restore_pipe_done() before asking for the next one.
+ *
+ * Without threads (or with threaded == 0), restore_pipe_next() reads the
+ * batch itself.
+ */
+struct restore_pipe;
+
+struct restore_pipe *restore_pipe_start(xc_interface *xch,
+                                        struct restore_ctx *ctx,
+                                        pagebuf_t* buf, int fd, uint32_t dom,
+                                        int threaded);
+int restore_pipe_next(struct restore_pipe *pipe, pagebuf_t **batch);
+void restore_pipe_done(struct restore_pipe *pipe, pagebuf_t *batch);
+/* Stop reading, whether or not the end was reached, and free the pipe. */
+void restore_pipe_stop(struct restore_pipe *pipe);
+
+#endif /* XG_RESTORE_STREAM_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -87,6 +87,19 @@
  *
  * If chunk type is 0 then body phase is complete.
  *
+ * Zero and duplicate pages (only sent with XCFLAGS_PAGE_REFS):
+ *
+ *   A +ve chunk may be preceded by a chunk of type XC_SAVE_ID_PAGE_REFS:
+ *
+ *     unsigned int         : number of references
+ *     struct xc_page_ref[] : one for each page of the batch which has no
+ *                            page data, by ascending index into the batch
+ *
+ *   Each reference is for a data page (XEN_DOMCTL_PFINFO_NOTAB) which is
+ *   either all zeroes, a copy of an earlier page in the same batch, or a
+ *   copy of a pfn sent in an earlier batch of the same iteration (whose
+ *   contents the receiver has not changed since). See xenguest.h.
+ *
  *
  * BODY PHASE - Format B (for Remus with compression)
  * ----------
@@ -259,6 +272,7 @@
 #define XC_SAVE_ID_HVM_ACCESS_RING_PFN  -16
 #define XC_SAVE_ID_HVM_SHARING_RING_PFN -17
 #define XC_SAVE_ID_TOOLSTACK          -18 /* Optional toolstack specific info */
+#define XC_SAVE_ID_PAGE_REFS          -19 /* Pages of the next batch sent without data */
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
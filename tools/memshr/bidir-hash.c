@@ -42,6 +42,10 @@ static const float hash_min_load_fact = 0.10;
 #define BUCKETS_PER_LOCK    64
 #define nr_locks(_nr_buckets)   (1 + (_nr_buckets) / BUCKETS_PER_LOCK)
 
+/* Buckets split (or merged) by a single insert (or remove), at least. */
+/* Resizes which fall behind the load take a share of the gap as well. */
+#define RESIZE_STEPS        8
+
 
 #define HASH_LOCK                                                              \
     pthread_rwlock_t hash_lock
@@ -49,6 +53,9 @@ static const float hash_min_load_fact = 0.10;
 #define BUCKET_LOCK                                                            \
     pthread_rwlock_t bucket_lock
 
+#define RESIZE_LOCK                                                            \
+    pthread_mutex_t resize_lock
+
 struct hash_entry
 {
     __k_t key;
@@ -68,22 +75,40 @@ struct bucket_lock
     BUCKET_LOCK;
 };
 
+/*
+ * The tables grow and shrink by linear hashing: a table of size buckets
+ * is split one bucket at a time, each split moving some of the entries of
+ * bucket (size - level) to the new bucket size, where level is the
+ * largest (base_size << n) not above size. Only the locks of those two
+ * buckets are held while a bucket is split or merged back, so lookups
+ * elsewhere carry on. The bucket arrays are allocated at max_size and
+ * never move.
+ *
+ * The size of each table changes under the lock of the bucket being
+ * split or merged. A bucket index worked out with no locks held is
+ * checked again once its bucket is locked.
+ */
 struct __hash
 {
     int lock_alive;
     HASH_LOCK;                            /* protects:
-                                           * *_tab, tab_size, size_idx, *_load
-                                           * (all writes with wrlock)
+                                           * *_tab (writes with wrlock)
+                                           */
+    RESIZE_LOCK;                          /* protects:
+                                           * *_size, *_load (writes)
                                            */
     uint32_t nr_ent;                      /* # entries held in hashtables */
     struct bucket *key_tab;               /* forward mapping hashtable    */
     struct bucket *value_tab;             /* backward mapping hashtable   */
     struct bucket_lock *key_lock_tab;     /* key table bucket locks       */
     struct bucket_lock *value_lock_tab;   /* value table bucket locks     */
-    uint32_t tab_size;                    /* # buckets is hashtables      */
-    uint16_t size_idx;                    /* table size index             */
-    uint32_t max_load;                    /* # entries before rehash      */
-    uint32_t min_load;                    /* # entries before rehash      */
+    uint32_t key_size;                    /* # buckets in key table       */
+    uint32_t value_size;                  /* # buckets in value table     */
+    uint32_t base_size;                   /* # buckets at level 0         */
+    uint32_t max_size;                    /* # buckets allocated          */
+    uint32_t max_load;                    /* # entries before split       */
+    uint32_t min_load;                    /* # entries before merge       */
+    uint32_t resize_pending;              /* a resize found the lock held */
 };
 
 struct __hash *__hash_init   (struct __hash *h, uint32_t min_size);
@@ -183,6 +208,9 @@ static inline void atomic_dec(uint32_t *v)
 
 #ifdef BIDIR_USE_STDMALLOC
 
+/* Tables never move, so they are allocated at the largest size */
+#define STDMALLOC_MAX_BUCKETS   (1U << 22)
+
 static void* alloc_entry(struct __hash *h, int size)
 {
     return malloc(size);
@@ -218,12 +246,17 @@ static int max_entries(struct __hash *h)
     return -1;
 }
 
+static uint32_t max_buckets(struct __hash *h)
+{
+    return STDMALLOC_MAX_BUCKETS;
+}
+
 #else
 
 /*****************************************************************************/
 /** Memory allocator for shared memory region **/
 /*****************************************************************************/
-#define SHM_TABLE_SLOTS 4
+#define SHM_TABLE_SLOTS 2
 
 struct shm_hdr
 {
@@ -364,9 +397,10 @@ static unsigned long shm_init_offsets(
     hdr->max_tab_size =
         (nr_entries * 3 / 2) * sizeof(struct bucket);
     hdr->max_lock_tab_size =
-        nr_locks(hdr->max_tab_size) * sizeof(struct bucket_lock);
+        nr_locks(nr_entries * 3 / 2) * sizeof(struct bucket_lock);
 
-    return hdr->tabs_offset + (hdr->max_tab_size + hdr->max_lock_tab_size) * 4;
+    return hdr->tabs_offset +
+        (hdr->max_tab_size + hdr->max_lock_tab_size) * SHM_TABLE_SLOTS;
 }
 
 struct __hash* __shm_hash_init(unsigned long shm_baddr, unsigned long shm_size)
@@ -487,6 +521,13 @@ static int max_entries(struct __hash *h)
     return hdr->nr_entries;
 }
 
+static uint32_t max_buckets(struct __hash *h)
+{
+    struct shm_hdr *hdr = get_shm_hdr(h);
+
+    return hdr->max_tab_size / sizeof(struct bucket);
+}
+
 #endif /* !BIDIR_USE_STDMALLOC */
 
 
@@ -564,6 +605,39 @@ static int max_entries(struct __hash *h)
     pthread_rwlock_unlock(&(_h)->hash_lock)
 
 
+#define RESIZE_LOCK_INIT(_h) ({                                                \
+    int _ret;                                                                  \
+    pthread_mutexattr_t _attr;                                                 \
+                                                                               \
+    _ret = pthread_mutexattr_init(&_attr);                                     \
+    if(_ret == 0)                                                              \
+        _ret = pthread_mutexattr_setpshared(&_attr, PTHREAD_PROCESS_SHARED);   \
+    if(_ret == 0)                                                              \
+        _ret = pthread_mutex_init(&(_h)->resize_lock, &_attr);                 \
+    if(_ret == 0)                                                              \
+        _ret = pthread_mutexattr_destroy(&_attr);                              \
+                                                                               \
+    _ret;                                                                      \
+})
+
+#define RESIZE_LOCK_LOCK(_h) ({                                                \
+    int _ret;                                                                  \
+    struct timespec _ts;                                                       \
+                                                                               \
+    _ts.tv_sec = time(NULL) + 10;                                              \
+    _ts.tv_nsec = 0;                                                           \
+    _ret = pthread_mutex_timedlock(&(_h)->resize_lock, &_ts);                  \
+    if(_ret == ETIMEDOUT) (_h)->lock_alive = 0;                                \
+    _ret;                                                                      \
+})
+
+#define RESIZE_LOCK_TRYLOCK(_h)                                                \
+    pthread_mutex_trylock(&(_h)->resize_lock)
+
+#define RESIZE_LOCK_UNLOCK(_h)                                                 \
+    pthread_mutex_unlock(&(_h)->resize_lock)
+
+
 #define BUCKET_LOCK_INIT(_h, _b) ({                                            \
     int _ret;                                                                  \
     pthread_rwlockattr_t _attr;                                                \
@@ -661,9 +735,79 @@ static int max_entries(struct __hash *h)
 
 
 
-static uint32_t hash_to_idx(struct __hash *h, uint32_t hash)
+/* Sizes are read with no locks held, and checked again under the locks */
+#define read_size(_s)   (*(volatile uint32_t *)&(_s))
+
+/* Largest (base_size << n) not above size: the buckets from size - level */
+/* to level - 1 are the next to be split.                                 */
+static uint32_t size_to_level(struct __hash *h, uint32_t size)
+{
+    return h->base_size << (31 - __builtin_clz(size / h->base_size));
+}
+
+static uint32_t hash_to_idx(struct __hash *h, uint32_t size, uint32_t hash)
+{
+    uint32_t level = size_to_level(h, size);
+    uint32_t idx = hash % (2 * level);
+
+    /* Bucket not split yet */
+    if(idx >= size)
+        idx -= level;
+
+    return idx;
+}
+
+/* Read lock the bucket with the given hash, returning its index in *idxp */
+static int bucket_rdlock(struct __hash *h,
+                         struct bucket_lock *blt,
+                         uint32_t *sizep,
+                         uint32_t hash,
+                         uint32_t *idxp)
+{
+    uint32_t idx;
+
+    for(;;)
+    {
+        idx = hash_to_idx(h, read_size(*sizep), hash);
+        if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
+        if(hash_to_idx(h, read_size(*sizep), hash) == idx)
+            break;
+        /* The bucket got split or merged in the meantime, try again */
+        BUCKET_LOCK_RDUNLOCK(h, blt, idx);
+    }
+    *idxp = idx;
+
+    return 0;
+}
+
+/* Write lock a bucket in each table, as above */
+static int two_buckets_wrlock(struct __hash *h,
+                              struct bucket_lock *blt1,
+                              uint32_t *sizep1,
+                              uint32_t hash1,
+                              uint32_t *idxp1,
+                              struct bucket_lock *blt2,
+                              uint32_t *sizep2,
+                              uint32_t hash2,
+                              uint32_t *idxp2)
 {
-    return (hash % h->tab_size);
+    uint32_t idx1, idx2;
+
+    for(;;)
+    {
+        idx1 = hash_to_idx(h, read_size(*sizep1), hash1);
+        idx2 = hash_to_idx(h, read_size(*sizep2), hash2);
+        if(TWO_BUCKETS_LOCK_WRLOCK(h, blt1, idx1, blt2, idx2) != 0)
+            return -ENOLCK;
+        if((hash_to_idx(h, read_size(*sizep1), hash1) == idx1) &&
+           (hash_to_idx(h, read_size(*sizep2), hash2) == idx2))
+            break;
+        TWO_BUCKETS_LOCK_WRUNLOCK(h, blt1, idx1, blt2, idx2);
+    }
+    *idxp1 = idx1;
+    *idxp2 = idx2;
+
+    return 0;
 }
 
 static void alloc_tab(struct __hash *h,
@@ -690,10 +834,20 @@ error_out:
     return;
 }
 
+/* Needs the resize lock */
+static void update_loads(struct __hash *h)
+{
+    uint32_t size = h->key_size;
+
+    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
+    h->min_load = (size > h->base_size ?
+                        (uint32_t)(hash_min_load_fact * size) : 0);
+}
+
 
 struct __hash *__hash_init(struct __hash *h, uint32_t min_size)
 {
-    uint32_t size;
+    uint32_t size, max_size;
     uint16_t size_idx;
     struct bucket *buckets;
     struct bucket_lock *bucket_locks;
@@ -707,21 +861,27 @@ struct __hash *__hash_init(struct __hash *h, uint32_t min_size)
     size = hash_sizes[size_idx];
 
     if(!h) return NULL;
-    alloc_tab(h, size, &buckets, &bucket_locks);
+    /* Tables are allocated at their largest, and grow in place */
+    max_size = max_buckets(h);
+    if(max_size < size || max_size > (1U << 31)) return NULL;
+    alloc_tab(h, max_size, &buckets, &bucket_locks);
     if(!buckets || !bucket_locks) goto alloc_fail;
     h->key_tab         = L2C(h, buckets);
     h->key_lock_tab    = L2C(h, bucket_locks);
-    alloc_tab(h, size, &buckets, &bucket_locks);
+    alloc_tab(h, max_size, &buckets, &bucket_locks);
     if(!buckets || !bucket_locks) goto alloc_fail;
     h->value_tab       = L2C(h, buckets);
     h->value_lock_tab  = L2C(h, bucket_locks);
     /* Init all h variables */
     if(HASH_LOCK_INIT(h) != 0) goto alloc_fail;
+    if(RESIZE_LOCK_INIT(h) != 0) goto alloc_fail;
     h->nr_ent = 0;
-    h->tab_size = size;
-    h->size_idx = size_idx;
-    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
-    h->min_load = (uint32_t)ceilf(hash_min_load_fact * size);
+    h->key_size = size;
+    h->value_size = size;
+    h->base_size = size;
+    h->max_size = max_size;
+    h->resize_pending = 0;
+    update_loads(h);
 
     return h;
 
@@ -735,6 +895,7 @@ alloc_fail:
 #undef __prim_t
 #undef __prim_tab
 #undef __prim_lock_tab
+#undef __prim_size
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -745,6 +906,7 @@ alloc_fail:
 #define __prim_t         __k_t
 #define __prim_tab         key_tab
 #define __prim_lock_tab    key_lock_tab
+#define __prim_size        key_size
 #define __prim_hash      __key_hash
 #define __prim_cmp       __key_cmp
 #define __prim_next        key_next
@@ -758,10 +920,10 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
     uint32_t idx;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    idx = hash_to_idx(h, __prim_hash(k));
-    b = C2L(h, &h->__prim_tab[idx]);
     blt = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
+    if(bucket_rdlock(h, blt, &h->__prim_size, __prim_hash(k), &idx) != 0)
+        return -ENOLCK;
+    b = C2L(h, &h->__prim_tab[idx]);
     entry = b->hash_entry;
     while(entry != NULL)
     {
@@ -786,6 +948,7 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
 #undef __prim_t
 #undef __prim_tab
 #undef __prim_lock_tab
+#undef __prim_size
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -796,6 +959,7 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
 #define __prim_t         __v_t
 #define __prim_tab         value_tab
 #define __prim_lock_tab    value_lock_tab
+#define __prim_size        value_size
 #define __prim_hash      __value_hash
 #define __prim_cmp       __value_cmp
 #define __prim_next        value_next
@@ -809,10 +973,10 @@ int __value_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
     uint32_t idx;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    idx = hash_to_idx(h, __prim_hash(k));
-    b = C2L(h, &h->__prim_tab[idx]);
     blt = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
+    if(bucket_rdlock(h, blt, &h->__prim_size, __prim_hash(k), &idx) != 0)
+        return -ENOLCK;
+    b = C2L(h, &h->__prim_tab[idx]);
     entry = b->hash_entry;
     while(entry != NULL)
     {
@@ -845,30 +1009,19 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
     if(!entry) return 0;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    /* Read from nr_ent is atomic(TODO check), no need for fancy accessors */
-    if(h->nr_ent+1 > h->max_load)
-    {
-        /* Resize needs the write lock, drop read lock temporarily */
-        HASH_LOCK_RDUNLOCK(h);
-        hash_resize(h);
-        if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    }
 
     /* Init the entry */
     entry->key = k;
     entry->value = v;
 
-    /* Work out the indicies */
-    k_idx = hash_to_idx(h, __key_hash(k));
-    v_idx = hash_to_idx(h, __value_hash(v));
-
     /* Insert */
-    bk   = C2L(h, &h->key_tab[k_idx]);
-    bv   = C2L(h, &h->value_tab[v_idx]);
     bltk = C2L(h, h->key_lock_tab);
     bltv = C2L(h, h->value_lock_tab);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, k_idx, bltv, v_idx) != 0)
+    if(two_buckets_wrlock(h, bltk, &h->key_size, __key_hash(k), &k_idx,
+                             bltv, &h->value_size, __value_hash(v), &v_idx) != 0)
         return -ENOLCK;
+    bk   = C2L(h, &h->key_tab[k_idx]);
+    bv   = C2L(h, &h->value_tab[v_idx]);
     entry->key_next = bk->hash_entry;
     bk->hash_entry = L2C(h, entry);
     entry->value_next = bv->hash_entry;
@@ -878,6 +1031,10 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
     /* Book keeping */
     atomic_inc(&h->nr_ent);
 
+    /* Read from nr_ent is atomic(TODO check), no need for fancy accessors */
+    if(h->nr_ent > h->max_load)
+        hash_resize(h);
+
     HASH_LOCK_RDUNLOCK(h);
 
     return 1;
@@ -888,6 +1045,7 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
 #undef __prim_t
 #undef __prim_tab
 #undef __prim_lock_tab
+#undef __prim_size
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -895,6 +1053,7 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
 #undef __sec_t
 #undef __sec_tab
 #undef __sec_lock_tab
+#undef __sec_size
 #undef __sec_hash
 #undef __sec_next
 
@@ -902,6 +1061,7 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
 #define __prim_t         __k_t
 #define __prim_tab         key_tab
 #define __prim_lock_tab    key_lock_tab
+#define __prim_size        key_size
 #define __prim_hash      __key_hash
 #define __prim_cmp       __key_cmp
 #define __prim_next        key_next
@@ -909,6 +1069,7 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
 #define __sec_t          __v_t
 #define __sec_tab          value_tab
 #define __sec_lock_tab     value_lock_tab
+#define __sec_size         value_size
 #define __sec_hash       __value_hash
 #define __sec_next         value_next
 
@@ -917,17 +1078,17 @@ int __key_remove(struct __hash *h, __prim_t k, __sec_t *vp)
     struct hash_entry *e, *es, **pek, **pev;
     struct bucket *bk, *bv;
     struct bucket_lock *bltk, *bltv;
-    uint32_t old_kidx, kidx, vidx, min_load, nr_ent;
+    uint32_t kidx, vidx;
     __prim_t ks;
     __sec_t vs;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
 
 again:
-    old_kidx = kidx = hash_to_idx(h, __prim_hash(k));
-    bk = C2L(h, &h->__prim_tab[kidx]);
     bltk = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, bltk, kidx) != 0) return -ENOLCK;
+    if(bucket_rdlock(h, bltk, &h->__prim_size, __prim_hash(k), &kidx) != 0)
+        return -ENOLCK;
+    bk = C2L(h, &h->__prim_tab[kidx]);
     pek = &(bk->hash_entry);
     e = *pek;
     while(e != NULL)
@@ -953,17 +1114,15 @@ found:
     es = e;
     ks = e->__prim;
     vs = e->__sec;
-    kidx = hash_to_idx(h, __prim_hash(ks));
-    /* Being paranoid: check if kidx has not changed, so that we unlock the
-     * right bucket */
-    assert(old_kidx == kidx);
-    vidx = hash_to_idx(h, __sec_hash(vs));
+    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
+    /* The entry may have moved bucket while unlocked, indices are worked
+     * out again */
+    bltv = C2L(h, h->__sec_lock_tab);
+    if(two_buckets_wrlock(h, bltk, &h->__prim_size, __prim_hash(ks), &kidx,
+                             bltv, &h->__sec_size, __sec_hash(vs), &vidx) != 0)
+        return -ENOLCK;
     bk   = C2L(h, &h->__prim_tab[kidx]);
     bv   = C2L(h, &h->__sec_tab[vidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    bltv = C2L(h, h->__sec_lock_tab);
-    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, kidx, bltv, vidx) != 0) return -ENOLCK;
     pek = &(bk->hash_entry);
     pev = &(bv->hash_entry);
 
@@ -1011,15 +1170,13 @@ found_again:
             *pev = e->__sec_next;
 
             atomic_dec(&h->nr_ent);
-            nr_ent = h->nr_ent;
-            /* read min_load still under the hash lock! */
-            min_load = h->min_load;
 
             TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-            HASH_LOCK_RDUNLOCK(h);
 
-            if(nr_ent < min_load)
+            if(h->nr_ent < h->min_load)
                 hash_resize(h);
+            HASH_LOCK_RDUNLOCK(h);
+
             if(vp != NULL)
                 *vp = e->__sec;
             free_entry(h, e);
@@ -1037,6 +1194,7 @@ found_again:
 #undef __prim_t
 #undef __prim_tab
 #undef __prim_lock_tab
+#undef __prim_size
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -1044,6 +1202,7 @@ found_again:
 #undef __sec_t
 #undef __sec_tab
 #undef __sec_lock_tab
+#undef __sec_size
 #undef __sec_hash
 #undef __sec_next
 
@@ -1051,6 +1210,7 @@ found_again:
 #define __prim_t         __v_t
 #define __prim_tab         value_tab
 #define __prim_lock_tab    value_lock_tab
+#define __prim_size        value_size
 #define __prim_hash      __value_hash
 #define __prim_cmp       __value_cmp
 #define __prim_next        value_next
@@ -1058,6 +1218,7 @@ found_again:
 #define __sec_t          __k_t
 #define __sec_tab          key_tab
 #define __sec_lock_tab     key_lock_tab
+#define __sec_size         key_size
 #define __sec_hash       __key_hash
 #define __sec_next         key_next
 
@@ -1066,17 +1227,17 @@ int __value_remove(struct __hash *h, __prim_t k, __sec_t *vp)
     struct hash_entry *e, *es, **pek, **pev;
     struct bucket *bk, *bv;
     struct bucket_lock *bltk, *bltv;
-    uint32_t old_kidx, kidx, vidx, min_load, nr_ent;
+    uint32_t kidx, vidx;
     __prim_t ks;
     __sec_t vs;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
 
 again:
-    old_kidx = kidx = hash_to_idx(h, __prim_hash(k));
-    bk = C2L(h, &h->__prim_tab[kidx]);
     bltk = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, bltk, kidx) != 0) return -ENOLCK;
+    if(bucket_rdlock(h, bltk, &h->__prim_size, __prim_hash(k), &kidx) != 0)
+        return -ENOLCK;
+    bk = C2L(h, &h->__prim_tab[kidx]);
     pek = &(bk->hash_entry);
     e = *pek;
     while(e != NULL)
@@ -1102,17 +1263,15 @@ found:
     es = e;
     ks = e->__prim;
     vs = e->__sec;
-    kidx = hash_to_idx(h, __prim_hash(ks));
-    /* Being paranoid: check if kidx has not changed, so that we unlock the
-     * right bucket */
-    assert(old_kidx == kidx);
-    vidx = hash_to_idx(h, __sec_hash(vs));
+    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
+    /* The entry may have moved bucket while unlocked, indices are worked
+     * out again */
+    bltv = C2L(h, h->__sec_lock_tab);
+    if(two_buckets_wrlock(h, bltk, &h->__prim_size, __prim_hash(ks), &kidx,
+                             bltv, &h->__sec_size, __sec_hash(vs), &vidx) != 0)
+        return -ENOLCK;
     bk   = C2L(h, &h->__prim_tab[kidx]);
     bv   = C2L(h, &h->__sec_tab[vidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    bltv = C2L(h, h->__sec_lock_tab);
-    BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, kidx, bltv, vidx) != 0) return -ENOLCK;
     pek = &(bk->hash_entry);
     pev = &(bv->hash_entry);
 
@@ -1160,15 +1319,13 @@ found_again:
             *pev = e->__sec_next;
 
             atomic_dec(&h->nr_ent);
-            nr_ent = h->nr_ent;
-            /* read min_load still under the hash lock! */
-            min_load = h->min_load;
 
             TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-            HASH_LOCK_RDUNLOCK(h);
 
-            if(nr_ent < min_load)
+            if(h->nr_ent < h->min_load)
                 hash_resize(h);
+            HASH_LOCK_RDUNLOCK(h);
+
             if(vp != NULL)
                 *vp = e->__sec;
             free_entry(h, e);
@@ -1194,7 +1351,7 @@ int __hash_destroy(struct __hash *h,
     if(HASH_LOCK_WRLOCK(h) != 0) return -ENOLCK;
 
     /* No need to lock individual buckets, with hash write lock  */
-    for(i=0; i < h->tab_size; i++)
+    for(i=0; i < h->key_size; i++)
     {
         b = C2L(h, &h->key_tab[i]);
         e = b->hash_entry;
@@ -1217,91 +1374,170 @@ int __hash_destroy(struct __hash *h,
     return 0;
 }
 
-static void hash_resize(struct __hash *h)
+/* Where the next pointer and hash of an entry are, in either table */
+static struct hash_entry **entry_next(struct hash_entry *e, int key)
 {
-    int new_size_idx, i, lock_ret;
-    uint32_t size, old_size, kidx, vidx;
-    struct bucket *t1, *t2, *b;
-    struct bucket_lock *l1, *l2;
-    struct hash_entry *e, *n;
+    return (key ? &e->key_next : &e->value_next);
+}
+
+static uint32_t entry_hash(struct hash_entry *e, int key)
+{
+    return (key ? __key_hash(e->key) : __value_hash(e->value));
+}
+
+/* Lock the two buckets of a split or merge, which may share a lock */
+static int split_lock(struct __hash *h,
+                      struct bucket_lock *blt, uint32_t s, uint32_t t)
+{
+    if(s / BUCKETS_PER_LOCK == t / BUCKETS_PER_LOCK)
+        return BUCKET_LOCK_WRLOCK(h, blt, s);
+    return TWO_BUCKETS_LOCK_WRLOCK(h, blt, s, blt, t);
+}
+
+static void split_unlock(struct __hash *h,
+                         struct bucket_lock *blt, uint32_t s, uint32_t t)
+{
+    if(s / BUCKETS_PER_LOCK == t / BUCKETS_PER_LOCK)
+        BUCKET_LOCK_WRUNLOCK(h, blt, s);
+    else
+        TWO_BUCKETS_LOCK_WRUNLOCK(h, blt, s, blt, t);
+}
+
+/* Add a bucket to a table, moving the entries which hash to it from the */
+/* bucket it splits. Needs the resize lock.                              */
+static int tab_split(struct __hash *h, int key)
+{
+    struct bucket *tab;
+    struct bucket_lock *blt;
+    struct hash_entry *e, *n, **pe, **pn;
+    uint32_t *sizep, size, s, t;
+
+    tab   = C2L(h, key ? h->key_tab : h->value_tab);
+    blt   = C2L(h, key ? h->key_lock_tab : h->value_lock_tab);
+    sizep = (key ? &h->key_size : &h->value_size);
 
-    /* We may fail to allocate the lock, if the resize is triggered while
-       we are iterating (under read lock) */
-    lock_ret = HASH_LOCK_TRYWRLOCK(h);
-    if(lock_ret != 0) return;
-
-    new_size_idx = h->size_idx;
-    /* Work out the new size */
-    if(h->nr_ent >= h->max_load)
-        new_size_idx = h->size_idx+1;
-    if(h->nr_ent < h->min_load)
-        new_size_idx = h->size_idx-1;
-    if((new_size_idx == h->size_idx) ||
-       (new_size_idx >= hash_sizes_len) ||
-       (new_size_idx < 0))
+    size = *sizep;
+    if(size >= h->max_size) return -ENOSPC;
+    s = size - size_to_level(h, size);
+    t = size;
+    if(split_lock(h, blt, s, t) != 0) return -ENOLCK;
+
+    pe = &tab[s].hash_entry;
+    e = *pe;
+    while(e != NULL)
     {
-        HASH_LOCK_WRUNLOCK(h);
-        return;
+        e = C2L(h, e);
+        pn = entry_next(e, key);
+        n = *pn;
+        if(hash_to_idx(h, size + 1, entry_hash(e, key)) == t)
+        {
+            *pe = n;
+            *pn = tab[t].hash_entry;
+            tab[t].hash_entry = L2C(h, e);
+        }
+        else
+            pe = pn;
+        e = n;
     }
+    /* Lookups which worked out the old index will look again */
+    *sizep = size + 1;
 
-    size = hash_sizes[new_size_idx];
+    split_unlock(h, blt, s, t);
 
-    /* Allocate the new sizes */
-    t1 = t2 = NULL;
-    l1 = l2 = NULL;
-    alloc_tab(h, size, &t1, &l1);
-    if(!t1 || !l1) goto alloc_fail;
-    alloc_tab(h, size, &t2, &l2);
-    if(!t2 || !l2) goto alloc_fail;
+    return 0;
+}
 
-    old_size = h->tab_size;
-    h->tab_size = size;
-    h->size_idx = new_size_idx;
-    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
-    h->min_load = (uint32_t)ceilf(hash_min_load_fact * size);
+/* Undo the last split of a table. Needs the resize lock. */
+static int tab_merge(struct __hash *h, int key)
+{
+    struct bucket *tab;
+    struct bucket_lock *blt;
+    struct hash_entry *e, **pe;
+    uint32_t *sizep, size, s, t;
+
+    tab   = C2L(h, key ? h->key_tab : h->value_tab);
+    blt   = C2L(h, key ? h->key_lock_tab : h->value_lock_tab);
+    sizep = (key ? &h->key_size : &h->value_size);
+
+    size = *sizep;
+    if(size <= h->base_size) return -EINVAL;
+    t = size - 1;
+    s = t - size_to_level(h, t);
+    if(split_lock(h, blt, s, t) != 0) return -ENOLCK;
+
+    pe = &tab[s].hash_entry;
+    while((e = *pe) != NULL)
+        pe = entry_next(C2L(h, e), key);
+    *pe = tab[t].hash_entry;
+    tab[t].hash_entry = NULL;
+    *sizep = t;
+
+    split_unlock(h, blt, s, t);
+
+    return 0;
+}
+
+/* How many buckets the tables are away from a size the load is fine at */
+static uint32_t resize_deficit(struct __hash *h)
+{
+    uint32_t nr_ent = h->nr_ent, size = h->key_size, target;
 
-    /* Move the entries */
-    for(i=0; i < old_size; i++)
+    if(nr_ent > h->max_load)
     {
-        b = C2L(h, &h->key_tab[i]);
-        e = b->hash_entry;
-        while(e != NULL)
+        target = (uint32_t)(nr_ent / hash_max_load_fact);
+        if(target > h->max_size) target = h->max_size;
+        return (target > size ? target - size : 0);
+    }
+    if(nr_ent < h->min_load)
+    {
+        target = (uint32_t)(nr_ent / hash_min_load_fact);
+        if(target < h->base_size) target = h->base_size;
+        return (size > target ? size - target : 0);
+    }
+    return 0;
+}
+
+/* Split or merge a few buckets of each table, if the load calls for it. */
+/* Called under the hash read lock, with no bucket locks held.           */
+static void hash_resize(struct __hash *h)
+{
+    uint32_t i, steps;
+
+    /* Whoever holds the resize lock looks at the load again once done */
+    h->resize_pending = 1;
+    __sync_synchronize();
+
+again:
+    /* Somebody else is resizing, or iterating */
+    if(RESIZE_LOCK_TRYLOCK(h) != 0) return;
+    h->resize_pending = 0;
+    __sync_synchronize();
+
+    /* A remove needs ~10 merges to keep up: 8 alone would fall behind */
+    steps = RESIZE_STEPS + resize_deficit(h) / RESIZE_STEPS;
+    for(i=0; i < steps; i++)
+    {
+        if((h->nr_ent > h->max_load) && (h->key_size < h->max_size))
         {
-            e = C2L(h, e);
-            n = e->key_next;
-            kidx =hash_to_idx(h, __key_hash(e->key));
-            vidx =hash_to_idx(h, __value_hash(e->value));
-            /* Move to the correct bucket */
-            e->key_next = t1[kidx].hash_entry;
-            t1[kidx].hash_entry = L2C(h, e);
-            e->value_next = t2[vidx].hash_entry;
-            t2[vidx].hash_entry = L2C(h, e);
-            e = n;
+            if((tab_split(h, 1) != 0) || (tab_split(h, 0) != 0))
+                break;
         }
+        else
+        if((h->nr_ent < h->min_load) && (h->key_size > h->base_size))
+        {
+            if((tab_merge(h, 1) != 0) || (tab_merge(h, 0) != 0))
+                break;
+        }
+        else
+            break;
+        update_loads(h);
     }
-    free_buckets(h, C2L(h, h->key_tab), C2L(h, h->key_lock_tab));
-    free_buckets(h, C2L(h, h->value_tab), C2L(h, h->value_lock_tab));
-    h->key_tab         = L2C(h, t1);
-    h->key_lock_tab    = L2C(h, l1);
-    h->value_tab       = L2C(h, t2);
-    h->value_lock_tab  = L2C(h, l2);
-
-    HASH_LOCK_WRUNLOCK(h);
 
-    return;
+    RESIZE_LOCK_UNLOCK(h);
 
-alloc_fail:
-    /* If we failed to resize, adjust max/min load. This will stop us from
-     * retrying resize too frequently */ 
-    if(new_size_idx > h->size_idx)
-        h->max_load = (h->max_load + 2 * h->tab_size) / 2 + 1;
-    else 
-    if (new_size_idx < h->size_idx)
-        h->min_load = h->min_load / 2;
-    HASH_LOCK_WRUNLOCK(h);
-    if(t1 || l1) free_buckets(h, t1, l1);
-    if(t2 || l2) free_buckets(h, t2, l2);
-    return;
+    /* Resizes skipped while we held the lock are ours to do */
+    __sync_synchronize();
+    if(h->resize_pending) goto again;
 }
 
 int __hash_iterator(struct __hash *h,
@@ -1314,8 +1550,10 @@ int __hash_iterator(struct __hash *h,
     int i, brk_early;
 
     if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
+    /* No entries may move from one bucket to another while iterating */
+    if(RESIZE_LOCK_LOCK(h) != 0) return -ENOLCK;
 
-    for(i=0; i < h->tab_size; i++)
+    for(i=0; i < h->key_size; i++)
     {
         b = C2L(h, &h->key_tab[i]);
         blt = C2L(h, h->key_lock_tab);
@@ -1336,6 +1574,10 @@ int __hash_iterator(struct __hash *h,
         BUCKET_LOCK_RDUNLOCK(h, blt, i);
     }
 out:
+    RESIZE_LOCK_UNLOCK(h);
+    /* Inserts and removes meanwhile couldn't resize */
+    __sync_synchronize();
+    if(h->resize_pending) hash_resize(h);
     HASH_LOCK_RDUNLOCK(h);
     return 0;
 }
@@ -1349,7 +1591,7 @@ void __hash_sizes(struct __hash *h,
 {
     if(nr_ent     != NULL) *nr_ent     = h->nr_ent;
     if(max_nr_ent != NULL) *max_nr_ent = max_entries(h); 
-    if(tab_size   != NULL) *tab_size   = h->tab_size;
+    if(tab_size   != NULL) *tab_size   = h->key_size;
     if(max_load   != NULL) *max_load   = h->max_load;
     if(min_load   != NULL) *min_load   = h->min_load;
 }
@@ -297,6 +297,44 @@ fsimage_getbootstring(PyObject *o, PyObject *args)
 	return Py_BuildValue("s", bootstring);
 }
 
+static PyObject *
+fsimage_read_disk(PyObject *o, PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = { "name", "size", "offset", NULL };
+	char *name;
+	int size;
+	uint64_t offset = 0;
+	ssize_t bytesread;
+	fsi_disk_t *disk;
+	PyObject *buffer;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|L", kwlist,
+	    &name, &size, &offset))
+		return (NULL);
+
+	if ((buffer = PyString_FromStringAndSize(NULL, size)) == NULL)
+		return (NULL);
+
+	if ((disk = fsi_open_disk(name)) == NULL) {
+		Py_DECREF(buffer);
+		PyErr_SetFromErrno(PyExc_IOError);
+		return (NULL);
+	}
+
+	bytesread = fsi_pread_disk(disk, PyString_AS_STRING(buffer), size,
+	    offset);
+	fsi_close_disk(disk);
+
+	if (bytesread == -1) {
+		Py_DECREF(buffer);
+		PyErr_SetFromErrno(PyExc_IOError);
+		return (NULL);
+	}
+
+	_PyString_Resize(&buffer, bytesread);
+	return (buffer);
+}
+
 PyDoc_STRVAR(fsimage_open__doc__,
     "open(name, [offset=off]) - Open the given file as a filesystem image.\n"
     "\n"
@@ -308,11 +346,17 @@ PyDoc_STRVAR(fsimage_getbootstring__doc__,
     "getbootstring(fs) - Return the boot string needed for this file system "
     "or NULL if none is needed.\n");
 
+PyDoc_STRVAR(fsimage_read_disk__doc__,
+    "read_disk(name, size, [offset=off]) - Read size bytes of the disk "
+    "in the given image, which may be a VHD chain, from offset.\n");
+
 static struct PyMethodDef fsimage_module_methods[] = {
 	{ "open", (PyCFunction)fsimage_open,
 	    METH_VARARGS|METH_KEYWORDS, fsimage_open__doc__ },
 	{ "getbootstring", (PyCFunction)fsimage_getbootstring,
 	    METH_VARARGS, fsimage_getbootstring__doc__ },
+	{ "read_disk", (PyCFunction)fsimage_read_disk,
+	    METH_VARARGS|METH_KEYWORDS, fsimage_read_disk__doc__ },
 	{ NULL, NULL, 0, NULL }
 };
 
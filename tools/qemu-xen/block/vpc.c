@@ -33,8 +33,10 @@
 /**************************************************************/
 
 #define HEADER_SIZE 512
+#define DYNDISK_HEADER_SIZE 1024
 
-//#define CACHE
+// Number of block bitmaps kept in memory
+#define BITMAP_CACHE_SIZE 16
 
 enum vhd_type {
     VHD_FIXED           = 2,
@@ -45,6 +47,11 @@ enum vhd_type {
 // Seconds since Jan 1, 2000 0:00:00 (UTC)
 #define VHD_TIMESTAMP_BASE 946684800
 
+// Parent locator platform codes
+#define PLAT_CODE_W2RU  0x57327275 // Windows relative path (UTF-16)
+#define PLAT_CODE_W2KU  0x57326B75 // Windows absolute path (UTF-16)
+#define PLAT_CODE_MACX  0x4D616358 // File URL (UTF-8)
+
 // always big-endian
 struct vhd_footer {
     char        creator[8]; // "conectix"
@@ -113,6 +120,12 @@ struct vhd_dyndisk_header {
     } parent_locator[8];
 };
 
+typedef struct VPCBitmap {
+    uint32_t index; // BAT index, 0xFFFFFFFF if the slot is unused
+    uint64_t lru;
+    uint8_t *map;
+} VPCBitmap;
+
 typedef struct BDRVVPCState {
     CoMutex lock;
     uint8_t footer_buf[HEADER_SIZE];
@@ -120,18 +133,16 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
 
+    uint32_t disk_type;
     uint32_t block_size;
     uint32_t bitmap_size;
 
-#ifdef CACHE
-    uint8_t *pageentry_u8;
-    uint32_t *pageentry_u32;
-    uint16_t *pageentry_u16;
+    // Early blktap images store the bitmap as little-endian 32bit words
+    bool old_bitmap_format;
 
-    uint64_t last_bitmap;
-#endif
+    VPCBitmap bitmap_cache[BITMAP_CACHE_SIZE];
+    uint64_t bitmap_lru;
 
     Error *migration_blocker;
 } BDRVVPCState;
@@ -155,13 +166,154 @@ static int vpc_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+/*
+ * Decodes a UTF-16 parent name into a path. Like libvhd, only ASCII names
+ * are supported; backslashes become slashes and a drive letter is dropped.
+ *
+ * Returns 0 on success and -EINVAL if the name can't be decoded.
+ */
+static int vpc_decode_utf16(const uint8_t *in, int len, bool big_endian,
+                            char *out, int out_size)
+{
+    char *p = out;
+    uint16_t c;
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        c = big_endian ? (in[i] << 8) | in[i + 1] : in[i] | (in[i + 1] << 8);
+        if (c == 0) {
+            break;
+        }
+        if (c > 0x7f || p - out >= out_size - 1) {
+            return -EINVAL;
+        }
+        *p++ = (c == '\\') ? '/' : c;
+    }
+    *p = '\0';
+
+    if ((out[0] == 'c' || out[0] == 'C') && out[1] == ':') {
+        memmove(out, out + 2, strlen(out + 2) + 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Decodes a MacX parent locator, which is a "file://" URL in UTF-8.
+ *
+ * Returns 0 on success and -EINVAL if the locator can't be decoded.
+ */
+static int vpc_decode_macx(const uint8_t *in, int len, char *out,
+                           int out_size)
+{
+    if (len >= out_size) {
+        return -EINVAL;
+    }
+
+    memcpy(out, in, len);
+    out[len] = '\0';
+
+    if (strncmp(out, "file://", 7)) {
+        return -EINVAL;
+    }
+    memmove(out, out + 7, strlen(out + 7) + 1);
+
+    return 0;
+}
+
+/*
+ * Returns true if the parent name refers to a readable file, resolving
+ * relative names against the directory of the child.
+ */
+static bool vpc_parent_exists(BlockDriverState *bs, const char *name)
+{
+    char path[PATH_MAX];
+
+    path_combine(path, sizeof(path), bs->filename, name);
+    return !access(path, R_OK);
+}
+
+/*
+ * Looks up the parent of a differencing disk the same way libvhd does: the
+ * parent locators are tried in order and the first one naming an existing
+ * file is used. The unicode name in the header is the last resort. If no
+ * candidate exists, the first one is kept so that opening it reports a
+ * sensible error.
+ *
+ * The block layer opens bs->backing_file once vpc_open returns.
+ */
+static int vpc_find_parent(BlockDriverState *bs,
+                           struct vhd_dyndisk_header *dyndisk_header)
+{
+    char name[sizeof(bs->backing_file)];
+    uint32_t code, len;
+    uint64_t offset;
+    uint8_t *buf;
+    int i, ret;
+
+    bs->backing_file[0] = '\0';
+
+    for (i = 0; i < 8; i++) {
+        code = be32_to_cpu(dyndisk_header->parent_locator[i].platform);
+        len = be32_to_cpu(dyndisk_header->parent_locator[i].data_length);
+        offset = be64_to_cpu(dyndisk_header->parent_locator[i].data_offset);
+
+        if (code != PLAT_CODE_MACX && code != PLAT_CODE_W2KU &&
+            code != PLAT_CODE_W2RU) {
+            continue;
+        }
+        if (len == 0 || len > 2 * sizeof(name)) {
+            continue;
+        }
+
+        buf = g_malloc(len);
+        ret = bdrv_pread(bs->file, offset, buf, len);
+        if (ret >= 0) {
+            if (code == PLAT_CODE_MACX) {
+                ret = vpc_decode_macx(buf, len, name, sizeof(name));
+            } else {
+                ret = vpc_decode_utf16(buf, len, false, name, sizeof(name));
+            }
+        }
+        g_free(buf);
+
+        if (ret < 0 || !name[0]) {
+            continue;
+        }
+
+        if (vpc_parent_exists(bs, name)) {
+            pstrcpy(bs->backing_file, sizeof(bs->backing_file), name);
+            goto out;
+        }
+        if (!bs->backing_file[0]) {
+            pstrcpy(bs->backing_file, sizeof(bs->backing_file), name);
+        }
+    }
+
+    ret = vpc_decode_utf16(dyndisk_header->parent_name,
+                           sizeof(dyndisk_header->parent_name), true,
+                           name, sizeof(name));
+    if (ret == 0 && name[0] &&
+        (vpc_parent_exists(bs, name) || !bs->backing_file[0])) {
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file), name);
+    }
+
+    if (!bs->backing_file[0]) {
+        return -EINVAL;
+    }
+
+out:
+    pstrcpy(bs->backing_format, sizeof(bs->backing_format), "vpc");
+    return 0;
+}
+
 static int vpc_open(BlockDriverState *bs, QDict *options, int flags)
 {
     BDRVVPCState *s = bs->opaque;
     int i;
     struct vhd_footer* footer;
     struct vhd_dyndisk_header* dyndisk_header;
-    uint8_t buf[HEADER_SIZE];
+    uint8_t buf[DYNDISK_HEADER_SIZE];
     uint32_t checksum;
     int disk_type = VHD_DYNAMIC;
     int ret;
@@ -210,15 +362,28 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags)
     bs->total_sectors = (int64_t)
         be16_to_cpu(footer->cyls) * footer->heads * footer->secs_per_cyl;
 
+    // blktap sizes its images by the footer; all disks of a chain must agree
+    if (!strncmp(footer->creator_app, "tap", 3)) {
+        bs->total_sectors = be64_to_cpu(footer->size) / BDRV_SECTOR_SIZE;
+        s->old_bitmap_format = be16_to_cpu(footer->major) == 0 &&
+            be16_to_cpu(footer->minor) == 1;
+    }
+
     /* Allow a maximum disk size of approximately 2 TB */
     if (bs->total_sectors >= 65535LL * 255 * 255) {
         ret = -EFBIG;
         goto fail;
     }
 
+    s->disk_type = disk_type;
+    if (disk_type == VHD_DYNAMIC &&
+        be32_to_cpu(footer->type) == VHD_DIFFERENCING) {
+        s->disk_type = VHD_DIFFERENCING;
+    }
+
     if (disk_type == VHD_DYNAMIC) {
         ret = bdrv_pread(bs->file, be64_to_cpu(footer->data_offset), buf,
-                         HEADER_SIZE);
+                         DYNDISK_HEADER_SIZE);
         if (ret < 0) {
             goto fail;
         }
@@ -259,14 +424,18 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags)
             }
         }
 
-        s->last_bitmap_offset = (int64_t) -1;
+        for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+            s->bitmap_cache[i].index = 0xFFFFFFFF;
+            s->bitmap_cache[i].lru = 0;
+            s->bitmap_cache[i].map = g_malloc(s->bitmap_size);
+        }
 
-#ifdef CACHE
-        s->pageentry_u8 = g_malloc(512);
-        s->pageentry_u32 = s->pageentry_u8;
-        s->pageentry_u16 = s->pageentry_u8;
-        s->last_pagetable = -1;
-#endif
+        if (s->disk_type == VHD_DIFFERENCING) {
+            ret = vpc_find_parent(bs, dyndisk_header);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
     }
 
     qemu_co_mutex_init(&s->lock);
@@ -281,9 +450,9 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags)
 
 fail:
     g_free(s->pagetable);
-#ifdef CACHE
-    g_free(s->pageentry_u8);
-#endif
+    for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+        g_free(s->bitmap_cache[i].map);
+    }
     return ret;
 }
 
@@ -295,13 +464,12 @@ static int vpc_reopen_prepare(BDRVReopenState *state,
 
 /*
  * Returns the absolute byte offset of the given sector in the image file.
- * If the sector is not allocated, -1 is returned instead.
- *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
+ * If the block containing the sector is not allocated, -1 is returned
+ * instead. Whether the sector itself is present is recorded in the block
+ * bitmap, see vpc_get_bitmap().
  */
 static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+    int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     uint64_t offset = sector_num * 512;
@@ -317,52 +485,130 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
     block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
+    return block_offset;
+}
 
-        s->last_bitmap_offset = bitmap_offset;
-        memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
+static inline bool vpc_bitmap_test(BDRVVPCState *s, const uint8_t *map,
+                                   uint32_t bit)
+{
+    if (s->old_bitmap_format) {
+        return (map[bit >> 3] >> (bit & 7)) & 1;
+    }
+    return (map[bit >> 3] << (bit & 7)) & 0x80;
+}
+
+static inline void vpc_bitmap_set(BDRVVPCState *s, uint8_t *map,
+                                  uint32_t bit)
+{
+    if (s->old_bitmap_format) {
+        map[bit >> 3] |= 1 << (bit & 7);
+    } else {
+        map[bit >> 3] |= 0x80 >> (bit & 7);
     }
+}
 
-//    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
-//	sector_num, pagetable_index, pageentry_index,
-//	bitmap_offset, block_offset);
+/*
+ * Returns the bitmap cache slot for the given block, or the least recently
+ * used slot if the block isn't cached. In the latter case *hit is false and
+ * the caller has to fill the slot.
+ */
+static VPCBitmap *vpc_bitmap_slot(BDRVVPCState *s, uint32_t index, bool *hit)
+{
+    VPCBitmap *bm, *victim = NULL;
+    int i;
 
-// disabled by reason
-#if 0
-#ifdef CACHE
-    if (bitmap_offset != s->last_bitmap)
-    {
-	lseek(s->fd, bitmap_offset, SEEK_SET);
+    for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+        bm = &s->bitmap_cache[i];
+        if (bm->index == index) {
+            victim = bm;
+            break;
+        }
+        if (!victim || bm->lru < victim->lru) {
+            victim = bm;
+        }
+    }
 
-	s->last_bitmap = bitmap_offset;
+    *hit = victim->index == index;
+    victim->lru = ++s->bitmap_lru;
+    return victim;
+}
 
-	// Scary! Bitmap is stored as big endian 32bit entries,
-	// while we used to look it up byte by byte
-	read(s->fd, s->pageentry_u8, 512);
-	for (i = 0; i < 128; i++)
-	    be32_to_cpus(&s->pageentry_u32[i]);
+/*
+ * Reads the sector bitmap of an allocated block through the bitmap cache.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int vpc_get_bitmap(BlockDriverState *bs, uint32_t index,
+                          uint8_t **map)
+{
+    BDRVVPCState *s = bs->opaque;
+    VPCBitmap *bm;
+    bool hit;
+    int ret;
+
+    bm = vpc_bitmap_slot(s, index, &hit);
+    if (!hit) {
+        bm->index = 0xFFFFFFFF;
+        ret = bdrv_pread(bs->file, 512 * (int64_t) s->pagetable[index],
+                         bm->map, s->bitmap_size);
+        if (ret < 0) {
+            return ret;
+        }
+        bm->index = index;
     }
 
-    if ((s->pageentry_u8[pageentry_index / 8] >> (pageentry_index % 8)) & 1)
-	return -1;
-#else
-    lseek(s->fd, bitmap_offset + (pageentry_index / 8), SEEK_SET);
+    *map = bm->map;
+    return 0;
+}
 
-    read(s->fd, &bitmap_entry, 1);
+/*
+ * Marks sectors of an allocated block as present and writes the changed
+ * part of its bitmap back. The data must already have been written.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int vpc_bitmap_update(BlockDriverState *bs, uint32_t index,
+                             uint32_t first, uint32_t count)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint32_t i, start, end;
+    uint8_t *map;
+    bool dirty = false;
+    int ret;
 
-    if ((bitmap_entry >> (pageentry_index % 8)) & 1)
-	return -1; // not allocated
-#endif
-#endif
+    ret = vpc_get_bitmap(bs, index, &map);
+    if (ret < 0) {
+        return ret;
+    }
 
-    return block_offset;
+    for (i = first; i < first + count; i++) {
+        if (!vpc_bitmap_test(s, map, i)) {
+            vpc_bitmap_set(s, map, i);
+            dirty = true;
+        }
+    }
+
+    if (!dirty) {
+        return 0;
+    }
+
+    start = (first / 8) & ~511;
+    end = (((first + count - 1) / 8) | 511) + 1;
+
+    ret = bdrv_pwrite_sync(bs->file,
+                           512 * (int64_t) s->pagetable[index] + start,
+                           map + start, end - start);
+    if (ret < 0) {
+        // The cached bitmap is ahead of the disk now
+        for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+            if (s->bitmap_cache[i].index == index) {
+                s->bitmap_cache[i].index = 0xFFFFFFFF;
+            }
+        }
+        return ret;
+    }
+
+    return 0;
 }
 
 /*
@@ -395,9 +641,11 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t bat_offset;
-    uint32_t index, bat_value;
+    uint32_t index, block, bat_value;
     int ret;
     uint8_t bitmap[s->bitmap_size];
+    VPCBitmap *bm;
+    bool hit;
 
     // Check if sector_num is valid
     if ((sector_num < 0) || (sector_num > bs->total_sectors))
@@ -408,10 +656,13 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
     if (s->pagetable[index] != 0xFFFFFFFF)
         return -1;
 
-    s->pagetable[index] = s->free_data_block_offset / 512;
+    block = s->free_data_block_offset / 512;
 
-    // Initialize the block's bitmap
-    memset(bitmap, 0xff, s->bitmap_size);
+    // Initialize the block's bitmap. Sectors of a differencing disk are
+    // marked present as they are written, the rest still comes from the
+    // parent.
+    memset(bitmap, s->disk_type == VHD_DIFFERENCING ? 0 : 0xff,
+           s->bitmap_size);
     ret = bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
         s->bitmap_size);
     if (ret < 0) {
@@ -426,32 +677,121 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
 
     // Write BAT entry to disk
     bat_offset = s->bat_offset + (4 * index);
-    bat_value = be32_to_cpu(s->pagetable[index]);
+    bat_value = be32_to_cpu(block);
     ret = bdrv_pwrite_sync(bs->file, bat_offset, &bat_value, 4);
     if (ret < 0)
         goto fail;
 
-    return get_sector_offset(bs, sector_num, 0);
+    bm = vpc_bitmap_slot(s, index, &hit);
+    memcpy(bm->map, bitmap, s->bitmap_size);
+    bm->index = index;
+
+    // Readers look up the in-memory BAT without taking the lock, so the
+    // entry is only published once the block's metadata is on disk
+    s->pagetable[index] = block;
+
+    return get_sector_offset(bs, sector_num);
 
 fail:
     s->free_data_block_offset -= (s->block_size + s->bitmap_size);
     return -1;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Looks up how many of the given sectors, all within one allocated block,
+ * share the present/absent state of the first one in the block bitmap.
+ *
+ * Returns the length of the run on success and < 0 on error
+ */
+static int vpc_bitmap_run(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, bool *present)
 {
     BDRVVPCState *s = bs->opaque;
+    uint32_t index, first;
+    uint8_t *map;
+    int n, ret;
+
+    index = (sector_num * 512) / s->block_size;
+    first = sector_num % (s->block_size >> BDRV_SECTOR_BITS);
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = vpc_get_bitmap(bs, index, &map);
+    if (ret < 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
+    *present = vpc_bitmap_test(s, map, first);
+    for (n = 1; n < nb_sectors; n++) {
+        if (vpc_bitmap_test(s, map, first + n) != *present) {
+            break;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+/*
+ * Reads sectors that are not present in the image: from the parent of a
+ * differencing disk, and as zeroes otherwise or beyond the end of the
+ * parent.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static coroutine_fn int vpc_read_unallocated(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    int64_t backing_sectors;
+    int n = 0;
     int ret;
+
+    if (bs->backing_hd) {
+        backing_sectors = bdrv_getlength(bs->backing_hd);
+        if (backing_sectors < 0) {
+            return backing_sectors;
+        }
+        backing_sectors >>= BDRV_SECTOR_BITS;
+
+        if (sector_num < backing_sectors) {
+            n = MIN(nb_sectors, backing_sectors - sector_num);
+            ret = bdrv_co_readv(bs->backing_hd, sector_num, n, qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    qemu_iovec_memset(qiov, n * BDRV_SECTOR_SIZE, 0,
+                      (nb_sectors - n) * BDRV_SECTOR_SIZE);
+    return 0;
+}
+
+/*
+ * Data is read and written without holding s->lock. The BAT is looked up
+ * lock-free, as an entry is only set once its block is fully initialised
+ * (see alloc_block), while block allocation and the bitmap cache are
+ * serialised by the lock.
+ */
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVVPCState *s = bs->opaque;
     int64_t offset;
     int64_t sectors, sectors_per_block;
-    struct vhd_footer *footer = (struct vhd_footer *) s->footer_buf;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    bool present;
+    int ret = 0;
 
-    if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_read(bs->file, sector_num, buf, nb_sectors);
+    if (s->disk_type == VHD_FIXED) {
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+        offset = get_sector_offset(bs, sector_num);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -459,48 +799,59 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
             sectors = nb_sectors;
         }
 
-        if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
-        } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+        present = false;
+        if (offset != -1) {
+            ret = vpc_bitmap_run(bs, sector_num, sectors, &present);
+            if (ret < 0) {
+                goto out;
             }
+            sectors = ret;
+        }
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+
+        if (present) {
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                sectors, &hd_qiov);
+        } else {
+            ret = vpc_read_unallocated(bs, sector_num, sectors, &hd_qiov);
+        }
+        if (ret < 0) {
+            goto out;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+out:
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
     int64_t sectors, sectors_per_block;
-    int ret;
-    struct vhd_footer *footer =  (struct vhd_footer *) s->footer_buf;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    int ret = 0;
 
-    if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_write(bs->file, sector_num, buf, nb_sectors);
+    if (s->disk_type == VHD_FIXED) {
+        return bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
+        offset = get_sector_offset(bs, sector_num);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -509,33 +860,96 @@ static int vpc_write(BlockDriverState *bs, int64_t sector_num,
         }
 
         if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+            // Another request may have allocated the block meanwhile
+            qemu_co_mutex_lock(&s->lock);
+            offset = get_sector_offset(bs, sector_num);
+            if (offset == -1) {
+                offset = alloc_block(bs, sector_num);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            if (offset < 0) {
+                ret = -EIO;
+                goto out;
+            }
+        }
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                             sectors, &hd_qiov);
+        if (ret < 0) {
+            goto out;
         }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        qemu_co_mutex_lock(&s->lock);
+        ret = vpc_bitmap_update(bs, sector_num / sectors_per_block,
+                                sector_num % sectors_per_block, sectors);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto out;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
+    ret = 0;
 
-    return 0;
+out:
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
+/*
+ * Reports whether sectors are present in this image, from the BAT and the
+ * block bitmaps. Absent sectors read as zeroes (dynamic disks) or from the
+ * parent (differencing disks).
+ */
+static int coroutine_fn vpc_co_is_allocated(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int *pnum)
 {
-    int ret;
     BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    int64_t sectors, sectors_per_block;
+    bool present, allocated = false;
+    int ret;
+
+    if (s->disk_type == VHD_FIXED) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    *pnum = 0;
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+
+    while (nb_sectors > 0) {
+        sectors = sectors_per_block - (sector_num % sectors_per_block);
+        if (sectors > nb_sectors) {
+            sectors = nb_sectors;
+        }
+
+        present = false;
+        if (get_sector_offset(bs, sector_num) != -1) {
+            ret = vpc_bitmap_run(bs, sector_num, sectors, &present);
+            if (ret < 0) {
+                return ret;
+            }
+            sectors = ret;
+        }
+
+        if (*pnum == 0) {
+            allocated = present;
+        } else if (present != allocated) {
+            break;
+        }
+
+        *pnum += sectors;
+        sector_num += sectors;
+        nb_sectors -= sectors;
+    }
+
+    return allocated;
 }
 
 /*
@@ -793,6 +1207,8 @@ static int vpc_has_zero_init(BlockDriverState *bs)
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
         return bdrv_has_zero_init(bs->file);
+    } else if (s->disk_type == VHD_DIFFERENCING) {
+        return 0;
     } else {
         return 1;
     }
@@ -801,10 +1217,12 @@ static int vpc_has_zero_init(BlockDriverState *bs)
 static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
+    int i;
+
     g_free(s->pagetable);
-#ifdef CACHE
-    g_free(s->pageentry_u8);
-#endif
+    for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+        g_free(s->bitmap_cache[i].map);
+    }
 
     migrate_del_blocker(s->migration_blocker);
     error_free(s->migration_blocker);
@@ -836,8 +1254,9 @@ static BlockDriver bdrv_vpc = {
     .bdrv_reopen_prepare    = vpc_reopen_prepare,
     .bdrv_create            = vpc_create,
 
-    .bdrv_read              = vpc_co_read,
-    .bdrv_write             = vpc_co_write,
+    .bdrv_co_readv          = vpc_co_readv,
+    .bdrv_co_writev         = vpc_co_writev,
+    .bdrv_co_is_allocated   = vpc_co_is_allocated,
 
     .create_options         = vpc_create_options,
     .bdrv_has_zero_init     = vpc_has_zero_init,
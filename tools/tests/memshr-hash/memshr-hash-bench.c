@@ -0,0 +1,338 @@
+/*
+ * memshr-hash-bench: stress the memshr fingerprint hash from several
+ * processes sharing it in memory, as blktap and qemu processes do.
+ *
+ * Each process inserts its own entries, growing the table from its
+ * initial size, then removes them again, shrinking it. In between each
+ * of these it looks up entries it knows are there, by key and by value,
+ * and checks what it gets back. Lookups are timed, to show how long they
+ * may be held up while the table is resized.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bidir-hash.h"
+
+#define SLOW_NS     1000000ULL      /* lookups counted as stalled */
+
+struct phase_stats {
+    uint64_t ops;
+    uint64_t lookups;
+    uint64_t lookup_ns;
+    uint64_t max_ns;
+    uint64_t slow;
+    uint64_t errors;
+    uint64_t elapsed_ns;
+};
+
+struct proc_stats {
+    struct phase_stats grow, shrink;
+    uint32_t peak_size;
+};
+
+struct shared {
+    pthread_barrier_t barrier;
+    struct proc_stats procs[0];
+};
+
+static unsigned int nr_procs = 4;
+static unsigned int nr_entries = 100000;
+static unsigned int nr_lookups = 4;
+static unsigned long shm_mb = 64;
+
+static struct fgprtshr_hash *h;
+static struct shared *shared;
+
+static void usage(void)
+{
+    fprintf(stderr,
+"Usage: memshr-hash-bench [OPTION...]\n"
+"Stress the memshr hash from several processes sharing it.\n"
+"\n"
+"  -p, --procs=N           Number of processes [4].\n"
+"  -n, --entries=N         Entries inserted by each process [100000].\n"
+"  -l, --lookups=N         Lookups after each insert or remove [4].\n"
+"  -s, --shm-size=MB       Size of the shared memory for the hash [64].\n"
+"  -h, --help              Show this help.\n");
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Entries of process p are keyed p, p + nr_procs, ... */
+static uint32_t entry_key(unsigned int p, unsigned int i)
+{
+    return p + i * nr_procs;
+}
+
+static xen_mfn_t entry_value(uint32_t key)
+{
+    return key ^ 0x5a5a5a5aU;
+}
+
+/* Look up entry i, which should be in the table. */
+static void lookup(struct phase_stats *st, unsigned int p, unsigned int i)
+{
+    uint32_t key = entry_key(p, i), k = 0;
+    xen_mfn_t v = 0;
+    uint64_t start, ns;
+    int rc;
+
+    start = now_ns();
+    if ( i & 1 )
+        rc = fgprtshr_fgprt_lookup(h, key, &v);
+    else
+        rc = fgprtshr_mfn_lookup(h, entry_value(key), &k);
+    ns = now_ns() - start;
+
+    if ( rc != 1 || (i & 1 ? v != entry_value(key) : k != key) )
+        st->errors++;
+
+    st->lookups++;
+    st->lookup_ns += ns;
+    if ( ns > st->max_ns )
+        st->max_ns = ns;
+    if ( ns >= SLOW_NS )
+        st->slow++;
+}
+
+static void run_proc(unsigned int p)
+{
+    struct proc_stats *ps = &shared->procs[p];
+    struct phase_stats *st;
+    unsigned int seed = p + 1, i, j;
+    uint32_t size, k;
+    xen_mfn_t v;
+    uint64_t start;
+
+    pthread_barrier_wait(&shared->barrier);
+
+    st = &ps->grow;
+    start = now_ns();
+    for ( i = 0; i < nr_entries; i++ )
+    {
+        uint32_t key = entry_key(p, i);
+
+        if ( fgprtshr_insert(h, key, entry_value(key)) != 1 )
+            st->errors++;
+        st->ops++;
+        for ( j = 0; j < nr_lookups; j++ )
+            lookup(st, p, rand_r(&seed) % (i + 1));
+    }
+    st->elapsed_ns = now_ns() - start;
+
+    fgprtshr_hash_sizes(h, NULL, NULL, &size, NULL, NULL);
+    ps->peak_size = size;
+
+    pthread_barrier_wait(&shared->barrier);
+
+    /* Remove from the end, so that the rest are all still there. */
+    st = &ps->shrink;
+    start = now_ns();
+    for ( i = nr_entries; i-- > 0; )
+    {
+        uint32_t key = entry_key(p, i);
+        int rc;
+
+        if ( i & 1 )
+            rc = fgprtshr_fgprt_remove(h, key, &v) != 1 ||
+                 v != entry_value(key);
+        else
+            rc = fgprtshr_mfn_remove(h, entry_value(key), &k) != 1 ||
+                 k != key;
+        if ( rc )
+            st->errors++;
+        st->ops++;
+        for ( j = 0; j < nr_lookups && i; j++ )
+            lookup(st, p, rand_r(&seed) % i);
+    }
+    st->elapsed_ns = now_ns() - start;
+}
+
+static void add_stats(struct phase_stats *sum, const struct phase_stats *st)
+{
+    sum->ops += st->ops;
+    sum->lookups += st->lookups;
+    sum->lookup_ns += st->lookup_ns;
+    if ( st->max_ns > sum->max_ns )
+        sum->max_ns = st->max_ns;
+    sum->slow += st->slow;
+    sum->errors += st->errors;
+    if ( st->elapsed_ns > sum->elapsed_ns )
+        sum->elapsed_ns = st->elapsed_ns;
+}
+
+static void print_stats(const char *name, const struct phase_stats *st)
+{
+    double secs = st->elapsed_ns / 1e9;
+
+    printf("%-7s %10.0f ops/s %10.0f lookups/s  lookup avg %6.2fus"
+           " max %9.1fus  stalled %"PRIu64"\n", name,
+           secs ? st->ops / secs : 0, secs ? st->lookups / secs : 0,
+           st->lookups ? st->lookup_ns / 1e3 / st->lookups : 0,
+           st->max_ns / 1e3, st->slow);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "procs",    required_argument, NULL, 'p' },
+        { "entries",  required_argument, NULL, 'n' },
+        { "lookups",  required_argument, NULL, 'l' },
+        { "shm-size", required_argument, NULL, 's' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct phase_stats grow, shrink;
+    pthread_barrierattr_t attr;
+    uint32_t nr_ent, max_ent, size, base_size, peak = 0;
+    size_t shared_size;
+    void *shm;
+    unsigned int p;
+    int ch, status, failed = 0;
+    char *end;
+
+    while ( (ch = getopt_long(argc, argv, "p:n:l:s:h", long_options,
+                              NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'p':
+            nr_procs = strtoul(optarg, &end, 0);
+            if ( *end || !nr_procs )
+                usage();
+            break;
+        case 'n':
+            nr_entries = strtoul(optarg, &end, 0);
+            if ( *end || !nr_entries )
+                usage();
+            break;
+        case 'l':
+            nr_lookups = strtoul(optarg, &end, 0);
+            if ( *end )
+                usage();
+            break;
+        case 's':
+            shm_mb = strtoul(optarg, &end, 0);
+            if ( *end || !shm_mb )
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    shm = mmap(NULL, shm_mb << 20, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    shared_size = sizeof(*shared) + nr_procs * sizeof(shared->procs[0]);
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( shm == MAP_FAILED || shared == MAP_FAILED )
+    {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    h = fgprtshr_shm_hash_init((unsigned long)shm, shm_mb << 20);
+    if ( !h )
+    {
+        fprintf(stderr, "Cannot create the hash in %luMB\n", shm_mb);
+        return EXIT_FAILURE;
+    }
+    fgprtshr_hash_sizes(h, NULL, &max_ent, &base_size, NULL, NULL);
+    if ( (uint64_t)nr_procs * nr_entries > max_ent )
+    {
+        fprintf(stderr, "%uMB holds %u entries at most, not %"PRIu64"\n",
+                (unsigned int)shm_mb, max_ent,
+                (uint64_t)nr_procs * nr_entries);
+        return EXIT_FAILURE;
+    }
+
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shared->barrier, &attr, nr_procs);
+
+    printf("%u processes, %u entries each, %u lookups per operation\n",
+           nr_procs, nr_entries, nr_lookups);
+    fflush(stdout);
+
+    for ( p = 0; p < nr_procs; p++ )
+    {
+        switch ( fork() )
+        {
+        case -1:
+            perror("fork");
+            return EXIT_FAILURE;
+        case 0:
+            run_proc(p);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    for ( p = 0; p < nr_procs; p++ )
+    {
+        if ( wait(&status) < 0 )
+        {
+            perror("wait");
+            return EXIT_FAILURE;
+        }
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+            failed = 1;
+    }
+
+    memset(&grow, 0, sizeof(grow));
+    memset(&shrink, 0, sizeof(shrink));
+    for ( p = 0; p < nr_procs; p++ )
+    {
+        add_stats(&grow, &shared->procs[p].grow);
+        add_stats(&shrink, &shared->procs[p].shrink);
+        if ( shared->procs[p].peak_size > peak )
+            peak = shared->procs[p].peak_size;
+    }
+
+    printf("table   %u buckets, grew to %u", base_size, peak);
+    fgprtshr_hash_sizes(h, &nr_ent, NULL, &size, NULL, NULL);
+    printf(", shrank to %u\n", size);
+    print_stats("grow", &grow);
+    print_stats("shrink", &shrink);
+
+    /* Emptied, the table must have merged all the way back. */
+    if ( failed || grow.errors || shrink.errors || nr_ent ||
+         size != base_size )
+    {
+        printf("FAIL: %"PRIu64" errors, %u entries left, %u buckets%s\n",
+               grow.errors + shrink.errors, nr_ent, size,
+               failed ? ", a process failed" : "");
+        return EXIT_FAILURE;
+    }
+
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,215 @@
+/*
+ * compression-bench.c
+ *
+ * Throughput of the checkpoint page compression in libxc, without a
+ * hypervisor. A set of cached pages is dirtied the same way every round
+ * and compressed, on -t threads; only xc_compression_compress_pages() is
+ * timed.
+ *
+ * Patterns:
+ *   clean    pages dirtied but written back unchanged
+ *   sparse   one lane in 64 changed, at random
+ *   runs     a few runs of changed lanes
+ *   dense    every lane changed
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <xenctrl.h>
+
+#define PAGE_SIZE 4096
+#define LANES (PAGE_SIZE / sizeof(uint32_t))
+
+static const char *patterns[] = { "clean", "sparse", "runs", "dense" };
+#define NR_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+static unsigned int nr_pages = 4096;
+static unsigned int nr_rounds = 100;
+static unsigned int nr_threads = 1;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n pages] [-r rounds] [-t threads] [pattern...]\n"
+            "  -n  pages per checkpoint, up to 8192 (default 4096)\n"
+            "  -r  checkpoints per pattern (default 100)\n"
+            "  -t  compression threads (default 1)\n"
+            "  patterns: clean sparse runs dense (default all)\n", prog);
+    exit(2);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bump(uint32_t *page, unsigned int lane)
+{
+    page[lane % LANES]++;
+}
+
+static void dirty(uint32_t *page, unsigned int pattern)
+{
+    unsigned int i, start;
+
+    switch (pattern)
+    {
+    case 0:
+        break;
+    case 1:
+        for (i = 0; i < LANES / 64; i++)
+            bump(page, rand());
+        break;
+    case 2:
+        for (i = 0; i < 4; i++)
+            for (start = rand(); start % 16; start++)
+                bump(page, start);
+        break;
+    case 3:
+        for (i = 0; i < LANES; i++)
+            bump(page, i);
+        break;
+    }
+}
+
+static int run(xc_interface *xch, unsigned int pattern)
+{
+    unsigned long size = (unsigned long)nr_pages * (PAGE_SIZE + 9), len;
+    unsigned long long out = 0;
+    double elapsed = 0, start;
+    unsigned int round, pfn;
+    uint32_t *pages;
+    comp_ctx *ctx;
+    char *compbuf;
+    int rc = 1;
+
+    ctx = xc_compression_create_context(xch, nr_pages);
+    pages = calloc(nr_pages, PAGE_SIZE);
+    compbuf = malloc(size);
+    if (!ctx || !pages || !compbuf)
+    {
+        fprintf(stderr, "out of memory\n");
+        goto out;
+    }
+    if (xc_compression_set_threads(xch, ctx, nr_threads))
+    {
+        fprintf(stderr, "could not compress on %u threads\n", nr_threads);
+        goto out;
+    }
+
+    for (pfn = 0; pfn < nr_pages * LANES; pfn++)
+        pages[pfn] = rand();
+
+    /* Round 0 fills the cache, and isn't counted. */
+    for (round = 0; round <= nr_rounds; round++)
+    {
+        for (pfn = 0; pfn < nr_pages; pfn++)
+        {
+            if (round)
+                dirty(pages + pfn * LANES, pattern);
+            xc_compression_add_page(xch, ctx, (char *)(pages + pfn * LANES),
+                                    pfn, 0);
+        }
+
+        start = now();
+        if (xc_compression_compress_pages(xch, ctx, compbuf, size,
+                                          &len) != 1)
+        {
+            fprintf(stderr, "compression failed\n");
+            goto out;
+        }
+        if (round)
+        {
+            elapsed += now() - start;
+            out += len;
+        }
+        xc_compression_reset_pagebuf(xch, ctx);
+    }
+
+    printf("%-8s %10.0f pages/s %8.1f MB/s  %5.1f%% of input\n",
+           patterns[pattern], nr_pages * (double)nr_rounds / elapsed,
+           nr_pages * (double)nr_rounds * PAGE_SIZE / elapsed / 1e6,
+           100.0 * out / ((double)nr_pages * nr_rounds * PAGE_SIZE));
+    rc = 0;
+
+ out:
+    free(compbuf);
+    free(pages);
+    if (ctx)
+        xc_compression_free_context(xch, ctx);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int i, j;
+    xc_interface *xch;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "n:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            nr_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            nr_rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            nr_threads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    /* More than the cache holds would only measure full pages. */
+    if (!nr_pages || nr_pages > 8192 || !nr_rounds)
+        usage(argv[0]);
+
+    xch = xc_interface_open(NULL, NULL, XC_OPENFLAG_DUMMY);
+    if (!xch)
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if (optind == argc)
+    {
+        for (i = 0; i < NR_PATTERNS; i++)
+            rc |= run(xch, i);
+    }
+    else
+    {
+        for (; optind < argc; optind++)
+        {
+            for (j = 0; j < NR_PATTERNS; j++)
+                if (!strcmp(argv[optind], patterns[j]))
+                    break;
+            if (j == NR_PATTERNS)
+                usage(argv[0]);
+            rc |= run(xch, j);
+        }
+    }
+
+    xc_interface_close(xch);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
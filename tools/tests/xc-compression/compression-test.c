@@ -0,0 +1,321 @@
+/*
+ * compression-test.c
+ *
+ * Round-trip test for the checkpoint page compression in libxc. It needs
+ * no hypervisor: pages are made up, run through
+ * xc_compression_compress_pages() and xc_compression_uncompress_page(),
+ * and the receiver's copy has to match the sender's after every round.
+ *
+ * The stream for each cached page is also compared byte for byte with
+ * the output of a plain reference encoder, so the format on the wire
+ * cannot change whichever diff kernel the cpu picks, nor when pages are
+ * compressed on several threads (-t).
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xenctrl.h>
+
+#define PAGE_SIZE 4096
+#define LANES (PAGE_SIZE / sizeof(uint32_t))
+#define NR_PAGES 512
+#define COMPBUF_SIZE (4 * (PAGE_SIZE + 9))
+
+#define RUNFLAG 0
+#define SKIPFLAG 0x80
+#define LENMASK 0x7f
+
+static unsigned char sender[NR_PAGES][PAGE_SIZE];
+static unsigned char receiver[NR_PAGES][PAGE_SIZE];
+/* What the compressor's cache should hold: NULL if not cached. */
+static unsigned char *cached[NR_PAGES];
+static unsigned char cache_copy[NR_PAGES][PAGE_SIZE];
+
+/* Pages sent this round, in order, and whether they were raw. */
+static unsigned long sent_pfn[NR_PAGES];
+static int sent_raw[NR_PAGES];
+static unsigned int nr_sent;
+
+static unsigned int failures;
+
+#define FAIL(_f, _a...) do {                        \
+    fprintf(stderr, "FAIL: " _f "\n", ## _a);       \
+    failures++;                                     \
+} while (0)
+
+/*
+ * The run-length encoder as it always was: runs of changed and unchanged
+ * 32-bit lanes, up to LENMASK lanes each, or a single EMPTY_PAGE byte.
+ */
+static unsigned int ref_encode(const unsigned char *new,
+                               const unsigned char *old, unsigned char *out)
+{
+    unsigned int off = 0, end, len, n = 0, skipped = 0;
+    int changed;
+
+    while (off < LANES)
+    {
+        changed = memcmp(new + off * 4, old + off * 4, 4) != 0;
+        for (end = off + 1; end < LANES && end - off < LENMASK; end++)
+            if ((memcmp(new + end * 4, old + end * 4, 4) != 0) != changed)
+                break;
+        len = end - off;
+        out[n++] = len | (changed ? RUNFLAG : SKIPFLAG);
+        if (changed)
+        {
+            memcpy(out + n, new + off * 4, len * 4);
+            n += len * 4;
+        }
+        else
+            skipped += len;
+        off = end;
+    }
+
+    if (skipped == LANES)
+    {
+        out[0] = 0;
+        n = 1;
+    }
+    return n;
+}
+
+static void set_lane(unsigned char *page, unsigned int lane)
+{
+    uint32_t v;
+
+    memcpy(&v, page + lane * 4, 4);
+    v += 1 + (rand() & 0xffff);
+    memcpy(page + lane * 4, &v, 4);
+}
+
+static void set_lanes(unsigned char *page, unsigned int lane,
+                      unsigned int count)
+{
+    while (count-- && lane < LANES)
+        set_lane(page, lane++);
+}
+
+/* Change the page in one of the ways which stress the run boundaries. */
+static void dirty_page(unsigned char *page, unsigned int pattern)
+{
+    unsigned char old[PAGE_SIZE];
+    unsigned int i, n;
+
+    switch (pattern)
+    {
+    case 0: /* dirtied but written back the same */
+        break;
+    case 1: /* everything */
+        set_lanes(page, 0, LANES);
+        break;
+    case 2: /* scattered lanes */
+        for (i = 0; i < LANES; i++)
+            if (!(rand() % 16))
+                set_lane(page, i);
+        break;
+    case 3: /* every other lane */
+        for (i = rand() % 2; i < LANES; i += 2)
+            set_lane(page, i);
+        break;
+    case 4: /* runs either side of the longest run, anywhere */
+        n = LENMASK - 1 + rand() % 3;
+        if (rand() % 2)
+            n += LENMASK;
+        set_lanes(page, rand() % LANES, n);
+        break;
+    case 5: /* the first and last lanes */
+        if (rand() % 2)
+            set_lane(page, 0);
+        set_lane(page, LANES - 1);
+        break;
+    case 6: /* a single byte, in a lane at a 64-lane boundary or not */
+        i = (rand() % 16) * 64 + (rand() % 2 ? 63 : rand() % 64);
+        page[i * 4 + rand() % 4] ^= 1 << (rand() % 8);
+        break;
+    case 7: /* changed everywhere but a few lanes */
+        memcpy(old, page, PAGE_SIZE);
+        set_lanes(page, 0, LANES);
+        for (i = 0; i < 8; i++)
+        {
+            n = rand() % LANES;
+            memcpy(page + n * 4, old + n * 4, 4);
+        }
+        break;
+    }
+}
+
+/* Walk one chunk of compressed pages, as a restore would. */
+static void receive(xc_interface *xch, char *buf, unsigned long len,
+                    unsigned int *next)
+{
+    unsigned char ref[PAGE_SIZE + 16];
+    unsigned long pos = 0, start;
+    unsigned int n, pfn;
+
+    while (pos < len)
+    {
+        if (*next >= nr_sent)
+        {
+            FAIL("more data than pages sent");
+            return;
+        }
+        pfn = sent_pfn[*next];
+
+        start = pos;
+        if (xc_compression_uncompress_page(xch, buf, len, &pos,
+                                           (char *)receiver[pfn]))
+        {
+            FAIL("pfn %u: could not uncompress", pfn);
+            return;
+        }
+
+        if (!sent_raw[*next] && cached[pfn])
+        {
+            n = ref_encode(sender[pfn], cache_copy[pfn], ref);
+            if (pos - start != n || memcmp(buf + start, ref, n))
+                FAIL("pfn %u: stream differs from reference "
+                     "(%lu bytes, expected %u)", pfn, pos - start, n);
+        }
+        else if (pos - start != PAGE_SIZE + 1)
+            FAIL("pfn %u: expected a full page, got %lu bytes",
+                 pfn, pos - start);
+
+        /* The compressor's cache now has this version. */
+        if (sent_raw[*next])
+            cached[pfn] = NULL;
+        else
+        {
+            memcpy(cache_copy[pfn], sender[pfn], PAGE_SIZE);
+            cached[pfn] = cache_copy[pfn];
+        }
+
+        (*next)++;
+    }
+}
+
+static void run_round(xc_interface *xch, comp_ctx *ctx, unsigned int round)
+{
+    static char compbuf[COMPBUF_SIZE];
+    unsigned long len;
+    unsigned int i, pfn, next = 0;
+    int rc;
+
+    nr_sent = 0;
+    for (pfn = 0; pfn < NR_PAGES; pfn++)
+    {
+        if (round && rand() % 4)
+            continue;
+
+        dirty_page(sender[pfn], rand() % 8);
+        sent_pfn[nr_sent] = pfn;
+        /* Now and again, a page table page. */
+        sent_raw[nr_sent] = !(rand() % 32);
+        if (xc_compression_add_page(xch, ctx, (char *)sender[pfn], pfn,
+                                    sent_raw[nr_sent]))
+        {
+            FAIL("round %u: could not add pfn %u", round, pfn);
+            return;
+        }
+        nr_sent++;
+    }
+
+    /* The buffer only holds a few pages: flush as it fills. */
+    while ((rc = xc_compression_compress_pages(xch, ctx, compbuf,
+                                               sizeof(compbuf), &len)))
+    {
+        receive(xch, compbuf, len, &next);
+        if (rc != 1 && rc != -1)
+        {
+            FAIL("round %u: compress returned %d", round, rc);
+            break;
+        }
+    }
+    xc_compression_reset_pagebuf(xch, ctx);
+
+    if (next != nr_sent)
+        FAIL("round %u: got %u pages back out of %u", round, next, nr_sent);
+
+    for (i = 0; i < NR_PAGES; i++)
+        if (memcmp(sender[i], receiver[i], PAGE_SIZE))
+            FAIL("round %u: pfn %u differs after restore", round, i);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int round, rounds = 200, seed = 1, threads = 1, i;
+    xc_interface *xch;
+    comp_ctx *ctx;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:s:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] [-s seed] [-t threads]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+
+    xch = xc_interface_open(NULL, NULL, XC_OPENFLAG_DUMMY);
+    if (!xch)
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+    ctx = xc_compression_create_context(xch, NR_PAGES);
+    if (!ctx)
+    {
+        fprintf(stderr, "could not create compression context\n");
+        return 1;
+    }
+    if (xc_compression_set_threads(xch, ctx, threads))
+    {
+        fprintf(stderr, "could not compress on %u threads\n", threads);
+        return 1;
+    }
+
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i++)
+        sender[i / PAGE_SIZE][i % PAGE_SIZE] = rand();
+
+    for (round = 0; round < rounds && !failures; round++)
+        run_round(xch, ctx, round);
+
+    xc_compression_free_context(xch, ctx);
+    xc_interface_close(xch);
+
+    if (failures)
+    {
+        fprintf(stderr, "%u failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("PASS: %u rounds of %u pages, %u threads\n",
+           rounds, NR_PAGES, threads);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
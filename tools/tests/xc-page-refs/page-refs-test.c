@@ -0,0 +1,500 @@
+/*
+ * page-refs-test.c
+ *
+ * Offline test of the zero and duplicate page references in the save
+ * stream. Made up memory images are saved into a buffer, batch by batch
+ * and iteration by iteration as xc_domain_save() does it, with the
+ * references from xc_page_refs_encode(). The buffer is then restored the
+ * way xc_domain_restore() reads it, and both images have to match.
+ *
+ * Malformed reference lists have to be refused by xc_page_refs_check().
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+
+#define PAGE_SIZE 4096
+#define NR_PFNS 4096
+#define BATCH 1000           /* not a power of two, so batches straddle */
+
+#define XC_SAVE_ID_PAGE_REFS -19
+
+#define NOTAB XEN_DOMCTL_PFINFO_NOTAB
+#define L1TAB XEN_DOMCTL_PFINFO_L1TAB
+#define XTAB  XEN_DOMCTL_PFINFO_XTAB
+
+static unsigned char sender[NR_PFNS][PAGE_SIZE];
+static unsigned char receiver[NR_PFNS][PAGE_SIZE];
+static unsigned long type_of[NR_PFNS];
+static unsigned char dirty[NR_PFNS];
+
+static struct {
+    char *buf;
+    size_t len, size, pos;
+} stream;
+
+static struct {
+    unsigned long pages, data, zero, batch, pfn;
+} stats;
+
+static unsigned int failures;
+
+#define FAIL(_f, _a...) do {                        \
+    fprintf(stderr, "FAIL: " _f "\n", ## _a);       \
+    failures++;                                     \
+} while (0)
+
+static void put(const void *p, size_t len)
+{
+    if ( stream.len + len > stream.size )
+    {
+        stream.size = (stream.len + len) * 2;
+        stream.buf = realloc(stream.buf, stream.size);
+        if ( !stream.buf )
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(stream.buf + stream.len, p, len);
+    stream.len += len;
+}
+
+static int is_zero(const unsigned char *page)
+{
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE; i++ )
+        if ( page[i] )
+            return 0;
+    return 1;
+}
+
+static int get(void *p, size_t len)
+{
+    if ( stream.pos + len > stream.len )
+        return -1;
+    memcpy(p, stream.buf + stream.pos, len);
+    stream.pos += len;
+    return 0;
+}
+
+/* Sources for references to earlier batches: the sender's image. */
+static int map_sender(void *data, const xen_pfn_t *pfns, unsigned int nr,
+                      const void **pages)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+        if ( pfns[i] < NR_PFNS )
+            pages[i] = sender[pfns[i]];
+    return 0;
+}
+
+static int map_nothing(void *data, const xen_pfn_t *pfns, unsigned int nr,
+                       const void **pages)
+{
+    return -1;
+}
+
+static const struct xc_page_refs_sources sender_sources = { map_sender };
+static const struct xc_page_refs_sources no_sources = { map_nothing };
+
+static void fill_page(unsigned int pfn)
+{
+    unsigned int i;
+
+    switch ( rand() % 8 )
+    {
+    case 0: case 1:
+        memset(sender[pfn], 0, PAGE_SIZE);
+        break;
+    case 2: case 3:
+        /* A copy of another page, close by or anywhere. */
+        i = rand() % 2 ? (pfn + 1 + rand() % 16) % NR_PFNS : rand() % NR_PFNS;
+        memcpy(sender[pfn], sender[i], PAGE_SIZE);
+        break;
+    case 4:
+        /* Zero but for one byte, anywhere. */
+        memset(sender[pfn], 0, PAGE_SIZE);
+        sender[pfn][rand() % PAGE_SIZE] = 1 + rand() % 255;
+        break;
+    default:
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            sender[pfn][i] = rand();
+        break;
+    }
+}
+
+/* Send the dirty pages, as one iteration. */
+static void save_iteration(xc_interface *xch, xc_page_refs_t *pr, int stable,
+                           const struct xc_page_refs_sources *src)
+{
+    static char pages[BATCH * PAGE_SIZE];
+    static xen_pfn_t pfn_type[BATCH];
+    static unsigned long wire[BATCH];
+    static struct xc_page_ref refs[BATCH];
+    unsigned int pfn = 0, batch, i, r;
+    int nr_refs, id;
+
+    xc_page_refs_reset(xch, pr, stable);
+
+    while ( pfn < NR_PFNS )
+    {
+        for ( batch = 0; batch < BATCH && pfn < NR_PFNS; pfn++ )
+        {
+            if ( !dirty[pfn] )
+                continue;
+            dirty[pfn] = 0;
+            pfn_type[batch] = pfn | type_of[pfn];
+            memcpy(pages + batch * PAGE_SIZE, sender[pfn], PAGE_SIZE);
+            batch++;
+        }
+        if ( !batch )
+            break;
+
+        nr_refs = xc_page_refs_encode(xch, pr, pfn_type, batch, pages, refs,
+                                      src);
+        if ( nr_refs < 0 || nr_refs > batch )
+        {
+            FAIL("encode returned %d for %u pages", nr_refs, batch);
+            return;
+        }
+        if ( nr_refs )
+        {
+            id = XC_SAVE_ID_PAGE_REFS;
+            put(&id, sizeof(id));
+            put(&nr_refs, sizeof(unsigned int));
+            put(refs, nr_refs * sizeof(*refs));
+        }
+
+        put(&batch, sizeof(batch));
+        for ( i = 0; i < batch; i++ )
+            wire[i] = pfn_type[i];
+        put(wire, batch * sizeof(*wire));
+
+        for ( i = r = 0; i < batch; i++ )
+        {
+            stats.pages++;
+            if ( (pfn_type[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) == XTAB )
+                continue;
+            if ( r < nr_refs && refs[r].index == i )
+            {
+                switch ( refs[r].type )
+                {
+                case XC_PAGE_REF_ZERO:
+                    stats.zero++;
+                    break;
+                case XC_PAGE_REF_BATCH:
+                    stats.batch++;
+                    break;
+                case XC_PAGE_REF_PFN:
+                    stats.pfn++;
+                    if ( !stable )
+                        FAIL("duplicate sent while the guest can run");
+                    break;
+                }
+                r++;
+                continue;
+            }
+            stats.data++;
+            if ( (pfn_type[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) == NOTAB &&
+                 is_zero((unsigned char *)pages + i * PAGE_SIZE) )
+                FAIL("zero page %#lx sent in full",
+                     (unsigned long)(pfn_type[i] &
+                                     ~XEN_DOMCTL_PFINFO_LTAB_MASK));
+            put(pages + i * PAGE_SIZE, PAGE_SIZE);
+        }
+        if ( r != nr_refs )
+            FAIL("reference to a page which is not data");
+    }
+
+    id = 0;
+    put(&id, sizeof(id));
+}
+
+/* Read one iteration back, as pagebuf_get_one() and apply_batch() do. */
+static void restore_iteration(xc_interface *xch)
+{
+    static struct xc_page_ref refs[BATCH];
+    static unsigned long pfn_type[BATCH];
+    unsigned int nr_refs = 0, i, r, pfn;
+    const void *from;
+    int count;
+
+    for ( ; ; )
+    {
+        if ( get(&count, sizeof(count)) )
+        {
+            FAIL("stream truncated");
+            return;
+        }
+        if ( count == 0 )
+            break;
+
+        if ( count == XC_SAVE_ID_PAGE_REFS )
+        {
+            if ( nr_refs || get(&nr_refs, sizeof(nr_refs)) ||
+                 nr_refs > BATCH ||
+                 get(refs, nr_refs * sizeof(*refs)) )
+            {
+                FAIL("bad page reference chunk");
+                return;
+            }
+            continue;
+        }
+        if ( count < 0 || count > BATCH ||
+             get(pfn_type, count * sizeof(*pfn_type)) )
+        {
+            FAIL("bad batch of %d pages", count);
+            return;
+        }
+        if ( xc_page_refs_check(xch, refs, nr_refs, pfn_type, count) )
+        {
+            FAIL("references refused");
+            return;
+        }
+
+        for ( i = r = 0; i < count; i++ )
+        {
+            pfn = pfn_type[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+            if ( (pfn_type[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) == XTAB )
+                continue;
+
+            if ( r < nr_refs && refs[r].index == i )
+            {
+                switch ( refs[r].type )
+                {
+                case XC_PAGE_REF_ZERO:
+                    memset(receiver[pfn], 0, PAGE_SIZE);
+                    break;
+                case XC_PAGE_REF_BATCH:
+                    from = receiver[pfn_type[refs[r].source] &
+                                    ~XEN_DOMCTL_PFINFO_LTAB_MASK];
+                    memcpy(receiver[pfn], from, PAGE_SIZE);
+                    break;
+                case XC_PAGE_REF_PFN:
+                    if ( refs[r].source >= NR_PFNS )
+                    {
+                        FAIL("reference to pfn %#"PRIx64, refs[r].source);
+                        return;
+                    }
+                    memcpy(receiver[pfn], receiver[refs[r].source],
+                           PAGE_SIZE);
+                    break;
+                }
+                r++;
+            }
+            else if ( get(receiver[pfn], PAGE_SIZE) )
+            {
+                FAIL("page data truncated");
+                return;
+            }
+        }
+        nr_refs = 0;
+    }
+
+    if ( nr_refs )
+        FAIL("page references without a batch");
+}
+
+static void transfer(xc_interface *xch, xc_page_refs_t *pr, int stable,
+                     const struct xc_page_refs_sources *src)
+{
+    stream.len = stream.pos = 0;
+    save_iteration(xch, pr, stable, src);
+    restore_iteration(xch);
+    if ( stream.pos != stream.len )
+        FAIL("%zu bytes left in the stream", stream.len - stream.pos);
+}
+
+static void compare(const char *what)
+{
+    unsigned int pfn;
+
+    for ( pfn = 0; pfn < NR_PFNS; pfn++ )
+        if ( type_of[pfn] != XTAB &&
+             memcmp(sender[pfn], receiver[pfn], PAGE_SIZE) )
+        {
+            FAIL("%s: pfn %#x differs after restore", what, pfn);
+            return;
+        }
+}
+
+/* A live migration: two iterations with the guest running, then one not. */
+static void migrate(xc_interface *xch, xc_page_refs_t *pr,
+                    const struct xc_page_refs_sources *src)
+{
+    unsigned int pfn, iter;
+
+    memset(receiver, 0xa5, sizeof(receiver));
+
+    for ( pfn = 0; pfn < NR_PFNS; pfn++ )
+    {
+        switch ( rand() % 32 )
+        {
+        case 0:
+            type_of[pfn] = XTAB;
+            break;
+        case 1:
+            type_of[pfn] = L1TAB;
+            break;
+        default:
+            type_of[pfn] = NOTAB;
+            break;
+        }
+        fill_page(pfn);
+        dirty[pfn] = 1;
+    }
+
+    for ( iter = 0; iter < 3; iter++ )
+    {
+        transfer(xch, pr, iter == 2, src);
+
+        /* The guest runs on until suspended for the last iteration. */
+        for ( pfn = 0; pfn < NR_PFNS; pfn++ )
+            if ( iter < 2 && !(rand() % 8) )
+            {
+                fill_page(pfn);
+                dirty[pfn] = 1;
+            }
+    }
+    compare("migration");
+
+    /* A save which isn't live: everything in one go. */
+    memset(receiver, 0x5a, sizeof(receiver));
+    memset(dirty, 1, sizeof(dirty));
+    transfer(xch, pr, 1, src);
+    compare("save");
+}
+
+static void check_refused(xc_interface *xch, const char *what,
+                          const struct xc_page_ref *refs, unsigned int nr_refs)
+{
+    static const unsigned long pfn_type[] = {
+        0x10, 0x11 | L1TAB, 0x12, 0x13 | XTAB, 0x14, 0x15,
+    };
+
+    errno = 0;
+    if ( !xc_page_refs_check(xch, refs, nr_refs, pfn_type, 6) ||
+         errno != EINVAL )
+        FAIL("%s: not refused", what);
+}
+
+static void malformed(xc_interface *xch)
+{
+    static const unsigned long pfn_type[] = { 0x10, 0x11, 0x12 };
+    struct xc_page_ref good[] = {
+        { 0, XC_PAGE_REF_ZERO, 0 },
+        { 1, XC_PAGE_REF_BATCH, 0 },
+        { 2, XC_PAGE_REF_PFN, 0x1234 },
+    };
+    struct xc_page_ref order[] = {
+        { 2, XC_PAGE_REF_ZERO, 0 }, { 0, XC_PAGE_REF_ZERO, 0 },
+    };
+    struct xc_page_ref twice[] = {
+        { 2, XC_PAGE_REF_ZERO, 0 }, { 2, XC_PAGE_REF_ZERO, 0 },
+    };
+    struct xc_page_ref range = { 6, XC_PAGE_REF_ZERO, 0 };
+    struct xc_page_ref pt = { 1, XC_PAGE_REF_ZERO, 0 };
+    struct xc_page_ref xtab = { 3, XC_PAGE_REF_ZERO, 0 };
+    struct xc_page_ref forward = { 2, XC_PAGE_REF_BATCH, 4 };
+    struct xc_page_ref self = { 2, XC_PAGE_REF_BATCH, 2 };
+    struct xc_page_ref from_pt = { 2, XC_PAGE_REF_BATCH, 1 };
+    struct xc_page_ref type = { 2, 3, 0 };
+
+    if ( xc_page_refs_check(xch, good, 3, pfn_type, 3) )
+        FAIL("well formed references refused");
+
+    check_refused(xch, "out of order", order, 2);
+    check_refused(xch, "same entry twice", twice, 2);
+    check_refused(xch, "out of range", &range, 1);
+    check_refused(xch, "page table page", &pt, 1);
+    check_refused(xch, "missing page", &xtab, 1);
+    check_refused(xch, "copy of a later entry", &forward, 1);
+    check_refused(xch, "copy of itself", &self, 1);
+    check_refused(xch, "copy of a page table page", &from_pt, 1);
+    check_refused(xch, "unknown type", &type, 1);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int round, rounds = 10, seed = 1;
+    xc_interface *xch;
+    xc_page_refs_t *pr;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "r:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'r':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+
+    xch = xc_interface_open(NULL, NULL, XC_OPENFLAG_DUMMY);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    malformed(xch);
+
+    /* A small index, so that pages fall out of it. */
+    pr = xc_page_refs_create(xch, NR_PFNS / 4);
+    if ( !pr )
+    {
+        fprintf(stderr, "could not create the page index\n");
+        return 1;
+    }
+
+    for ( round = 0; round < rounds && !failures; round++ )
+    {
+        migrate(xch, pr, &sender_sources);
+        /* Without the earlier batches: only zeroes and copies in a batch. */
+        migrate(xch, pr, round % 2 ? &no_sources : NULL);
+    }
+
+    xc_page_refs_free(xch, pr);
+    xc_interface_close(xch);
+    free(stream.buf);
+
+    if ( failures )
+    {
+        fprintf(stderr, "%u failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("PASS: %u rounds, %lu pages: %lu data, %lu zero, "
+           "%lu copies in a batch, %lu copies of earlier batches\n",
+           rounds, stats.pages, stats.data, stats.zero, stats.batch,
+           stats.pfn);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
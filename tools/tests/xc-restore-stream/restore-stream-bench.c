@@ -0,0 +1,298 @@
+/*
+ * restore-stream-bench.c
+ *
+ * How fast a restore takes the pages off its stream, reading inline and
+ * on the read ahead thread, without a hypervisor. The body of a save
+ * image comes down a pipe at -b MB/s, as it would off the network, and
+ * each batch is "applied" by copying its pages into an image and then
+ * spending -a microseconds a page, for the mapping and the hypercalls.
+ *
+ * The body is made up (-n pages of it), or taken from a file (-f), from
+ * -o bytes in: where the first chunk after the p2m frame list is.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+#include <xg_private.h>
+#include "xg_save_restore.h"
+#include "xg_restore_stream.h"
+
+static unsigned long nr_pfns = 16384;
+static double bandwidth;        /* MB/s, 0 for as fast as it goes */
+static double apply_cost;       /* us a page */
+static const char *file;
+static long offset;
+
+struct feeder {
+    int fd;
+    pthread_t thread;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n pages] [-b MB/s] [-a us] [-f file [-o offset]]\n"
+            "  -n  pages in the made up body (default 16384)\n"
+            "  -b  bandwidth of the stream (default unlimited)\n"
+            "  -a  time to apply each page, besides copying it (default 0)\n"
+            "  -f  read the body from a save image instead\n"
+            "  -o  offset of the body in the file (default 0)\n", prog);
+    exit(2);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void spin(double us)
+{
+    double end = now() + us / 1e6;
+
+    while ( now() < end )
+        ;
+}
+
+/*
+ * Write out len bytes, a socket buffer at a time, each taking as long as
+ * the bandwidth says. Time lost waiting for the reader is not made up for:
+ * a link cannot go faster afterwards.
+ */
+#define FEED_SIZE 65536
+
+static int feed(int fd, const void *buf, size_t len)
+{
+    size_t n;
+    double due;
+
+    for ( ; len; buf += n, len -= n )
+    {
+        n = len < FEED_SIZE ? len : FEED_SIZE;
+        if ( write_exact(fd, buf, n) )
+            return -1;
+
+        if ( bandwidth )
+        {
+            due = now() + n / (bandwidth * 1e6);
+            while ( now() < due )
+                usleep((due - now()) * 1e6);
+        }
+    }
+    return 0;
+}
+
+static void *feed_body(void *arg)
+{
+    struct feeder *feeder = arg;
+    static unsigned long pfn_types[MAX_BATCH_SIZE];
+    static char pages[MAX_BATCH_SIZE][PAGE_SIZE];
+    unsigned long pfn = 0;
+    int count, zero = 0, i;
+    ssize_t len;
+    int in;
+
+    if ( file )
+    {
+        in = open(file, O_RDONLY);
+        if ( in < 0 || lseek(in, offset, SEEK_SET) != offset )
+        {
+            perror(file);
+            goto out;
+        }
+        while ( (len = read(in, pages, sizeof(pages))) > 0 )
+            if ( feed(feeder->fd, pages, len) )
+                break;
+        close(in);
+        goto out;
+    }
+
+    for ( i = 0; i < MAX_BATCH_SIZE * PAGE_SIZE; i++ )
+        pages[i / PAGE_SIZE][i % PAGE_SIZE] = rand();
+
+    while ( pfn < nr_pfns )
+    {
+        count = MAX_BATCH_SIZE;
+        if ( count > nr_pfns - pfn )
+            count = nr_pfns - pfn;
+        for ( i = 0; i < count; i++ )
+            pfn_types[i] = pfn++;
+
+        if ( feed(feeder->fd, &count, sizeof(count)) ||
+             feed(feeder->fd, pfn_types, count * sizeof(*pfn_types)) ||
+             feed(feeder->fd, pages, count * PAGE_SIZE) )
+            goto out;
+    }
+    feed(feeder->fd, &zero, sizeof(zero));
+
+ out:
+    close(feeder->fd);
+    return NULL;
+}
+
+static void apply(pagebuf_t *batch, char *image, unsigned long size)
+{
+    unsigned long pfn, type;
+    unsigned int i, page = 0;
+
+    for ( i = 0; i < batch->nr_pages; i++ )
+    {
+        pfn = batch->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        type = batch->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( type == XEN_DOMCTL_PFINFO_XTAB ||
+             type == XEN_DOMCTL_PFINFO_BROKEN ||
+             type == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+        /* References are not worth following here: they are rare. */
+        if ( page >= batch->nr_physpages )
+            break;
+        memcpy(image + (pfn % size) * PAGE_SIZE,
+               (char *)batch->pages + page++ * PAGE_SIZE, PAGE_SIZE);
+    }
+
+    if ( apply_cost )
+        spin(apply_cost * batch->nr_pages);
+}
+
+static int run(xc_interface *xch, int threaded, char *image,
+               unsigned long size)
+{
+    struct feeder feeder;
+    struct restore_pipe *rp;
+    struct restore_ctx ctx;
+    unsigned long long pages = 0;
+    pagebuf_t buf, *batch;
+    double start, elapsed;
+    int fds[2], rc;
+
+    if ( pipe(fds) )
+    {
+        perror("pipe");
+        return 1;
+    }
+    feeder.fd = fds[1];
+
+    memset(&ctx, 0, sizeof(ctx));
+    pagebuf_init(&buf);
+
+    start = now();
+    if ( pthread_create(&feeder.thread, NULL, feed_body, &feeder) )
+    {
+        perror("pthread_create");
+        return 1;
+    }
+    rp = restore_pipe_start(xch, &ctx, &buf, fds[0], 0, threaded);
+    if ( !rp )
+    {
+        fprintf(stderr, "could not start the pipe\n");
+        return 1;
+    }
+
+    while ( (rc = restore_pipe_next(rp, &batch)) > 0 )
+    {
+        apply(batch, image, size);
+        pages += batch->nr_pages;
+        restore_pipe_done(rp, batch);
+    }
+    elapsed = now() - start;
+
+    restore_pipe_stop(rp);
+    close(fds[0]);
+    pthread_join(feeder.thread, NULL);
+    pagebuf_free(&buf);
+
+    if ( rc < 0 )
+    {
+        fprintf(stderr, "%s: stream failed after %llu pages\n",
+                threaded ? "ahead" : "inline", pages);
+        return 1;
+    }
+
+    printf("%-8s %10.0f pages/s %8.1f MB/s  %llu pages in %.2fs\n",
+           threaded ? "ahead" : "inline", pages / elapsed,
+           pages * PAGE_SIZE / elapsed / 1e6, pages, elapsed);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    xc_interface *xch;
+    unsigned long size = 16384;
+    char *image;
+    int opt, rc;
+
+    while ( (opt = getopt(argc, argv, "n:b:a:f:o:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr_pfns = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            bandwidth = strtod(optarg, NULL);
+            break;
+        case 'a':
+            apply_cost = strtod(optarg, NULL);
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'o':
+            offset = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ( !nr_pfns || optind != argc )
+        usage(argv[0]);
+
+    xch = xc_interface_open(NULL, NULL, XC_OPENFLAG_DUMMY);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Pages land in an image of at most 64MB, wrapping round. */
+    if ( !file && nr_pfns < size )
+        size = nr_pfns;
+    image = calloc(size, PAGE_SIZE);
+    if ( !image )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    rc = run(xch, 0, image, size);
+    rc |= run(xch, 1, image, size);
+
+    free(image);
+    xc_interface_close(xch);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
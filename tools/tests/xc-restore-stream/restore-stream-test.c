@@ -0,0 +1,518 @@
+/*
+ * restore-stream-test.c
+ *
+ * Test for the reading of the body of a save image, as xc_domain_restore()
+ * does it, without a hypervisor. A body is made up and written to a file:
+ * batches of pages of all types, some sent as page references, between
+ * the chunks a restore keeps for later. It is read back through the
+ * restore pipe, inline and on the read ahead thread, and the pages applied
+ * to an image which has to match the sender's.
+ *
+ * Streams cut short have to fail, and a pipe stopped while the stream has
+ * nothing more to give must not hang.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+#include <xg_private.h>
+#include "xg_save_restore.h"
+#include "xg_restore_stream.h"
+
+#define NR_PFNS 2048
+#define MAX_VCPU_ID 70
+
+static const char tail[] = "TAIL";
+
+/* What the sender had, and what the receiver has so far. */
+static unsigned char sender[NR_PFNS][PAGE_SIZE];
+static unsigned char receiver[NR_PFNS][PAGE_SIZE];
+/* Sent in an earlier batch; in the batch being made up. */
+static int sent[NR_PFNS], in_batch[NR_PFNS];
+
+/* The batches of the stream, and whether verify mode was on for each. */
+#define MAX_BATCHES 64
+static unsigned int nr_batches;
+static int batch_verify[MAX_BATCHES];
+
+static uint8_t tdata[100];
+static uint64_t vcpumap[XC_SR_MAX_VCPUS / 64];
+
+static unsigned int failures;
+
+#define FAIL(_f, _a...) do {                        \
+    fprintf(stderr, "FAIL: " _f "\n", ## _a);       \
+    failures++;                                     \
+} while (0)
+
+static void put(FILE *f, const void *p, size_t len)
+{
+    if ( fwrite(p, len, 1, f) != 1 )
+    {
+        perror("fwrite");
+        exit(1);
+    }
+}
+
+static void put_int(FILE *f, int v)
+{
+    put(f, &v, sizeof(v));
+}
+
+/* A chunk with 4 bytes of padding, then a 64 bit value. */
+static void put_param(FILE *f, int id, uint64_t v)
+{
+    put_int(f, id);
+    put_int(f, 0);
+    put(f, &v, sizeof(v));
+}
+
+static void make_page(unsigned int pfn)
+{
+    unsigned int i;
+
+    switch ( rand() % 4 )
+    {
+    case 0:
+        memset(sender[pfn], 0, PAGE_SIZE);
+        break;
+    case 1:
+        /* Much the same as some other page. */
+        memcpy(sender[pfn], sender[rand() % NR_PFNS], PAGE_SIZE);
+        break;
+    default:
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            sender[pfn][i] = rand();
+        break;
+    }
+}
+
+/* A batch of pages, some sent by reference. */
+static void put_batch(FILE *f)
+{
+    static unsigned long pfn_types[MAX_BATCH_SIZE];
+    static struct xc_page_ref refs[MAX_BATCH_SIZE];
+    static const unsigned long types[] = {
+        XEN_DOMCTL_PFINFO_NOTAB, XEN_DOMCTL_PFINFO_NOTAB,
+        XEN_DOMCTL_PFINFO_NOTAB, XEN_DOMCTL_PFINFO_L1TAB,
+        XEN_DOMCTL_PFINFO_XTAB, XEN_DOMCTL_PFINFO_BROKEN,
+        XEN_DOMCTL_PFINFO_XALLOC,
+    };
+    unsigned int i, j, count, nr_refs = 0;
+    unsigned long type, pfn;
+
+    /*
+     * A pfn is only in a batch once: the data for it is written out after
+     * the whole batch is made up.
+     */
+    memset(in_batch, 0, sizeof(in_batch));
+    count = 1 + rand() % MAX_BATCH_SIZE;
+    for ( i = 0; i < count; i++ )
+    {
+        for ( pfn = rand() % NR_PFNS; in_batch[pfn]; )
+            pfn = (pfn + 1) % NR_PFNS;
+        in_batch[pfn] = 1;
+        type = types[rand() % (sizeof(types) / sizeof(types[0]))];
+        pfn_types[i] = pfn | type;
+        if ( type != XEN_DOMCTL_PFINFO_NOTAB &&
+             type != XEN_DOMCTL_PFINFO_L1TAB )
+            continue;
+
+        make_page(pfn);
+        if ( type != XEN_DOMCTL_PFINFO_NOTAB || rand() % 3 )
+            continue;
+
+        refs[nr_refs].index = i;
+        refs[nr_refs].source = 0;
+        refs[nr_refs].type = XC_PAGE_REF_ZERO;
+        switch ( rand() % 3 )
+        {
+        case 0:
+            memset(sender[pfn], 0, PAGE_SIZE);
+            break;
+        case 1:
+            /* A copy of a data page earlier in the batch, if any. */
+            for ( j = i; j--; )
+                if ( (pfn_types[j] & XEN_DOMCTL_PFINFO_LTAB_MASK) ==
+                     XEN_DOMCTL_PFINFO_NOTAB )
+                    break;
+            if ( j == ~0U )
+                continue;
+            memcpy(sender[pfn],
+                   sender[pfn_types[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK],
+                   PAGE_SIZE);
+            refs[nr_refs].type = XC_PAGE_REF_BATCH;
+            refs[nr_refs].source = j;
+            break;
+        case 2:
+            /* A copy of another page sent in an earlier batch, if any. */
+            for ( j = 0; j < NR_PFNS && (!sent[j] || j == pfn); j++ )
+                ;
+            if ( j == NR_PFNS )
+                continue;
+            for ( j = rand() % NR_PFNS; !sent[j] || j == pfn; )
+                j = (j + 1) % NR_PFNS;
+            memcpy(sender[pfn], sender[j], PAGE_SIZE);
+            refs[nr_refs].type = XC_PAGE_REF_PFN;
+            refs[nr_refs].source = j;
+            break;
+        }
+        nr_refs++;
+    }
+
+    if ( nr_refs )
+    {
+        put_int(f, XC_SAVE_ID_PAGE_REFS);
+        put(f, &nr_refs, sizeof(nr_refs));
+        put(f, refs, nr_refs * sizeof(*refs));
+    }
+    put_int(f, count);
+    put(f, pfn_types, count * sizeof(*pfn_types));
+    for ( i = j = 0; i < count; i++ )
+    {
+        type = pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( type != XEN_DOMCTL_PFINFO_NOTAB &&
+             type != XEN_DOMCTL_PFINFO_L1TAB )
+            continue;
+        if ( j < nr_refs && refs[j].index == i )
+        {
+            j++;
+            continue;
+        }
+        put(f, sender[pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK], PAGE_SIZE);
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        type = pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( type == XEN_DOMCTL_PFINFO_NOTAB ||
+             type == XEN_DOMCTL_PFINFO_L1TAB )
+            sent[pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK] = 1;
+    }
+}
+
+/*
+ * Write a body of batches, the other chunks of the body in between, and
+ * something from the tail after it. Returns where the body ends.
+ */
+static long make_stream(FILE *f)
+{
+    unsigned int i, verify = 0;
+    int max_vcpu_id = MAX_VCPU_ID;
+    uint32_t len = sizeof(tdata);
+    long end;
+
+    memset(sent, 0, sizeof(sent));
+    nr_batches = 4 + rand() % (MAX_BATCHES - 4);
+
+    for ( i = 0; i < nr_batches; i++ )
+    {
+        switch ( rand() % 8 )
+        {
+        case 0:
+            put_int(f, XC_SAVE_ID_VCPU_INFO);
+            put(f, &max_vcpu_id, sizeof(max_vcpu_id));
+            put(f, vcpumap, vcpumap_sz(max_vcpu_id));
+            break;
+        case 1:
+            put_int(f, XC_SAVE_ID_TOOLSTACK);
+            put(f, &len, sizeof(len));
+            put(f, tdata, len);
+            break;
+        case 2:
+            put_param(f, XC_SAVE_ID_HVM_IDENT_PT, 0xfeffc000);
+            put_param(f, XC_SAVE_ID_HVM_CONSOLE_PFN, 0xfefff);
+            break;
+        case 3:
+            if ( i >= nr_batches / 2 && !verify )
+            {
+                put_int(f, XC_SAVE_ID_ENABLE_VERIFY_MODE);
+                verify = 1;
+            }
+            break;
+        }
+        batch_verify[i] = verify;
+        put_batch(f);
+    }
+
+    /* These last, so that they are known to come with the end. */
+    put_int(f, XC_SAVE_ID_VCPU_INFO);
+    put(f, &max_vcpu_id, sizeof(max_vcpu_id));
+    put(f, vcpumap, vcpumap_sz(max_vcpu_id));
+    put_int(f, XC_SAVE_ID_TOOLSTACK);
+    put(f, &len, sizeof(len));
+    put(f, tdata, len);
+    put_int(f, XC_SAVE_ID_LAST_CHECKPOINT);
+    put_int(f, 0);
+    end = ftell(f);
+    put(f, tail, sizeof(tail));
+    fflush(f);
+
+    return end;
+}
+
+static void apply(pagebuf_t *batch)
+{
+    unsigned int i, r = 0;
+    unsigned long type, pfn, src;
+    struct xc_page_ref *ref;
+
+    for ( i = 0; i < batch->nr_pages; i++ )
+    {
+        type = batch->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pfn = batch->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( type == XEN_DOMCTL_PFINFO_XTAB ||
+             type == XEN_DOMCTL_PFINFO_BROKEN ||
+             type == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        if ( r < batch->nr_refs && batch->refs[r].index == i )
+        {
+            ref = &batch->refs[r++];
+            switch ( ref->type )
+            {
+            case XC_PAGE_REF_ZERO:
+                memset(receiver[pfn], 0, PAGE_SIZE);
+                break;
+            case XC_PAGE_REF_BATCH:
+                src = batch->pfn_types[ref->source] &
+                    ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+                memcpy(receiver[pfn], receiver[src], PAGE_SIZE);
+                break;
+            case XC_PAGE_REF_PFN:
+                memcpy(receiver[pfn], receiver[ref->source], PAGE_SIZE);
+                break;
+            }
+            continue;
+        }
+
+        if ( batch->next_physpage >= batch->nr_physpages )
+        {
+            FAIL("batch of %u has too few pages", batch->nr_pages);
+            return;
+        }
+        memcpy(receiver[pfn],
+               (char *)batch->pages + batch->next_physpage++ * PAGE_SIZE,
+               PAGE_SIZE);
+    }
+
+    if ( r != batch->nr_refs || batch->next_physpage != batch->nr_physpages )
+        FAIL("batch of %u: %u of %u refs and %u of %u pages used",
+             batch->nr_pages, r, batch->nr_refs, batch->next_physpage,
+             batch->nr_physpages);
+}
+
+/*
+ * Read the stream on fd as a restore does. Returns what the last
+ * restore_pipe_next() did, and the number of batches applied.
+ */
+static int receive(xc_interface *xch, int fd, int threaded, pagebuf_t *buf,
+                   struct restore_ctx *ctx, unsigned int *nr)
+{
+    struct restore_pipe *rp;
+    pagebuf_t *batch;
+    int rc;
+
+    memset(ctx, 0, sizeof(*ctx));
+    pagebuf_init(buf);
+    rp = restore_pipe_start(xch, ctx, buf, fd, 0, threaded);
+    if ( !rp )
+    {
+        FAIL("could not start the pipe");
+        return -1;
+    }
+
+    for ( *nr = 0; (rc = restore_pipe_next(rp, &batch)) > 0; (*nr)++ )
+    {
+        if ( *nr < nr_batches && batch->verify != batch_verify[*nr] )
+            FAIL("batch %u: verify %d, expected %d", *nr, batch->verify,
+                 batch_verify[*nr]);
+        apply(batch);
+        /* Now and again, let the reader get ahead. */
+        if ( !(rand() % 4) )
+            usleep(1000);
+        restore_pipe_done(rp, batch);
+    }
+
+    restore_pipe_stop(rp);
+    return rc;
+}
+
+static void run_round(xc_interface *xch, unsigned int round, int threaded)
+{
+    struct restore_ctx ctx;
+    pagebuf_t buf;
+    char name[] = "/tmp/restore-stream-XXXXXX", check[sizeof(tail)];
+    unsigned int nr, pfn;
+    long end, cut;
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(name);
+    if ( fd < 0 || !(f = fdopen(fd, "w+")) )
+    {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(name);
+
+    end = make_stream(f);
+
+    lseek(fd, 0, SEEK_SET);
+    memset(receiver, 0, sizeof(receiver));
+    if ( receive(xch, fd, threaded, &buf, &ctx, &nr) != 0 )
+        FAIL("round %u: stream failed", round);
+    else
+    {
+        if ( nr != nr_batches )
+            FAIL("round %u: %u batches, expected %u", round, nr, nr_batches);
+        for ( pfn = 0; pfn < NR_PFNS; pfn++ )
+            if ( sent[pfn] && memcmp(sender[pfn], receiver[pfn], PAGE_SIZE) )
+                FAIL("round %u: pfn %u differs after restore", round, pfn);
+        if ( !buf.new_ctxt_format || buf.max_vcpu_id != MAX_VCPU_ID ||
+             memcmp(buf.vcpumap, vcpumap, vcpumap_sz(MAX_VCPU_ID)) )
+            FAIL("round %u: vcpu info lost", round);
+        if ( buf.tdata.len != sizeof(tdata) ||
+             memcmp(buf.tdata.data, tdata, sizeof(tdata)) )
+            FAIL("round %u: toolstack data lost", round);
+        if ( !ctx.last_checkpoint )
+            FAIL("round %u: last checkpoint not seen", round);
+        /* Nothing past the end of the body may have been read. */
+        if ( lseek(fd, 0, SEEK_CUR) != end ||
+             read(fd, check, sizeof(check)) != sizeof(check) ||
+             memcmp(check, tail, sizeof(tail)) )
+            FAIL("round %u: read beyond the body", round);
+    }
+    pagebuf_free(&buf);
+
+    /* The same, cut short. */
+    cut = 1 + rand() % (end - 1);
+    if ( ftruncate(fd, cut) )
+    {
+        perror("ftruncate");
+        exit(1);
+    }
+    lseek(fd, 0, SEEK_SET);
+    if ( receive(xch, fd, threaded, &buf, &ctx, &nr) >= 0 )
+        FAIL("round %u: stream cut at %ld of %ld did not fail", round, cut,
+             end);
+    pagebuf_free(&buf);
+
+    fclose(f);
+}
+
+/* Stop the pipe while the reader waits for more of the stream. */
+static void run_stop(xc_interface *xch)
+{
+    struct restore_pipe *rp;
+    struct restore_ctx ctx;
+    pagebuf_t buf, *batch;
+    int fds[2];
+    FILE *f;
+
+    if ( pipe(fds) || !(f = fdopen(fds[1], "w")) )
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    pagebuf_init(&buf);
+    rp = restore_pipe_start(xch, &ctx, &buf, fds[0], 0, 1);
+    if ( !rp )
+    {
+        FAIL("could not start the pipe");
+        return;
+    }
+
+    nr_batches = 1;
+    put_batch(f);
+    fflush(f);
+    if ( restore_pipe_next(rp, &batch) != 1 )
+        FAIL("no batch from the pipe");
+
+    /* Hangs, if the reader cannot be stopped. */
+    alarm(10);
+    restore_pipe_stop(rp);
+    alarm(0);
+
+    pagebuf_free(&buf);
+    fclose(f);
+    close(fds[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int round, rounds = 10, seed = 1, i;
+    xentoollog_logger *logger;
+    xc_interface *xch;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "r:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'r':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+
+    /* Streams are cut short on purpose: only report what is critical. */
+    logger = (xentoollog_logger *)
+        xtl_createlogger_stdiostream(stderr, XTL_CRITICAL, 0);
+    xch = xc_interface_open(logger, logger, XC_OPENFLAG_DUMMY);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for ( i = 0; i < sizeof(tdata); i++ )
+        tdata[i] = rand();
+    for ( i = 0; i <= MAX_VCPU_ID; i++ )
+        if ( rand() % 2 )
+            vcpumap[i / 64] |= 1ULL << (i % 64);
+
+    for ( round = 0; round < rounds && !failures; round++ )
+        run_round(xch, round, round % 2);
+    if ( !failures )
+        run_stop(xch);
+
+    xc_interface_close(xch);
+    xtl_logger_destroy(logger);
+
+    if ( failures )
+    {
+        fprintf(stderr, "%u failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("PASS: %u rounds, read inline and ahead\n", rounds);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
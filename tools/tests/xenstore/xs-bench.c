@@ -0,0 +1,293 @@
+/*
+ * xs-bench.c
+ *
+ * Transaction throughput benchmark for xenstored.
+ *
+ * Each thread opens its own connection and repeatedly runs a transaction
+ * that reads a counter, increments it and writes it back, retrying on
+ * EAGAIN. By default every thread has its own counter, so transactions
+ * don't touch common nodes; with -c they all share one.
+ *
+ * The counters are checked at the end: no increment may be lost.
+ *
+ * With -i, that many more connections are opened and left idle, the way
+ * most domains' rings are most of the time, to measure what the daemon
+ * spends on connections which have nothing to say.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <xenstore.h>
+
+#define BENCH_ROOT "/bench"
+
+static unsigned int nr_threads = 4;
+static unsigned int nr_txns = 1000;
+static unsigned int nr_fill;
+static unsigned int nr_idle;
+static bool shared;
+
+struct worker {
+    pthread_t thread;
+    unsigned int id;
+    unsigned long retries;
+    int err;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-n transactions] [-s store-nodes] "
+            "[-i idle] [-c]\n"
+            "  -t  number of concurrent connections (default 4)\n"
+            "  -n  transactions per connection (default 1000)\n"
+            "  -s  nodes to add to the store beforehand (default 0)\n"
+            "  -i  idle connections to open beforehand (default 0)\n"
+            "  -c  all connections update the same counter\n", prog);
+    exit(2);
+}
+
+static void counter_path(char *buf, size_t len, unsigned int id)
+{
+    if (shared)
+        snprintf(buf, len, BENCH_ROOT "/shared");
+    else
+        snprintf(buf, len, BENCH_ROOT "/%u/count", id);
+}
+
+static int increment(struct xs_handle *xsh, const char *path,
+                     unsigned long *retries)
+{
+    xs_transaction_t t;
+    unsigned int len;
+    char *val, buf[32];
+    unsigned long count;
+
+    for (;;) {
+        t = xs_transaction_start(xsh);
+        if (t == XBT_NULL)
+            return errno;
+
+        val = xs_read(xsh, t, path, &len);
+        count = val ? strtoul(val, NULL, 10) : 0;
+        free(val);
+
+        snprintf(buf, sizeof(buf), "%lu", count + 1);
+        if (!xs_write(xsh, t, path, buf, strlen(buf))) {
+            int err = errno;
+            xs_transaction_end(xsh, t, true);
+            return err;
+        }
+
+        if (xs_transaction_end(xsh, t, false))
+            return 0;
+        if (errno != EAGAIN)
+            return errno;
+        (*retries)++;
+    }
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    struct xs_handle *xsh;
+    char path[64];
+    unsigned int i;
+
+    xsh = xs_open(0);
+    if (!xsh) {
+        w->err = errno;
+        return NULL;
+    }
+
+    counter_path(path, sizeof(path), w->id);
+    for (i = 0; i < nr_txns && !w->err; i++)
+        w->err = increment(xsh, path, &w->retries);
+
+    xs_close(xsh);
+    return NULL;
+}
+
+static int open_socket(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, xs_daemon_socket(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int setup(struct xs_handle *xsh)
+{
+    char path[64], val[16];
+    unsigned int i;
+
+    xs_rm(xsh, XBT_NULL, BENCH_ROOT);
+
+    for (i = 0; i < nr_fill; i++) {
+        snprintf(path, sizeof(path), BENCH_ROOT "/fill/%u/%u", i / 256, i);
+        snprintf(val, sizeof(val), "%u", i);
+        if (!xs_write(xsh, XBT_NULL, path, val, strlen(val)))
+            return errno;
+    }
+
+    for (i = 0; i < nr_threads; i++) {
+        counter_path(path, sizeof(path), i);
+        if (!xs_write(xsh, XBT_NULL, path, "0", 1))
+            return errno;
+    }
+
+    return 0;
+}
+
+static int check(struct xs_handle *xsh)
+{
+    char path[64];
+    unsigned long expected, count;
+    unsigned int i, len;
+    char *val;
+    int bad = 0;
+
+    expected = shared ? (unsigned long)nr_threads * nr_txns : nr_txns;
+    for (i = 0; i < (shared ? 1 : nr_threads); i++) {
+        counter_path(path, sizeof(path), i);
+        val = xs_read(xsh, XBT_NULL, path, &len);
+        count = val ? strtoul(val, NULL, 10) : 0;
+        free(val);
+        if (count != expected) {
+            fprintf(stderr, "%s: %lu, expected %lu\n", path, count, expected);
+            bad = 1;
+        }
+    }
+
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    struct xs_handle *xsh;
+    struct worker *workers;
+    struct timeval start, end;
+    unsigned long retries = 0;
+    unsigned int i;
+    double secs;
+    int *idle_fds = NULL;
+    int opt, err = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:s:i:ch")) != -1) {
+        switch (opt) {
+        case 't':
+            nr_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_txns = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            nr_fill = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            nr_idle = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            shared = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!nr_threads || !nr_txns)
+        usage(argv[0]);
+
+    xsh = xs_open(0);
+    if (!xsh) {
+        perror("xs_open");
+        return 1;
+    }
+
+    err = setup(xsh);
+    if (err) {
+        fprintf(stderr, "setup: %s\n", strerror(err));
+        return 1;
+    }
+
+    /* The daemon only sees a connection once it has been accepted. */
+    if (nr_idle) {
+        idle_fds = calloc(nr_idle, sizeof(*idle_fds));
+        if (!idle_fds) {
+            perror("calloc");
+            return 1;
+        }
+        for (i = 0; i < nr_idle; i++) {
+            idle_fds[i] = open_socket();
+            if (idle_fds[i] < 0) {
+                perror("connect");
+                return 1;
+            }
+        }
+        free(xs_read(xsh, XBT_NULL, BENCH_ROOT, NULL));
+    }
+
+    workers = calloc(nr_threads, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        retries += workers[i].retries;
+        if (workers[i].err && !err)
+            err = workers[i].err;
+    }
+    gettimeofday(&end, NULL);
+
+    if (err) {
+        fprintf(stderr, "transaction failed: %s\n", strerror(err));
+        return 1;
+    }
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%u connections, %u transactions each, %u extra nodes, "
+           "%u idle connections%s\n", nr_threads, nr_txns, nr_fill, nr_idle,
+           shared ? ", shared counter" : "");
+    printf("%.3f s, %.0f commits/s, %lu retries (%.2f per commit)\n",
+           secs, nr_threads * nr_txns / secs, retries,
+           (double)retries / (nr_threads * nr_txns));
+
+    err = check(xsh);
+    for (i = 0; i < nr_idle; i++)
+        close(idle_fds[i]);
+    xs_rm(xsh, XBT_NULL, BENCH_ROOT);
+    xs_close(xsh);
+
+    return err;
+}
@@ -0,0 +1,218 @@
+/*
+ * xs-watch-bench.c
+ *
+ * Watch dispatch benchmark for xenstored.
+ *
+ * Opens one connection per simulated domain and registers a number of
+ * watches on each, below a per-domain directory the way frontends and
+ * backends do. A separate connection then writes to randomly chosen
+ * watched nodes; every write fires exactly one watch, so the write rate
+ * is dominated by the cost of finding the watches to fire.
+ *
+ * At the end the events received on every connection are counted and
+ * checked against the writes done.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <xenstore.h>
+
+#define BENCH_ROOT "/bench"
+
+static unsigned int nr_domains = 1000;
+static unsigned int nr_watches = 32;
+static unsigned int nr_writes = 10000;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d domains] [-w watches] [-n writes]\n"
+            "  -d  number of watching connections (default 1000)\n"
+            "  -w  watches per connection (default 32)\n"
+            "  -n  number of writes (default 10000)\n", prog);
+    exit(2);
+}
+
+static int open_socket(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, xs_daemon_socket(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = read(fd, buf, len);
+        if (ret <= 0)
+            return -1;
+        buf = (char *)buf + ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/* Read one message, returning its type. */
+static int read_msg(int fd)
+{
+    struct xsd_sockmsg msg;
+    char body[XENSTORE_PAYLOAD_MAX];
+
+    if (read_all(fd, &msg, sizeof(msg)) ||
+        msg.len > sizeof(body) ||
+        read_all(fd, body, msg.len))
+        return -1;
+
+    return msg.type;
+}
+
+static int add_watch(int fd, const char *path)
+{
+    struct xsd_sockmsg msg = { .type = XS_WATCH };
+    char body[128];
+    int len, type, acked = 0, events = 0;
+
+    len = snprintf(body, sizeof(body), "%s%ctoken", path, 0) + 1;
+    msg.len = len;
+    if (write(fd, &msg, sizeof(msg)) != sizeof(msg) ||
+        write(fd, body, len) != len)
+        return -1;
+
+    /* The ack, and the event every new watch fires. */
+    while (!acked || !events) {
+        type = read_msg(fd);
+        if (type == XS_WATCH)
+            acked++;
+        else if (type == XS_WATCH_EVENT)
+            events++;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+static void watch_path(char *buf, size_t len, unsigned int dom,
+                       unsigned int watch)
+{
+    snprintf(buf, len, BENCH_ROOT "/%u/device/%u", dom, watch);
+}
+
+int main(int argc, char **argv)
+{
+    struct xs_handle *xsh;
+    struct timeval start, end;
+    unsigned int *expected;
+    unsigned int i, j, dom;
+    char path[64];
+    double secs;
+    int *fds;
+    int opt, bad = 0;
+
+    while ((opt = getopt(argc, argv, "d:w:n:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            nr_domains = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            nr_watches = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_writes = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!nr_domains || !nr_watches)
+        usage(argv[0]);
+
+    xsh = xs_open(0);
+    if (!xsh) {
+        perror("xs_open");
+        return 1;
+    }
+    xs_rm(xsh, XBT_NULL, BENCH_ROOT);
+
+    fds = calloc(nr_domains, sizeof(*fds));
+    expected = calloc(nr_domains, sizeof(*expected));
+    if (!fds || !expected) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (i = 0; i < nr_domains; i++) {
+        fds[i] = open_socket();
+        if (fds[i] < 0) {
+            perror("connect");
+            return 1;
+        }
+        for (j = 0; j < nr_watches; j++) {
+            watch_path(path, sizeof(path), i, j);
+            if (add_watch(fds[i], path)) {
+                fprintf(stderr, "watch %s failed\n", path);
+                return 1;
+            }
+        }
+    }
+
+    printf("%u connections, %u watches each, %u writes\n",
+           nr_domains, nr_watches, nr_writes);
+
+    srand(1);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nr_writes; i++) {
+        dom = rand() % nr_domains;
+        watch_path(path, sizeof(path), dom, rand() % nr_watches);
+        if (!xs_write(xsh, XBT_NULL, path, "1", 1)) {
+            perror("xs_write");
+            return 1;
+        }
+        expected[dom]++;
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%.3f s, %.0f writes/s\n", secs, nr_writes / secs);
+
+    for (i = 0; i < nr_domains; i++) {
+        for (j = 0; j < expected[i]; j++) {
+            if (read_msg(fds[i]) != XS_WATCH_EVENT) {
+                fprintf(stderr, "connection %u: missing events\n", i);
+                bad = 1;
+                break;
+            }
+        }
+        close(fds[i]);
+    }
+
+    xs_rm(xsh, XBT_NULL, BENCH_ROOT);
+    xs_close(xsh);
+
+    return bad;
+}
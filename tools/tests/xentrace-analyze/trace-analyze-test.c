@@ -0,0 +1,711 @@
+/*
+ * trace-analyze-test.c
+ *
+ * Test for the analysis done by xentrace_analyze, on traces made up here
+ * in xentrace's format: records kept per CPU and written out a window at
+ * a time, so that windows of different CPUs are out of TSC order in the
+ * file. Each case checks the counts, the merge by TSC, the handling of
+ * damaged traces and the reading of compressed ones; the last runs a random schedule of vcpus over the CPUs
+ * and checks the runstate times and latencies found for each domain
+ * against the schedule.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <xen/xen.h>
+#include <xen/trace.h>
+#include <xen/vcpu.h>
+
+#include "analyze.h"
+
+#define NR_CPUS 4
+#define NR_DOMS 4
+#define NR_VCPUS 3
+
+static unsigned int failures;
+
+#define FAIL(_f, _a...) do {                        \
+    fprintf(stderr, "FAIL: " _f "\n", ## _a);       \
+    failures++;                                     \
+} while (0)
+
+#define CHECK(_name, _got, _want) do {                                  \
+    uint64_t got_ = (_got), want_ = (_want);                            \
+    if ( got_ != want_ )                                                \
+        FAIL("%s: %s is %"PRIu64", expected %"PRIu64,                   \
+             __func__, _name, got_, want_);                             \
+} while (0)
+
+struct buf {
+    unsigned char *p;
+    size_t len, max;
+};
+
+/* The trace, and the records of each CPU not yet written to it. */
+static struct buf trace, pending[NR_CPUS];
+
+static void put(struct buf *b, const void *p, size_t len)
+{
+    if ( b->len + len > b->max )
+    {
+        b->max = (b->len + len) * 2;
+        b->p = realloc(b->p, b->max);
+        if ( !b->p )
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(b->p + b->len, p, len);
+    b->len += len;
+}
+
+static void put_u32(struct buf *b, uint32_t v)
+{
+    put(b, &v, sizeof(v));
+}
+
+static void reset(void)
+{
+    unsigned int i;
+
+    trace.len = 0;
+    for ( i = 0; i < NR_CPUS; i++ )
+        pending[i].len = 0;
+}
+
+/* A record, with a TSC unless tsc is 0. */
+static void rec(unsigned int cpu, uint64_t tsc, uint32_t event,
+                unsigned int extra, const uint32_t *data)
+{
+    struct buf *b = &pending[cpu];
+
+    put_u32(b, event | (extra << TRACE_EXTRA_SHIFT) |
+            (tsc ? TRC_HD_CYCLE_FLAG : 0));
+    if ( tsc )
+        put(b, &tsc, sizeof(tsc));
+    put(b, data, extra * sizeof(uint32_t));
+}
+
+static void rec1(unsigned int cpu, uint64_t tsc, uint32_t event,
+                 uint32_t d0)
+{
+    rec(cpu, tsc, event, 1, &d0);
+}
+
+static void runstate(unsigned int cpu, uint64_t tsc, unsigned int domid,
+                     unsigned int vcpuid, int old, int new)
+{
+    rec1(cpu, tsc, TRC_SCHED_RUNSTATE_CHANGE | (old << 8) | (new << 4),
+         (domid << 16) | vcpuid);
+}
+
+/* Write out a window of a CPU, as xentrace does, claiming size bytes. */
+static void window_size(unsigned int cpu, uint32_t size)
+{
+    put_u32(&trace, TRC_TRACE_CPU_CHANGE | (2 << TRACE_EXTRA_SHIFT));
+    put_u32(&trace, cpu);
+    put_u32(&trace, size);
+    put(&trace, pending[cpu].p, pending[cpu].len);
+    pending[cpu].len = 0;
+}
+
+static void window(unsigned int cpu)
+{
+    window_size(cpu, pending[cpu].len);
+}
+
+static void analyze_trace(struct analyze *a)
+{
+    if ( analyze_init(a) || analyze_add_buffer(a, trace.p, trace.len) ||
+         analyze_run(a) )
+    {
+        perror("analyze");
+        exit(1);
+    }
+}
+
+static struct analyze_event *find_event(struct analyze *a, uint32_t event)
+{
+    unsigned int i;
+
+    for ( i = 0; i < a->max_events; i++ )
+        if ( a->events[i].records && a->events[i].event == event )
+            return &a->events[i];
+    return NULL;
+}
+
+static uint64_t event_records(struct analyze *a, uint32_t event)
+{
+    struct analyze_event *e = find_event(a, event);
+
+    return e ? e->records : 0;
+}
+
+/* Records and bytes by class and event, over many events. */
+static void test_counts(void)
+{
+    static const uint32_t classes[] = {
+        TRC_GEN, TRC_SCHED, TRC_DOM0OP, TRC_HVM, TRC_MEM, TRC_PV,
+        TRC_SHADOW, TRC_HW, TRC_GUEST
+    };
+    uint64_t records[ANALYZE_NR_CLASSES + 1] = { 0 };
+    uint64_t bytes[ANALYZE_NR_CLASSES + 1] = { 0 };
+    uint32_t data[7] = { 0 }, event;
+    unsigned int i, cls, extra, size;
+    uint64_t tsc = 1, total = 0;
+    struct analyze a;
+
+    reset();
+    for ( i = 0; i < 5000; i++ )
+    {
+        /* 9 classes, 50 events in each. */
+        cls = i % 9;
+        event = classes[cls] + 0x100 + (i / 9) % 50;
+        extra = i % 8;
+        rec(i % NR_CPUS, (i % 3) ? tsc++ : 0, event, extra, data);
+        size = 4 + extra * 4 + ((i % 3) ? 8 : 0);
+        cls = analyze_class(event);
+        records[cls]++;
+        bytes[cls] += size;
+        total += size;
+        if ( i % 97 == 0 )
+            window(i % NR_CPUS);
+    }
+    for ( i = 0; i < NR_CPUS; i++ )
+        window(i);
+
+    /* Not a single class. */
+    rec(0, tsc++, 0x00030001, 0, data);
+    window(0);
+    records[ANALYZE_CLASS_OTHER]++;
+    bytes[ANALYZE_CLASS_OTHER] += 12;
+    total += 12;
+
+    analyze_trace(&a);
+    CHECK("records", a.records, 5001);
+    CHECK("bytes", a.bytes, total);
+    CHECK("events", a.nr_events, 451);
+    for ( i = 0; i <= ANALYZE_NR_CLASSES; i++ )
+    {
+        CHECK("class records", a.classes[i].records, records[i]);
+        CHECK("class bytes", a.classes[i].bytes, bytes[i]);
+    }
+    CHECK("class of TRC_GEN", analyze_class(TRC_LOST_RECORDS), 0);
+    CHECK("class of TRC_GUEST", analyze_class(TRC_GUEST | 1), 11);
+    CHECK("event", event_records(&a, TRC_HVM + 0x100), 12);
+    CHECK("event", event_records(&a, TRC_HVM + 0x100 + 49), 11);
+    CHECK("backwards", a.backwards, 0);
+    CHECK("truncated", a.truncated, 0);
+    analyze_free(&a);
+}
+
+/*
+ * A vcpu woken on CPU 0 and run on CPU 1, with the window of CPU 1 first
+ * in the file: the wakeup has to be taken first.
+ */
+static void test_merge(void)
+{
+    struct analyze_domain *d;
+    struct analyze a;
+    uint32_t data[1] = { 0 };
+
+    reset();
+    runstate(0, 10, 1, 0, RUNSTATE_runnable, RUNSTATE_running);
+    rec(0, 20, TRC_HVM_VMEXIT, 1, data);
+    runstate(0, 50, 1, 0, RUNSTATE_running, RUNSTATE_blocked);
+    runstate(0, 100, 1, 0, RUNSTATE_blocked, RUNSTATE_runnable);
+    runstate(1, 200, 1, 0, RUNSTATE_runnable, RUNSTATE_running);
+    rec(1, 250, TRC_HVM_VMEXIT, 1, data);
+    rec(1, 260, TRC_HVM_VMEXIT, 1, data);
+    runstate(1, 300, 1, 0, RUNSTATE_running, RUNSTATE_runnable);
+    runstate(1, 400, 1, 0, RUNSTATE_runnable, RUNSTATE_running);
+    window(1);
+    window(0);
+
+    analyze_trace(&a);
+    CHECK("backwards", a.backwards, 0);
+    CHECK("first tsc", a.first_tsc, 10);
+    CHECK("last tsc", a.last_tsc, 400);
+    d = a.domains[1];
+    if ( !d )
+    {
+        FAIL("%s: no domain 1", __func__);
+        analyze_free(&a);
+        return;
+    }
+    CHECK("running", d->runstate[RUNSTATE_running], 40 + 100);
+    CHECK("runnable", d->runstate[RUNSTATE_runnable], 100 + 100);
+    CHECK("blocked", d->runstate[RUNSTATE_blocked], 50);
+    CHECK("switches", d->switches, 3);
+    CHECK("wakeups", d->wakeups, 1);
+    CHECK("wake count", d->wake_lat.count, 1);
+    CHECK("wake total", d->wake_lat.total, 100);
+    CHECK("preempt count", d->preempt_lat.count, 1);
+    CHECK("preempt max", d->preempt_lat.max, 100);
+    CHECK("preempt bucket", a.preempt_lat.hist[analyze_lat_bucket(100)], 1);
+    /* Those while it was running, including the switches away. */
+    CHECK("domain records", d->records, 5);
+    analyze_free(&a);
+}
+
+/* Records without a TSC are at the time of the record before. */
+static void test_inherit(void)
+{
+    struct analyze a;
+
+    reset();
+    runstate(0, 1000, 2, 0, RUNSTATE_running, RUNSTATE_runnable);
+    runstate(0, 0, 3, 0, RUNSTATE_runnable, RUNSTATE_running);
+    runstate(0, 2000, 3, 0, RUNSTATE_running, RUNSTATE_blocked);
+    runstate(1, 500, 3, 0, RUNSTATE_blocked, RUNSTATE_runnable);
+    runstate(1, 1500, 2, 0, RUNSTATE_runnable, RUNSTATE_running);
+    window(0);
+    window(1);
+
+    analyze_trace(&a);
+    CHECK("backwards", a.backwards, 0);
+    CHECK("wake total", a.wake_lat.total, 500);
+    CHECK("preempt total", a.preempt_lat.total, 500);
+    if ( a.domains[3] )
+        CHECK("running", a.domains[3]->runstate[RUNSTATE_running], 1000);
+    else
+        FAIL("%s: no domain 3", __func__);
+    analyze_free(&a);
+}
+
+static void test_lost(void)
+{
+    struct analyze a;
+
+    reset();
+    rec1(0, 10, TRC_LOST_RECORDS, 42);
+    rec1(1, 20, TRC_LOST_RECORDS, 58);
+    window(0);
+    window(1);
+
+    analyze_trace(&a);
+    CHECK("lost", a.lost, 100);
+    analyze_free(&a);
+}
+
+/* Damage to a trace is counted, and what can be read is. */
+static void test_truncated(void)
+{
+    uint32_t data[2] = { 0 };
+    struct analyze a;
+    size_t len;
+
+    /* A window which runs off the end. */
+    reset();
+    rec(0, 10, TRC_HVM_VMEXIT, 2, data);
+    rec(0, 20, TRC_HVM_VMEXIT, 2, data);
+    window(0);
+    rec(1, 30, TRC_HVM_VMEXIT, 2, data);
+    rec(1, 40, TRC_HVM_VMEXIT, 2, data);
+    window(1);
+    trace.len -= 4;
+
+    analyze_trace(&a);
+    CHECK("records", a.records, 3);
+    CHECK("truncated", a.truncated, 2);
+    analyze_free(&a);
+
+    /* A window which does not end on a record. */
+    reset();
+    rec(0, 10, TRC_HVM_VMEXIT, 2, data);
+    rec(0, 20, TRC_HVM_VMEXIT, 2, data);
+    len = pending[0].len;
+    window_size(0, len - 4);
+    trace.len -= 4;
+    rec(0, 30, TRC_HVM_VMEXIT, 2, data);
+    window(0);
+
+    analyze_trace(&a);
+    CHECK("records", a.records, 2);
+    CHECK("truncated", a.truncated, 1);
+    analyze_free(&a);
+
+    /* Garbage between windows, and a part of a window header at the end. */
+    reset();
+    rec(0, 10, TRC_HVM_VMEXIT, 2, data);
+    window(0);
+    put_u32(&trace, 0xdeadbeef);
+    rec(1, 20, TRC_HVM_VMEXIT, 2, data);
+    window(1);
+
+    analyze_trace(&a);
+    CHECK("records", a.records, 1);
+    CHECK("truncated", a.truncated, 1);
+    analyze_free(&a);
+
+    reset();
+    rec(0, 10, TRC_HVM_VMEXIT, 2, data);
+    window(0);
+    put_u32(&trace, TRC_TRACE_CPU_CHANGE | (2 << TRACE_EXTRA_SHIFT));
+
+    analyze_trace(&a);
+    CHECK("records", a.records, 1);
+    CHECK("truncated", a.truncated, 1);
+    analyze_free(&a);
+}
+
+/* A trace split over files, as xentrace with its output rotated. */
+static void test_files(void)
+{
+    char name[2][32];
+    struct analyze a;
+    unsigned int i;
+    size_t split;
+    FILE *f;
+    int fd;
+
+    reset();
+    runstate(0, 100, 4, 1, RUNSTATE_blocked, RUNSTATE_runnable);
+    window(0);
+    split = trace.len;
+    runstate(1, 150, 4, 1, RUNSTATE_runnable, RUNSTATE_running);
+    runstate(1, 400, 4, 1, RUNSTATE_running, RUNSTATE_blocked);
+    window(1);
+
+    for ( i = 0; i < 2; i++ )
+    {
+        strcpy(name[i], "/tmp/trace-analyze.XXXXXX");
+        if ( (fd = mkstemp(name[i])) < 0 || !(f = fdopen(fd, "w")) )
+        {
+            perror("mkstemp");
+            exit(1);
+        }
+        if ( i == 0 )
+            fwrite(trace.p, split, 1, f);
+        else
+            fwrite(trace.p + split, trace.len - split, 1, f);
+        fclose(f);
+    }
+
+    if ( analyze_init(&a) || analyze_add_file(&a, name[0]) ||
+         analyze_add_file(&a, name[1]) || analyze_run(&a) )
+    {
+        perror("analyze");
+        exit(1);
+    }
+    unlink(name[0]);
+    unlink(name[1]);
+
+    CHECK("records", a.records, 3);
+    CHECK("wake total", a.wake_lat.total, 50);
+    if ( a.domains[4] )
+        CHECK("running", a.domains[4]->runstate[RUNSTATE_running], 250);
+    else
+        FAIL("%s: no domain 4", __func__);
+    CHECK("nr files", a.nr_files, 2);
+    analyze_free(&a);
+
+    if ( analyze_init(&a) )
+        exit(1);
+    if ( analyze_add_file(&a, "/nonexistent/trace") == 0 || errno != ENOENT )
+        FAIL("%s: missing file not reported", __func__);
+    analyze_free(&a);
+}
+
+/* As written by xentrace -z: a gzip member for each chunk. */
+static void test_gzip(void)
+{
+    char name[] = "/tmp/trace-analyze.XXXXXX";
+    struct analyze a;
+    size_t split;
+    struct stat st;
+    gzFile gz;
+    int fd;
+
+    reset();
+    runstate(0, 100, 4, 1, RUNSTATE_blocked, RUNSTATE_runnable);
+    window(0);
+    split = trace.len;
+    runstate(1, 150, 4, 1, RUNSTATE_runnable, RUNSTATE_running);
+    runstate(1, 400, 4, 1, RUNSTATE_running, RUNSTATE_blocked);
+    window(1);
+
+    if ( (fd = mkstemp(name)) < 0 )
+    {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    if ( !(gz = gzopen(name, "wb")) || gzwrite(gz, trace.p, split) <= 0 ||
+         gzclose(gz) != Z_OK || stat(name, &st) ||
+         !(gz = gzopen(name, "ab")) ||
+         gzwrite(gz, trace.p + split, trace.len - split) <= 0 ||
+         gzclose(gz) != Z_OK )
+    {
+        perror("gzwrite");
+        exit(1);
+    }
+
+    if ( analyze_init(&a) || analyze_add_file(&a, name) || analyze_run(&a) )
+    {
+        perror("analyze");
+        exit(1);
+    }
+    CHECK("records", a.records, 3);
+    CHECK("bytes", a.bytes, trace.len - 2 * 12);
+    CHECK("wake total", a.wake_lat.total, 50);
+    CHECK("truncated", a.truncated, 0);
+    analyze_free(&a);
+
+    /* Cut short in the second member: the first is still read. */
+    if ( truncate(name, st.st_size + 16) )
+    {
+        perror("truncate");
+        exit(1);
+    }
+    if ( analyze_init(&a) || analyze_add_file(&a, name) || analyze_run(&a) )
+    {
+        perror("analyze");
+        exit(1);
+    }
+    unlink(name);
+    CHECK("records", a.records, 1);
+    if ( !a.truncated )
+        FAIL("%s: cut short file not reported", __func__);
+    analyze_free(&a);
+}
+
+/*
+ * A random schedule. Each CPU runs a vcpu or none; at each step a running
+ * vcpu blocks or is preempted, a blocked one is woken, or an idle CPU
+ * picks a runnable vcpu. Windows are written out at random.
+ */
+struct sim_vcpu {
+    int state, woken;
+    uint64_t since;
+};
+
+static struct sim_vcpu sim[NR_DOMS][NR_VCPUS];
+static int cpu_dom[NR_CPUS], cpu_vcpu[NR_CPUS];
+static struct analyze_domain want[NR_DOMS];
+static uint64_t want_records, now;
+
+static void sim_rec(unsigned int cpu)
+{
+    if ( cpu_dom[cpu] >= 0 )
+        want[cpu_dom[cpu]].records++;
+    want_records++;
+}
+
+static void sim_change(unsigned int cpu, unsigned int dom, unsigned int v,
+                       int new)
+{
+    struct sim_vcpu *s = &sim[dom][v];
+    uint64_t lat;
+
+    sim_rec(cpu);
+    runstate(cpu, ++now, dom, v, s->state, new);
+
+    want[dom].runstate[s->state] += now - s->since;
+    if ( new == RUNSTATE_running )
+    {
+        want[dom].switches++;
+        if ( s->state == RUNSTATE_runnable )
+        {
+            lat = now - s->since;
+            if ( s->woken )
+                want[dom].wake_lat.count++, want[dom].wake_lat.total += lat;
+            else
+                want[dom].preempt_lat.count++,
+                    want[dom].preempt_lat.total += lat;
+        }
+        cpu_dom[cpu] = dom;
+        cpu_vcpu[cpu] = v;
+    }
+    else if ( new == RUNSTATE_runnable )
+    {
+        s->woken = (s->state == RUNSTATE_blocked ||
+                    s->state == RUNSTATE_offline);
+        if ( s->woken )
+            want[dom].wakeups++;
+    }
+    if ( s->state == RUNSTATE_running && new != RUNSTATE_running )
+        cpu_dom[cpu] = cpu_vcpu[cpu] = -1;
+
+    s->state = new;
+    s->since = now;
+}
+
+static void test_sim(unsigned int steps)
+{
+    unsigned int i, cpu, dom, v, tries;
+    struct analyze_domain *d;
+    uint32_t data[3] = { 0 };
+    uint64_t wake = 0, preempt = 0;
+    struct analyze a;
+
+    reset();
+    memset(want, 0, sizeof(want));
+    want_records = 0;
+    now = 0;
+    for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+        cpu_dom[cpu] = cpu_vcpu[cpu] = -1;
+
+    /* Everything starts offline, with a record to say so. */
+    for ( dom = 0; dom < NR_DOMS; dom++ )
+        for ( v = 0; v < NR_VCPUS; v++ )
+        {
+            sim[dom][v].state = RUNSTATE_offline;
+            sim[dom][v].since = now + 1;
+            sim_rec(0);
+            runstate(0, ++now, dom, v, RUNSTATE_offline, RUNSTATE_offline);
+        }
+
+    for ( i = 0; i < steps; i++ )
+    {
+        cpu = rand() % NR_CPUS;
+        switch ( rand() % 4 )
+        {
+        case 0:
+            /* Some records, a few without a TSC. */
+            sim_rec(cpu);
+            rec(cpu, ++now, TRC_HVM_VMEXIT, 3, data);
+            while ( rand() % 2 )
+            {
+                sim_rec(cpu);
+                rec(cpu, 0, TRC_PV_HYPERCALL, 1, data);
+            }
+            break;
+
+        case 1:
+            if ( cpu_dom[cpu] < 0 )
+                break;
+            sim_change(cpu, cpu_dom[cpu], cpu_vcpu[cpu],
+                       rand() % 2 ? RUNSTATE_blocked : RUNSTATE_runnable);
+            break;
+
+        case 2:
+            dom = rand() % NR_DOMS;
+            v = rand() % NR_VCPUS;
+            if ( sim[dom][v].state == RUNSTATE_blocked ||
+                 sim[dom][v].state == RUNSTATE_offline )
+                sim_change(cpu, dom, v, RUNSTATE_runnable);
+            break;
+
+        case 3:
+            if ( cpu_dom[cpu] >= 0 )
+                break;
+            for ( tries = 0; tries < 8; tries++ )
+            {
+                dom = rand() % NR_DOMS;
+                v = rand() % NR_VCPUS;
+                if ( sim[dom][v].state == RUNSTATE_runnable )
+                {
+                    sim_change(cpu, dom, v, RUNSTATE_running);
+                    break;
+                }
+            }
+            break;
+        }
+
+        if ( rand() % 16 == 0 )
+            window(rand() % NR_CPUS);
+    }
+    for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+        window(cpu);
+
+    /* Whatever each vcpu is doing lasts to the end of the trace. */
+    for ( dom = 0; dom < NR_DOMS; dom++ )
+        for ( v = 0; v < NR_VCPUS; v++ )
+            want[dom].runstate[sim[dom][v].state] += now - sim[dom][v].since;
+
+    analyze_trace(&a);
+    CHECK("records", a.records, want_records);
+    CHECK("backwards", a.backwards, 0);
+    CHECK("last tsc", a.last_tsc, now);
+
+    for ( dom = 0; dom < NR_DOMS; dom++ )
+    {
+        if ( !(d = a.domains[dom]) )
+        {
+            FAIL("%s: no domain %u", __func__, dom);
+            continue;
+        }
+        for ( i = 0; i < ANALYZE_NR_RUNSTATES; i++ )
+            CHECK("runstate", d->runstate[i], want[dom].runstate[i]);
+        CHECK("switches", d->switches, want[dom].switches);
+        CHECK("wakeups", d->wakeups, want[dom].wakeups);
+        CHECK("wake count", d->wake_lat.count, want[dom].wake_lat.count);
+        CHECK("wake total", d->wake_lat.total, want[dom].wake_lat.total);
+        CHECK("preempt count", d->preempt_lat.count,
+              want[dom].preempt_lat.count);
+        CHECK("preempt total", d->preempt_lat.total,
+              want[dom].preempt_lat.total);
+        CHECK("domain records", d->records, want[dom].records);
+        wake += want[dom].wake_lat.count;
+        preempt += want[dom].preempt_lat.count;
+    }
+
+    CHECK("wake count", a.wake_lat.count, wake);
+    CHECK("preempt count", a.preempt_lat.count, preempt);
+    for ( i = 0; i < ANALYZE_LAT_BUCKETS; i++ )
+        wake -= a.wake_lat.hist[i];
+    CHECK("wake histogram", wake, 0);
+    analyze_free(&a);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int round, rounds = 10, seed = 1;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "r:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'r':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+
+    test_counts();
+    test_merge();
+    test_inherit();
+    test_lost();
+    test_truncated();
+    test_files();
+    test_gzip();
+    for ( round = 0; round < rounds && !failures; round++ )
+        test_sim(20000);
+
+    if ( failures )
+    {
+        fprintf(stderr, "%u failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("PASS: %u random schedules\n", rounds);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -30,10 +30,14 @@
 
 int policy_init(struct xenpaging *paging);
 unsigned long policy_choose_victim(struct xenpaging *paging);
+/* Nominate up to nr gfns at once, returns how many, 0 if none are left */
+int policy_choose_victims(struct xenpaging *paging, unsigned long *gfns, int nr);
 void policy_notify_paged_out(unsigned long gfn);
 void policy_notify_paged_in(unsigned long gfn);
 void policy_notify_paged_in_nomru(unsigned long gfn);
 void policy_notify_dropped(unsigned long gfn);
+/* A nominated gfn was not paged out after all, it may be nominated again */
+void policy_notify_not_paged_out(unsigned long gfn);
 
 #endif // __XEN_PAGING_POLICY_H__
 
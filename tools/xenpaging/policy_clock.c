@@ -0,0 +1,254 @@
+/******************************************************************************
+ *
+ * Xen domain paging policy which keeps hot pages in.
+ *
+ * xenpaging only learns that the guest uses a page when the guest faults
+ * on it after it was paged out, so hot pages are told apart by their
+ * page-in faults. As in CLOCK-Pro, a page faulted in during its test
+ * period, that is before as many pages have been paged out after it as
+ * are paged out now, was paged out too soon: it becomes hot. Other pages
+ * are cold, and only cold pages are paged out.
+ *
+ * Hot pages stay hot until there are more of them than the hot target,
+ * when the clock hand demotes them to cold as it passes. The target
+ * adapts, like in ARC: it grows when a demoted page is faulted in during
+ * its test period, as more hot pages should have been kept, and shrinks
+ * when a page which was cold all along is, as the cold pages needed more
+ * room.
+ *
+ * The hand nominates a batch of victims in one go.
+ *
+ * Unlike the default policy, every page-in counts, whatever the MRU size:
+ * a small target is when telling hot pages apart matters most.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "xc_bitops.h"
+#include "policy.h"
+
+
+#define DEFAULT_MRU_SIZE (1024 * 16)
+
+/* Page state */
+#define PAGE_HOT        1
+#define PAGE_DEMOTED    2
+
+
+static unsigned long *bitmap;
+static unsigned long *unconsumed;
+static unsigned int unconsumed_cleared;
+static unsigned char *state;
+static uint32_t *paged_out_seq;
+static uint32_t seq;
+static unsigned long nr_paged_out;
+static unsigned long nr_hot, hot_target;
+static unsigned long hand;
+static unsigned long max_pages;
+
+
+int policy_init(struct xenpaging *paging)
+{
+    int rc = -ENOMEM;
+
+    max_pages = paging->max_pages;
+
+    /* Allocate bitmap for pages not to page out */
+    bitmap = bitmap_alloc(max_pages);
+    if ( !bitmap )
+        goto out;
+    /* Allocate bitmap to track unusable pages */
+    unconsumed = bitmap_alloc(max_pages);
+    if ( !unconsumed )
+        goto out;
+
+    state = calloc(max_pages, sizeof(*state));
+    paged_out_seq = calloc(max_pages, sizeof(*paged_out_seq));
+    if ( !state || !paged_out_seq )
+        goto out;
+
+    /* Not used here, but xenpaging looks at it when pages are paged in */
+    if ( paging->policy_mru_size <= 0 )
+        paging->policy_mru_size = DEFAULT_MRU_SIZE;
+
+    /* Don't page out page 0 */
+    set_bit(0, bitmap);
+
+    /* Start in the middle to avoid paging during BIOS startup */
+    hand = max_pages / 2;
+
+    hot_target = max_pages / 2;
+
+    rc = 0;
+ out:
+    return rc;
+}
+
+/* Most pages which may be hot, out of those in memory */
+static unsigned long max_hot(void)
+{
+    return (max_pages - nr_paged_out) / 8 * 7;
+}
+
+int policy_choose_victims(struct xenpaging *paging, unsigned long *gfns, int nr)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long i;
+    int n = 0;
+
+    /* The second turn demotes hot pages, whatever the target */
+    for ( i = 0; i < 2 * max_pages && n < nr; i++ )
+    {
+        if ( ++hand >= max_pages )
+            hand = 0;
+
+        if ( (hand & (BITS_PER_LONG - 1)) == 0 &&
+             hand + BITS_PER_LONG <= max_pages )
+        {
+            /* All gfns busy */
+            if ( ~(bitmap[hand >> ORDER_LONG] |
+                   unconsumed[hand >> ORDER_LONG]) == 0 )
+            {
+                hand += BITS_PER_LONG - 1;
+                i += BITS_PER_LONG - 1;
+                continue;
+            }
+        }
+
+        /* gfn busy, or already tested */
+        if ( test_bit(hand, bitmap) || test_bit(hand, unconsumed) )
+            continue;
+
+        if ( state[hand] & PAGE_HOT )
+        {
+            if ( nr_hot <= hot_target && nr_hot <= max_hot() &&
+                 i < max_pages )
+                continue;
+            /* Too many hot pages, this one gets paged out next time */
+            state[hand] = PAGE_DEMOTED;
+            nr_hot--;
+            continue;
+        }
+
+        set_bit(hand, unconsumed);
+        gfns[n++] = hand;
+    }
+
+    /* Could not nominate any gfn */
+    if ( n == 0 )
+    {
+        /* No more pages, wait in poll */
+        paging->use_poll_timeout = 1;
+        /* Count wrap arounds */
+        unconsumed_cleared++;
+        /* Force retry every few seconds (depends on poll() timeout) */
+        if ( unconsumed_cleared > 123 )
+        {
+            /* Force retry of unconsumed gfns on next call */
+            bitmap_clear(unconsumed, max_pages);
+            unconsumed_cleared = 0;
+            DPRINTF("clearing unconsumed, hand %lx", hand);
+        }
+    }
+
+    return n;
+}
+
+unsigned long policy_choose_victim(struct xenpaging *paging)
+{
+    unsigned long gfn;
+
+    if ( policy_choose_victims(paging, &gfn, 1) == 0 )
+        return INVALID_MFN;
+
+    return gfn;
+}
+
+void policy_notify_paged_out(unsigned long gfn)
+{
+    set_bit(gfn, bitmap);
+    clear_bit(gfn, unconsumed);
+    if ( state[gfn] & PAGE_HOT )
+    {
+        /* Only when the policy was not asked */
+        state[gfn] = PAGE_DEMOTED;
+        nr_hot--;
+    }
+    paged_out_seq[gfn] = ++seq;
+    nr_paged_out++;
+}
+
+static void policy_handle_paged_in(unsigned long gfn)
+{
+    int test_period;
+
+    /* Dropped pages are resumed too, but are no longer paged out */
+    if ( !test_and_clear_bit(gfn, bitmap) )
+        return;
+    nr_paged_out--;
+    test_period = seq - paged_out_seq[gfn] < nr_paged_out;
+
+    if ( test_period )
+    {
+        /* Adapt the hot target, see above */
+        if ( state[gfn] & PAGE_DEMOTED )
+        {
+            if ( hot_target < max_pages )
+                hot_target++;
+        }
+        else if ( hot_target > 0 )
+            hot_target--;
+
+        state[gfn] = PAGE_HOT;
+        nr_hot++;
+    }
+    else
+        state[gfn] = 0;
+}
+
+void policy_notify_paged_in(unsigned long gfn)
+{
+    policy_handle_paged_in(gfn);
+}
+
+void policy_notify_paged_in_nomru(unsigned long gfn)
+{
+    policy_handle_paged_in(gfn);
+}
+
+void policy_notify_dropped(unsigned long gfn)
+{
+    /* The guest no longer needs the page, that says nothing of its heat */
+    if ( test_and_clear_bit(gfn, bitmap) )
+        nr_paged_out--;
+    state[gfn] = 0;
+}
+
+void policy_notify_not_paged_out(unsigned long gfn)
+{
+    clear_bit(gfn, unconsumed);
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
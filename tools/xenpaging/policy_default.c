@@ -137,6 +137,20 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
     return current_gfn;
 }
 
+int policy_choose_victims(struct xenpaging *paging, unsigned long *gfns, int nr)
+{
+    int n;
+
+    for ( n = 0; n < nr; n++ )
+    {
+        gfns[n] = policy_choose_victim(paging);
+        if ( gfns[n] == INVALID_MFN )
+            break;
+    }
+
+    return n;
+}
+
 void policy_notify_paged_out(unsigned long gfn)
 {
     set_bit(gfn, bitmap);
@@ -175,6 +189,11 @@ void policy_notify_dropped(unsigned long gfn)
     clear_bit(gfn, bitmap);
 }
 
+void policy_notify_not_paged_out(unsigned long gfn)
+{
+    clear_bit(gfn, unconsumed);
+}
+
 
 /*
  * Local variables:
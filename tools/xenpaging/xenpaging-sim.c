@@ -0,0 +1,386 @@
+/******************************************************************************
+ * tools/xenpaging/xenpaging-sim.c
+ *
+ * Replay a recorded sequence of page references against a paging policy,
+ * to see how often the guest would have faulted with it. Each policy is
+ * linked into a binary of its own, xenpaging-sim-<policy>.
+ *
+ * The trace has one event per line, gfns in hex and counts in decimal:
+ *
+ *   m <pages>   the guest has this many pages (gfns 0 to pages - 1)
+ *   t <pages>   the target number of pages in memory is now this, or
+ *               0 for no target: all pages are paged in
+ *   i <gfn>     the guest faulted on this page (from xenpaging -t)
+ *   r <gfn>     the guest used this page (from any other source)
+ *
+ * and # starts a comment. As in xenpaging, pages are paged out whenever
+ * more than the target are in memory, and paged in when the guest refers
+ * to them. A trace recorded by xenpaging only has the references which
+ * faulted under the policy it ran with; references to pages in memory
+ * can be merged in as r lines where they are known.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <xc_private.h>
+
+#include "xc_bitops.h"
+#include "policy.h"
+#include "xenpaging.h"
+
+struct sim_stats {
+    uint64_t refs;
+    uint64_t faults;
+    uint64_t test_faults;       /* faults on pages in their test period */
+    uint64_t paged_out;
+    uint64_t short_rounds;      /* rounds which could not reach the target */
+    uint64_t window_faults, worst_window;
+    uint64_t policy_ns;
+};
+
+static struct xenpaging paging;
+static unsigned long *paged_out;
+static uint32_t *paged_out_seq;
+static unsigned long target;
+static int batch = 42;
+static unsigned long window = 1000;
+static struct sim_stats st;
+
+static void usage(void)
+{
+    fprintf(stderr,
+"Usage: xenpaging-sim-<policy> [OPTION...] TRACE\n"
+"Replay a trace of page references against a xenpaging policy.\n"
+"\n"
+"  -m, --max_pages=N       Pages in the guest, if not in the trace\n"
+"                          [highest gfn + 1].\n"
+"  -t, --target=N          Pages in memory until the trace sets a target\n"
+"                          [0, no target].\n"
+"  -r, --mru_size=N        As for xenpaging.\n"
+"  -b, --batch=N           Most pages paged out at a time [42].\n"
+"  -w, --window=N          References per window for the worst burst of\n"
+"                          faults [1000].\n"
+"  -v, --verbose           Show the policy's debug output.\n"
+"  -h, --help              Show this help.\n");
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Page out pages until no more than the target are in memory. */
+static void reach_target(void)
+{
+    unsigned long victims[XENPAGING_VICTIM_BATCH];
+    unsigned long gfn;
+    uint64_t start;
+    int i, n, num;
+
+    while ( target && paging.max_pages - paging.num_paged_out > target )
+    {
+        num = paging.max_pages - paging.num_paged_out - target;
+        if ( num > batch )
+            num = batch;
+
+        start = now_ns();
+        n = policy_choose_victims(&paging, victims, num);
+        st.policy_ns += now_ns() - start;
+
+        if ( n == 0 )
+        {
+            st.short_rounds++;
+            break;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            gfn = victims[i];
+            if ( test_and_set_bit(gfn, paged_out) )
+            {
+                fprintf(stderr, "Page %lx has been evicted before\n", gfn);
+                exit(EXIT_FAILURE);
+            }
+            policy_notify_paged_out(gfn);
+            paged_out_seq[gfn] = ++st.paged_out;
+            paging.num_paged_out++;
+        }
+    }
+}
+
+/* As xenpaging_resume_page */
+static void page_in(unsigned long gfn)
+{
+    if ( paging.num_paged_out > paging.policy_mru_size )
+        policy_notify_paged_in(gfn);
+    else
+        policy_notify_paged_in_nomru(gfn);
+    paging.num_paged_out--;
+}
+
+/* No target: everything is paged in, as xenpaging does. */
+static void resume_all(void)
+{
+    unsigned long gfn;
+
+    for ( gfn = 0; gfn < paging.max_pages && paging.num_paged_out; gfn++ )
+        if ( test_and_clear_bit(gfn, paged_out) )
+            page_in(gfn);
+}
+
+static void reference(unsigned long gfn)
+{
+    st.refs++;
+
+    if ( test_and_clear_bit(gfn, paged_out) )
+    {
+        st.faults++;
+        st.window_faults++;
+        /* Paged in again before as many pages were paged out after it
+         * as are out now */
+        if ( st.paged_out - paged_out_seq[gfn] < paging.num_paged_out )
+            st.test_faults++;
+
+        page_in(gfn);
+        reach_target();
+    }
+
+    if ( st.refs % window == 0 )
+    {
+        if ( st.window_faults > st.worst_window )
+            st.worst_window = st.window_faults;
+        st.window_faults = 0;
+    }
+}
+
+/* Read one event, returns 0 at the end of the trace. */
+static int read_event(FILE *f, const char *name, unsigned long *line,
+                      char *type, unsigned long *arg)
+{
+    char buf[128], *p, *end;
+
+    while ( fgets(buf, sizeof(buf), f) )
+    {
+        (*line)++;
+        p = buf + strspn(buf, " \t");
+        if ( *p == '#' || *p == '\n' || *p == '\0' )
+            continue;
+
+        *type = *p++;
+        *arg = strtoul(p, &end, (*type == 'i' || *type == 'r') ? 16 : 10);
+        if ( end == p || !strchr("mtir", *type) ||
+             end[strspn(end, " \t\r\n")] != '\0' )
+        {
+            fprintf(stderr, "%s:%lu: malformed event\n", name, *line);
+            exit(EXIT_FAILURE);
+        }
+        return 1;
+    }
+
+    if ( ferror(f) )
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/* Guest size from the trace, for traces which do not give it. */
+static unsigned long scan_max_pages(FILE *f, const char *name)
+{
+    unsigned long line = 0, arg, max = 0;
+    char type;
+
+    while ( read_event(f, name, &line, &type, &arg) )
+    {
+        if ( type == 'm' )
+        {
+            max = arg;
+            break;
+        }
+        if ( (type == 'i' || type == 'r') && arg >= max )
+            max = arg + 1;
+    }
+    rewind(f);
+
+    return max;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        { "max_pages", required_argument, NULL, 'm' },
+        { "target",    required_argument, NULL, 't' },
+        { "mru_size",  required_argument, NULL, 'r' },
+        { "batch",     required_argument, NULL, 'b' },
+        { "window",    required_argument, NULL, 'w' },
+        { "verbose",   no_argument,       NULL, 'v' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct xc_interface_core xch_sim;
+    unsigned long max_pages = 0, line = 0, arg;
+    const char *name;
+    int ch, verbose = 0;
+    char type, *end;
+    FILE *f;
+
+    while ( (ch = getopt_long(argc, argv, "m:t:r:b:w:vh", long_options,
+                              NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'm':
+            max_pages = strtoul(optarg, &end, 0);
+            if ( *end )
+                usage();
+            break;
+        case 't':
+            target = strtoul(optarg, &end, 0);
+            if ( *end )
+                usage();
+            break;
+        case 'r':
+            paging.policy_mru_size = strtol(optarg, &end, 0);
+            if ( *end )
+                usage();
+            break;
+        case 'b':
+            batch = strtol(optarg, &end, 0);
+            if ( *end || batch <= 0 || batch > XENPAGING_VICTIM_BATCH )
+                usage();
+            break;
+        case 'w':
+            window = strtoul(optarg, &end, 0);
+            if ( *end || !window )
+                usage();
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if ( optind != argc - 1 )
+        usage();
+    name = argv[optind];
+
+    f = fopen(name, "r");
+    if ( !f )
+    {
+        perror(name);
+        return EXIT_FAILURE;
+    }
+    if ( !max_pages )
+        max_pages = scan_max_pages(f, name);
+    if ( !max_pages || max_pages > INT32_MAX )
+    {
+        fprintf(stderr, "%s: no pages to page\n", name);
+        return EXIT_FAILURE;
+    }
+
+    /* The policy only logs through the handle */
+    memset(&xch_sim, 0, sizeof(xch_sim));
+    xch_sim.error_handler = (xentoollog_logger *)
+        xtl_createlogger_stdiostream(stderr, verbose ? XTL_DEBUG : XTL_ERROR,
+                                     0);
+    if ( !xch_sim.error_handler )
+        return EXIT_FAILURE;
+    paging.xc_handle = &xch_sim;
+    paging.max_pages = max_pages;
+
+    paged_out = bitmap_alloc(max_pages);
+    paged_out_seq = calloc(max_pages, sizeof(*paged_out_seq));
+    if ( !paged_out || !paged_out_seq || policy_init(&paging) )
+    {
+        perror("xenpaging-sim");
+        return EXIT_FAILURE;
+    }
+
+    reach_target();
+
+    while ( read_event(f, name, &line, &type, &arg) )
+    {
+        switch ( type )
+        {
+        case 'm':
+            if ( arg != max_pages )
+                fprintf(stderr, "%s:%lu: guest size %lu ignored\n",
+                        name, line, arg);
+            break;
+        case 't':
+            target = arg < max_pages ? arg : max_pages;
+            if ( target )
+                reach_target();
+            else
+                resume_all();
+            break;
+        default:
+            if ( arg >= max_pages )
+            {
+                fprintf(stderr, "%s:%lu: gfn %lx beyond the guest\n",
+                        name, line, arg);
+                return EXIT_FAILURE;
+            }
+            reference(arg);
+        }
+    }
+    fclose(f);
+
+    if ( st.window_faults > st.worst_window )
+        st.worst_window = st.window_faults;
+
+    printf("Pages:        %lu, %d paged out at the end (target %lu)\n",
+           max_pages, paging.num_paged_out, target);
+    printf("References:   %"PRIu64"\n", st.refs);
+    printf("Faults:       %"PRIu64" (%.2f per 1000 references)\n", st.faults,
+           st.refs ? 1000.0 * st.faults / st.refs : 0);
+    printf("  too soon:   %"PRIu64" (in their test period)\n",
+           st.test_faults);
+    printf("Worst burst:  %"PRIu64" faults in %lu references\n",
+           st.worst_window, window);
+    printf("Paged out:    %"PRIu64" (%"PRIu64" rounds short of target)\n",
+           st.paged_out, st.short_rounds);
+    printf("Policy time:  %.0f ns per page paged out\n",
+           st.paged_out ? (double)st.policy_ns / st.paged_out : 0);
+
+    xtl_logger_destroy(xch_sim.error_handler);
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -44,6 +44,8 @@ static char *dom_path;
 static char watch_token[16];
 static char *filename;
 static int interrupted;
+/* Page-ins and targets recorded for xenpaging-sim */
+static FILE *trace;
 
 static void unlink_pagefile(void)
 {
@@ -133,6 +135,8 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
                         if ( target_tot_pages < 0 || target_tot_pages > paging->max_pages )
                             target_tot_pages = paging->max_pages;
                         paging->target_tot_pages = target_tot_pages;
+                        if ( trace )
+                            fprintf(trace, "t %d\n", target_tot_pages);
                         /* Disable poll() delay while new target is not yet reached */
                         paging->use_poll_timeout = 0;
                         DPRINTF("new target_tot_pages %d\n", target_tot_pages);
@@ -210,6 +214,7 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -t <file>      --trace=<file>           record page-ins for xenpaging-sim.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,13 +222,14 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:t:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"trace", 1, NULL, 't'},
         { }
     };
 
@@ -243,6 +249,14 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 't':
+            trace = fopen(optarg, "w");
+            if ( !trace )
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -447,6 +461,8 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
     DPRINTF("max_pages = %d\n", paging->max_pages);
+    if ( trace )
+        fprintf(trace, "m %d\n", paging->max_pages);
 
     /* Allocate indicies for pagefile slots */
     paging->slot_to_gfn = calloc(paging->max_pages, sizeof(*paging->slot_to_gfn));
@@ -758,12 +774,17 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
+/* Victims nominated by the policy, a batch at a time */
+static unsigned long victims[XENPAGING_VICTIM_BATCH];
+static int num_victims, next_victim;
+
 /* Evict one gfn and write it to the given slot
+ * Up to num gfns are nominated at once, for this and the next calls
  * Returns < 0 on fatal error
  * Returns 0 on successful evict
  * Returns > 0 if no gfn can be evicted
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int evict_victim(struct xenpaging *paging, int slot, int num)
 {
     xc_interface *xch = paging->xc_handle;
     unsigned long gfn;
@@ -772,7 +793,14 @@ static int evict_victim(struct xenpaging *paging, int slot)
 
     do
     {
-        gfn = policy_choose_victim(paging);
+        if ( next_victim == num_victims )
+        {
+            if ( num > XENPAGING_VICTIM_BATCH )
+                num = XENPAGING_VICTIM_BATCH;
+            num_victims = policy_choose_victims(paging, victims, num);
+            next_victim = 0;
+        }
+        gfn = next_victim < num_victims ? victims[next_victim++] : INVALID_MFN;
         if ( gfn == INVALID_MFN )
         {
             /* If the number did not change after last flush command then
@@ -825,11 +853,11 @@ static int evict_pages(struct xenpaging *paging, int num_pages)
     while ( paging->stack_count > 0 && num < num_pages )
     {
         slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
+        rc = evict_victim(paging, slot, num_pages - num);
         if ( rc )
         {
             num = rc < 0 ? -1 : num;
-            return num;
+            goto out;
         }
         num++;
     }
@@ -841,7 +869,7 @@ static int evict_pages(struct xenpaging *paging, int num_pages)
         if ( paging->slot_to_gfn[slot] )
             continue;
 
-        rc = evict_victim(paging, slot);
+        rc = evict_victim(paging, slot, num_pages - num);
         if ( rc )
         {
             num = rc < 0 ? -1 : num;
@@ -850,6 +878,12 @@ static int evict_pages(struct xenpaging *paging, int num_pages)
 
         num++;
     }
+
+ out:
+    /* Nominate afresh next time, the guest may have used what is left */
+    while ( next_victim < num_victims )
+        policy_notify_not_paged_out(victims[next_victim++]);
+    num_victims = next_victim = 0;
     return num;
 }
 
@@ -943,6 +977,8 @@ int main(int argc, char *argv[])
                         ERROR("Error populating page %"PRIx64"", req.gfn);
                         goto out;
                     }
+                    if ( trace )
+                        fprintf(trace, "i %"PRIx64"\n", req.gfn);
                 }
 
                 /* Prepare the response */
@@ -1065,6 +1101,8 @@ int main(int argc, char *argv[])
  out:
     close(paging->fd);
     unlink_pagefile();
+    if ( trace && fclose(trace) )
+        PERROR("Error writing trace");
 
     /* Tear down domain paging */
     xenpaging_teardown(paging);
@@ -30,6 +30,7 @@
 #include <xen/mem_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+#define XENPAGING_VICTIM_BATCH 64
 
 struct mem_event {
     domid_t domain_id;
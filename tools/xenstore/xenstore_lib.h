@@ -42,6 +42,62 @@ struct xs_permissions
 	enum xs_perm_type perms;
 };
 
+/* Header of the node records in the xenstored TDB. */
+struct xs_tdb_record_hdr {
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
+/*
+ * Read-only snapshot of the store which xenstored shares with local
+ * clients.  The daemon is the only writer: seq is odd while it changes the
+ * slots, and readers try again if seq changed under them.  Records are
+ * appended to the heap and never changed afterwards.  When the file is
+ * full the daemon writes a new one, renames it into place and sets retired
+ * in the old one; it also retires and removes the file when it starts and
+ * when it exits.  Clients only trust a file whose pid is that of the
+ * daemon at the other end of their socket.
+ */
+#define XS_SNAPSHOT_MAGIC 0x32737378 /* "xss2" */
+
+struct xs_snapshot_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t retired;
+	/* A power of two: open addressing, probing linearly. */
+	uint32_t nr_slots;
+	/* The daemon which writes the file. */
+	uint32_t pid;
+	uint32_t pad;
+	/* The heap follows the slots. */
+	uint64_t heap_off;
+	uint64_t heap_size;
+	uint64_t heap_used;
+};
+
+#define XS_SNAPSHOT_FREE	0
+#define XS_SNAPSHOT_DELETED	1
+
+struct xs_snapshot_slot {
+	uint32_t hash;
+	/* The name, without nul. */
+	uint32_t namelen;
+	/* The record: struct xs_tdb_record_hdr and what follows. */
+	uint32_t reclen;
+	uint32_t pad;
+	/* Heap offset of the name, nul-terminated, then the record 8-byte
+	 * aligned; or XS_SNAPSHOT_FREE or XS_SNAPSHOT_DELETED. */
+	uint64_t off;
+};
+
+#define XS_SNAPSHOT_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+/* Hash of the node names in the snapshot. */
+uint32_t xs_snapshot_hash(const char *name, unsigned int len);
+
 /* Each 10 bits takes ~ 3 digits, plus one, plus one for nul terminator. */
 #define MAX_STRLEN(x) ((sizeof(x) * CHAR_BIT + CHAR_BIT-1) / 10 * 3 + 2)
 
@@ -52,6 +108,7 @@ const char *xs_daemon_socket(void);
 const char *xs_daemon_socket_ro(void);
 const char *xs_domain_dev(void);
 const char *xs_daemon_tdb(void);
+const char *xs_daemon_snapshot(void);
 
 /* Simple write function: loops for you. */
 bool xs_write_all(int fd, const void *data, unsigned int len);
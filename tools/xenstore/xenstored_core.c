@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
@@ -40,6 +41,9 @@
 #include <signal.h>
 #include <assert.h>
 #include <setjmp.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "utils.h"
 #include "list.h"
@@ -48,19 +52,31 @@
 #include "xenstored_core.h"
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
+#include "xenstored_store.h"
 #include "xenstored_domain.h"
+#include "xenstored_reader.h"
+#include "xenstored_snapshot.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
 #include "hashtable.h"
 
 extern xc_evtchn *xce_handle; /* in xenstored_domain.c */
+#ifdef HAVE_EPOLL
+static int epoll_fd = -1;
+/* The events returned by the last epoll_wait(), and the one handled. */
+static struct epoll_event epoll_events[256];
+static int nr_epoll_events, cur_epoll_event;
+/* The epoll data of the fds which aren't connections. */
+static char sock_tag, ro_sock_tag, reopen_log_pipe_tag, xce_tag;
+#else
 static int xce_pollfd_idx = -1;
 static struct pollfd *fds;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
 
 #define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+#endif
 
 static bool verbose = false;
 LIST_HEAD(connections);
@@ -68,11 +84,11 @@ static int tracefd = -1;
 static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
+#ifndef HAVE_EPOLL
 static int reopen_log_pipe0_pollfd_idx = -1;
+#endif
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
 #define log(...)							\
@@ -89,24 +105,6 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
-}
-
 static char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	switch (type) {
@@ -215,6 +213,13 @@ static void trigger_reopen_log(int signal __attribute__((unused)))
 	dummy = write(reopen_log_pipe[1], &c, 1);
 }
 
+/* Clients mustn't go on reading a snapshot which nobody updates. */
+static void retire_snapshot_and_die(int sig)
+{
+	snapshot_retire();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
 
 static void reopen_log(void)
 {
@@ -283,6 +288,14 @@ static bool write_messages(struct connection *conn)
 static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
+#ifdef HAVE_EPOLL
+	int i;
+
+	/* Its fd leaves the epoll set when closed, but may have events. */
+	for (i = cur_epoll_event + 1; i < nr_epoll_events; i++)
+		if (epoll_events[i].data.ptr == conn)
+			epoll_events[i].data.ptr = NULL;
+#endif
 
 	/* Flush outgoing if possible, but don't block. */
 	if (!conn->domain) {
@@ -303,6 +316,35 @@ static int destroy_conn(void *_conn)
 	return 0;
 }
 
+#ifdef HAVE_EPOLL
+static int epoll_register(int op, int fd, uint32_t events, void *data)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = data;
+	return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static void initialize_epoll(int sock, int ro_sock)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll fd");
+
+	if ((sock != -1 &&
+	     epoll_register(EPOLL_CTL_ADD, sock, EPOLLIN, &sock_tag)) ||
+	    (ro_sock != -1 &&
+	     epoll_register(EPOLL_CTL_ADD, ro_sock, EPOLLIN, &ro_sock_tag)) ||
+	    (reopen_log_pipe[0] != -1 &&
+	     epoll_register(EPOLL_CTL_ADD, reopen_log_pipe[0], EPOLLIN,
+			    &reopen_log_pipe_tag)) ||
+	    (xce_handle != NULL &&
+	     epoll_register(EPOLL_CTL_ADD, xc_evtchn_fd(xce_handle), EPOLLIN,
+			    &xce_tag)))
+		barf_perror("Could not add fd to epoll set");
+}
+#else
 /* This function returns index inside the array if succeed, -1 if fail */
 static int set_fd(int fd, short events)
 {
@@ -338,8 +380,7 @@ fail:
 }
 
 static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
+			   int ro_sock, int *p_ro_sock_pollfd_idx)
 {
 	struct connection *conn;
 
@@ -347,8 +388,6 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
 	nr_fds = 0;
 
-	*ptimeout = -1;
-
 	if (sock != -1)
 		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
 	if (ro_sock != -1)
@@ -362,12 +401,7 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 					POLLIN|POLLPRI);
 
 	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
+		if (!conn->domain) {
 			short events = POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
@@ -375,6 +409,51 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		}
 	}
 }
+#endif
+
+/* Wait for the fds only if no domain has work left in its ring. */
+static int main_loop_timeout(void)
+{
+	struct connection *conn;
+	int timeout = -1, store_timeout;
+
+	for (conn = next_domain_conn(NULL); conn;
+	     conn = next_domain_conn(conn)) {
+		if (domain_can_read(conn) ||
+		    (domain_can_write(conn) && !list_empty(&conn->out_list))) {
+			timeout = 0;
+			break;
+		}
+	}
+
+	/* The requests of this round are done: write them back. */
+	store_timeout = store_flush();
+	if (store_timeout >= 0 && (timeout < 0 || store_timeout < timeout))
+		timeout = store_timeout;
+	return timeout;
+}
+
+/* Only ask for POLLOUT on a socket while there's output queued. */
+static void update_conn_events(struct connection *conn)
+{
+#ifdef HAVE_EPOLL
+	uint32_t events = EPOLLIN|EPOLLPRI;
+
+	if (conn->domain || conn->fd == -1)
+		return;
+
+	if (!list_empty(&conn->out_list))
+		events |= EPOLLOUT;
+	if (events == conn->epoll_events)
+		return;
+
+	if (epoll_register(EPOLL_CTL_MOD, conn->fd, events, conn) == 0)
+		conn->epoll_events = events;
+	else
+		syslog(LOG_ERR, "Could not update epoll events of fd %d: %m",
+		       conn->fd);
+#endif
+}
 
 /* Is child a subnode of parent, or equal? */
 bool is_child(const char *child, const char *parent)
@@ -396,71 +475,87 @@ bool is_child(const char *child, const char *parent)
 static struct node *read_node(struct connection *conn, const char *name)
 {
 	TDB_DATA key, data;
-	uint32_t *p;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	node = talloc(name, struct node);
+	if (!node) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	transaction_prepend(conn, name, &key);
+	data = store_fetch(node, key);
 
 	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
+		if (errno == ENOENT) {
+			/* A transaction depends on absent nodes, too. */
+			struct node absent = { .name = name,
+					       .generation = NO_GENERATION };
+
+			access_node(conn, &absent, NODE_ACCESS_READ, NULL);
 			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+		} else
+			log("Store error on read of %s", name);
+		talloc_free(node);
 		return NULL;
 	}
 
-	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
-	talloc_steal(node, data.dptr);
+	node->key.dptr = NULL;
+	node->key.dsize = 0;
 
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	/* Generation, datalen, childlen, number of permissions */
+	hdr = (void *)data.dptr;
+	node->generation = hdr->generation;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
+	access_node(conn, node, NODE_ACCESS_READ, NULL);
+
 	return node;
 }
 
-static bool write_node(struct connection *conn, const struct node *node)
+static bool write_node(struct connection *conn, struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * access_node copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	/* The header's tail padding is where the permissions start. */
+	data.dsize = offsetof(struct xs_tdb_record_hdr, perms)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
-	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
+	/* The generation count doesn't count against the quota. */
+	if (domain_is_unprivileged(conn) &&
+	    data.dsize - sizeof(hdr->generation) >= quota_max_entry_size)
+		goto error;
+
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = node->generation;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -468,20 +563,20 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (store_store(key, data) != 0) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
+	node->key = key;
 	return true;
  error:
 	errno = ENOSPC;
 	return false;
 }
 
-static enum xs_perm_type perm_for_conn(struct connection *conn,
-				       struct xs_permissions *perms,
-				       unsigned int num)
+enum xs_perm_type perm_for_conn(struct connection *conn,
+				struct xs_permissions *perms,
+				unsigned int num)
 {
 	unsigned int i;
 	enum xs_perm_type mask = XS_PERM_READ|XS_PERM_WRITE|XS_PERM_OWNER;
@@ -653,6 +748,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	update_conn_events(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -787,11 +883,14 @@ static void do_read(struct connection *conn, const char *name)
 static void delete_node_single(struct connection *conn, struct node *node)
 {
 	TDB_DATA key;
+	int ret;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+		return;
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	/* Within a transaction the node may exist only in the store. */
+	ret = store_delete(key);
+	if (ret && (!conn || !conn->transaction || ret != ENOENT)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -832,8 +931,10 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
 	node->name = talloc_strdup(node, name);
+	node->key.dptr = NULL;
+	node->key.dsize = 0;
+	node->generation = NO_GENERATION;
 
 	/* Inherit permissions, except unprivileged domains own what they create */
 	node->num_perms = parent->num_perms;
@@ -853,15 +954,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	store_delete(node->key);
 	return 0;
 }
 
@@ -991,19 +1088,19 @@ static void delete_node(struct connection *conn, struct node *node)
 }
 
 
-/* Delete memory using memmove. */
-static void memdel(void *mem, unsigned off, unsigned len, unsigned total)
-{
-	memmove(mem + off, mem + off + len, total - off - len);
-}
-
-
 static bool remove_child_entry(struct connection *conn, struct node *node,
 			       size_t offset)
 {
-	size_t childlen = strlen(node->children + offset);
-	memdel(node->children, offset, childlen + 1, node->childlen);
-	node->childlen -= childlen + 1;
+	size_t len = strlen(node->children + offset) + 1;
+	char *children;
+
+	/* Build a new list: the old one may be shared with the store. */
+	children = talloc_array(node, char, node->childlen - len + 1);
+	memcpy(children, node->children, offset);
+	memcpy(children + offset, node->children + offset + len,
+	       node->childlen - offset - len);
+	node->children = children;
+	node->childlen -= len;
 	return write_node(conn, node);
 }
 
@@ -1296,18 +1393,25 @@ static void consider_message(struct connection *conn)
 			sockmsg_string(conn->in->hdr.msg.type),
 			conn->in->hdr.msg.len, conn);
 
-	process_message(conn, conn->in);
-
-	talloc_free(conn->in);
+	if (!reader_defer(conn, conn->in)) {
+		process_message(conn, conn->in);
+		talloc_free(conn->in);
+	}
 	conn->in = new_buffer(conn);
 }
 
 /* Errors in reading or allocating here mean we get out of sync, so we
- * drop the whole client connection. */
-static void handle_input(struct connection *conn)
+ * drop the whole client connection.  Returns true if a whole message was
+ * handled and the connection can take the next one. */
+static bool handle_input(struct connection *conn)
 {
 	int bytes;
 	struct buffered_data *in = conn->in;
+	enum xsd_sockmsg_type type;
+
+	/* Requests are answered in order: wait for the readers. */
+	if (conn->read_job)
+		return false;
 
 	/* Not finished header yet? */
 	if (in->inhdr) {
@@ -1317,7 +1421,7 @@ static void handle_input(struct connection *conn)
 			goto bad_client;
 		in->used += bytes;
 		if (in->used != sizeof(in->hdr))
-			return;
+			return false;
 
 		if (in->hdr.msg.len > XENSTORE_PAYLOAD_MAX) {
 			syslog(LOG_ERR, "Client tried to feed us %i",
@@ -1339,21 +1443,29 @@ static void handle_input(struct connection *conn)
 
 	in->used += bytes;
 	if (in->used != in->hdr.msg.len)
-		return;
+		return false;
 
 	trace_io(conn, in, 0);
+	type = in->hdr.msg.type;
 	consider_message(conn);
-	return;
+
+	/* Releasing a domain may have freed other connections. */
+	return type != XS_RELEASE;
 
 bad_client:
 	/* Kill it. */
 	talloc_free(conn);
+	return false;
 }
 
-static void handle_output(struct connection *conn)
+static bool handle_output(struct connection *conn)
 {
-	if (!write_messages(conn))
+	if (!write_messages(conn)) {
 		talloc_free(conn);
+		return false;
+	}
+	update_conn_events(conn);
+	return true;
 }
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
@@ -1442,13 +1554,21 @@ static void accept_connection(int sock, bool canwrite)
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
-	} else
+	} else {
 		close(fd);
+		return;
+	}
+
+#ifdef HAVE_EPOLL
+	conn->epoll_events = EPOLLIN|EPOLLPRI;
+	if (epoll_register(EPOLL_CTL_ADD, fd, conn->epoll_events, conn)) {
+		syslog(LOG_ERR, "Could not add fd %d to epoll set: %m", fd);
+		talloc_free(conn);
+	}
+#endif
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1457,6 +1577,7 @@ static void manual_node(const char *name, const char *child)
 
 	node = talloc_zero(NULL, struct node);
 	node->name = name;
+	node->generation = NO_GENERATION;
 	node->perms = &perms;
 	node->num_perms = 1;
 	node->children = (char *)child;
@@ -1470,13 +1591,7 @@ static void manual_node(const char *name, const char *child)
 
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
-
-	if (tdb_ctx) {
+	if (store_open()) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1505,11 +1620,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1519,7 +1629,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1532,7 +1642,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1636,16 +1746,25 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(TDB_DATA key, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+	char * name;
+
+	/* Skip the private records of transactions. */
+	if (key.dsize == 0 || key.dptr[0] != '/')
+		return 0;
 
+	/* New generations must not repeat those of a store we loaded. */
+	if (hdr->generation != NO_GENERATION && hdr->generation >= generation)
+		generation = hdr->generation + 1;
+
+	name = talloc_strndup(NULL, key.dptr, key.dsize);
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(key);
 		}
 	}
 
@@ -1661,7 +1780,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1683,7 +1802,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1785,6 +1904,14 @@ static void usage(void)
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --internal-db       store database in memory, not on disk\n"
+"  --persist <mode>    with --internal-db, write the database to disk after\n"
+"                      each batch of requests (write-behind) or at most\n"
+"                      every --persist-interval seconds (snapshot),\n"
+"  --persist-interval <secs> time between snapshots (default 5),\n"
+"  --reader-threads <nb> with --internal-db, answer reads outside of\n"
+"                      transactions on <nb> threads besides the main one,\n"
+"  --shared-snapshot   to share a read-only copy of the store with local\n"
+"                      clients, which then read without asking the daemon,\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
 "  --verbose           to request verbose execution.\n");
 }
@@ -1805,10 +1932,234 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "persist", 1, NULL, 'M' },
+	{ "persist-interval", 1, NULL, 'i' },
+	{ "reader-threads", 1, NULL, 'r' },
+	{ "shared-snapshot", 0, NULL, 's' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
 
+static void handle_reopen_log_pipe(short revents)
+{
+	char c;
+
+	if (revents & ~POLLIN) {
+		close(reopen_log_pipe[0]);
+		close(reopen_log_pipe[1]);
+		init_pipe(reopen_log_pipe);
+#ifdef HAVE_EPOLL
+		if (epoll_register(EPOLL_CTL_ADD, reopen_log_pipe[0], EPOLLIN,
+				   &reopen_log_pipe_tag))
+			barf_perror("Could not add fd to epoll set");
+#endif
+	} else if (revents & POLLIN) {
+		if (read(reopen_log_pipe[0], &c, 1) != 1)
+			barf_perror("read failed");
+		reopen_log();
+	}
+}
+
+/* The caller holds a reference to conn, which is dropped here. */
+static void handle_socket_conn(struct connection *conn, short revents)
+{
+	if (revents & ~(POLLIN|POLLOUT))
+		talloc_free(conn);
+	else if (revents & POLLIN)
+		handle_input(conn);
+	if (talloc_free(conn) == 0)
+		return;
+
+	talloc_increase_ref_count(conn);
+	if (revents & ~(POLLIN|POLLOUT))
+		talloc_free(conn);
+	else if (revents & POLLOUT)
+		handle_output(conn);
+	if (talloc_free(conn) == 0)
+		return;
+
+	conn->pollfd_idx = -1;
+}
+
+/*
+ * The caller holds a reference to conn, which is dropped here.  All the
+ * requests waiting in the ring are handled, and as many replies as fit
+ * are written back, before the domain is kicked once for the lot.
+ */
+static void handle_domain_conn(struct connection *conn)
+{
+	while (domain_can_read(conn) && handle_input(conn))
+		;
+	if (talloc_free(conn) == 0)
+		return;
+
+	talloc_increase_ref_count(conn);
+	while (domain_can_write(conn) && !list_empty(&conn->out_list))
+		if (!handle_output(conn))
+			break;
+	domain_notify(conn);
+	talloc_free(conn);
+}
+
+#ifdef HAVE_EPOLL
+static void handle_domain_conns(void)
+{
+	struct connection *conn, *next;
+
+	next = next_domain_conn(NULL);
+	if (next)
+		talloc_increase_ref_count(next);
+	while (next) {
+		conn = next;
+
+		next = next_domain_conn(conn);
+		if (next)
+			talloc_increase_ref_count(next);
+
+		handle_domain_conn(conn);
+	}
+}
+
+static void main_loop(int sock, int ro_sock)
+{
+	struct connection *conn;
+	uint32_t revents;
+	void *data;
+	int timeout;
+
+	/* Sockets stay in the epoll set from accept until they're closed. */
+	initialize_epoll(sock, ro_sock);
+	timeout = main_loop_timeout();
+
+	for (;;) {
+		nr_epoll_events = epoll_wait(epoll_fd, epoll_events,
+					     ARRAY_SIZE(epoll_events), timeout);
+		if (nr_epoll_events < 0) {
+			nr_epoll_events = 0;
+			if (errno == EINTR)
+				continue;
+			barf_perror("epoll_wait failed");
+		}
+
+		/* The EPOLL* event bits are the POLL* ones. */
+		for (cur_epoll_event = 0; cur_epoll_event < nr_epoll_events;
+		     cur_epoll_event++) {
+			data = epoll_events[cur_epoll_event].data.ptr;
+			revents = epoll_events[cur_epoll_event].events;
+
+			if (data == NULL) {
+				/* Connection freed earlier in this round. */
+			} else if (data == &reopen_log_pipe_tag) {
+				handle_reopen_log_pipe(revents);
+			} else if (data == &sock_tag) {
+				if (revents & ~POLLIN)
+					barf_perror("sock poll failed");
+				accept_connection(sock, true);
+			} else if (data == &ro_sock_tag) {
+				if (revents & ~POLLIN)
+					barf_perror("ro sock poll failed");
+				accept_connection(ro_sock, false);
+			} else if (data == &xce_tag) {
+				if (revents & ~POLLIN)
+					barf_perror("xce_handle poll failed");
+				handle_event();
+			} else {
+				conn = data;
+				talloc_increase_ref_count(conn);
+				handle_socket_conn(conn, revents);
+			}
+		}
+		nr_epoll_events = 0;
+
+		handle_domain_conns();
+
+		reader_run();
+		timeout = main_loop_timeout();
+	}
+}
+#else
+static void main_loop(int sock, int ro_sock)
+{
+	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
+	int timeout;
+
+	initialize_fds(sock, &sock_pollfd_idx, ro_sock, &ro_sock_pollfd_idx);
+	timeout = main_loop_timeout();
+
+	for (;;) {
+		struct connection *conn, *next;
+
+		if (poll(fds, nr_fds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			barf_perror("Poll failed");
+		}
+
+		if (reopen_log_pipe0_pollfd_idx != -1) {
+			handle_reopen_log_pipe(
+				fds[reopen_log_pipe0_pollfd_idx].revents);
+			reopen_log_pipe0_pollfd_idx = -1;
+		}
+
+		if (sock_pollfd_idx != -1) {
+			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
+				barf_perror("sock poll failed");
+				break;
+			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
+				accept_connection(sock, true);
+				sock_pollfd_idx = -1;
+			}
+		}
+
+		if (ro_sock_pollfd_idx != -1) {
+			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
+				barf_perror("ro sock poll failed");
+				break;
+			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
+				accept_connection(ro_sock, false);
+				ro_sock_pollfd_idx = -1;
+			}
+		}
+
+		if (xce_pollfd_idx != -1) {
+			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
+				barf_perror("xce_handle poll failed");
+				break;
+			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
+				handle_event();
+				xce_pollfd_idx = -1;
+			}
+		}
+
+		next = list_entry(connections.next, typeof(*conn), list);
+		if (&next->list != &connections)
+			talloc_increase_ref_count(next);
+		while (&next->list != &connections) {
+			conn = next;
+
+			next = list_entry(conn->list.next,
+					  typeof(*conn), list);
+			if (&next->list != &connections)
+				talloc_increase_ref_count(next);
+
+			if (conn->domain)
+				handle_domain_conn(conn);
+			else if (conn->pollfd_idx != -1)
+				handle_socket_conn(conn,
+						   fds[conn->pollfd_idx].revents);
+			else
+				talloc_free(conn);
+		}
+
+		reader_run();
+
+		initialize_fds(sock, &sock_pollfd_idx, ro_sock,
+			       &ro_sock_pollfd_idx);
+		timeout = main_loop_timeout();
+	}
+}
+#endif
+
 extern void dump_conn(struct connection *conn); 
 int dom0_event = 0;
 int priv_domid = 0;
@@ -1816,12 +2167,17 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock, *ro_sock;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
-	int timeout;
+	bool internal_db = false;
+	enum store_persist persist = STORE_PERSIST_NONE;
+	unsigned int persist_interval = 5;
+	unsigned int reader_threads = 0;
+	bool shared_snapshot = false;
+	char *end;
+	long val;
 
 	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
 				  NULL)) != -1) {
@@ -1860,7 +2216,33 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			internal_db = true;
+			break;
+		case 'M':
+			if (streq(optarg, "none"))
+				persist = STORE_PERSIST_NONE;
+			else if (streq(optarg, "snapshot"))
+				persist = STORE_PERSIST_SNAPSHOT;
+			else if (streq(optarg, "write-behind"))
+				persist = STORE_PERSIST_WRITE_BEHIND;
+			else
+				barf("%s: unknown persistence mode %s",
+				     argv[0], optarg);
+			break;
+		case 'i':
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if (errno || end == optarg || *end != '\0' ||
+			    val <= 0 || val > INT_MAX)
+				barf("%s: persist interval must be a positive "
+				     "number of seconds, not %s", argv[0], optarg);
+			persist_interval = val;
+			break;
+		case 'r':
+			reader_threads = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			shared_snapshot = true;
 			break;
 		case 'V':
 			verbose = true;
@@ -1878,6 +2260,10 @@ int main(int argc, char *argv[])
 	}
 	if (optind != argc)
 		barf("%s: No arguments desired", argv[0]);
+	if (internal_db)
+		store_use_memory(persist, persist_interval);
+	else if (reader_threads)
+		barf("%s: --reader-threads needs --internal-db", argv[0]);
 
 	reopen_log();
 
@@ -1900,12 +2286,21 @@ int main(int argc, char *argv[])
 	/* Don't kill us with SIGPIPE. */
 	signal(SIGPIPE, SIG_IGN);
 
+	/* Whatever the options, a snapshot left behind is out of date. */
+	snapshot_retire();
+
 	init_sockets(&sock, &ro_sock);
 	init_pipe(reopen_log_pipe);
 
 	/* Setup the database */
 	setup_structure();
 
+	if (shared_snapshot) {
+		snapshot_init();
+		signal(SIGTERM, retire_snapshot_and_die);
+		signal(SIGINT, retire_snapshot_and_die);
+	}
+
 	/* Listen to hypervisor. */
 	if (!no_domain_init)
 		domain_init();
@@ -1924,124 +2319,14 @@ int main(int argc, char *argv[])
 
 	signal(SIGHUP, trigger_reopen_log);
 
-	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	/* Threads don't survive daemonize(). */
+	if (reader_threads)
+		reader_init(reader_threads);
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
 
-	/* Main loop. */
-	for (;;) {
-		struct connection *conn, *next;
-
-		if (poll(fds, nr_fds, timeout) < 0) {
-			if (errno == EINTR)
-				continue;
-			barf_perror("Poll failed");
-		}
-
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
-		}
-
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
-
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
-		}
-
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				conn->pollfd_idx = -1;
-			}
-		}
-
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
-	}
+	main_loop(*sock, *ro_sock);
 }
 
 /*
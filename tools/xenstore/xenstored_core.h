@@ -51,6 +51,7 @@ struct buffered_data
 };
 
 struct connection;
+struct read_job;
 typedef int connwritefn_t(struct connection *, const void *, unsigned int);
 typedef int connreadfn_t(struct connection *, void *, unsigned int);
 
@@ -62,6 +63,8 @@ struct connection
 	int fd;
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
+	/* The events the fd is registered for in the epoll set */
+	uint32_t epoll_events;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -92,6 +95,9 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* A request being answered by the reader threads. */
+	struct read_job *read_job;
+
 	/* Methods for communicating over this connection: write can be NULL */
 	connwritefn_t *write;
 	connreadfn_t *read;
@@ -101,8 +107,12 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Key of the record I was last written to */
+	TDB_DATA key;
+
+	/* Generation count of the record I was read from */
+	uint64_t generation;
+#define NO_GENERATION ~((uint64_t)0)
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,21 +157,27 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* What may this connection do to a node with these permissions? */
+enum xs_perm_type perm_for_conn(struct connection *conn,
+				struct xs_permissions *perms,
+				unsigned int num);
+
+/* Something is wrong with the store: log it, then check and fix it. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
 /* Destructor for tdbs: required for transaction code */
 int destroy_tdb(void *_tdb);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
-
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
 
+/* Hash functions for hashtables keyed by node names. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
 /* Tracing infrastructure. */
 void trace_create(const void *data, const char *type);
 void trace_destroy(const void *data, const char *type);
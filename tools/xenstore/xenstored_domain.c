@@ -70,6 +70,9 @@ struct domain
 	/* Have we noticed that this domain is shutdown? */
 	int shutdown;
 
+	/* Have we moved the ring indexes since we last kicked the domain? */
+	bool notify;
+
 	/* number of entry from this domain in the store */
 	int nbentry;
 
@@ -130,7 +133,7 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -160,7 +163,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -257,6 +260,25 @@ bool domain_can_read(struct connection *conn)
 	return (intf->req_cons != intf->req_prod);
 }
 
+struct connection *next_domain_conn(struct connection *conn)
+{
+	struct list_head *next;
+
+	next = conn ? conn->domain->list.next : domains.next;
+	if (next == &domains)
+		return NULL;
+	return list_entry(next, struct domain, list)->conn;
+}
+
+void domain_notify(struct connection *conn)
+{
+	if (!conn->domain->notify)
+		return;
+
+	conn->domain->notify = false;
+	xc_evtchn_notify(xce_handle, conn->domain->port);
+}
+
 bool domain_is_unprivileged(struct connection *conn)
 {
 	return (conn && conn->domain && conn->domain->domid != 0 && conn->domain->domid != priv_domid);
@@ -282,6 +304,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain = talloc(context, struct domain);
 	domain->port = 0;
 	domain->shutdown = 0;
+	domain->notify = false;
 	domain->domid = domid;
 	domain->path = talloc_domain_path(domain, domid);
 
@@ -524,6 +547,7 @@ void do_resume(struct connection *conn, const char *domid_str)
 	}
 
 	domain->shutdown = 0;
+	domain->notify = false;
 	
 	send_ack(conn, XS_RESUME);
 }
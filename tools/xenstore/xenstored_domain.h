@@ -55,6 +55,12 @@ void restore_existing_connections(void);
 bool domain_can_read(struct connection *conn);
 bool domain_can_write(struct connection *conn);
 
+/* Walk the connections of the domains: start with NULL. */
+struct connection *next_domain_conn(struct connection *conn);
+
+/* Kick the domain if we have read or written its ring since last time. */
+void domain_notify(struct connection *conn);
+
 bool domain_is_unprivileged(struct connection *conn);
 
 /* Quota manipulation */
@@ -20,6 +20,8 @@
 #include <sys/mman.h>
 #include <xenctrl.h>
 #include "xenstored_core.h"
+#include "xenstored_reader.h"
+#include "xenstored_snapshot.h"
 #include <xen/grant_table.h>
 
 void write_pidfile(const char *pidfile)
@@ -60,3 +62,25 @@ void unmap_xenbus(void *interface)
 	xc_gnttab_munmap(*xcg_handle, interface, 1);
 }
 
+/* There are no threads in a stub domain: the main loop answers all. */
+void reader_init(unsigned int threads)
+{
+}
+
+bool reader_defer(struct connection *conn, struct buffered_data *in)
+{
+	return false;
+}
+
+void reader_run(void)
+{
+}
+
+/* Nor are there local clients to share a snapshot with. */
+void snapshot_init(void)
+{
+}
+
+void snapshot_update(TDB_DATA key, TDB_DATA data)
+{
+}
@@ -0,0 +1,354 @@
+/*
+    Reader threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Requests which only read the store (read, directory and get-perms
+ * outside of transactions) are collected during a round of the main loop
+ * and answered together at its end, by the main thread and the reader
+ * threads at once.  Nothing changes the store while they do, so it is an
+ * immutable snapshot for the readers: they look records up in place and
+ * never allocate from talloc, which isn't thread-safe.  The main thread
+ * then sends the replies, and writes carry on as before.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "talloc.h"
+#include "list.h"
+#include "utils.h"
+#include "xenstore_lib.h"
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+#include "xenstored_reader.h"
+
+struct read_job
+{
+	struct list_head list;
+
+	struct connection *conn;
+
+	/* The request, and the node it's about. */
+	struct buffered_data *in;
+	const char *name;
+
+	/* The answer: an error, or a reply which may point into the store. */
+	int error;
+	const void *reply;
+	unsigned int len;
+
+	/* A reply which had to be built (malloc'd). */
+	char *buf;
+
+	/* There was no node all the way up to the root. */
+	bool corrupt;
+};
+
+static unsigned int nr_threads;
+static LIST_HEAD(read_jobs);
+
+/* The jobs of this round: threads take the next one when they're free. */
+static struct read_job **jobs;
+static unsigned int nr_jobs;
+static unsigned int next_job;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t round_done = PTHREAD_COND_INITIALIZER;
+static unsigned int round_nr, busy;
+
+static struct xs_tdb_record_hdr *peek_node(const char *name)
+{
+	return (struct xs_tdb_record_hdr *)store_peek(name).dptr;
+}
+
+/* Like ask_parents(), on the snapshot. */
+static enum xs_perm_type parent_perms(struct read_job *job)
+{
+	char name[XENSTORE_ABS_PATH_MAX + 1];
+	struct xs_tdb_record_hdr *hdr;
+	char *slash;
+
+	strcpy(name, job->name);
+	do {
+		slash = strrchr(name + 1, '/');
+		if (slash)
+			*slash = '\0';
+		else
+			strcpy(name, "/");
+		hdr = peek_node(name);
+	} while (!hdr && !streq(name, "/"));
+
+	if (!hdr) {
+		job->corrupt = true;
+		return XS_PERM_NONE;
+	}
+
+	return perm_for_conn(job->conn, hdr->perms, hdr->num_perms);
+}
+
+static void get_perms_reply(struct read_job *job,
+			    struct xs_tdb_record_hdr *hdr)
+{
+	unsigned int i, len = 0;
+	char *buf;
+
+	buf = malloc(hdr->num_perms * (MAX_STRLEN(unsigned int) + 1));
+	if (!buf) {
+		job->error = ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < hdr->num_perms; i++) {
+		if (!xs_perm_to_string(&hdr->perms[i], buf + len,
+				       MAX_STRLEN(unsigned int) + 1)) {
+			free(buf);
+			job->error = EINVAL;
+			return;
+		}
+		len += strlen(buf + len) + 1;
+	}
+
+	job->buf = buf;
+	job->reply = buf;
+	job->len = len;
+}
+
+/* Runs on any thread: mustn't touch talloc or change anything shared. */
+static void answer(struct read_job *job)
+{
+	struct xs_tdb_record_hdr *hdr;
+	const char *data;
+
+	hdr = peek_node(job->name);
+	if (!hdr) {
+		job->error = ENOENT;
+	} else if (!(perm_for_conn(job->conn, hdr->perms, hdr->num_perms)
+		     & XS_PERM_READ)) {
+		job->error = EACCES;
+	} else {
+		data = (const char *)(hdr->perms + hdr->num_perms);
+		switch (job->in->hdr.msg.type) {
+		case XS_READ:
+			job->reply = data;
+			job->len = hdr->datalen;
+			break;
+		case XS_DIRECTORY:
+			job->reply = data + hdr->datalen;
+			job->len = hdr->childlen;
+			break;
+		default:
+			get_perms_reply(job, hdr);
+			break;
+		}
+		return;
+	}
+
+	/* Clean up the error if they weren't supposed to know. */
+	if (!(parent_perms(job) & XS_PERM_READ))
+		job->error = EACCES;
+}
+
+static void run_jobs(void)
+{
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&next_job, 1)) < nr_jobs)
+		answer(jobs[i]);
+}
+
+static void *reader_thread(void *arg)
+{
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (round_nr == seen)
+			pthread_cond_wait(&round_start, &lock);
+		seen = round_nr;
+		busy++;
+		pthread_mutex_unlock(&lock);
+
+		run_jobs();
+
+		pthread_mutex_lock(&lock);
+		if (--busy == 0)
+			pthread_cond_signal(&round_done);
+	}
+
+	return NULL;
+}
+
+/* Wait for the threads which took part in the round: call with lock. */
+static void wait_round_done(void)
+{
+	while (busy)
+		pthread_cond_wait(&round_done, &lock);
+}
+
+void reader_init(unsigned int threads)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t set, old;
+	unsigned int i;
+
+	/* Signals are for the main loop. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&thread, &attr, reader_thread, NULL))
+			barf("Could not start reader thread");
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	nr_threads = threads;
+}
+
+static int destroy_read_job(void *_job)
+{
+	struct read_job *job = _job;
+
+	list_del(&job->list);
+	job->conn->read_job = NULL;
+	free(job->buf);
+	return 0;
+}
+
+bool reader_defer(struct connection *conn, struct buffered_data *in)
+{
+	struct read_job *job;
+	const char *name;
+
+	if (!nr_threads || in->hdr.msg.tx_id)
+		return false;
+
+	switch (in->hdr.msg.type) {
+	case XS_READ:
+	case XS_DIRECTORY:
+	case XS_GET_PERMS:
+		break;
+	default:
+		return false;
+	}
+
+	/* The main loop sends the errors for bad requests. */
+	if (!in->used || memchr(in->buffer, 0, in->used) !=
+			 in->buffer + in->used - 1)
+		return false;
+	name = canonicalize(conn, in->buffer);
+	if (!name || !is_valid_nodename(name))
+		return false;
+
+	job = talloc_zero(conn, struct read_job);
+	if (!job)
+		return false;
+	job->conn = conn;
+	job->in = talloc_steal(job, in);
+	job->name = name;
+	list_add_tail(&job->list, &read_jobs);
+	talloc_set_destructor(job, destroy_read_job);
+
+	conn->read_job = job;
+	return true;
+}
+
+void reader_run(void)
+{
+	struct read_job *job, *tmp, **array;
+	struct buffered_data *in;
+	struct connection *conn;
+	bool corrupted = false;
+	unsigned int n = 0;
+
+	list_for_each_entry(job, &read_jobs, list)
+		n++;
+	if (!n)
+		return;
+
+	array = talloc_array(NULL, struct read_job *, n);
+	if (!array) {
+		/* Answer them here, one by one. */
+		list_for_each_entry(job, &read_jobs, list)
+			answer(job);
+	} else {
+		n = 0;
+		list_for_each_entry(job, &read_jobs, list)
+			array[n++] = job;
+
+		pthread_mutex_lock(&lock);
+		wait_round_done();
+		jobs = array;
+		nr_jobs = n;
+		next_job = 0;
+		/* Waking the threads for a single job isn't worth it. */
+		if (n > 1) {
+			round_nr++;
+			pthread_cond_broadcast(&round_start);
+		}
+		pthread_mutex_unlock(&lock);
+
+		run_jobs();
+
+		pthread_mutex_lock(&lock);
+		wait_round_done();
+		nr_jobs = 0;
+		pthread_mutex_unlock(&lock);
+	}
+
+	/* Replies may point into the store: send them before it changes. */
+	list_for_each_entry_safe(job, tmp, &read_jobs, list) {
+		conn = job->conn;
+
+		/* Replies echo the header of conn->in. */
+		in = conn->in;
+		conn->in = job->in;
+		if (job->error)
+			send_error(conn, job->error);
+		else
+			send_reply(conn, job->in->hdr.msg.type,
+				   job->reply, job->len);
+		conn->in = in;
+
+		corrupted |= job->corrupt;
+		talloc_free(job);
+	}
+
+	talloc_free(array);
+
+	if (corrupted)
+		corrupt(NULL, "No permissions file at root");
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,37 @@
+/*
+    Reader threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_READER_H
+#define _XENSTORED_READER_H
+
+#include "xenstored_core.h"
+
+/* Start the reader threads: needs the in-memory store. */
+void reader_init(unsigned int threads);
+
+/*
+ * Leave a request to the readers if it only reads the store: takes over
+ * in and returns true if so.  The connection takes no further requests
+ * until the reply has been sent.
+ */
+bool reader_defer(struct connection *conn, struct buffered_data *in);
+
+/* Answer the deferred requests. */
+void reader_run(void);
+
+#endif /* _XENSTORED_READER_H */
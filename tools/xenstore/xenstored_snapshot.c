@@ -0,0 +1,296 @@
+/*
+    Shared snapshot of the store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * The nodes of the store are copied into a file which local clients map
+ * read-only, so they can read nodes without a round trip to the daemon.
+ * See struct xs_snapshot_hdr for the layout.  Every change appends the
+ * new record to the heap and points the node's slot at it; once the heap
+ * or the slots run out, a new file is written from the store.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "talloc.h"
+#include "utils.h"
+#include "xenstore_lib.h"
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+#include "xenstored_snapshot.h"
+
+static struct xs_snapshot_hdr *hdr;
+static size_t map_size;
+
+/* Slots which aren't free (deleted ones count: they lengthen probes). */
+static unsigned int used_slots;
+
+static struct xs_snapshot_slot *get_slots(struct xs_snapshot_hdr *h)
+{
+	return (struct xs_snapshot_slot *)(h + 1);
+}
+
+static char *get_heap(struct xs_snapshot_hdr *h)
+{
+	return (char *)h + h->heap_off;
+}
+
+static bool is_node(TDB_DATA key)
+{
+	/* The store also has the records of transactions. */
+	return key.dsize && key.dptr[0] == '/';
+}
+
+/* The slot of the node, or the one to put it in if it isn't there. */
+static struct xs_snapshot_slot *find_slot(struct xs_snapshot_hdr *h,
+					  TDB_DATA key, uint32_t hash)
+{
+	struct xs_snapshot_slot *slots = get_slots(h), *slot, *deleted = NULL;
+	uint32_t mask = h->nr_slots - 1, i;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		slot = &slots[i];
+		if (slot->off == XS_SNAPSHOT_FREE)
+			return deleted ? deleted : slot;
+		if (slot->off == XS_SNAPSHOT_DELETED) {
+			if (!deleted)
+				deleted = slot;
+			continue;
+		}
+		if (slot->hash == hash && slot->namelen == key.dsize &&
+		    memcmp(get_heap(h) + slot->off, key.dptr, key.dsize) == 0)
+			return slot;
+	}
+}
+
+/* Add the record, unless the heap is full or the slots half used. */
+static bool append(struct xs_snapshot_hdr *h, TDB_DATA key, TDB_DATA data)
+{
+	struct xs_snapshot_slot *slot;
+	uint64_t off, reclen;
+	uint32_t hash;
+
+	off = h->heap_used;
+	reclen = XS_SNAPSHOT_ALIGN(key.dsize + 1) + XS_SNAPSHOT_ALIGN(data.dsize);
+	if (off + reclen > h->heap_size)
+		return false;
+
+	hash = xs_snapshot_hash((char *)key.dptr, key.dsize);
+	slot = find_slot(h, key, hash);
+	if (slot->off == XS_SNAPSHOT_FREE &&
+	    (used_slots + 1) * 2 > h->nr_slots)
+		return false;
+
+	memcpy(get_heap(h) + off, key.dptr, key.dsize);
+	get_heap(h)[off + key.dsize] = '\0';
+	memcpy(get_heap(h) + off + XS_SNAPSHOT_ALIGN(key.dsize + 1),
+	       data.dptr, data.dsize);
+	h->heap_used += reclen;
+
+	if (slot->off == XS_SNAPSHOT_FREE)
+		used_slots++;
+
+	/* Readers may be looking at the slot right now. */
+	h->seq++;
+	xen_wmb();
+	slot->hash = hash;
+	slot->namelen = key.dsize;
+	slot->reclen = data.dsize;
+	slot->off = off;
+	xen_wmb();
+	h->seq++;
+
+	return true;
+}
+
+struct snapshot_size {
+	unsigned int nodes;
+	uint64_t bytes;
+};
+
+static int count_node(TDB_DATA key, TDB_DATA data, void *private)
+{
+	struct snapshot_size *size = private;
+
+	if (is_node(key)) {
+		size->nodes++;
+		size->bytes += XS_SNAPSHOT_ALIGN(key.dsize + 1) +
+			       XS_SNAPSHOT_ALIGN(data.dsize);
+	}
+	return 0;
+}
+
+static int add_node(TDB_DATA key, TDB_DATA data, void *private)
+{
+	struct xs_snapshot_hdr *h = private;
+
+	if (is_node(key) && !append(h, key, data))
+		return -1;
+	return 0;
+}
+
+/* Write a new snapshot file from the store, with room to grow. */
+static bool rebuild(void)
+{
+	struct snapshot_size size = { 0, 0 };
+	struct xs_snapshot_hdr *h;
+	const char *name = xs_daemon_snapshot();
+	char *tmpname;
+	unsigned int nr_slots = 1024;
+	size_t new_size;
+	uint64_t heap_off;
+	int fd;
+
+	store_traverse(count_node, &size);
+	while (nr_slots < size.nodes * 4)
+		nr_slots *= 2;
+	heap_off = XS_SNAPSHOT_ALIGN(sizeof(*h) +
+				     nr_slots * sizeof(struct xs_snapshot_slot));
+	new_size = heap_off + size.bytes * 2 + 1024 * 1024;
+
+	tmpname = talloc_asprintf(NULL, "%s.new", name);
+	if (!tmpname)
+		return false;
+	fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0640);
+	if (fd < 0 || ftruncate(fd, new_size) != 0)
+		goto fail;
+	h = mmap(NULL, new_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED)
+		goto fail;
+	close(fd);
+	fd = -1;
+
+	h->magic = XS_SNAPSHOT_MAGIC;
+	h->nr_slots = nr_slots;
+	h->pid = getpid();
+	h->heap_off = heap_off;
+	h->heap_size = new_size - heap_off;
+	/* Offsets 0 and 1 mean free and deleted: start after them. */
+	h->heap_used = 8;
+
+	used_slots = 0;
+	store_traverse(add_node, h);
+	if (used_slots != size.nodes || rename(tmpname, name) != 0) {
+		munmap(h, new_size);
+		goto fail;
+	}
+	talloc_free(tmpname);
+
+	/* Tell the readers of the old file to map the new one. */
+	if (hdr) {
+		hdr->retired = 1;
+		munmap(hdr, map_size);
+	}
+	hdr = h;
+	map_size = new_size;
+	return true;
+
+fail:
+	syslog(LOG_ERR, "Could not write snapshot %s: %m", tmpname);
+	if (fd >= 0)
+		close(fd);
+	unlink(tmpname);
+	talloc_free(tmpname);
+	return false;
+}
+
+static void disable(void)
+{
+	syslog(LOG_ERR, "Shared snapshot disabled");
+	snapshot_retire();
+}
+
+void snapshot_update(TDB_DATA key, TDB_DATA data)
+{
+	struct xs_snapshot_slot *slot;
+
+	if (!hdr || !is_node(key))
+		return;
+
+	if (!data.dptr) {
+		slot = find_slot(hdr, key, xs_snapshot_hash((char *)key.dptr,
+							    key.dsize));
+		if (slot->off == XS_SNAPSHOT_FREE ||
+		    slot->off == XS_SNAPSHOT_DELETED)
+			return;
+		hdr->seq++;
+		xen_wmb();
+		slot->off = XS_SNAPSHOT_DELETED;
+		xen_wmb();
+		hdr->seq++;
+		return;
+	}
+
+	/* The store has the new record already, so a rebuild has it too. */
+	if (!append(hdr, key, data) && !rebuild())
+		disable();
+}
+
+void snapshot_retire(void)
+{
+	struct xs_snapshot_hdr *old;
+	struct stat st;
+	int fd;
+
+	if (hdr) {
+		/* Children which exit don't own the file. */
+		if (hdr->pid != getpid())
+			return;
+		hdr->retired = 1;
+		munmap(hdr, map_size);
+		hdr = NULL;
+	} else {
+		/* Clients of a previous daemon may still map its file. */
+		fd = open(xs_daemon_snapshot(), O_RDWR|O_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (fstat(fd, &st) == 0 && st.st_size >= sizeof(*old)) {
+			old = mmap(NULL, sizeof(*old), PROT_READ|PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+			if (old != MAP_FAILED) {
+				old->retired = 1;
+				munmap(old, sizeof(*old));
+			}
+		}
+		close(fd);
+	}
+	unlink(xs_daemon_snapshot());
+}
+
+void snapshot_init(void)
+{
+	if (!rebuild())
+		barf("Could not create shared snapshot");
+	atexit(snapshot_retire);
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,33 @@
+/*
+    Shared snapshot of the store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_SNAPSHOT_H
+#define _XENSTORED_SNAPSHOT_H
+
+#include "xenstored_core.h"
+
+/* Write the snapshot file and keep it up to date from now on. */
+void snapshot_init(void);
+
+/* Retire and remove the snapshot file, ours or a previous daemon's. */
+void snapshot_retire(void);
+
+/* A record of the store changed: data.dptr is NULL if it was deleted. */
+void snapshot_update(TDB_DATA key, TDB_DATA data);
+
+#endif /* _XENSTORED_SNAPSHOT_H */
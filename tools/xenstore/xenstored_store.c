@@ -0,0 +1,436 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * The records of the store are either kept in the TDB file, or in memory
+ * with the TDB file as optional backing.  In memory, each record is a
+ * single talloc block in the same layout as in the TDB, found through a
+ * hashtable keyed by the node name.  Readers get a reference to the block
+ * instead of a copy, so records are never modified in place: a write
+ * replaces the whole block.  Directory listings are sent straight from the
+ * children of the block.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "xenstored_store.h"
+#include "xenstored_snapshot.h"
+#include "xenstore_lib.h"
+#include "utils.h"
+
+struct mem_record
+{
+	/* List of all records. */
+	struct list_head list;
+
+	char *name;
+	TDB_DATA data;
+};
+
+/* A record changed in memory but not on disk yet. */
+struct dirty_record
+{
+	struct list_head list;
+	char *name;
+};
+
+static TDB_CONTEXT *tdb_ctx;
+
+static bool in_memory;
+static enum store_persist persist;
+static unsigned int persist_interval;
+
+static struct hashtable *mem_index;
+static LIST_HEAD(mem_records);
+static void *mem_ctx;
+
+/* Write-behind: records to write, and a hashtable to avoid duplicates. */
+static LIST_HEAD(dirty_records);
+static struct hashtable *dirty_index;
+
+/* Snapshot: has the store changed since the last one, and when was it? */
+static bool snapshot_dirty;
+static time_t snapshot_time;
+
+void store_use_memory(enum store_persist mode, unsigned int interval)
+{
+	in_memory = true;
+	persist = mode;
+	persist_interval = interval;
+}
+
+static void mark_dirty(const char *name)
+{
+	struct dirty_record *d;
+	char *key;
+
+	/* Only nodes are written out, not the records of transactions. */
+	if (name[0] != '/')
+		return;
+
+	if (persist == STORE_PERSIST_SNAPSHOT) {
+		snapshot_dirty = true;
+		return;
+	}
+
+	if (persist != STORE_PERSIST_WRITE_BEHIND ||
+	    hashtable_search(dirty_index, (void *)name))
+		return;
+
+	d = talloc(mem_ctx, struct dirty_record);
+	key = strdup(name);
+	if (!d || !key || !hashtable_insert(dirty_index, key, d)) {
+		/* We'll write it with the next snapshot of the store. */
+		free(key);
+		talloc_free(d);
+		snapshot_dirty = true;
+		return;
+	}
+	d->name = talloc_strdup(d, name);
+	list_add_tail(&d->list, &dirty_records);
+}
+
+static int mem_store(const char *name, TDB_DATA data)
+{
+	struct mem_record *r;
+	char *key;
+
+	r = hashtable_search(mem_index, (void *)name);
+	if (r) {
+		talloc_unlink(r, r->data.dptr);
+	} else {
+		r = talloc(mem_ctx, struct mem_record);
+		if (!r)
+			return ENOMEM;
+		r->name = talloc_strdup(r, name);
+		key = strdup(name);
+		if (!r->name || !key ||
+		    !hashtable_insert(mem_index, key, r)) {
+			free(key);
+			talloc_free(r);
+			return ENOMEM;
+		}
+		list_add_tail(&r->list, &mem_records);
+	}
+
+	r->data = data;
+	talloc_steal(r, data.dptr);
+	return 0;
+}
+
+static int load_record(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		       void *private)
+{
+	char *name = talloc_strndup(NULL, (char *)key.dptr, key.dsize);
+	int *err = private;
+
+	val.dptr = talloc_memdup(NULL, val.dptr, val.dsize);
+	if (!name || !val.dptr || mem_store(name, val)) {
+		talloc_free(val.dptr);
+		*err = ENOMEM;
+	}
+	talloc_free(name);
+	return *err ? -1 : 0;
+}
+
+static bool mem_open(const char *tdbname)
+{
+	TDB_CONTEXT *tdb;
+	int err = 0;
+
+	mem_ctx = talloc_named_const(talloc_autofree_context(), 0, "store");
+	mem_index = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	dirty_index = create_hashtable(64, hash_from_key_fn, keys_equal_fn);
+	if (!mem_ctx || !mem_index || !dirty_index)
+		barf("Could not allocate the store");
+
+	if (persist == STORE_PERSIST_NONE)
+		return false;
+
+	tdb = tdb_open(tdbname, 0, 0, O_RDWR, 0);
+	if (tdb) {
+		if (tdb_traverse(tdb, load_record, &err) < 0 || err)
+			barf("Could not load tdb file %s", tdbname);
+	} else if (persist == STORE_PERSIST_WRITE_BEHIND) {
+		tdb = tdb_open(tdbname, 7919, 0, O_RDWR|O_CREAT, 0640);
+		if (!tdb)
+			barf_perror("Could not create tdb file %s", tdbname);
+	}
+
+	/* Write-behind updates the file in place, snapshots replace it. */
+	if (persist == STORE_PERSIST_WRITE_BEHIND) {
+		tdb_ctx = talloc_steal(mem_ctx, tdb);
+	} else if (tdb) {
+		tdb_close(tdb);
+	}
+	snapshot_time = time(NULL);
+
+	return !list_empty(&mem_records);
+}
+
+bool store_open(void)
+{
+	char *tdbname;
+
+	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
+
+	if (in_memory)
+		return mem_open(tdbname);
+
+	tdb_ctx = tdb_open(tdbname, 0, 0, O_RDWR, 0);
+	if (tdb_ctx)
+		return true;
+
+	tdb_ctx = tdb_open(tdbname, 7919, 0, O_RDWR|O_CREAT, 0640);
+	if (!tdb_ctx)
+		barf_perror("Could not create tdb file %s", tdbname);
+	return false;
+}
+
+TDB_DATA store_fetch(const void *ctx, TDB_DATA key)
+{
+	struct mem_record *r;
+	TDB_DATA data;
+
+	if (in_memory) {
+		/* Keys are nul-terminated node names. */
+		r = hashtable_search(mem_index, key.dptr);
+		if (!r) {
+			errno = ENOENT;
+			return (TDB_DATA) { NULL, 0 };
+		}
+		if (!talloc_reference(ctx, r->data.dptr)) {
+			errno = ENOMEM;
+			return (TDB_DATA) { NULL, 0 };
+		}
+		return r->data;
+	}
+
+	data = tdb_fetch(tdb_ctx, key);
+	if (!data.dptr)
+		errno = tdb_error(tdb_ctx) == TDB_ERR_NOEXIST ? ENOENT : EIO;
+	else
+		talloc_steal(ctx, data.dptr);
+	return data;
+}
+
+TDB_DATA store_peek(const char *name)
+{
+	struct mem_record *r;
+
+	r = hashtable_search(mem_index, (void *)name);
+	if (!r)
+		return (TDB_DATA) { NULL, 0 };
+	return r->data;
+}
+
+void store_release(const void *ctx, TDB_DATA data)
+{
+	talloc_unlink(ctx, data.dptr);
+}
+
+int store_store(TDB_DATA key, TDB_DATA data)
+{
+	int ret;
+
+	if (in_memory) {
+		ret = mem_store((char *)key.dptr, data);
+		if (ret) {
+			talloc_free(data.dptr);
+		} else {
+			mark_dirty((char *)key.dptr);
+			snapshot_update(key, data);
+		}
+		return ret;
+	}
+
+	/* TDB should set errno, but doesn't even set ecode AFAICT. */
+	ret = tdb_store(tdb_ctx, key, data, TDB_REPLACE) ? EIO : 0;
+	if (!ret)
+		snapshot_update(key, data);
+	talloc_free(data.dptr);
+	return ret;
+}
+
+int store_delete(TDB_DATA key)
+{
+	struct mem_record *r;
+
+	if (in_memory) {
+		r = hashtable_remove(mem_index, key.dptr);
+		if (!r)
+			return ENOENT;
+		/* The key may be the name of the record itself. */
+		mark_dirty(r->name);
+		snapshot_update(key, (TDB_DATA) { NULL, 0 });
+		list_del(&r->list);
+		/* Readers may still hold a reference to the data. */
+		talloc_unlink(r, r->data.dptr);
+		talloc_free(r);
+		return 0;
+	}
+
+	if (tdb_delete(tdb_ctx, key) == 0) {
+		snapshot_update(key, (TDB_DATA) { NULL, 0 });
+		return 0;
+	}
+	return tdb_error(tdb_ctx) == TDB_ERR_NOEXIST ? ENOENT : EIO;
+}
+
+struct traverse_args {
+	store_traverse_fn *fn;
+	void *private;
+};
+
+static int traverse_tdb(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+			void *private)
+{
+	struct traverse_args *args = private;
+
+	return args->fn(key, val, args->private);
+}
+
+void store_traverse(store_traverse_fn *fn, void *private)
+{
+	struct traverse_args args = { fn, private };
+	struct mem_record *r, *next;
+	TDB_DATA key;
+
+	if (!in_memory) {
+		tdb_traverse(tdb_ctx, traverse_tdb, &args);
+		return;
+	}
+
+	list_for_each_entry_safe(r, next, &mem_records, list) {
+		key.dptr = (void *)r->name;
+		key.dsize = strlen(r->name);
+		if (fn(key, r->data, private))
+			break;
+	}
+}
+
+static void flush_dirty(void)
+{
+	struct dirty_record *d;
+	struct mem_record *r;
+	TDB_DATA key;
+
+	while ((d = list_top(&dirty_records, struct dirty_record, list))) {
+		key.dptr = (void *)d->name;
+		key.dsize = strlen(d->name);
+		r = hashtable_search(mem_index, d->name);
+		if (r ? tdb_store(tdb_ctx, key, r->data, TDB_REPLACE) != 0
+		      : (tdb_delete(tdb_ctx, key) != 0 &&
+			 tdb_error(tdb_ctx) != TDB_ERR_NOEXIST))
+			syslog(LOG_ERR, "Could not write %s to the tdb file: %s",
+			       d->name, tdb_errorstr(tdb_ctx));
+		list_del(&d->list);
+		hashtable_remove(dirty_index, d->name);
+		talloc_free(d);
+	}
+}
+
+static bool write_snapshot(void)
+{
+	const char *tdbname = xs_daemon_tdb();
+	char *tmpname;
+	struct mem_record *r;
+	TDB_CONTEXT *tdb;
+	TDB_DATA key;
+	bool ok = true;
+
+	tmpname = talloc_asprintf(NULL, "%s.snapshot", tdbname);
+	if (!tmpname)
+		return false;
+
+	tdb = tdb_open(tmpname, 7919, 0, O_RDWR|O_CREAT|O_TRUNC, 0640);
+	if (!tdb) {
+		talloc_free(tmpname);
+		return false;
+	}
+
+	list_for_each_entry(r, &mem_records, list) {
+		if (r->name[0] != '/')
+			continue;
+		key.dptr = (void *)r->name;
+		key.dsize = strlen(r->name);
+		if (tdb_store(tdb, key, r->data, TDB_REPLACE) != 0) {
+			ok = false;
+			break;
+		}
+	}
+
+	if (tdb_close(tdb) != 0)
+		ok = false;
+	if (ok && rename(tmpname, tdbname) != 0)
+		ok = false;
+	if (!ok)
+		unlink(tmpname);
+
+	talloc_free(tmpname);
+	return ok;
+}
+
+int store_flush(void)
+{
+	time_t now, due;
+
+	if (!in_memory)
+		return -1;
+
+	/* If write-behind lost track of a record, fall back to a snapshot. */
+	if (persist == STORE_PERSIST_WRITE_BEHIND)
+		flush_dirty();
+
+	if (!snapshot_dirty)
+		return -1;
+
+	now = time(NULL);
+	due = snapshot_time + persist_interval;
+	if (now < due)
+		return (due - now) * 1000;
+
+	if (!write_snapshot()) {
+		syslog(LOG_ERR, "Could not write snapshot of the store: %m");
+		/* Try again later. */
+		snapshot_time = now;
+		return persist_interval * 1000;
+	}
+
+	snapshot_dirty = false;
+	snapshot_time = now;
+
+	/* Follow the rename with the handle we write behind to. */
+	if (persist == STORE_PERSIST_WRITE_BEHIND) {
+		tdb_close(tdb_ctx);
+		tdb_ctx = tdb_open(xs_daemon_tdb(), 0, 0, O_RDWR, 0);
+		if (!tdb_ctx)
+			barf_perror("Could not reopen tdb file");
+		talloc_steal(mem_ctx, tdb_ctx);
+	}
+	return -1;
+}
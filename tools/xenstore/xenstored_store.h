@@ -0,0 +1,66 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include "xenstored_core.h"
+
+/* How an in-memory store is written to disk. */
+enum store_persist {
+	STORE_PERSIST_NONE,
+	/* Write the whole store every few seconds if it changed. */
+	STORE_PERSIST_SNAPSHOT,
+	/* Write the changed records after each batch of requests. */
+	STORE_PERSIST_WRITE_BEHIND,
+};
+
+/* Keep the records in memory instead of in the TDB file. */
+void store_use_memory(enum store_persist persist, unsigned int interval);
+
+/* Open the store: returns false if it is new and empty. */
+bool store_open(void);
+
+/*
+ * Fetch a record; errno is ENOENT or EIO on failure.  The data must not
+ * be modified, and stays valid until released or ctx is freed.
+ */
+TDB_DATA store_fetch(const void *ctx, TDB_DATA key);
+void store_release(const void *ctx, TDB_DATA data);
+
+/*
+ * Look up a record of the in-memory store in place.  It stays valid until
+ * the store is next changed; several threads may look up at once as long
+ * as nothing changes it meanwhile.
+ */
+TDB_DATA store_peek(const char *name);
+
+/* Store a record, taking over data.dptr.  Return 0 or an errno. */
+int store_store(TDB_DATA key, TDB_DATA data);
+
+/* Delete a record.  Return 0 or an errno (ENOENT if it doesn't exist). */
+int store_delete(TDB_DATA key);
+
+/* Call fn for every record; fn may delete the record it's called on. */
+typedef int store_traverse_fn(TDB_DATA key, TDB_DATA data, void *private);
+void store_traverse(store_traverse_fn *fn, void *private);
+
+/* Write the store to disk as needed: returns the poll timeout to use. */
+int store_flush(void);
+
+#endif /* _XENSTORED_STORE_H */
@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "talloc.h"
@@ -33,9 +34,43 @@
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Transactions don't copy the store.  Every node a transaction touches is
+ * remembered together with the generation count of its record at the time
+ * of the first access.  Modified nodes are written to private records of
+ * the transaction, keyed by a per-transaction prefix followed by the node
+ * name; as node names always start with '/' such keys can't clash with
+ * the global ones.  At commit time the transaction fails with EAGAIN if
+ * any of the accessed nodes has changed in the meantime, otherwise the
+ * private records replace the global ones.
+ */
+
+struct accessed_node
+{
+	/* List of all accessed nodes in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Key of the private record of the node. */
+	TDB_DATA trans_key;
+
+	/* Generation of the global record at the first access. */
+	uint64_t generation;
+
+	/* Has the node been written or deleted by the transaction? */
+	bool ta_node;
+
+	/* While committing: the new global record, and the one it replaces
+	 * (dptr NULL if none). */
+	TDB_DATA new_data, old_data;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -68,12 +103,11 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
+	/* Prefix of the private records of this transaction. */
+	uint64_t prefix;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes. */
+	struct list_head accessed;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +117,210 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
+uint64_t generation;
+static uint64_t next_prefix;
+
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (streq(i->node, name))
+			return i;
+
+	return NULL;
+}
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+void transaction_prepend(struct connection *conn, const char *name,
+			 TDB_DATA *key)
 {
-	return trans->tdb;
+	struct accessed_node *i;
+
+	if (conn && conn->transaction) {
+		i = find_accessed_node(conn->transaction, name);
+		if (i && i->ta_node) {
+			*key = i->trans_key;
+			return;
+		}
+	}
+
+	key->dptr = (void *)name;
+	key->dsize = strlen(name);
+}
+
+int access_node(struct connection *conn, struct node *node,
+		enum node_access_type type, TDB_DATA *key)
+{
+	struct transaction *trans = conn ? conn->transaction : NULL;
+	struct accessed_node *i;
+
+	if (!trans) {
+		if (type == NODE_ACCESS_WRITE)
+			node->generation = generation++;
+		if (key) {
+			key->dptr = (void *)node->name;
+			key->dsize = strlen(node->name);
+		}
+		return 0;
+	}
+
+	i = find_accessed_node(trans, node->name);
+	if (!i) {
+		i = talloc_zero(trans, struct accessed_node);
+		if (!i)
+			goto nomem;
+		i->node = talloc_strdup(i, node->name);
+		if (!i->node) {
+			talloc_free(i);
+			goto nomem;
+		}
+		i->generation = node->generation;
+		list_add_tail(&i->list, &trans->accessed);
+	}
+
+	if (type != NODE_ACCESS_READ) {
+		if (!i->trans_key.dptr) {
+			i->trans_key.dptr = (void *)talloc_asprintf(i,
+				"%llu%s", (unsigned long long)trans->prefix,
+				i->node);
+			if (!i->trans_key.dptr)
+				goto nomem;
+			i->trans_key.dsize = strlen((char *)i->trans_key.dptr);
+		}
+		i->ta_node = true;
+	}
+
+	if (key)
+		*key = i->ta_node ? i->trans_key : (TDB_DATA) {
+			.dptr = (void *)node->name,
+			.dsize = strlen(node->name) };
+	return 0;
+
+ nomem:
+	errno = ENOMEM;
+	return ENOMEM;
+}
+
+/* Generation of the global record of a node, NO_GENERATION if absent. */
+static uint64_t global_generation(struct transaction *trans, const char *name)
+{
+	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
+	uint64_t gen;
+
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+	data = store_fetch(trans, key);
+	if (!data.dptr)
+		return NO_GENERATION;
+
+	hdr = (void *)data.dptr;
+	gen = hdr->generation;
+	store_release(trans, data);
+	return gen;
+}
+
+/* A private copy of a record, dptr NULL if there is none. */
+static int copy_record(struct transaction *trans, TDB_DATA key,
+		       TDB_DATA *copy)
+{
+	TDB_DATA data;
+
+	copy->dptr = NULL;
+	copy->dsize = 0;
+
+	data = store_fetch(trans, key);
+	if (!data.dptr)
+		return errno == ENOENT ? 0 : EIO;
+
+	/* Records are read-only: the caller gets a copy it may change. */
+	copy->dptr = talloc_memdup(trans, data.dptr, data.dsize);
+	copy->dsize = data.dsize;
+	store_release(trans, data);
+	return copy->dptr ? 0 : ENOMEM;
+}
+
+/* Put a record in the global store back as it was before the commit. */
+static void restore_record(struct accessed_node *i)
+{
+	TDB_DATA key;
+
+	key.dptr = (void *)i->node;
+	key.dsize = strlen(i->node);
+	if (i->old_data.dptr ? store_store(key, i->old_data) != 0
+			     : store_delete(key) == EIO)
+		syslog(LOG_ERR, "Could not restore %s after a failed commit",
+		       i->node);
+	i->old_data.dptr = NULL;
+}
+
+/*
+ * Move the private records of a transaction into the global store.  All
+ * the records are staged first, so that running out of memory changes
+ * nothing; if writing one fails, those already written are put back.
+ */
+static int finalize_transaction(struct transaction *trans)
+{
+	struct accessed_node *i, *j;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA key;
+	int ret;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (global_generation(trans, i->node) != i->generation)
+			return EAGAIN;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->ta_node)
+			continue;
+
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+		ret = copy_record(trans, i->trans_key, &i->new_data);
+		if (!ret)
+			ret = copy_record(trans, key, &i->old_data);
+		if (ret)
+			return ret;
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->ta_node)
+			continue;
+
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+		if (i->new_data.dptr) {
+			hdr = (void *)i->new_data.dptr;
+			hdr->generation = generation++;
+			ret = store_store(key, i->new_data);
+		} else
+			ret = store_delete(key) == EIO ? EIO : 0;
+		/* The store owns the new record now, whatever happened. */
+		i->new_data.dptr = NULL;
+
+		if (ret) {
+			list_for_each_entry(j, &trans->accessed, list) {
+				if (j == i)
+					break;
+				if (j->ta_node)
+					restore_record(j);
+			}
+			return ret;
+		}
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->ta_node)
+			continue;
+		store_delete(i->trans_key);
+		/* Unused: nothing to roll back any more. */
+		talloc_free(i->old_data.dptr);
+		i->old_data.dptr = NULL;
+		i->ta_node = false;
+	}
+
+	return 0;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +329,8 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -116,11 +345,12 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
+	struct accessed_node *i;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	list_for_each_entry(i, &trans->accessed, list)
+		if (i->ta_node)
+			store_delete(i->trans_key);
 	return 0;
 }
 
@@ -156,18 +386,10 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
-		return;
-	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	trans->prefix = next_prefix++;
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -190,6 +412,7 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	struct changed_node *i;
 	struct changed_domain *d;
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
 		send_error(conn, EINVAL);
@@ -209,17 +432,11 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
-			send_error(conn, EAGAIN);
-			return;
-		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		ret = finalize_transaction(trans);
+		if (ret) {
+			send_error(conn, ret);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,7 +445,6 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
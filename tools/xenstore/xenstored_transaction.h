@@ -35,8 +35,22 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+enum node_access_type {
+	NODE_ACCESS_READ,
+	NODE_ACCESS_WRITE,
+	NODE_ACCESS_DELETE
+};
+
+/* Generation count of the store, bumped by every committed write. */
+extern uint64_t generation;
+
+/* Return the key under which the connection sees this node. */
+void transaction_prepend(struct connection *conn, const char *name,
+			 TDB_DATA *key);
+
+/* Record an access to a node; returns the key to use for a write. */
+int access_node(struct connection *conn, struct node *node,
+		enum node_access_type type, TDB_DATA *key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
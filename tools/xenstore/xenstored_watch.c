@@ -26,6 +26,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -33,11 +34,41 @@
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watches are indexed by a tree of the watched paths, so firing them
+ * doesn't have to look at every watch of every connection.  The tree has
+ * an entry for every watched path and for all of its ancestors; entries
+ * are looked up by path in watch_index.  Event paths ("@...") are entries
+ * without a parent.
+ */
+struct watch_node
+{
+	char *path;
+
+	struct watch_node *parent;
+
+	/* Entries one level below this one. */
+	struct list_head children;
+	struct list_head sibling;
+
+	/* Watches on this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, and the index entry of the path. */
+	struct list_head index_list;
+	struct watch_node *index;
+
+	/* Connection owning this watch. */
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -48,6 +79,100 @@ struct watch
 	char *node;
 };
 
+/* Drop index entries which neither carry watches nor lead to any. */
+static void put_watch_node(struct watch_node *wn)
+{
+	struct watch_node *parent;
+
+	while (wn && list_empty(&wn->watches) && list_empty(&wn->children)) {
+		parent = wn->parent;
+		list_del(&wn->sibling);
+		hashtable_remove(watch_index, wn->path);
+		talloc_free(wn);
+		wn = parent;
+	}
+}
+
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *wn, *parent_wn;
+	char *key, *parent, *slash;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	wn = hashtable_search(watch_index, (void *)path);
+	if (wn)
+		return wn;
+
+	wn = talloc_zero(NULL, struct watch_node);
+	if (!wn)
+		return NULL;
+	wn->path = talloc_strdup(wn, path);
+	if (!wn->path)
+		goto nomem;
+	INIT_LIST_HEAD(&wn->children);
+	INIT_LIST_HEAD(&wn->sibling);
+	INIT_LIST_HEAD(&wn->watches);
+
+	if (path[0] == '/' && path[1] != '\0') {
+		parent = talloc_strdup(wn, path);
+		if (!parent)
+			goto nomem;
+		slash = strrchr(parent, '/');
+		if (slash == parent)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+		wn->parent = get_watch_node(parent);
+		if (!wn->parent)
+			goto nomem;
+		list_add_tail(&wn->sibling, &wn->parent->children);
+	}
+
+	/* The hashtable owns its keys and free()s them. */
+	key = strdup(path);
+	if (!key || !hashtable_insert(watch_index, key, wn)) {
+		free(key);
+		list_del(&wn->sibling);
+		/* Ancestors just created for this entry would lead nowhere. */
+		parent_wn = wn->parent;
+		talloc_free(wn);
+		put_watch_node(parent_wn);
+		return NULL;
+	}
+	return wn;
+
+ nomem:
+	talloc_free(wn);
+	return NULL;
+}
+
+/* Can this conn load node, or see that it doesn't exist? */
+static bool may_see_event(struct connection *conn, const char *name)
+{
+	struct node *node;
+
+	if (check_event_node(name))
+		return true;
+
+	node = get_node(conn, name, XS_PERM_READ);
+	/*
+	 * XXX We allow EACCES here because otherwise a non-dom0
+	 * backend driver cannot watch for disappearance of a frontend
+	 * xenstore directory. When the directory disappears, we
+	 * revert to permissions of the parent directory for that path,
+	 * which will typically disallow access for the backend.
+	 * But this breaks device-channel teardown!
+	 * Really we should fix this better...
+	 */
+	return node || errno == ENOENT || errno == EACCES;
+}
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -56,22 +181,6 @@ static void add_event(struct connection *conn,
 	unsigned int len;
 	char *data;
 
-	if (!check_event_node(name)) {
-		/* Can this conn load node, or see that it doesn't exist? */
-		struct node *node = get_node(conn, name, XS_PERM_READ);
-		/*
-		 * XXX We allow EACCES here because otherwise a non-dom0
-		 * backend driver cannot watch for disappearance of a frontend
-		 * xenstore directory. When the directory disappears, we
-		 * revert to permissions of the parent directory for that path,
-		 * which will typically disallow access for the backend.
-		 * But this breaks device-channel teardown!
-		 * Really we should fix this better...
-		 */
-		if (!node && errno != ENOENT && errno != EACCES)
-			return;
-	}
-
 	if (watch->relative_path) {
 		name += strlen(watch->relative_path);
 		if (*name == '/') /* Could be "" */
@@ -86,29 +195,101 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+/* Fire the watches on one path; name is the path reported to them. */
+static void fire_watch_node(struct watch_node *wn, const char *name)
+{
+	struct connection *checked = NULL;
+	struct watch *watch;
+	bool visible = false;
+
+	list_for_each_entry(watch, &wn->watches, index_list) {
+		/* Watches of a connection mostly come in a row. */
+		if (watch->conn != checked) {
+			checked = watch->conn;
+			visible = may_see_event(checked, name);
+		}
+		if (visible)
+			add_event(watch->conn, watch, name);
+	}
+}
+
+/* Fire the watches strictly below a path, each with its own path. */
+static void fire_watch_children(struct watch_node *wn)
+{
+	struct watch_node *child;
+
+	list_for_each_entry(child, &wn->children, sibling) {
+		fire_watch_node(child, child->path);
+		fire_watch_children(child);
+	}
+}
+
+/* Fire the watches without the index, looking at every one of them. */
+static void fire_watches_unindexed(const char *name, bool recurse)
 {
 	struct connection *i;
 	struct watch *watch;
 
+	list_for_each_entry(i, &connections, list) {
+		list_for_each_entry(watch, &i->watches, list) {
+			if (is_child(name, watch->node)) {
+				if (may_see_event(i, name))
+					add_event(i, watch, name);
+			} else if (recurse && is_child(watch->node, name)) {
+				if (may_see_event(i, watch->node))
+					add_event(i, watch, watch->node);
+			}
+		}
+	}
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_node *wn;
+	char *path, *slash;
+
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	if (!watch_index)
+		return;
+
+	/* Watches on the node itself and on all of its ancestors... */
+	path = talloc_strdup(NULL, name);
+	if (!path) {
+		fire_watches_unindexed(name, recurse);
+		return;
+	}
+	for (;;) {
+		wn = hashtable_search(watch_index, path);
+		if (wn)
+			fire_watch_node(wn, name);
+		if (streq(path, "/"))
+			break;
+		slash = strrchr(path, '/');
+		if (!slash || slash == path)
+			strcpy(path, "/");
+		else
+			*slash = '\0';
+	}
+	talloc_free(path);
+
+	/* ... and, if they are affected too, on its children. */
+	if (recurse) {
+		wn = hashtable_search(watch_index, (void *)name);
+		if (wn)
+			fire_watch_children(wn);
 	}
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+
+	trace_destroy(watch, "watch");
+	list_del(&watch->index_list);
+	put_watch_node(watch->index);
 	return 0;
 }
 
@@ -156,21 +337,31 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	watch = talloc(conn, struct watch);
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
+	watch->conn = conn;
 	if (relative)
 		watch->relative_path = get_implicit_path(conn);
 	else
 		watch->relative_path = NULL;
 
+	watch->index = get_watch_node(watch->node);
+	if (!watch->index) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->index_list, &watch->index->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
 
 	/* We fire once up front: simplifies clients and restart. */
-	add_event(conn, watch, watch->node);
+	if (may_see_event(conn, watch->node))
+		add_event(conn, watch, watch->node);
 }
 
 void do_unwatch(struct connection *conn, struct buffered_data *in)
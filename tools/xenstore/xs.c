@@ -17,12 +17,14 @@
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -30,9 +32,11 @@
 #include <assert.h>
 #include <stdio.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
 #include "xenstore.h"
+#include "xenstore_lib.h"
 #include "list.h"
 #include "utils.h"
 
@@ -82,6 +86,12 @@ struct xs_handle {
 	/* One request at a time. */
 	pthread_mutex_t request_mutex;
 
+	/* The daemon's snapshot of the store, if it shares one. */
+	struct xs_snapshot_hdr *snapshot;
+	size_t snapshot_size;
+	/* The daemon at the other end of the socket, 0 if unknown. */
+	pid_t daemon_pid;
+
 	/* Lock discipline:
 	 *  Only holder of the request lock may write to h->fd.
 	 *  Only holder of the request lock may access read_thr_exists.
@@ -89,6 +99,7 @@ struct xs_handle {
 	 *  If read_thr_exists==1, only the read thread may read h->fd.
 	 *  Only holder of the reply lock may access reply_list.
 	 *  Only holder of the watch lock may access watch_list.
+	 *  Only holder of the request lock may map or read the snapshot.
 	 * Lock hierarchy:
 	 *  The order in which to acquire locks is
 	 *     request_mutex
@@ -129,6 +140,11 @@ struct xs_handle {
 	int watch_pipe[2];
 	/* Filtering watch event in unwatch function? */
 	bool unwatch_filter;
+	/* The daemon's snapshot of the store, if it shares one. */
+	struct xs_snapshot_hdr *snapshot;
+	size_t snapshot_size;
+	/* The daemon at the other end of the socket, 0 if unknown. */
+	pid_t daemon_pid;
 };
 
 #define mutex_lock(m)		((void)0)
@@ -214,6 +230,69 @@ error:
 	return -1;
 }
 
+static void snapshot_unmap(struct xs_handle *h)
+{
+	if (h->snapshot)
+		munmap(h->snapshot, h->snapshot_size);
+	h->snapshot = NULL;
+}
+
+/* Map the snapshot of the store which the daemon shares, if any. */
+static void snapshot_map(struct xs_handle *h)
+{
+	const char *name = xs_daemon_snapshot();
+	struct xs_snapshot_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	snapshot_unmap(h);
+
+	if (!name)
+		return;
+	fd = open(name, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return;
+
+	/*
+	 * The layout doesn't change for the life of the file.  A file
+	 * written by another daemon than ours is stale.
+	 */
+	if (hdr->magic != XS_SNAPSHOT_MAGIC || hdr->retired ||
+	    !h->daemon_pid || hdr->pid != h->daemon_pid ||
+	    !hdr->nr_slots || (hdr->nr_slots & (hdr->nr_slots - 1)) ||
+	    hdr->heap_off < sizeof(*hdr) +
+			    (uint64_t)hdr->nr_slots * sizeof(struct xs_snapshot_slot) ||
+	    hdr->heap_off + hdr->heap_size > st.st_size) {
+		munmap(hdr, st.st_size);
+		return;
+	}
+
+	h->snapshot = hdr;
+	h->snapshot_size = st.st_size;
+}
+
+/* Which process is at the other end of a local socket, 0 if unknown. */
+static pid_t get_peer_pid(int sock)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+	    len == sizeof(cred))
+		return cred.pid;
+#endif
+	return 0;
+}
+
 static int get_dev(const char *connect_to)
 {
 	/* We cannot open read-only because requests are writes */
@@ -257,6 +336,12 @@ static struct xs_handle *get_handle(const char *connect_to)
 
 	h->unwatch_filter = false;
 
+	/* Only a local daemon can share its snapshot. */
+	if (S_ISSOCK(buf.st_mode)) {
+		h->daemon_pid = get_peer_pid(fd);
+		snapshot_map(h);
+	}
+
 #ifdef USE_PTHREAD
 	pthread_mutex_init(&h->watch_mutex, NULL);
 	pthread_cond_init(&h->watch_condvar, NULL);
@@ -325,6 +410,7 @@ static void close_fds_free(struct xs_handle *h) {
 
         close(h->fd);
         
+	snapshot_unmap(h);
 	free(h);
 }
 
@@ -559,13 +645,151 @@ static bool xs_bool(char *reply)
 	return true;
 }
 
+/*
+ * Copy the record of a node out of the snapshot.  Returns NULL if the
+ * daemon must be asked: no snapshot, or no such node in it (the daemon
+ * knows the right error).
+ */
+static struct xs_tdb_record_hdr *snapshot_fetch(struct xs_handle *h,
+						const char *path,
+						unsigned int *reclen)
+{
+	struct xs_snapshot_hdr *hdr;
+	const volatile struct xs_snapshot_slot *slots;
+	struct xs_snapshot_slot slot;
+	struct xs_tdb_record_hdr *rec;
+	const char *heap;
+	uint64_t heap_size, name_size;
+	uint32_t seq, hash, mask, i, n;
+	unsigned int len = strlen(path), tries;
+	bool found;
+
+	hash = xs_snapshot_hash(path, len);
+	name_size = XS_SNAPSHOT_ALIGN(len + 1);
+
+	for (tries = 0; tries < 100; tries++) {
+		hdr = h->snapshot;
+		if (!hdr)
+			return NULL;
+
+		seq = hdr->seq;
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+		if (hdr->retired) {
+			snapshot_map(h);
+			continue;
+		}
+
+		slots = (const volatile struct xs_snapshot_slot *)(hdr + 1);
+		heap = (const char *)hdr + hdr->heap_off;
+		heap_size = hdr->heap_size;
+		mask = hdr->nr_slots - 1;
+		found = false;
+		for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+			/*
+			 * The slot may change under us, and off may even be
+			 * torn: only use this copy of it, check that it fits,
+			 * and trust it once seq is found unchanged below.
+			 */
+			slot.off = slots[i].off;
+			slot.hash = slots[i].hash;
+			slot.namelen = slots[i].namelen;
+			slot.reclen = slots[i].reclen;
+			if (slot.off == XS_SNAPSHOT_FREE)
+				break;
+			if (slot.off == XS_SNAPSHOT_DELETED ||
+			    slot.hash != hash || slot.namelen != len)
+				continue;
+			if (slot.off > heap_size ||
+			    heap_size - slot.off < name_size ||
+			    heap_size - slot.off - name_size < slot.reclen)
+				break;
+			if (memcmp(heap + slot.off, path, len) == 0) {
+				found = true;
+				break;
+			}
+		}
+
+		rec = NULL;
+		if (found) {
+			rec = malloc(slot.reclen ? slot.reclen : 1);
+			if (!rec)
+				return NULL;
+			memcpy(rec, heap + slot.off + name_size, slot.reclen);
+		}
+
+		__sync_synchronize();
+		if (hdr->seq == seq) {
+			if (rec)
+				*reclen = slot.reclen;
+			return rec;
+		}
+		free(rec);
+	}
+
+	return NULL;
+}
+
+/* Answer a read or directory request from the snapshot if we can. */
+static void *snapshot_single(struct xs_handle *h, xs_transaction_t t,
+			     enum xsd_sockmsg_type type, const char *path,
+			     unsigned int *len)
+{
+	struct xs_tdb_record_hdr *rec;
+	unsigned int reclen, off, size;
+	char *ret = NULL;
+
+	/* Transactions have their own view of the store. */
+	if (t != XBT_NULL || path[0] != '/')
+		return NULL;
+
+	mutex_lock(&h->request_mutex);
+	rec = snapshot_fetch(h, path, &reclen);
+	mutex_unlock(&h->request_mutex);
+	if (!rec)
+		return NULL;
+
+	/* The header is padded: the permissions start before its end. */
+	off = offsetof(struct xs_tdb_record_hdr, perms);
+	if (reclen < off ||
+	    (reclen - off) / sizeof(rec->perms[0]) < rec->num_perms)
+		goto out;
+	off += rec->num_perms * sizeof(rec->perms[0]);
+	if (reclen - off < rec->datalen ||
+	    reclen - off - rec->datalen < rec->childlen)
+		goto out;
+
+	if (type == XS_DIRECTORY) {
+		off += rec->datalen;
+		size = rec->childlen;
+	} else {
+		size = rec->datalen;
+	}
+
+	/* Nul-terminated, as if it came from the daemon. */
+	ret = malloc(size + 1);
+	if (ret) {
+		memcpy(ret, (char *)rec + off, size);
+		ret[size] = '\0';
+		if (len)
+			*len = size;
+	}
+
+out:
+	free(rec);
+	return ret;
+}
+
 char **xs_directory(struct xs_handle *h, xs_transaction_t t,
 		    const char *path, unsigned int *num)
 {
 	char *strings, *p, **ret;
 	unsigned int len;
 
-	strings = xs_single(h, t, XS_DIRECTORY, path, &len);
+	strings = snapshot_single(h, t, XS_DIRECTORY, path, &len);
+	if (!strings)
+		strings = xs_single(h, t, XS_DIRECTORY, path, &len);
 	if (!strings)
 		return NULL;
 
@@ -594,6 +818,11 @@ char **xs_directory(struct xs_handle *h, xs_transaction_t t,
 void *xs_read(struct xs_handle *h, xs_transaction_t t,
 	      const char *path, unsigned int *len)
 {
+	void *ret;
+
+	ret = snapshot_single(h, t, XS_READ, path, len);
+	if (ret)
+		return ret;
 	return xs_single(h, t, XS_READ, path, len);
 }
 
@@ -710,6 +939,15 @@ bool xs_restrict(struct xs_handle *h, unsigned domid)
 {
 	char buf[16];
 
+	/*
+	 * The snapshot shows every node: drop it before the daemon starts
+	 * checking permissions, so no read can bypass them.
+	 */
+	mutex_lock(&h->request_mutex);
+	snapshot_unmap(h);
+	h->daemon_pid = 0;
+	mutex_unlock(&h->request_mutex);
+
 	sprintf(buf, "%d", domid);
 	return xs_bool(xs_single(h, XBT_NULL, XS_RESTRICT, buf, NULL));
 }
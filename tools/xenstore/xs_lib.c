@@ -63,6 +63,17 @@ const char *xs_daemon_socket(void)
 	return xs_daemon_path();
 }
 
+const char *xs_daemon_snapshot(void)
+{
+	static char buf[PATH_MAX];
+	const char *s = xs_daemon_path();
+	if (s == NULL)
+		return NULL;
+	if (snprintf(buf, sizeof(buf), "%s_snapshot", s) >= PATH_MAX)
+		return NULL;
+	return buf;
+}
+
 const char *xs_daemon_socket_ro(void)
 {
 	static char buf[PATH_MAX];
@@ -145,6 +156,19 @@ bool xs_strings_to_perms(struct xs_permissions *perms, unsigned int num,
 	return true;
 }
 
+/* FNV-1a. */
+uint32_t xs_snapshot_hash(const char *name, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
 /* Convert permissions to a string (up to len MAX_STRLEN(unsigned int)+1). */
 bool xs_perm_to_string(const struct xs_permissions *perm,
                        char *buffer, size_t buf_len)
@@ -0,0 +1,675 @@
+/******************************************************************************
+ * tools/xentrace/analyze.c
+ *
+ * One pass analysis of xentrace binary output: see analyze.h.
+ *
+ * xentrace writes the trace buffer of each CPU out a window at a time,
+ * each window after a cpu change record giving its CPU and size. Records
+ * of one CPU are in order, but windows of different CPUs are interleaved
+ * as they were collected. Here the windows of each CPU are strung
+ * together, and the CPUs kept in a heap by the TSC of their next record.
+ *
+ * Files written compressed by xentrace are gzip members one after
+ * another; these are inflated into memory rather than mapped.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <xen/xen.h>
+#include <xen/trace.h>
+#include <xen/vcpu.h>
+
+#include "analyze.h"
+
+/* As written by xentrace. */
+struct cpu_change_record {
+    uint32_t header;
+    struct {
+        int cpu;
+        unsigned window_size;
+    } data;
+};
+
+#define CPU_CHANGE_HEADER                                           \
+    (TRC_TRACE_CPU_CHANGE                                           \
+     | (((sizeof(struct cpu_change_record)/sizeof(uint32_t)) - 1)   \
+        << TRACE_EXTRA_SHIFT) )
+
+/* The old and new runstates are in bits 8-9 and 4-5 of the event. */
+#define RUNSTATE_CHANGE_MASK 0x330
+
+#define MAX_CPUS 0x10000
+
+#define HASH(_k, _size) (((_k) * 2654435761u) & ((_size) - 1))
+
+int analyze_class(uint32_t event)
+{
+    uint32_t cls = ((event & TRC_ALL) >> 16) & 0xfff;
+
+    if ( cls == 0 || (cls & (cls - 1)) )
+        return ANALYZE_CLASS_OTHER;
+
+    return __builtin_ctz(cls);
+}
+
+unsigned int analyze_lat_bucket(uint64_t cycles)
+{
+    unsigned int b = cycles ? 64 - __builtin_clzll(cycles) : 0;
+
+    return b < ANALYZE_LAT_BUCKETS ? b : ANALYZE_LAT_BUCKETS - 1;
+}
+
+static void lat_add(struct analyze_lat *lat, uint64_t cycles)
+{
+    lat->count++;
+    lat->total += cycles;
+    if ( cycles > lat->max )
+        lat->max = cycles;
+    lat->hist[analyze_lat_bucket(cycles)]++;
+}
+
+int analyze_init(struct analyze *a)
+{
+    memset(a, 0, sizeof(*a));
+
+    a->domains = calloc(0x10000, sizeof(*a->domains));
+    if ( !a->domains )
+        return -1;
+
+    return 0;
+}
+
+void analyze_free(struct analyze *a)
+{
+    unsigned int i;
+
+    for ( i = 0; i < a->nr_files; i++ )
+    {
+        if ( a->files[i].inflated )
+            free(a->files[i].map);
+        else
+            munmap(a->files[i].map, a->files[i].len);
+    }
+    free(a->files);
+
+    for ( i = 0; i < a->nr_cpus; i++ )
+    {
+        if ( !a->cpus[i] )
+            continue;
+        free(a->cpus[i]->segs);
+        free(a->cpus[i]);
+    }
+    free(a->cpus);
+
+    if ( a->domains )
+    {
+        for ( i = 0; i < 0x10000; i++ )
+            free(a->domains[i]);
+        free(a->domains);
+    }
+
+    free(a->events);
+    free(a->vcpus);
+    memset(a, 0, sizeof(*a));
+}
+
+static struct analyze_cpu *get_cpu(struct analyze *a, unsigned int cpu)
+{
+    struct analyze_cpu **cpus;
+    unsigned int nr;
+
+    if ( cpu >= a->nr_cpus )
+    {
+        nr = cpu + 1;
+        cpus = realloc(a->cpus, nr * sizeof(*cpus));
+        if ( !cpus )
+            return NULL;
+        memset(cpus + a->nr_cpus, 0, (nr - a->nr_cpus) * sizeof(*cpus));
+        a->cpus = cpus;
+        a->nr_cpus = nr;
+    }
+
+    if ( !a->cpus[cpu] )
+    {
+        a->cpus[cpu] = calloc(1, sizeof(struct analyze_cpu));
+        if ( !a->cpus[cpu] )
+            return NULL;
+        a->cpus[cpu]->cpu = cpu;
+        a->cpus[cpu]->domid = -1;
+    }
+
+    return a->cpus[cpu];
+}
+
+static int add_seg(struct analyze_cpu *c, const unsigned char *start,
+                   const unsigned char *end)
+{
+    struct analyze_seg *segs;
+
+    /* Windows which follow on from each other in memory are one. */
+    if ( c->nr_segs && c->segs[c->nr_segs - 1].end == start )
+    {
+        c->segs[c->nr_segs - 1].end = end;
+        return 0;
+    }
+
+    if ( c->nr_segs == c->max_segs )
+    {
+        segs = realloc(c->segs, (c->max_segs * 2 + 16) * sizeof(*segs));
+        if ( !segs )
+            return -1;
+        c->segs = segs;
+        c->max_segs = c->max_segs * 2 + 16;
+    }
+
+    c->segs[c->nr_segs].start = start;
+    c->segs[c->nr_segs].end = end;
+    c->nr_segs++;
+    return 0;
+}
+
+int analyze_add_buffer(struct analyze *a, const void *buf, size_t len)
+{
+    const unsigned char *p = buf, *end = p + len;
+    struct cpu_change_record rec;
+    struct analyze_cpu *c;
+    size_t size;
+
+    while ( p < end )
+    {
+        if ( end - p < sizeof(rec) )
+        {
+            a->truncated++;
+            break;
+        }
+
+        memcpy(&rec, p, sizeof(rec));
+        if ( rec.header != CPU_CHANGE_HEADER ||
+             (unsigned)rec.data.cpu >= MAX_CPUS )
+        {
+            /* Nothing after this can be trusted. */
+            a->truncated++;
+            break;
+        }
+        p += sizeof(rec);
+
+        size = rec.data.window_size;
+        if ( size > end - p )
+        {
+            size = end - p;
+            a->truncated++;
+        }
+
+        if ( size )
+        {
+            c = get_cpu(a, rec.data.cpu);
+            if ( !c || add_seg(c, p, p + size) )
+                return -1;
+        }
+        p += size;
+    }
+
+    return 0;
+}
+
+/*
+ * Inflate all the gzip members of a compressed file. A damaged or cut
+ * short file gives what could be inflated, and counts as truncated.
+ */
+static int inflate_file(struct analyze *a, struct analyze_file *f,
+                        const unsigned char *in, size_t in_len)
+{
+    size_t size = in_len * 4, len = 0;
+    unsigned char *buf = NULL, *b;
+    z_stream zs;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    if ( inflateInit2(&zs, 15 + 16) != Z_OK )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = in_len;
+
+    for ( ; ; )
+    {
+        if ( !buf || len == size )
+        {
+            if ( buf )
+                size *= 2;
+            b = realloc(buf, size);
+            if ( !b )
+                goto nomem;
+            buf = b;
+        }
+
+        zs.next_out = buf + len;
+        zs.avail_out = size - len;
+        rc = inflate(&zs, Z_NO_FLUSH);
+        len = size - zs.avail_out;
+
+        if ( rc == Z_STREAM_END )
+        {
+            if ( !zs.avail_in )
+                break;
+            inflateReset(&zs);
+        }
+        else if ( rc == Z_MEM_ERROR )
+            goto nomem;
+        else if ( rc != Z_OK && !(rc == Z_BUF_ERROR && !zs.avail_out) )
+        {
+            a->truncated++;
+            break;
+        }
+    }
+
+    inflateEnd(&zs);
+    f->map = buf;
+    f->len = len;
+    f->inflated = 1;
+    return 0;
+
+ nomem:
+    inflateEnd(&zs);
+    free(buf);
+    errno = ENOMEM;
+    return -1;
+}
+
+int analyze_add_file(struct analyze *a, const char *path)
+{
+    struct analyze_file *f;
+    struct analyze_file *files;
+    struct stat st;
+    void *map;
+    int fd, rc, saved_errno;
+
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 )
+        return -1;
+
+    if ( fstat(fd, &st) )
+        goto fail;
+
+    if ( st.st_size == 0 )
+    {
+        close(fd);
+        return 0;
+    }
+
+    files = realloc(a->files, (a->nr_files + 1) * sizeof(*files));
+    if ( !files )
+        goto fail;
+    a->files = files;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( map == MAP_FAILED )
+        goto fail;
+    close(fd);
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    f = &a->files[a->nr_files];
+    f->map = map;
+    f->len = st.st_size;
+    f->inflated = 0;
+
+    if ( st.st_size >= 2 && !memcmp(map, "\x1f\x8b", 2) )
+    {
+        rc = inflate_file(a, f, map, st.st_size);
+        munmap(map, st.st_size);
+        if ( rc )
+            return -1;
+    }
+    a->nr_files++;
+
+    return analyze_add_buffer(a, f->map, f->len);
+
+ fail:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+static struct analyze_event *get_event(struct analyze *a, uint32_t event)
+{
+    struct analyze_event *events, *e;
+    unsigned int i, j;
+
+    if ( a->nr_events * 4 >= a->max_events * 3 )
+    {
+        unsigned int max = a->max_events ? a->max_events * 2 : 256;
+
+        events = calloc(max, sizeof(*events));
+        if ( !events )
+            return NULL;
+        for ( i = 0; i < a->max_events; i++ )
+        {
+            if ( !a->events[i].records )
+                continue;
+            for ( j = HASH(a->events[i].event, max); events[j].records;
+                  j = (j + 1) & (max - 1) )
+                ;
+            events[j] = a->events[i];
+        }
+        free(a->events);
+        a->events = events;
+        a->max_events = max;
+    }
+
+    for ( i = HASH(event, a->max_events); ;
+          i = (i + 1) & (a->max_events - 1) )
+    {
+        e = &a->events[i];
+        if ( !e->records )
+        {
+            e->event = event;
+            a->nr_events++;
+            return e;
+        }
+        if ( e->event == event )
+            return e;
+    }
+}
+
+static struct analyze_vcpu *get_vcpu(struct analyze *a, uint32_t key)
+{
+    struct analyze_vcpu *vcpus, *v;
+    unsigned int i, j;
+
+    if ( a->nr_vcpus * 4 >= a->max_vcpus * 3 )
+    {
+        unsigned int max = a->max_vcpus ? a->max_vcpus * 2 : 64;
+
+        vcpus = calloc(max, sizeof(*vcpus));
+        if ( !vcpus )
+            return NULL;
+        for ( i = 0; i < a->max_vcpus; i++ )
+        {
+            if ( !a->vcpus[i].used )
+                continue;
+            for ( j = HASH(a->vcpus[i].key, max); vcpus[j].used;
+                  j = (j + 1) & (max - 1) )
+                ;
+            vcpus[j] = a->vcpus[i];
+        }
+        free(a->vcpus);
+        a->vcpus = vcpus;
+        a->max_vcpus = max;
+    }
+
+    for ( i = HASH(key, a->max_vcpus); ; i = (i + 1) & (a->max_vcpus - 1) )
+    {
+        v = &a->vcpus[i];
+        if ( !v->used )
+        {
+            v->used = 1;
+            v->key = key;
+            v->state = -1;
+            a->nr_vcpus++;
+            return v;
+        }
+        if ( v->key == key )
+            return v;
+    }
+}
+
+static struct analyze_domain *get_domain(struct analyze *a, uint16_t domid)
+{
+    struct analyze_domain *d = a->domains[domid];
+
+    if ( !d )
+    {
+        d = calloc(1, sizeof(*d));
+        if ( !d )
+            return NULL;
+        d->domid = domid;
+        a->domains[domid] = d;
+    }
+
+    return d;
+}
+
+static int runstate_change(struct analyze *a, struct analyze_cpu *c,
+                           uint32_t event, uint32_t data)
+{
+    uint16_t domid = data >> 16;
+    int old = (event >> 8) & 3, new = (event >> 4) & 3;
+    struct analyze_domain *d;
+    struct analyze_vcpu *v;
+    uint64_t now = c->tsc, wait;
+
+    v = get_vcpu(a, data);
+    d = get_domain(a, domid);
+    if ( !v || !d )
+        return -1;
+
+    if ( v->state >= 0 && now >= v->since )
+        d->runstate[v->state] += now - v->since;
+
+    switch ( new )
+    {
+    case RUNSTATE_running:
+        d->switches++;
+        if ( v->state == RUNSTATE_runnable && now >= v->since )
+        {
+            wait = now - v->since;
+            lat_add(v->woken ? &d->wake_lat : &d->preempt_lat, wait);
+            if ( domid != DOMID_IDLE )
+                lat_add(v->woken ? &a->wake_lat : &a->preempt_lat, wait);
+        }
+        c->domid = domid;
+        break;
+
+    case RUNSTATE_runnable:
+        v->woken = (old == RUNSTATE_blocked || old == RUNSTATE_offline);
+        if ( v->woken )
+            d->wakeups++;
+        /* fall through */
+    default:
+        if ( old == RUNSTATE_running && c->domid == domid )
+            c->domid = -1;
+        break;
+    }
+
+    v->state = new;
+    v->since = now;
+    return 0;
+}
+
+static int record(struct analyze *a, struct analyze_cpu *c, uint32_t hdr,
+                  const unsigned char *data, unsigned int size)
+{
+    uint32_t event = TRC_HD_TO_EVENT(hdr), d0 = 0;
+    unsigned int extra = TRC_HD_EXTRA(hdr);
+    struct analyze_event *e;
+    int cls;
+
+    a->records++;
+    a->bytes += size;
+
+    if ( c->tsc )
+    {
+        if ( !a->first_tsc )
+            a->first_tsc = c->tsc;
+        if ( c->tsc < a->last_tsc )
+            a->backwards++;
+        else
+            a->last_tsc = c->tsc;
+    }
+
+    cls = analyze_class(event);
+    a->classes[cls].records++;
+    a->classes[cls].bytes += size;
+
+    e = get_event(a, event);
+    if ( !e )
+        return -1;
+    e->records++;
+
+    if ( c->domid >= 0 )
+        a->domains[c->domid]->records++;
+
+    if ( extra )
+        memcpy(&d0, data, sizeof(d0));
+
+    if ( event == TRC_LOST_RECORDS && extra )
+        a->lost += d0;
+    else if ( (event & ~RUNSTATE_CHANGE_MASK) == TRC_SCHED_RUNSTATE_CHANGE &&
+              extra )
+        return runstate_change(a, c, event, d0);
+
+    return 0;
+}
+
+/*
+ * Find the next whole record of a CPU, from c->p on, and its TSC. Records
+ * without one are taken to be at the time of the record before.
+ */
+static int cpu_peek(struct analyze *a, struct analyze_cpu *c)
+{
+    uint32_t hdr;
+    unsigned int size;
+
+    for ( ; ; )
+    {
+        if ( c->p == c->end )
+        {
+            if ( c->seg == c->nr_segs )
+                return 0;
+            c->p = c->segs[c->seg].start;
+            c->end = c->segs[c->seg].end;
+            c->seg++;
+            continue;
+        }
+
+        if ( c->end - c->p < sizeof(hdr) )
+            goto truncated;
+        memcpy(&hdr, c->p, sizeof(hdr));
+        size = sizeof(hdr) + TRC_HD_EXTRA(hdr) * sizeof(uint32_t) +
+            (TRC_HD_INCLUDES_CYCLE_COUNT(hdr) ? sizeof(uint64_t) : 0);
+        if ( c->end - c->p < size )
+            goto truncated;
+
+        if ( TRC_HD_INCLUDES_CYCLE_COUNT(hdr) )
+            memcpy(&c->tsc, c->p + sizeof(hdr), sizeof(c->tsc));
+        return 1;
+
+    truncated:
+        a->truncated++;
+        c->p = c->end;
+    }
+}
+
+static void cpu_take(struct analyze_cpu *c, uint32_t *hdr,
+                     const unsigned char **data, unsigned int *size)
+{
+    memcpy(hdr, c->p, sizeof(*hdr));
+    *data = c->p + sizeof(*hdr);
+    if ( TRC_HD_INCLUDES_CYCLE_COUNT(*hdr) )
+        *data += sizeof(uint64_t);
+    *size = *data - c->p + TRC_HD_EXTRA(*hdr) * sizeof(uint32_t);
+    c->p += *size;
+}
+
+static void heap_down(struct analyze_cpu **heap, unsigned int n,
+                      unsigned int i)
+{
+    struct analyze_cpu *c = heap[i];
+    unsigned int child;
+
+    while ( (child = 2 * i + 1) < n )
+    {
+        if ( child + 1 < n && heap[child + 1]->tsc < heap[child]->tsc )
+            child++;
+        if ( c->tsc <= heap[child]->tsc )
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = c;
+}
+
+int analyze_run(struct analyze *a)
+{
+    struct analyze_cpu **heap, *c;
+    const unsigned char *data;
+    unsigned int i, n = 0, size;
+    uint64_t limit;
+    uint32_t hdr;
+    int rc = 0;
+
+    heap = malloc((a->nr_cpus ?: 1) * sizeof(*heap));
+    if ( !heap )
+        return -1;
+
+    for ( i = 0; i < a->nr_cpus; i++ )
+        if ( a->cpus[i] && cpu_peek(a, a->cpus[i]) )
+            heap[n++] = a->cpus[i];
+    for ( i = n / 2; i-- > 0; )
+        heap_down(heap, n, i);
+
+    while ( n )
+    {
+        /* Carry on with this CPU until another one is due. */
+        c = heap[0];
+        limit = UINT64_MAX;
+        if ( n > 1 )
+            limit = heap[1]->tsc;
+        if ( n > 2 && heap[2]->tsc < limit )
+            limit = heap[2]->tsc;
+
+        do {
+            cpu_take(c, &hdr, &data, &size);
+            if ( record(a, c, hdr, data, size) )
+            {
+                rc = -1;
+                goto out;
+            }
+            if ( !cpu_peek(a, c) )
+            {
+                heap[0] = heap[--n];
+                break;
+            }
+        } while ( c->tsc <= limit );
+
+        if ( n )
+            heap_down(heap, n, 0);
+    }
+
+    /* Close off the runstates still open at the end. */
+    for ( i = 0; i < a->max_vcpus; i++ )
+    {
+        struct analyze_vcpu *v = &a->vcpus[i];
+
+        if ( v->used && v->state >= 0 && a->last_tsc >= v->since )
+            a->domains[v->key >> 16]->runstate[v->state] +=
+                a->last_tsc - v->since;
+    }
+
+ out:
+    free(heap);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,132 @@
+/******************************************************************************
+ * tools/xentrace/analyze.h
+ *
+ * One pass analysis of xentrace binary output, for xentrace_analyze.
+ *
+ * The trace files are mapped, split into the windows xentrace wrote for
+ * each CPU, and the records of all CPUs are then taken in TSC order,
+ * keeping:
+ *  - a count of records and bytes for each event class and each event;
+ *  - for each domain, the time its vcpus spent in each runstate, how long
+ *    they waited to run once runnable (after a wakeup or after being
+ *    preempted), and the records logged while it was running.
+ */
+
+#ifndef __XENTRACE_ANALYZE_H__
+#define __XENTRACE_ANALYZE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Event classes are the bits of TRC_ALL, 0x0ffff000: class 0 is TRC_GEN. */
+#define ANALYZE_NR_CLASSES   12
+#define ANALYZE_CLASS_OTHER  ANALYZE_NR_CLASSES
+
+/* Latency histograms have a bucket for each power of 2 cycles. */
+#define ANALYZE_LAT_BUCKETS  48
+
+#define ANALYZE_NR_RUNSTATES 4
+
+struct analyze_lat {
+    uint64_t count, total, max;
+    uint64_t hist[ANALYZE_LAT_BUCKETS];
+};
+
+struct analyze_class {
+    uint64_t records, bytes;
+};
+
+struct analyze_event {
+    uint32_t event;
+    uint64_t records;           /* 0 for an empty slot */
+};
+
+struct analyze_domain {
+    uint16_t domid;
+    uint64_t runstate[ANALYZE_NR_RUNSTATES]; /* cycles, all vcpus */
+    uint64_t switches;          /* times a vcpu went to running */
+    uint64_t wakeups;           /* blocked or offline to runnable */
+    uint64_t records;           /* logged on a CPU while it ran there */
+    struct analyze_lat wake_lat;    /* runnable after wakeup to running */
+    struct analyze_lat preempt_lat; /* runnable after running to running */
+};
+
+struct analyze_vcpu {
+    int used;
+    uint32_t key;               /* domid << 16 | vcpuid */
+    int state;                  /* RUNSTATE_*, or -1 before the first */
+    int woken;                  /* runnable since a wakeup */
+    uint64_t since;
+};
+
+struct analyze_seg {
+    const unsigned char *start, *end;
+};
+
+struct analyze_cpu {
+    unsigned int cpu;
+    struct analyze_seg *segs;
+    unsigned int nr_segs, max_segs, seg;
+    const unsigned char *p, *end;   /* the next record, and its segment end */
+    uint64_t tsc;                   /* of the next record */
+    int domid;                      /* running here, or -1 */
+};
+
+struct analyze_file {
+    void *map;
+    size_t len;
+    int inflated;               /* malloc()ed, not mapped */
+};
+
+struct analyze {
+    struct analyze_file *files;
+    unsigned int nr_files;
+
+    struct analyze_cpu **cpus;      /* by CPU number, NULL if none seen */
+    unsigned int nr_cpus;
+
+    /* Results */
+    uint64_t records, bytes;
+    uint64_t first_tsc, last_tsc;
+    uint64_t lost;                  /* from TRC_LOST_RECORDS */
+    uint64_t backwards;             /* records older than the one before */
+    uint64_t truncated;             /* windows cut short or malformed */
+    struct analyze_class classes[ANALYZE_NR_CLASSES + 1];
+
+    struct analyze_event *events;   /* open addressed, by event */
+    unsigned int nr_events, max_events;
+
+    struct analyze_domain **domains; /* by domid, NULL if none seen */
+
+    struct analyze_vcpu *vcpus;     /* open addressed, by key */
+    unsigned int nr_vcpus, max_vcpus;
+
+    struct analyze_lat wake_lat, preempt_lat;
+};
+
+/* All return 0, or -1 with errno set. */
+int analyze_init(struct analyze *a);
+/*
+ * Map a trace file, or inflate it if gzip compressed; files are taken in
+ * the order given.
+ */
+int analyze_add_file(struct analyze *a, const char *path);
+/* Take in the windows of a trace held in memory, which must be kept. */
+int analyze_add_buffer(struct analyze *a, const void *buf, size_t len);
+int analyze_run(struct analyze *a);
+void analyze_free(struct analyze *a);
+
+int analyze_class(uint32_t event);
+unsigned int analyze_lat_bucket(uint64_t cycles);
+
+#endif /* __XENTRACE_ANALYZE_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
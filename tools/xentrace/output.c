@@ -0,0 +1,338 @@
+/******************************************************************************
+ * tools/xentrace/output.c
+ *
+ * Output stage for xentrace: see output.h.
+ *
+ * The main thread fills a ring of chunks, one at a time. A chunk is handed
+ * to the output thread when it is full or has been filling for a second,
+ * and only at the end of a window when rotating. If all the chunks are
+ * waiting to be written, the main thread waits too, rather than keeping
+ * an unbounded amount of trace in memory.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <zlib.h>
+
+#include "output.h"
+
+#define CHUNK_SIZE  (1UL << 20)
+#define NR_CHUNKS   16
+#define FLUSH_SECS  1
+
+/* *BSD has no O_LARGEFILE */
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+struct chunk {
+    unsigned char *buf;
+    size_t len, size;
+    time_t started;
+};
+
+static struct output_opts opts;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* ring[prod % NR_CHUNKS] is being filled; those from cons are queued. */
+static struct chunk ring[NR_CHUNKS];
+static unsigned int prod, cons;
+static int finished;
+
+/* Used by the output thread only. */
+static int fd = -1;
+static unsigned int seq;
+static unsigned long long file_bytes;
+static time_t file_opened;
+static z_stream zs;
+static unsigned char *zbuf;
+static size_t zbuf_size;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "ERROR: %s (%d = %s)\n", what, errno, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int open_next(void)
+{
+    char name[strlen(opts.path) + 16];
+
+    snprintf(name, sizeof(name), "%s.%04u", opts.path, seq++);
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    file_bytes = 0;
+    file_opened = time(NULL);
+    return fd;
+}
+
+static int rotate_due(void)
+{
+    if ( !opts.rotate_size && !opts.rotate_time )
+        return 0;
+    if ( file_bytes == 0 )
+        return 0;
+
+    return (opts.rotate_size && file_bytes >= opts.rotate_size) ||
+        (opts.rotate_time && time(NULL) - file_opened >= opts.rotate_time);
+}
+
+static void check_disk_space(size_t len)
+{
+    unsigned long long freespace;
+    struct statvfs stat;
+
+    if ( fstatvfs(fd, &stat) )
+        fail("Statfs failed");
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace = freespace > len ? (freespace - len) >> 20 : 0;
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Each chunk is a gzip member of its own. */
+static void compress_chunk(struct chunk *c, unsigned char **data, size_t *len)
+{
+    size_t bound;
+
+    if ( deflateReset(&zs) != Z_OK )
+        goto fail;
+
+    bound = deflateBound(&zs, c->len);
+    if ( bound > zbuf_size )
+    {
+        free(zbuf);
+        zbuf = malloc(bound);
+        if ( !zbuf )
+            fail("Cannot allocate compression buffer");
+        zbuf_size = bound;
+    }
+
+    zs.next_in = c->buf;
+    zs.avail_in = c->len;
+    zs.next_out = zbuf;
+    zs.avail_out = zbuf_size;
+    if ( deflate(&zs, Z_FINISH) != Z_STREAM_END )
+        goto fail;
+
+    *data = zbuf;
+    *len = zbuf_size - zs.avail_out;
+    return;
+
+ fail:
+    fprintf(stderr, "ERROR: Compression failed (%s)\n",
+            zs.msg ? zs.msg : "zlib error");
+    exit(EXIT_FAILURE);
+}
+
+static void write_chunk(struct chunk *c)
+{
+    unsigned char *data = c->buf;
+    size_t len = c->len, done = 0;
+    ssize_t written;
+
+    if ( rotate_due() )
+    {
+        if ( close(fd) )
+            fail("Failed to close trace file");
+        if ( open_next() < 0 )
+            fail("Could not open output file");
+    }
+
+    if ( opts.compress )
+        compress_chunk(c, &data, &len);
+
+    if ( opts.disk_rsvd )
+        check_disk_space(len);
+
+    while ( done < len )
+    {
+        written = write(fd, data + done, len - done);
+        if ( written < 0 && errno == EINTR )
+            continue;
+        if ( written <= 0 )
+            fail("Failed to write trace data");
+        done += written;
+    }
+    file_bytes += len;
+}
+
+static void *output_thread(void *arg)
+{
+    struct chunk *c;
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&lock);
+        while ( cons == prod && !finished )
+            pthread_cond_wait(&cond, &lock);
+        if ( cons == prod )
+        {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        c = &ring[cons % NR_CHUNKS];
+        pthread_mutex_unlock(&lock);
+
+        write_chunk(c);
+
+        pthread_mutex_lock(&lock);
+        cons++;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+/* Queue the chunk being filled, and wait for one to fill next. */
+static void hand_off(void)
+{
+    struct chunk *c;
+
+    pthread_mutex_lock(&lock);
+    prod++;
+    pthread_cond_broadcast(&cond);
+    while ( prod - cons == NR_CHUNKS )
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    c = &ring[prod % NR_CHUNKS];
+    c->len = 0;
+}
+
+void output_write(const void *buf, size_t len)
+{
+    struct chunk *c = &ring[prod % NR_CHUNKS];
+    const unsigned char *p = buf;
+    int rotating = opts.rotate_size || opts.rotate_time;
+    size_t n;
+
+    while ( len )
+    {
+        if ( !rotating && c->len >= CHUNK_SIZE )
+        {
+            hand_off();
+            c = &ring[prod % NR_CHUNKS];
+        }
+        if ( !c->len )
+            c->started = time(NULL);
+
+        /* A file may only change at the end of a window. */
+        n = len;
+        if ( !rotating && n > CHUNK_SIZE - c->len )
+            n = CHUNK_SIZE - c->len;
+
+        if ( c->len + n > c->size )
+        {
+            unsigned char *b = realloc(c->buf, c->len + n);
+
+            if ( !b )
+                fail("Cannot allocate output chunk");
+            c->buf = b;
+            c->size = c->len + n;
+        }
+
+        memcpy(c->buf + c->len, p, n);
+        c->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void output_boundary(void)
+{
+    struct chunk *c = &ring[prod % NR_CHUNKS];
+
+    if ( c->len >= CHUNK_SIZE ||
+         (c->len && time(NULL) - c->started >= FLUSH_SECS) )
+        hand_off();
+}
+
+int output_start(const struct output_opts *o)
+{
+    sigset_t all, old;
+    int rc;
+
+    opts = *o;
+
+    if ( opts.rotate_size || opts.rotate_time )
+    {
+        if ( open_next() < 0 )
+            return -1;
+    }
+    else
+    {
+        fd = opts.fd;
+        file_opened = time(NULL);
+    }
+
+    if ( opts.compress &&
+         deflateInit2(&zs, opts.compress, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) != Z_OK )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Signals are for the main thread, to stop tracing. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rc = pthread_create(&thread, NULL, output_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if ( rc )
+    {
+        errno = rc;
+        return -1;
+    }
+
+    return fd;
+}
+
+void output_finish(void)
+{
+    unsigned int i;
+
+    if ( ring[prod % NR_CHUNKS].len )
+        hand_off();
+
+    pthread_mutex_lock(&lock);
+    finished = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+
+    if ( close(fd) )
+        fail("Failed to close trace file");
+
+    if ( opts.compress )
+        deflateEnd(&zs);
+    free(zbuf);
+    for ( i = 0; i < NR_CHUNKS; i++ )
+        free(ring[i].buf);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
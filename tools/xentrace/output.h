@@ -0,0 +1,49 @@
+/******************************************************************************
+ * tools/xentrace/output.h
+ *
+ * Output stage for xentrace: trace data is gathered into chunks, which a
+ * background thread compresses and writes out, starting a new file when
+ * the current one is big enough or old enough.
+ *
+ * Compressed chunks are gzip members, one after another, so each file is
+ * an ordinary .gz file. Files are only changed between xentrace windows,
+ * so each of them is a trace on its own.
+ */
+
+#ifndef __XENTRACE_OUTPUT_H__
+#define __XENTRACE_OUTPUT_H__
+
+#include <stddef.h>
+
+struct output_opts {
+    const char *path;           /* for rotation, which needs a file */
+    int fd;                     /* if not rotating, already open */
+    int compress;               /* zlib level 1-9, or 0 for none */
+    unsigned long rotate_size;  /* bytes written to a file, or 0 */
+    unsigned long rotate_time;  /* seconds, or 0 */
+    unsigned long disk_rsvd;    /* MB to leave free, or 0 */
+};
+
+/*
+ * Start the output thread. Returns the first file, which is
+ * path.0000 when rotating, or -1 with errno set.
+ */
+int output_start(const struct output_opts *opts);
+/* Add trace data to the current chunk. */
+void output_write(const void *buf, size_t len);
+/* The end of a window: the chunk is written out if full or old enough. */
+void output_boundary(void);
+/* Write out everything and close the output. */
+void output_finish(void);
+
+#endif /* __XENTRACE_OUTPUT_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -31,6 +31,8 @@
 
 #include <xenctrl.h>
 
+#include "output.h"
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -57,6 +59,9 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned long rotate_size;
+    unsigned long rotate_time;
+    int compress;
     uint8_t discard:1,
         disable_tracing:1,
         start_disabled:1;
@@ -76,6 +81,7 @@ static xc_interface *xc_handle;
 static xc_evtchn *xce_handle = NULL;
 static int virq_port = -1;
 static int outfd = 1;
+static int use_output; /* through the output stage, see output.h */
 
 static void close_handler(int signal)
 {
@@ -275,6 +281,16 @@ void membuf_write(void *start, unsigned long size) {
     }
 }
 
+/* Write to the output file, or hand over to the output stage. */
+static ssize_t write_out(const void *buf, size_t size)
+{
+    if ( !use_output )
+        return write(outfd, buf, size);
+
+    output_write(buf, size);
+    return size;
+}
+
 void membuf_dump(void) {
     /* Dump circular memory buffer */
     int cons, prod, wsize, written;
@@ -291,7 +307,7 @@ void membuf_dump(void) {
         wstart = membuf.buf + cons;
         wsize = prod - cons;
 
-        written = write(outfd, wstart, wsize);
+        written = write_out(wstart, wsize);
         if ( written != wsize )
             goto fail;
     }
@@ -301,7 +317,7 @@ void membuf_dump(void) {
         wstart = membuf.buf + cons;
         wsize = membuf.size - cons;
 
-        written = write(outfd, wstart, wsize);
+        written = write_out(wstart, wsize);
         if ( written != wsize )
         {
             fprintf(stderr, "Write failed! (size %d, returned %d)\n",
@@ -312,7 +328,7 @@ void membuf_dump(void) {
         wstart = membuf.buf;
         wsize = prod;
 
-        written = write(outfd, wstart, wsize);
+        written = write_out(wstart, wsize);
         if ( written != wsize )
         {
             fprintf(stderr, "Write failed! (size %d, returned %d)\n",
@@ -346,7 +362,8 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
     struct statvfs stat;
     size_t written = 0;
     
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+    /* The output stage checks for itself. */
+    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 && !use_output )
     {
         unsigned long long freespace;
 
@@ -390,7 +407,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
             rec.data.cpu = cpu;
             rec.data.window_size = total_size;
 
-            written = write(outfd, &rec, sizeof(rec));
+            written = write_out(&rec, sizeof(rec));
             if ( written != sizeof(rec) )
             {
                 fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
@@ -406,7 +423,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
     }
     else
     {
-        written = write(outfd, start, size);
+        written = write_out(start, size);
         if ( written != size )
         {
             fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
@@ -723,11 +740,17 @@ static int monitor_tbufs(void)
                              0);
             }
 
+            if ( use_output )
+                output_boundary();
+
             xen_mb(); /* read buffer, then update cons. */
             meta[i]->cons = prod;
 
         }
 
+        if ( use_output )
+            output_boundary();
+
         if ( interrupted )
         {
             if ( last_read )
@@ -752,7 +775,10 @@ static int monitor_tbufs(void)
     free(meta);
     free(data);
     /* don't need to munmap - cleanup is automatic */
-    close(outfd);
+    if ( use_output )
+        output_finish();
+    else
+        close(outfd);
 
     return 0;
 }
@@ -802,6 +828,12 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -z, --compress[=l]      Compress the output with gzip, at level l (1-9,\n" \
+"                          default 1), on a separate thread.\n" \
+"  -R, --rotate-size=n     Write to output file.0000, output file.0001 and\n" \
+"                          so on, starting a new file when one reaches n\n" \
+"                          bytes (suffixes k and M are allowed).\n" \
+"  -I, --rotate-interval=s As -R, starting a new file every s seconds.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -809,7 +841,8 @@ static void usage(void)
 "  CPU(uint) TSC(uint64_t) EVENT(uint32_t) D1 D2 D3 D4 D5 (all uint32_t)\n" \
 "\n" \
 "The output should be parsed using the tool xentrace_format,\n" \
-"which can produce human-readable output in ASCII format.\n" 
+"which can produce human-readable output in ASCII format, or\n" \
+"summarised with xentrace_analyze, which also reads compressed output.\n" 
 
     printf(USAGE_STR);
     printf("\nReport bugs to %s\n", program_bug_address);
@@ -919,6 +952,9 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "compress",       optional_argument, 0, 'z' },
+        { "rotate-size",    required_argument, 0, 'R' },
+        { "rotate-interval", required_argument, 0, 'I' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -927,7 +963,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:z::R:I:DxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -977,6 +1013,23 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'z': /* Compress the output */
+            opts.compress = optarg ? argtol(optarg, 0) : 1;
+            if ( opts.compress < 1 || opts.compress > 9 )
+            {
+                fprintf(stderr, "Compression level must be 1 to 9\n\n");
+                usage();
+            }
+            break;
+
+        case 'R': /* Rotate output files by size */
+            opts.rotate_size = sargtol(optarg, 0);
+            break;
+
+        case 'I': /* Rotate output files by time */
+            opts.rotate_time = argtol(optarg, 0);
+            break;
+
         default:
             usage();
         }
@@ -987,6 +1040,13 @@ static void parse_args(int argc, char **argv)
         usage();
 
     opts.outfile = argv[optind];
+
+    /* Files are changed between windows, not in a memory dump. */
+    if ( (opts.rotate_size || opts.rotate_time) && opts.memory_buffer )
+    {
+        fprintf(stderr, "Cannot rotate output with a memory buffer\n\n");
+        usage();
+    }
 }
 
 /* *BSD has no O_LARGEFILE */
@@ -1026,11 +1086,27 @@ int main(int argc, char **argv)
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
-    if ( opts.outfile )
+    use_output = opts.compress || opts.rotate_size || opts.rotate_time;
+
+    if ( opts.outfile && !opts.rotate_size && !opts.rotate_time )
         outfd = open(opts.outfile,
                      O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
                      0644);
 
+    if ( outfd >= 0 && use_output )
+    {
+        struct output_opts out = {
+            .path = opts.outfile,
+            .fd = outfd,
+            .compress = opts.compress,
+            .rotate_size = opts.rotate_size,
+            .rotate_time = opts.rotate_time,
+            .disk_rsvd = opts.disk_rsvd,
+        };
+
+        outfd = output_start(&out);
+    }
+
     if ( outfd < 0 )
     {
         perror("Could not open output file");
@@ -0,0 +1,281 @@
+/******************************************************************************
+ * tools/xentrace/xentrace_analyze.c
+ *
+ * Summarise xentrace binary output: records by event class and event,
+ * how long vcpus waited to run, and where each domain's time went.
+ *
+ * Unlike xentrace_format, the trace files are mapped and analysed in one
+ * pass, with the records of all CPUs taken in TSC order.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "analyze.h"
+
+static const char *class_names[ANALYZE_NR_CLASSES + 1] = {
+    "gen", "sched", "dom0op", "hvm", "mem", "pv", "shadow", "hw",
+    "class8", "class9", "class10", "guest", "other"
+};
+
+static const char *runstate_names[ANALYZE_NR_RUNSTATES] = {
+    "running", "runnable", "blocked", "offline"
+};
+
+static double cpu_mhz;
+
+static void usage(void)
+{
+    fprintf(stderr,
+"Usage: xentrace_analyze [OPTION...] FILE...\n"
+"Summarise trace data in xentrace binary format.\n"
+"\n"
+"  -c, --cpu-mhz=MHZ       TSC frequency, to show times in us rather\n"
+"                          than cycles.\n"
+"  -n, --events=N          Show the N most frequent events [20].\n"
+"  -h, --help              Show this help.\n");
+    exit(EXIT_FAILURE);
+}
+
+/* A time, in us if the TSC frequency is known. */
+static void print_time(uint64_t cycles)
+{
+    if ( cpu_mhz )
+        printf(" %14.1f", cycles / cpu_mhz);
+    else
+        printf(" %14"PRIu64, cycles);
+}
+
+static int cmp_events(const void *a, const void *b)
+{
+    const struct analyze_event *ea = a, *eb = b;
+
+    if ( ea->records != eb->records )
+        return ea->records < eb->records ? 1 : -1;
+    return ea->event < eb->event ? -1 : ea->event > eb->event;
+}
+
+static void print_summary(struct analyze *a)
+{
+    unsigned int i, cpus = 0;
+
+    for ( i = 0; i < a->nr_cpus; i++ )
+        if ( a->cpus[i] )
+            cpus++;
+
+    printf("Records:    %"PRIu64" (%"PRIu64" bytes) from %u CPUs\n",
+           a->records, a->bytes, cpus);
+    printf("Span:      ");
+    print_time(a->last_tsc - a->first_tsc);
+    printf(" %s\n", cpu_mhz ? "us" : "cycles");
+    printf("Lost:       %"PRIu64" records\n", a->lost);
+    if ( a->backwards )
+        printf("Warning:    %"PRIu64" records out of TSC order\n",
+               a->backwards);
+    if ( a->truncated )
+        printf("Warning:    %"PRIu64" windows truncated or malformed\n",
+               a->truncated);
+}
+
+static void print_classes(struct analyze *a)
+{
+    unsigned int i;
+
+    printf("\n%-10s %14s %6s %14s\n", "Class", "Records", "%", "Bytes");
+    for ( i = 0; i <= ANALYZE_NR_CLASSES; i++ )
+    {
+        if ( !a->classes[i].records )
+            continue;
+        printf("%-10s %14"PRIu64" %6.2f %14"PRIu64"\n", class_names[i],
+               a->classes[i].records,
+               100.0 * a->classes[i].records / a->records,
+               a->classes[i].bytes);
+    }
+}
+
+static int print_events(struct analyze *a, unsigned int top)
+{
+    struct analyze_event *events;
+    unsigned int i, n = 0;
+
+    events = malloc((a->nr_events ?: 1) * sizeof(*events));
+    if ( !events )
+        return -1;
+
+    for ( i = 0; i < a->max_events; i++ )
+        if ( a->events[i].records )
+            events[n++] = a->events[i];
+    qsort(events, n, sizeof(*events), cmp_events);
+
+    printf("\n%-10s %-10s %14s %6s\n", "Event", "Class", "Records", "%");
+    for ( i = 0; i < n && i < top; i++ )
+        printf("%#010x %-10s %14"PRIu64" %6.2f\n", events[i].event,
+               class_names[analyze_class(events[i].event)],
+               events[i].records, 100.0 * events[i].records / a->records);
+    if ( n > top )
+        printf("(%u more events)\n", n - top);
+
+    free(events);
+    return 0;
+}
+
+static void print_lat_row(const char *name, struct analyze_lat *lat)
+{
+    printf("%-14s %10"PRIu64, name, lat->count);
+    print_time(lat->count ? lat->total / lat->count : 0);
+    print_time(lat->max);
+    printf("\n");
+}
+
+static void print_latency(struct analyze *a)
+{
+    unsigned int i, lo = ANALYZE_LAT_BUCKETS, hi = 0;
+
+    printf("\nScheduling latency, runnable to running (%s):\n",
+           cpu_mhz ? "us" : "cycles");
+    printf("%-14s %10s %14s %14s\n", "", "Count", "Average", "Max");
+    print_lat_row("after wakeup", &a->wake_lat);
+    print_lat_row("after preempt", &a->preempt_lat);
+
+    for ( i = 0; i < ANALYZE_LAT_BUCKETS; i++ )
+    {
+        if ( !a->wake_lat.hist[i] && !a->preempt_lat.hist[i] )
+            continue;
+        if ( i < lo )
+            lo = i;
+        hi = i;
+    }
+    if ( lo > hi )
+        return;
+
+    printf("\n%-16s %14s %14s\n", "Cycles below", "Wakeup", "Preempt");
+    for ( i = lo; i <= hi; i++ )
+    {
+        if ( i == ANALYZE_LAT_BUCKETS - 1 )
+            printf("%-16s", "more");
+        else
+            printf("2^%-14u", i);
+        printf(" %14"PRIu64" %14"PRIu64"\n",
+               a->wake_lat.hist[i], a->preempt_lat.hist[i]);
+    }
+}
+
+static void print_domains(struct analyze *a)
+{
+    struct analyze_domain *d;
+    unsigned int i, j;
+
+    printf("\nDomains (%s):\n", cpu_mhz ? "us" : "cycles");
+    printf("%-6s", "Domain");
+    for ( j = 0; j < ANALYZE_NR_RUNSTATES; j++ )
+        printf(" %14s", runstate_names[j]);
+    printf(" %10s %10s %14s %14s %14s\n", "Switches", "Wakeups",
+           "Wake avg", "Preempt avg", "Records");
+
+    for ( i = 0; i < 0x10000; i++ )
+    {
+        if ( !(d = a->domains[i]) )
+            continue;
+        if ( d->domid == 0x7FFF )
+            printf("%-6s", "idle");
+        else
+            printf("%-6u", d->domid);
+        for ( j = 0; j < ANALYZE_NR_RUNSTATES; j++ )
+            print_time(d->runstate[j]);
+        printf(" %10"PRIu64" %10"PRIu64, d->switches, d->wakeups);
+        print_time(d->wake_lat.count ?
+                   d->wake_lat.total / d->wake_lat.count : 0);
+        print_time(d->preempt_lat.count ?
+                   d->preempt_lat.total / d->preempt_lat.count : 0);
+        printf(" %14"PRIu64"\n", d->records);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "cpu-mhz", required_argument, NULL, 'c' },
+        { "events",  required_argument, NULL, 'n' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct analyze a;
+    unsigned int top = 20;
+    char *end;
+    int ch;
+
+    while ( (ch = getopt_long(argc, argv, "c:n:h", long_options, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'c':
+            cpu_mhz = strtod(optarg, &end);
+            if ( *end || cpu_mhz <= 0 )
+                usage();
+            break;
+        case 'n':
+            top = strtoul(optarg, &end, 0);
+            if ( *end )
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if ( optind == argc )
+        usage();
+
+    if ( analyze_init(&a) )
+    {
+        perror("xentrace_analyze");
+        return EXIT_FAILURE;
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        if ( analyze_add_file(&a, argv[optind]) )
+        {
+            fprintf(stderr, "xentrace_analyze: %s: %s\n", argv[optind],
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ( analyze_run(&a) )
+    {
+        perror("xentrace_analyze");
+        return EXIT_FAILURE;
+    }
+
+    print_summary(&a);
+    if ( a.records )
+    {
+        print_classes(&a);
+        if ( print_events(&a, top) )
+        {
+            perror("xentrace_analyze");
+            return EXIT_FAILURE;
+        }
+        print_latency(&a);
+        print_domains(&a);
+    }
+
+    analyze_free(&a);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */